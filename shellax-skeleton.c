@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -12,6 +13,31 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <time.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <glob.h>
+#include <fnmatch.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <sys/uio.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/file.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 const char *sysname = "shellax";
 
 enum return_codes
@@ -21,6 +47,29 @@ enum return_codes
     UNKNOWN = 2,
 };
 
+#define WORD_LENGTH 5
+#define WORD_PATTERNS 243 // 3^WORD_LENGTH feedback patterns
+#define WORD_MAX_SOLVER_GUESSES 20
+#define WORD_PARALLEL_THRESHOLD 1024 // bench word lists at least this long run on all cores
+static const int pow3[WORD_LENGTH] = {1, 3, 9, 27, 81};
+
+// word list for the word game, stored column-wise so filters run over whole columns
+struct wordList
+{
+    int count;
+    uint32_t *masks;                       // bit i set if letter 'a'+i is in the word
+    unsigned char *letters[WORD_LENGTH];   // letters[p][i]: letter at position p of word i (0-25)
+    char (*texts)[WORD_LENGTH + 1];
+};
+
+// a redirect of a script naming a fd: 2>file, 3<file, 2>&1
+struct fdRedirect
+{
+    int fd;
+    int flags; // to open target with, -1: fd becomes a copy of the fd target names
+    char *target;
+};
+
 struct command_t
 {
     char *name;
@@ -29,9 +78,452 @@ struct command_t
     int arg_count;
     char **args;
     char *redirects[3];     // in/out redirection
+    struct fdRedirect *fdRedirects; // redirects naming a fd (2>file, 2>&1), applied after redirects[] in order
+    int fdRedirectCount;
+    int heredoc_fd;         // memfd with a here-document or here-string, 0 if none
     struct command_t *next; // for piping
 };
 
+#define STREAM_CHUNK (1 << 20)    // read size of the text builtins
+#define STREAM_OUT_SIZE (1 << 16) // output buffer of a stage writing to a fd
+#define COPY_CHUNK (1 << 30)       // most bytes asked from one copy_file_range/splice/sendfile
+#define COPY_BUFFER_SIZE (1 << 20) // buffer of copyFd when the kernel can't copy for us
+#define CAPTURE_CHUNK (1 << 16)    // smallest read of a command substitution
+
+/**
+ * One stage of an in-shell text command. Input is pushed in with feed() in
+ * chunks, output goes to the next stage or to fd. Line based stages use
+ * streamFeedLines as feed and get whole lines in lines().
+ */
+struct stream_t
+{
+    int (*feed)(struct stream_t *s, const char *data, size_t len); // returns 1 to stop reading the current input
+    int (*lines)(struct stream_t *s, const char *data, size_t len);
+    int (*finish)(struct stream_t *s);
+    int (*beginFile)(struct stream_t *s, const char *name); // only called with several files
+    int (*endFile)(struct stream_t *s, const char *name);
+    struct stream_t *next; // NULL: write to fd
+    int fd;
+    char *out; // pending output for fd
+    size_t outLen;
+    char *carry; // start of a line cut at the end of a chunk
+    size_t carryLen, carryCap;
+    struct command_t *command;
+    char **files; // file arguments, stdin if there are none
+    int fileCount;
+    int status; // exit status
+    int closed; // output can not be written anymore
+    void *state;
+    void (*release)(struct stream_t *s); // frees what state points to, besides state itself
+    int (*pump)(struct stream_t *s, int fd); // reads a whole input instead of streamPump
+};
+
+#define SORT_DEFAULT_BUDGET ((size_t)256 << 20) // memory sort uses before it spills a run
+#define SORT_MIN_BUDGET ((size_t)1 << 20)
+#define SORT_BLOCK_SIZE ((size_t)4 << 20) // lines are copied into blocks this big
+#define SORT_IO_SIZE ((size_t)1 << 20)    // buffer for writing and reading each run
+#define SORT_INSERTION_THRESHOLD 16
+#define SORT_MIN_PART 65536 // fewest lines worth a thread of their own
+#define SORT_MAX_THREADS 64
+#define SORT_MAX_RUNS 64 // runs are merged into one when there are this many
+#define FIXED_SIMD_MAX 8 // grep -F uses the SIMD prefilter up to this many patterns
+
+// the patterns of grep -F
+struct fixedStrings
+{
+    int count;
+    char **strings;
+    size_t *lengths;
+    size_t maxLength;
+    const char **found; // used by the scalar search: where each string is next in the buffer
+    const char *cacheEnd;
+};
+
+struct textBuiltin
+{
+    const char *name;
+    struct stream_t *(*create)(struct command_t *command); // NULL on bad arguments
+};
+
+// a <(...) or >(...) of the command line being run
+struct processSubstitution
+{
+    pid_t pid;
+    int fd; // our end of the pipe, -1 once closed
+};
+
+// tokens of a script, see scriptLex
+enum tokenType
+{
+    TOKEN_WORD,
+    TOKEN_NEWLINE,
+    TOKEN_SEMI,    // ;
+    TOKEN_DSEMI,   // ;;
+    TOKEN_AND,     // &&
+    TOKEN_OR,      // ||
+    TOKEN_PIPE,    // |
+    TOKEN_AMP,     // &
+    TOKEN_LPAREN,  // (
+    TOKEN_RPAREN,  // )
+    TOKEN_LESS,    // <
+    TOKEN_GREAT,   // >
+    TOKEN_DGREAT,  // >>
+    TOKEN_TLESS,   // <<<
+    TOKEN_LESSAND, // <&
+    TOKEN_GREATAND, // >&
+    TOKEN_HEREDOC, // <<WORD, text is the body
+    TOKEN_END,
+};
+
+struct token
+{
+    enum tokenType type;
+    char *text;
+    bool quoted;    // here-document with a quoted delimiter: the body is not expanded
+    int fd;         // of a redirect: the digit before it (2>), -1 if none
+    int start, end; // where it is in the source, -1 for tokens from an alias
+};
+
+// a word of a compiled script
+struct scriptWord
+{
+    char *text;   // final text, or the source text when dynamic
+    bool dynamic; // has expansions ($, `, <(...), ~ or a glob), so it is expanded each time it runs
+};
+
+enum redirectKind
+{
+    REDIRECT_IN,
+    REDIRECT_OUT,
+    REDIRECT_APPEND,
+    REDIRECT_STRING,  // <<<word
+    REDIRECT_HEREDOC, // <<WORD, target is the body
+    REDIRECT_DUP,     // >&N or <&N, target is N
+};
+
+#define REDIRECT_FDS 10 // a redirect can name fds 0-9, as in sh
+
+struct scriptRedirect
+{
+    enum redirectKind kind;
+    struct scriptWord target;
+    int fd; // the fd redirected: 0 for < and <&, 1 for > and >&, or the digit before it
+};
+
+// one simple command of a pipeline
+struct scriptStage
+{
+    struct scriptWord *words;
+    int wordCount;
+    struct scriptWord *assignments; // NAME=value before the command
+    int assignmentCount;
+    struct scriptRedirect *redirects;
+    int redirectCount;
+};
+
+enum scriptNodeType
+{
+    NODE_COMMAND,  // a pipeline of simple commands
+    NODE_PIPELINE, // a pipeline with compound commands in it
+    NODE_LIST,
+    NODE_AND,
+    NODE_OR,
+    NODE_NOT,
+    NODE_IF,
+    NODE_WHILE,
+    NODE_UNTIL,
+    NODE_FOR,
+    NODE_CASE,
+    NODE_FUNCTION,
+    NODE_GROUP,    // { list; }
+    NODE_SUBSHELL, // ( list )
+};
+
+struct caseArm
+{
+    struct scriptWord *patterns;
+    int patternCount;
+    struct scriptNode *body;
+};
+
+/**
+ * A compiled script. Scripts are compiled once, loops and functions run
+ * these nodes again without looking at the source.
+ */
+struct scriptNode
+{
+    enum scriptNodeType type;
+    int references; // functions keep their body after the script is freed
+    bool background;
+    struct scriptNode *first, *second, *third; // if: condition, then, else; loops: condition (or nothing), body;
+                                               // and/or: left, right; not, group, subshell, function: body
+    struct scriptNode **children;               // list, pipeline
+    int childCount;
+    char *name;               // for: variable, function: name
+    struct scriptWord *words; // for: the list (NULL: "$@"), case: the subject
+    int wordCount;
+    struct caseArm *arms;
+    int armCount;
+    struct scriptStage *stages; // command
+    int stageCount;
+    struct command_t *compiled; // command without dynamic words, built on its first run and reused
+    struct scriptRedirect *redirects; // of a compound command
+    int redirectCount;
+    char *definition; // function: the source of its definition, for the rc snapshot
+};
+
+struct shellVariable
+{
+    char *name;
+    char *value;
+    bool exported;
+    struct shellVariable *next;
+};
+
+// a variable as it was before local changed it; value NULL if it was not set
+struct savedVariable
+{
+    char *name;
+    char *value;
+};
+
+struct shellFunction
+{
+    char *name;
+    struct scriptNode *body;  // NULL until first called when loaded from the rc snapshot
+    char *definition;         // its source, NULL if it came from an alias
+    struct shellFunction *next;
+};
+
+struct alias
+{
+    char *name;
+    char *value;
+    struct alias *next;
+};
+
+// fields a word expands to
+struct fieldList
+{
+    char **items;
+    int count, capacity;
+};
+
+enum expandMode
+{
+    EXPAND_FIELDS,  // split unquoted expansions into fields, then glob
+    EXPAND_STRING,  // one string, no splitting
+    EXPAND_PATTERN, // one string, quoted glob characters are escaped
+};
+
+struct shellBuiltin
+{
+    const char *name;
+    int (*run)(int argc, char **argv);
+    bool pure; // only changes shell state, so an rc file running it can still be snapshotted
+};
+
+#define VARIABLE_BUCKETS 1024
+#define FUNCTION_BUCKETS 64
+#define ALIAS_BUCKETS 256
+#define ALIAS_DEPTH 16 // aliases expanding to aliases
+
+// state of the script interpreter
+struct shellVariable *variables[VARIABLE_BUCKETS];
+struct shellFunction *functions[FUNCTION_BUCKETS];
+int lastStatus;           // $?
+pid_t lastBackground;     // $!
+char **positional;        // $1, $2, ...
+int positionalCount;      // $#
+const char *scriptName = "shellax"; // $0
+int loopDepth, breakLevels, continueLevels, functionDepth;
+bool returning, exiting;  // return or exit ran, unwind to the function or the top
+struct savedVariable *locals; // variables to put back when the function returns
+int localCount;
+struct alias *aliases[ALIAS_BUCKETS];
+bool interactive; // reading commands from the terminal
+int pipelineStage, pipelineStages = 1; // of this child, for pin --spread
+
+// what running the rc file depends on, see loadRcFile
+struct rcRecording
+{
+    bool active;
+    bool impure;                  // it did something its snapshot can't replay
+    struct savedVariable *reads;  // environment variables it read, value NULL if unset
+    int readCount;
+} rcRecording;
+const char *rcGetenv(const char *name);
+void rcImpure();
+// the rc snapshot, kept mapped: entries loaded from it point into it
+struct
+{
+    const char *data;
+    size_t size;
+    const char *entries; // the structs of those entries
+    size_t entriesSize;
+} rcSnapshot;
+void snapshotFree(void *p);
+struct shellVariable *findVariable(const char *name);
+char *expandString(const char *text, int mode);
+bool expansionFailed; // an expansion went wrong ($((1/0))), the command it is for does not run
+
+// command substitution, here-documents and process substitution:
+char *captureCommand(const char *line, size_t *length);
+int stageHereText(struct command_t *command, const char *text, size_t length);
+const char *findClosingParen(const char *start);
+void runSubshell(const char *line);
+struct processSubstitution *substitutions; // of the command being run
+int substitutionCount;
+int startProcessSubstitution(const char *line, bool output);
+void finishProcessSubstitutions(bool background);
+void restoreFds(int saved[REDIRECT_FDS]);
+
+// highlighting of the line being typed, see highlightInsert
+void highlightStart();
+bool highlightInsert(const char *line, int length);
+bool highlightErase(const char *line, int length);
+bool highlightLine(const char *line, int length);
+void highlightEnd();
+bool zComplete(char *line, size_t size);
+void zRecord();
+void historyAdd(const char *line);
+void historyReset();
+int historyMove(int direction, char *line, size_t size);
+
+/**
+ * Output of the shell. Everything the shell process writes to stdout goes
+ * through one buffer, printf and putchar too: stdout is a stream that appends
+ * to it. It is written out at fixed points only: before fork, before a
+ * blocking read (the prompt, read, the games), when fd 1 is redirected in the
+ * shell, before anything goes to stderr and at exit. When data does not fit,
+ * it leaves together with the buffer in one writev.
+ */
+#define OUTPUT_SIZE 65536
+
+struct
+{
+    char data[OUTPUT_SIZE];
+    size_t length;
+} output;
+
+// write all of iov (changing it), retrying short writes and EINTR
+int writevAll(int fd, struct iovec *iov, int count)
+{
+    while (count > 0)
+    {
+        ssize_t w = writev(fd, iov, count);
+        if (w == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        while (count > 0 && (size_t)w >= iov->iov_len)
+        {
+            w -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return 0;
+}
+
+int outFlush()
+{
+    if (output.length == 0)
+        return 0;
+    struct iovec iov = {output.data, output.length};
+    output.length = 0;
+    return writevAll(STDOUT_FILENO, &iov, 1);
+}
+
+int outWrite(const char *data, size_t length)
+{
+    if (output.length + length <= OUTPUT_SIZE)
+    {
+        memcpy(output.data + output.length, data, length);
+        output.length += length;
+        return 0;
+    }
+    struct iovec iov[2] = {{output.data, output.length}, {(char *)data, length}};
+    output.length = 0;
+    return writevAll(STDOUT_FILENO, iov, 2);
+}
+
+static inline void outChar(char c)
+{
+    if (output.length == OUTPUT_SIZE)
+        outFlush();
+    output.data[output.length++] = c;
+}
+
+void outString(const char *text)
+{
+    outWrite(text, strlen(text));
+}
+
+int outPrintf(const char *format, ...)
+{
+    char small[512];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(small, sizeof(small), format, args);
+    va_end(args);
+    if (n < 0)
+        return n;
+    if ((size_t)n < sizeof(small))
+        outWrite(small, n);
+    else
+    {
+        char *text = malloc(n + 1);
+        va_start(args, format);
+        vsnprintf(text, n + 1, format, args);
+        va_end(args);
+        outWrite(text, n);
+        free(text);
+    }
+    return n;
+}
+
+static ssize_t stdoutWrite(void *cookie, const char *data, size_t length)
+{
+    (void)cookie;
+    return outWrite(data, length) == -1 ? -1 : (ssize_t)length;
+}
+
+static ssize_t stderrWrite(void *cookie, const char *data, size_t length)
+{
+    (void)cookie;
+    outFlush(); // so what was printed before comes before the message
+    struct iovec iov = {(char *)data, length};
+    return writevAll(STDERR_FILENO, &iov, 1) == -1 ? -1 : (ssize_t)length;
+}
+
+static void outExit()
+{
+    outFlush();
+}
+
+// point stdout and stderr of stdio at the output buffer
+void outputStart()
+{
+    cookie_io_functions_t out = {NULL, stdoutWrite, NULL, NULL}, err = {NULL, stderrWrite, NULL, NULL};
+    FILE *newOut = fopencookie(NULL, "w", out), *newErr = fopencookie(NULL, "w", err);
+    if (newOut == NULL || newErr == NULL)
+        return;
+    setvbuf(newOut, NULL, _IONBF, 0); // the buffer is ours, stdio would only copy twice
+    setvbuf(newErr, NULL, _IONBF, 0);
+    fflush(stdout);
+    stdout = newOut;
+    stderr = newErr;
+    atexit(outExit);
+}
+
 /**
  * Prints a command struct
  * @param struct command_t *
@@ -71,6 +563,11 @@ int free_command(struct command_t *command)
     for (int i = 0; i < 3; ++i)
         if (command->redirects[i])
             free(command->redirects[i]);
+    for (int i = 0; i < command->fdRedirectCount; i++)
+        free(command->fdRedirects[i].target);
+    free(command->fdRedirects);
+    if (command->heredoc_fd > 0)
+        close(command->heredoc_fd);
     if (command->next)
     {
         free_command(command->next);
@@ -86,152 +583,59 @@ int free_command(struct command_t *command)
  */
 int show_prompt()
 {
+    struct shellVariable *ps1 = findVariable("PS1"); // set by ~/.shellaxrc, say
+    if (ps1)
+    {
+        char *text = expandString(ps1->value, EXPAND_STRING);
+        outString(text);
+        free(text);
+        return 0;
+    }
     char cwd[1024], hostname[1024];
     gethostname(hostname, sizeof(hostname));
     getcwd(cwd, sizeof(cwd));
-    printf("%s@%s:%s %s$ ", getenv("USER"), hostname, cwd, sysname);
+    outPrintf("%s@%s:%s %s$ ", getenv("USER"), hostname, cwd, sysname);
     return 0;
 }
+void prompt_backspace()
+{
+    outWrite("\b \b", 3); // go back 1, write empty over, go back 1 again
+}
+
 /**
- * Parse a command string into a command struct
- * @param  buf     [description]
- * @param  command [description]
- * @return         0
+ * Next key for prompt. Keys come in with one read as many as there are (a
+ * paste is one read), and the echo of all of them goes out with one write,
+ * just before blocking for more.
+ * @return the key, or EOF
  */
-int parse_command(char *buf, struct command_t *command)
+static int promptKey()
 {
-    const char *splitters = " \t"; // split at whitespace
-    int index, len;
-    len = strlen(buf);
-    while (len > 0 && strchr(splitters, buf[0]) != NULL) // trim left whitespace
-    {
-        buf++;
-        len--;
-    }
-    while (len > 0 && strchr(splitters, buf[len - 1]) != NULL)
-        buf[--len] = 0; // trim right whitespace
-
-    if (len > 0 && buf[len - 1] == '?') // auto-complete
-        command->auto_complete = true;
-    if (len > 0 && buf[len - 1] == '&') // background
-        command->background = true;
-
-    char *pch = strtok(buf, splitters);
-    if (pch == NULL)
-    {
-        command->name = (char *)malloc(1);
-        command->name[0] = 0;
-    }
-    else
+    static char keys[256];
+    static int keyCount, keyNext;
+    if (keyNext == keyCount)
     {
-        command->name = (char *)malloc(strlen(pch) + 1);
-        strcpy(command->name, pch);
-    }
-
-    command->args = (char **)malloc(sizeof(char *));
-
-    int redirect_index;
-    int arg_index = 0;
-    char temp_buf[1024], *arg;
-    while (1)
-    {
-        // tokenize input on splitters
-        pch = strtok(NULL, splitters);
-        if (!pch)
-            break;
-        arg = temp_buf;
-        strcpy(arg, pch);
-        len = strlen(arg);
-
-        if (len == 0)
-            continue;                                        // empty arg, go for next
-        while (len > 0 && strchr(splitters, arg[0]) != NULL) // trim left whitespace
-        {
-            arg++;
-            len--;
-        }
-        while (len > 0 && strchr(splitters, arg[len - 1]) != NULL)
-            arg[--len] = 0; // trim right whitespace
-        if (len == 0)
-            continue; // empty arg, go for next
-
-        // piping to another command
-        if (strcmp(arg, "|") == 0)
-        {
-            struct command_t *c = malloc(sizeof(struct command_t));
-            int l = strlen(pch);
-            pch[l] = splitters[0]; // restore strtok termination
-            index = 1;
-            while (pch[index] == ' ' || pch[index] == '\t')
-                index++; // skip whitespaces
-
-            parse_command(pch + index, c);
-            pch[l] = 0; // put back strtok termination
-            command->next = c;
-            continue;
-        }
-
-        // background process
-        if (strcmp(arg, "&") == 0)
-            continue; // handled before
-
-        // handle input redirection
-        redirect_index = -1;
-        if (arg[0] == '<')
-            redirect_index = 0;
-        if (arg[0] == '>')
-        {
-            if (len > 1 && arg[1] == '>')
-            {
-                redirect_index = 2;
-                arg++;
-                len--;
-            }
-            else
-                redirect_index = 1;
-        }
-        if (redirect_index != -1)
-        {
-            command->redirects[redirect_index] = malloc(len);
-            strcpy(command->redirects[redirect_index], arg + 1);
-            continue;
-        }
-
-        // normal arguments
-        if (len > 2 &&
-            ((arg[0] == '"' && arg[len - 1] == '"') ||
-             (arg[0] == '\'' && arg[len - 1] == '\''))) // quote wrapped arg
-        {
-            arg[--len] = 0;
-            arg++;
-        }
-        command->args =
-            (char **)realloc(command->args, sizeof(char *) * (arg_index + 1));
-        command->args[arg_index] = (char *)malloc(len + 1);
-        strcpy(command->args[arg_index++], arg);
+        outFlush();
+        ssize_t n;
+        while ((n = read(STDIN_FILENO, keys, sizeof(keys))) == -1 && errno == EINTR)
+            ;
+        if (n <= 0)
+            return EOF;
+        keyCount = n;
+        keyNext = 0;
     }
-    command->arg_count = arg_index;
-
-    return 0;
-}
-
-void prompt_backspace()
-{
-    putchar(8);   // go back 1
-    putchar(' '); // write empty over
-    putchar(8);   // go back 1 again
+    return (unsigned char)keys[keyNext++];
 }
 /**
- * Prompt a command from the user
- * @param  buf      [description]
- * @param  buf_size [description]
- * @return          [description]
+ * Prompt a line from the user
+ * @param  buf          where the line goes
+ * @param  size         size of buf (the arrows take at most 4096 from the history)
+ * @param  continuation the line continues an unfinished command, show "> "
+ * @return              SUCCESS, or EXIT on Ctrl+D
  */
-int prompt(struct command_t *command)
+int prompt(char *buf, size_t size, bool continuation)
 {
     int index = 0;
     char c;
-    char buf[4096];
     static char oldbuf[4096];
 
     // tcgetattr gets the parameters of the current terminal
@@ -249,15 +653,34 @@ int prompt(struct command_t *command)
     // TCSANOW tells tcsetattr to change attributes immediately.
     tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
 
-    show_prompt();
+    if (continuation)
+        outWrite("> ", 2);
+    else
+        show_prompt();
+    highlightStart();
+    historyReset();
     buf[0] = 0;
     while (1)
     {
-        c = getchar();
+        int key = promptKey();
+        c = key == EOF ? 4 : key; // end of input is Ctrl+D
         // printf("Keycode: %u\n", c); // DEBUG: uncomment for debugging
 
         if (c == 9) // handle tab
         {
+            buf[index] = 0;
+            if (zComplete(buf, size < sizeof(oldbuf) ? size : sizeof(oldbuf)))
+            {
+                while (index > 0)
+                {
+                    prompt_backspace();
+                    index--;
+                }
+                index = strlen(buf);
+                if (!highlightLine(buf, index))
+                    outString(buf);
+                continue;
+            }
             buf[index++] = '?'; // autocomplete
             break;
         }
@@ -266,37 +689,53 @@ int prompt(struct command_t *command)
         {
             if (index > 0)
             {
-                prompt_backspace();
                 index--;
+                buf[index] = 0;
+                if (!highlightErase(buf, index))
+                    prompt_backspace();
             }
             continue;
         }
 
-        if (c == 27 || c == 91 || c == 66 || c == 67 || c == 68)
+        if (c == 27) // escape sequence: ESC [ or ESC O, parameters, then a final byte
         {
-            continue;
-        }
+            int key = promptKey();
+            if (key == '[' || key == 'O')
+                while ((key = promptKey()) != EOF && (key < 0x40 || key > 0x7e))
+                    ;
+            if (key != 'A' && key != 'B') // only the up and down arrows do something
+                continue;
+            buf[index] = 0;
+            int moved = historyMove(key == 'A' ? -1 : 1, buf, size < sizeof(oldbuf) ? size : sizeof(oldbuf));
+            if (moved == 0 || (moved == -1 && key == 'B'))
+                continue;
 
-        if (c == 65) // up arrow
-        {
             while (index > 0)
             {
                 prompt_backspace();
                 index--;
             }
 
-            char tmpbuf[4096];
-            printf("%s", oldbuf);
-            strcpy(tmpbuf, buf);
-            strcpy(buf, oldbuf);
-            strcpy(oldbuf, tmpbuf);
+            if (moved == -1) // no shared history: the last line of this session
+            {
+                char tmpbuf[4096];
+                strcpy(tmpbuf, buf);
+                strcpy(buf, oldbuf);
+                strcpy(oldbuf, tmpbuf);
+            }
             index += strlen(buf);
+            if (!highlightLine(buf, index))
+                outString(buf);
             continue;
         }
 
-        putchar(c); // echo the character
         buf[index++] = c;
-        if (index >= sizeof(buf) - 1)
+        buf[index] = 0;
+        if (c == '\n' || c == 4)
+            highlightEnd();
+        if (c == 4 || (c == '\n' || !highlightInsert(buf, index)))
+            outChar(c); // echo the character
+        if ((size_t)index >= size - 1 || (size_t)index >= sizeof(oldbuf) - 1)
             break;
         if (c == '\n') // enter key
             break;
@@ -308,8 +747,8 @@ int prompt(struct command_t *command)
     buf[index++] = '\0'; // null terminate string
 
     strcpy(oldbuf, buf);
-
-    parse_command(buf, command);
+    if (isatty(STDIN_FILENO)) // typed, not a script on stdin
+        historyAdd(buf);
 
     // print_command(command); // DEBUG: uncomment for debugging
 
@@ -319,15 +758,83 @@ int prompt(struct command_t *command)
 }
 
 int process_command(struct command_t *command);
-int pipeCommand(struct command_t *command, int *p);
+int pipeCommand(struct command_t *command);
 void runCommand(struct command_t *command);
-void ourUniq(char *input);
-void ourUniqWithCount(char *input);
+int resolveCommand(const char *name, char *path, size_t size);
+int parallelCommand(struct command_t *command);
+int makeTempFd(const char *name);
+// child supervision (pidfd + epoll) and the background jobs on top of it:
+int superviseChild(pid_t pid);
+int superviseDeadline(int slot, long ms, int signal, long graceMs);
+int supervisorWait(int timeoutMs, int *exited, int max);
+int superviseUntilExit(int slot);
+void releaseChild(int slot);
+int addJob(pid_t pid, const char *command);
+void forgetJobs();
+void reportJobs();
+char *describeCommand(struct command_t *command);
+// ulimit and the rusage ledger:
+void applyChildLimits();
+// pin: CPUs, nice and scheduling policy of the commands started
+void preparePlacement();
+void applyPlacement();
+void recordUsage(pid_t pid, const char *command, int wstatus, const struct rusage *usage,
+                 const struct timespec *started);
+// text builtins (cat, wc, head, grep -F) running in the shell without exec:
+const struct textBuiltin *findTextBuiltin(struct command_t *command);
+int runTextBuiltin(const struct textBuiltin *builtin, struct command_t *command);
+struct stream_t *createStage(struct command_t *command);
+int streamRunChain(struct stream_t *first);
+void streamFree(struct stream_t *s);
+int streamEmit(struct stream_t *s, const char *data, size_t len);
+int streamFlush(struct stream_t *s);
+int writeAll(int fd, const char *data, size_t len);
+ssize_t copyFd(int in, int out);
+int applyRedirects(struct command_t *command);
+// scripts: compiled once to a tree of scriptNode, then run without re-reading the source
+int scriptLex(const char *source, struct token **tokensOut, int *countOut);
+void freeTokens(struct token *tokens, int count);
+int compileScript(const char *source, struct scriptNode **program);
+void freeNode(struct scriptNode *node);
+int executeNode(struct scriptNode *node);
+int runScript(const char *source);
+char *readScriptFile(const char *fileName);
+void expandWord(const char *text, struct fieldList *fields, int mode);
+char *expandString(const char *text, int mode);
+void freeFields(struct fieldList *fields);
+int evalArithmetic(const char *expression, long *value);
+const char *getVariable(const char *name);
+void setVariable(const char *name, const char *value, bool export);
+void unsetVariable(const char *name);
+bool inRcSnapshot(const void *p);
+struct shellFunction *findFunction(const char *name);
+void defineFunction(const char *name, struct scriptNode *body, const char *definition);
+struct alias *findAlias(const char *name);
+void setAlias(const char *name, const char *value);
+void loadRcFile();
+int benchStartup(int count);
+// shellax --server: one warm shell forking a session per shellax -c
+int runServer(const char *path);
+int runThroughServer(const char *path, int argc, char **argv);
+int benchServer(const char *path, int count);
+int callFunction(struct shellFunction *function, int argc, char **argv);
+const struct shellBuiltin *findShellBuiltin(const char *name);
 int wiseman(struct command_t *command, char *minutes);
 void chatroom(struct command_t *command);
 void sendMessage(char *inputMessage, char users[50][50], int numUsers);
 void guessGame(int guess, int goal, int lower, int higher, int *shot);
 void wordGame(char word[], int *chance);
+// word game solver, words are kept as letter masks plus one byte per position:
+uint32_t encodeWord(const char *word, unsigned char *letters);
+int scoreGuess(const unsigned char *guess, const unsigned char *answer);
+int loadWordList(const char *fileName, struct wordList *list);
+void freeWordList(struct wordList *list);
+int filterCandidates(const struct wordList *list, int *cand, int n,
+                     const unsigned char *guess, int pattern);
+int bestGuess(const struct wordList *list, const int *cand, int n);
+int solveWord(const struct wordList *list, int answerIndex, int firstGuess, int trace);
+void wordSolve(struct command_t *command);
+void wordBench(struct command_t *command);
 // helper functions to color texts in word game:
 void printGameInfo();
 void red();
@@ -338,27 +845,98 @@ void yellow();
 void cyan();
 void reset();
 
-int main()
+int main(int argc, char *argv[])
 {
-    while (1)
+    outputStart();
+    if (argc > 1 && strcmp(argv[1], "--bench-startup") == 0) // shellax --bench-startup [N]
+        return benchStartup(argc > 2 ? atoi(argv[2]) : 100);
+    if (argc > 2 && strcmp(argv[1], "--server") == 0) // shellax --server SOCKET
+        return runServer(argv[2]);
+    if (argc > 2 && strcmp(argv[1], "--bench-server") == 0) // shellax --bench-server SOCKET [N]
+        return benchServer(argv[2], argc > 3 ? atoi(argv[3]) : 100);
+    if (argc > 4 && strcmp(argv[1], "--client") == 0 && strcmp(argv[3], "-c") == 0) // shellax --client SOCKET -c ...
+    {
+        int status = runThroughServer(argv[2], argc - 4, argv + 4);
+        if (status != -1)
+            return status;
+        argc -= 2, argv += 2; // no server there, run it here
+    }
+    if (argc > 2 && strcmp(argv[1], "-c") == 0) // shellax -c 'script' [name [args...]]
+    {
+        int status;
+        if (argc > 3)
+            scriptName = argv[3];
+        positional = argv + 4 - (argc == 3);
+        positionalCount = argc > 4 ? argc - 4 : 0;
+        status = runScript(argv[2]);
+        outFlush();
+        return status;
+    }
+    if (argc > 1) // shellax script [args...]
+    {
+        char *source = readScriptFile(argv[1]);
+        if (source == NULL)
+        {
+            fprintf(stderr, "-%s: %s: %s\n", sysname, argv[1], strerror(errno));
+            return 127;
+        }
+        scriptName = argv[1];
+        positional = argv + 2;
+        positionalCount = argc - 2;
+        int status = runScript(source);
+        free(source);
+        outFlush();
+        return status;
+    }
+
+    loadRcFile();
+    if (getenv("SHELLAX_STARTUP_EXIT")) // for --bench-startup: stop at the first prompt
     {
-        struct command_t *command = malloc(sizeof(struct command_t));
-        memset(command, 0, sizeof(struct command_t)); // set all bytes to 0
+        show_prompt();
+        outFlush();
+        return 0;
+    }
 
-        int code;
-        code = prompt(command);
-        if (code == EXIT)
+    // interactive: lines are collected until they make a complete command
+    char buf[4096];
+    size_t length = 0, capacity = 4096;
+    char *source = malloc(capacity);
+    source[0] = 0;
+    interactive = true;
+    while (1)
+    {
+        if (length == 0)
+            reportJobs();
+        if (prompt(buf, sizeof(buf), length > 0) == EXIT)
             break;
-
-        code = process_command(command);
-        if (code == EXIT)
+        size_t n = strlen(buf);
+        if (length + n + 2 > capacity)
+            source = realloc(source, capacity = (length + n + 2) * 2);
+        memcpy(source + length, buf, n);
+        length += n;
+        source[length++] = '\n';
+        source[length] = 0;
+
+        struct scriptNode *program;
+        int code = compileScript(source, &program);
+        if (code == 1) // a quote, here-document or compound command is still open
+            continue;
+        length = 0;
+        source[0] = 0;
+        if (code == -1)
+        {
+            lastStatus = 2;
+            continue;
+        }
+        executeNode(program);
+        freeNode(program);
+        if (exiting)
             break;
-
-        free_command(command);
     }
+    free(source);
 
     printf("\n");
-    return 0;
+    return lastStatus;
 }
 
 int process_command(struct command_t *command)
@@ -368,7 +946,10 @@ int process_command(struct command_t *command)
         return SUCCESS;
 
     if (strcmp(command->name, "exit") == 0)
+    {
+        exiting = true;
         return EXIT;
+    }
 
     if (strcmp(command->name, "cd") == 0)
     {
@@ -377,22 +958,23 @@ int process_command(struct command_t *command)
             r = chdir(command->args[0]);
             if (r == -1)
                 printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+            else
+                zRecord();
+            lastStatus = r == -1;
             return SUCCESS;
         }
     }
 
-    int connection[2];
-    char message[4096];
-    char message2[4096];
-
-    if (pipe(connection) == -1)
-    {
-        printf("Pipe failed\n");
-    }
-
+    outFlush();
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
     pid_t pid = fork();
     if (pid == 0) // child process
     {
+        // redirects of a pipeline are opened by its stages, see pipeCommand
+        if (command->next == NULL && applyRedirects(command) == -1)
+            exit(1);
+
         /// This shows how to do exec with environ (but is not available on MacOs)
         // extern char** environ; // environment variables
         // execvpe(command->name, command->args, environ); // exec+args+path+environ
@@ -403,11 +985,19 @@ int process_command(struct command_t *command)
 
         // increase args size by 2
 
-        int p[2];
-        pipe(p);
-
         if (strcmp(command->name, "word") == 0) // custom command "word": a word guessing game
         {
+            if (command->arg_count > 0 && strcmp(command->args[0], "--solve") == 0) // let the solver play
+            {
+                wordSolve(command);
+                exit(0);
+            }
+            if (command->arg_count > 0 && strcmp(command->args[0], "--bench") == 0) // solver over the whole list
+            {
+                wordBench(command);
+                exit(0);
+            }
+
             int chance = 6; // user has 6 chances to guess the word correctly
 
             srand(time(NULL));
@@ -453,6 +1043,7 @@ int process_command(struct command_t *command)
                 int firstGuess;
                 int shott = 1;
                 printf("Welcome to guess game please enter your first guess: ");
+                outFlush();
                 scanf("%d", &firstGuess);
                 guessGame(firstGuess, r, 0, size, &shott);
                 exit(0);
@@ -472,333 +1063,10477 @@ int process_command(struct command_t *command)
 
         if (command->next != NULL) // if command includes pipe, calls the pipeCommand function
         {
-            pipeCommand(command, p);
+            exit(pipeCommand(command));
         }
 
-        command->args = (char **)realloc(
-            command->args, sizeof(char *) * (command->arg_count += 2));
-
-        // shift everything forward by 1
-        for (int i = command->arg_count - 2; i > 0; --i)
-            command->args[i] = command->args[i - 1];
-
-        // set args[0] as a copy of name
-        command->args[0] = strdup(command->name);
-        // set args[arg_count-1] (last) to NULL
-        command->args[command->arg_count - 1] = NULL;
-
-        // TODO: do your own exec with path resolving using execv()
-        // do so by replacing the execvp call below
-        // execvp(command->name, command->args); // exec+args+path
-
-        char *path = getenv("PATH"); // getting the path to find the given commands' paths.
-
-        char pathOfCommand[50];
-
-        const char s[2] = ":";
-        char *token;
-
-        // divide the path from each ":" to search every directory
-        token = strtok(path, s);
-
-        DIR *pDir;
-        struct dirent *entry;
-
-        while (token != NULL)
-        {
-            pDir = opendir(token);
-
-            if (pDir == NULL)
-            {
-                // return 1;
-            }
-            else
-            {
-                while ((entry = readdir(pDir)) != NULL)
-                {
-                    if (strcmp(entry->d_name, command->name) == 0) // find the command's path
-                    {
-                        strcpy(pathOfCommand, "");
-                        strcpy(pathOfCommand, token);
-                        strcat(pathOfCommand, "/");
-                        strcat(pathOfCommand, command->name); // pathOfCommand is the full path of the given command
-                        execv(pathOfCommand, command->args);  // give the path of the command and the arguments to execv()
-                        exit(0);
-                        break;
-                    }
-                    if (command->redirects[1] != NULL || command->redirects[2] != NULL) //---------Check if redirects
-                    {
-                        dup2(connection[1], STDOUT_FILENO); // creates the copy of connection[1]
-                    }
-                }
-            }
-
-            token = strtok(NULL, s); // search the next directory
-        }
+        runCommand(command); // builtins and exec with path resolving
+        exit(127);
     }
     else // parent process
     {
         // TODO: implement background processes here
         if (!command->background) //-----------------------------Background
         {
-            wait(0); // wait for child process to finish, if the command is not running on the background
-        }
-        if (command->redirects[0] != NULL) // includes <
-        {                                  //-------------------------------- Redirects
-            FILE *inputFile;
-            inputFile = fopen(command->redirects[0], "r"); // open the input file to read
-            fseek(inputFile, 0, SEEK_END);
-            int lenght = ftell(inputFile);
-            fseek(inputFile, 0, SEEK_SET);
-            char *message2 = (char *)malloc(sizeof(char) * (lenght + 1));
-            char inp;
-            message;
-            int i = 0;
-            while (1)
-            {
-                inp = fgetc(inputFile);
-                if (feof(inputFile))
-                {
-                    break;
-                }
-                message2[i] = inp;
-                i++;
-            }
-            message2[i] = '\0';
-            if (command->redirects[1] != NULL) // includes >
-            {
-                close(connection[1]);                           // close the unused end of the file
-                read(connection[0], &message, sizeof(message)); // read the input from the pipe
-                FILE *ptr;
-                ptr = fopen(command->redirects[1], "w"); // open the given file to write
-                printf("%s\n", command->redirects[1]);
-                fprintf(ptr, "%s%s", message, message2);
-                fclose(ptr);
-                close(connection[1]);
-            }
-            if (command->redirects[2] != NULL) // includes >>
-            {
-                close(connection[1]);                           // close the unused end of the file
-                read(connection[0], &message, sizeof(message)); // read the input from the pipe
-                FILE *ptr;
-                ptr = fopen(command->redirects[2], "a"); // option "a" appends to the end of the file
-                printf("%s\n", command->redirects[2]);
-                fputs(message, ptr);
-                fprintf(ptr, "%s", message2);
-                fclose(ptr);
-                close(connection[1]);
+            int wstatus;
+            struct rusage usage;
+            wait4(pid, &wstatus, 0, &usage); // wait for child process to finish, if the command is not running on the background
+            lastStatus = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128 + WTERMSIG(wstatus);
+            char *text = describeCommand(command);
+            recordUsage(pid, text, wstatus, &usage, &started);
+            free(text);
+        }
+        else
+        {
+            lastBackground = pid;
+            char *text = describeCommand(command);
+            addJob(pid, text);
+            free(text);
+        }
+        return SUCCESS;
+    }
+
+    // TODO: your implementation here
+    printf("-%s: %s: command not found\n", sysname, command->name);
+    return UNKNOWN;
+}
+
+/**
+ * Run a pipeline. Neighbouring text builtins are fused: they run as stages of
+ * one process and pass chunks to each other in memory, kernel pipes are only
+ * made where an external command (or a builtin reading its own files) starts
+ * or ends a run.
+ * @return exit status of the last command
+ */
+int pipeCommand(struct command_t *command)
+{
+    int input = STDIN_FILENO, status = 0;
+    int count = 0;
+    for (struct command_t *c = command; c; c = c->next)
+        count++;
+    pid_t *pids = malloc(sizeof(pid_t) * count);
+    int running = 0;
+    preparePlacement();
+
+    struct command_t *c = command;
+    struct stream_t *pending = NULL; // stage made for c while looking at the previous run
+    int havePending = 0;
+    while (c != NULL)
+    {
+        // a run is one external command, or builtins where each one reads the previous one's output
+        struct stream_t *first = havePending ? pending : createStage(c), *last = first;
+        struct command_t *runEnd = c;
+        havePending = 0;
+        while (first != NULL && runEnd->next != NULL && findTextBuiltin(runEnd->next) != NULL &&
+               runEnd->redirects[1] == NULL && runEnd->redirects[2] == NULL && runEnd->fdRedirectCount == 0)
+        {
+            struct stream_t *stage = createStage(runEnd->next);
+            if (stage == NULL || stage->fileCount > 0 || runEnd->next->redirects[0] != NULL ||
+                runEnd->next->fdRedirectCount > 0) // reads its own input, or has a 2>file of its own
+            {
+                pending = stage; // starts the next run
+                havePending = 1;
+                break;
+            }
+            last->next = stage;
+            last = stage;
+            runEnd = runEnd->next;
+        }
+
+        int p[2] = {-1, -1};
+        if (runEnd->next != NULL && pipe(p) == -1)
+        {
+            fprintf(stderr, "-%s: pipe: %s\n", sysname, strerror(errno));
+            break;
+        }
+
+        outFlush();
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            pipelineStage = running;
+            pipelineStages = count;
+            applyPlacement(); // for the text builtins, runCommand does it too
+            if (input != STDIN_FILENO) // read the previous run's output
+            {
+                dup2(input, STDIN_FILENO);
+                close(input);
+            }
+            if (p[1] != -1) // write to the next run
+            {
+                dup2(p[1], STDOUT_FILENO);
+                close(p[1]);
+                close(p[0]);
+            }
+            if (applyRedirects(c) == -1 || (runEnd != c && applyRedirects(runEnd) == -1))
+                exit(1);
+            if (first != NULL)
+                exit(streamRunChain(first));
+            if (findTextBuiltin(c) != NULL) // bad arguments, error already printed
+                exit(2);
+            runCommand(c);
+            exit(127);
+        }
+        if (pid != -1)
+            pids[running++] = pid;
+        while (first != NULL) // the stages only run in the child
+        {
+            struct stream_t *next = first->next;
+            streamFree(first);
+            first = next;
+        }
+        if (input != STDIN_FILENO)
+            close(input);
+        if (p[1] != -1)
+            close(p[1]);
+        input = p[0];
+        c = runEnd->next;
+    }
+    if (input != STDIN_FILENO)
+        close(input);
+
+    for (int i = 0; i < running; i++)
+    {
+        int wstatus;
+        if (waitpid(pids[i], &wstatus, 0) != -1 && i == running - 1)
+            status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128 + WTERMSIG(wstatus);
+    }
+    free(pids);
+    return status;
+}
+
+/**
+ * The fd a >&N or <&N redirect copies
+ * @return N, or -1 (errno EBADF) if it is not a number or not an open fd
+ */
+int redirectSource(const char *target)
+{
+    char *end;
+    long fd = strtol(target, &end, 10);
+    if (end == target || *end || fd < 0 || fd > INT_MAX || fcntl(fd, F_GETFD) == -1)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Open the redirect files of a command onto stdin/stdout, done in the child so
+ * the command reads and writes the files itself
+ * @return 0, or -1 if a file could not be opened
+ */
+int applyRedirects(struct command_t *command)
+{
+    const int flags[3] = {O_RDONLY, O_WRONLY | O_CREAT | O_TRUNC, O_WRONLY | O_CREAT | O_APPEND};
+    for (int i = 0; i < 3; i++)
+    {
+        if (command->redirects[i] == NULL)
+            continue;
+        int fd = open(command->redirects[i], flags[i], 0666);
+        if (fd == -1)
+        {
+            fprintf(stderr, "-%s: %s: %s\n", sysname, command->redirects[i], strerror(errno));
+            return -1;
+        }
+        dup2(fd, i == 0 ? STDIN_FILENO : STDOUT_FILENO);
+        close(fd);
+    }
+    for (int i = 0; i < command->fdRedirectCount; i++)
+    {
+        struct fdRedirect *r = &command->fdRedirects[i];
+        int fd = r->flags == -1 ? redirectSource(r->target) : open(r->target, r->flags, 0666);
+        if (fd == -1)
+        {
+            fprintf(stderr, "-%s: %s: %s\n", sysname, r->target, strerror(errno));
+            return -1;
+        }
+        if (fd != r->fd)
+        {
+            dup2(fd, r->fd);
+            if (r->flags != -1)
+                close(fd);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Stage the body of a here-document or here-string in a memfd. The child gets
+ * it as stdin through redirects[0] ("/dev/fd/N" opens the memfd from the start)
+ * @return 0, or -1 if no temporary file could be made
+ */
+int stageHereText(struct command_t *command, const char *text, size_t length)
+{
+    int fd = makeTempFd("heredoc");
+    if (fd == -1 || writeAll(fd, text, length) == -1)
+    {
+        fprintf(stderr, "-%s: here-document: %s\n", sysname, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    if (command->heredoc_fd > 0)
+        close(command->heredoc_fd);
+    command->heredoc_fd = fd;
+    free(command->redirects[0]);
+    command->redirects[0] = malloc(32);
+    snprintf(command->redirects[0], 32, "/dev/fd/%d", fd);
+    return 0;
+}
+
+/**
+ * Run a command line in a subshell and collect what it writes to stdout, for
+ * $(...) and `...`. The output goes into a buffer that doubles as it fills.
+ * @return the output without its trailing newlines (malloc'd), or NULL
+ */
+char *captureCommand(const char *line, size_t *length)
+{
+    rcImpure();
+    int fds[2];
+    if (pipe(fds) == -1)
+    {
+        fprintf(stderr, "-%s: command substitution: %s\n", sysname, strerror(errno));
+        return NULL;
+    }
+    outFlush(); // or the child would write our pending output into the pipe
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(fds[0]);
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[1]);
+        runSubshell(line);
+    }
+    close(fds[1]);
+
+    size_t used = 0, capacity = CAPTURE_CHUNK;
+    char *out = malloc(capacity);
+    while (1)
+    {
+        if (capacity - used < CAPTURE_CHUNK / 2)
+            out = realloc(out, capacity *= 2);
+        ssize_t n = read(fds[0], out + used, capacity - used);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        used += n;
+    }
+    close(fds[0]);
+    int wstatus;
+    if (waitpid(pid, &wstatus, 0) != -1)
+        lastStatus = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128 + WTERMSIG(wstatus);
+
+    while (used > 0 && out[used - 1] == '\n')
+        used--;
+    out[used] = 0;
+    *length = used;
+    return out;
+}
+
+// the ) closing a ( just before start, skipping nested and quoted parens; NULL if there is none
+const char *findClosingParen(const char *start)
+{
+    int depth = 1, quote = 0;
+    for (const char *p = start; *p; p++)
+    {
+        if (quote)
+            quote = *p == quote ? 0 : quote;
+        else if (*p == '\'' || *p == '"')
+            quote = *p;
+        else if (*p == '(')
+            depth++;
+        else if (*p == ')' && --depth == 0)
+            return p;
+    }
+    return NULL;
+}
+
+/**
+ * Run a script in this (forked) process and exit, for the children of command
+ * and process substitutions
+ */
+void runSubshell(const char *line)
+{
+    int status = runScript(line);
+    finishProcessSubstitutions(false);
+    outFlush();
+    exit(status);
+}
+
+/**
+ * Start the command of a <(...) or >(...) with its stdout (or stdin) on a pipe
+ * and remember the other end, which the command line gets as /dev/fd/N
+ * @return that fd, or -1
+ */
+int startProcessSubstitution(const char *line, bool output)
+{
+    rcImpure();
+    int fds[2];
+    if (pipe(fds) == -1)
+    {
+        fprintf(stderr, "-%s: process substitution: %s\n", sysname, strerror(errno));
+        return -1;
+    }
+    outFlush();
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // earlier substitutions are not ours, a >(...) holding their write end would never see EOF
+        for (int i = 0; i < substitutionCount; i++)
+            if (substitutions[i].fd != -1)
+                close(substitutions[i].fd);
+        substitutionCount = 0;
+        dup2(fds[output ? 0 : 1], output ? STDIN_FILENO : STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        runSubshell(line);
+    }
+    close(fds[output ? 0 : 1]);
+    if (pid == -1)
+    {
+        close(fds[output ? 1 : 0]);
+        return -1;
+    }
+    substitutions = realloc(substitutions, sizeof(struct processSubstitution) * (substitutionCount + 1));
+    substitutions[substitutionCount].pid = pid;
+    substitutions[substitutionCount].fd = fds[output ? 1 : 0];
+    return substitutions[substitutionCount++].fd;
+}
+
+/**
+ * Called when a command line is done: close our ends of its substitution
+ * pipes (so a >(...) sees EOF) and reap their commands. For a background
+ * command line they are reaped later, without waiting.
+ */
+void finishProcessSubstitutions(bool background)
+{
+    int kept = 0;
+    for (int i = 0; i < substitutionCount; i++)
+    {
+        if (substitutions[i].fd != -1)
+            close(substitutions[i].fd);
+        substitutions[i].fd = -1;
+        if (waitpid(substitutions[i].pid, NULL, background ? WNOHANG : 0) == 0)
+            substitutions[kept++] = substitutions[i];
+    }
+    substitutionCount = kept;
+}
+
+/**
+ * Find a command in PATH (names with a / are used as they are). The last
+ * answer is remembered, so children forked after a lookup don't search again.
+ * @return 0 and the full path in path, or -1 if there is no such command
+ */
+int resolveCommand(const char *name, char *path, size_t size)
+{
+    static char lastName[NAME_MAX + 1], lastPath[PATH_MAX];
+    static char lastPathVariable[4096];
+    struct stat st;
+
+    if (strchr(name, '/') != NULL)
+    {
+        snprintf(path, size, "%s", name);
+        return access(path, X_OK) == 0 && stat(path, &st) == 0 && !S_ISDIR(st.st_mode) ? 0 : -1;
+    }
+
+    const char *variable = getenv("PATH"); // get the path to search for commands
+    if (variable == NULL)
+        variable = "/usr/local/bin:/usr/bin:/bin";
+    if (lastName[0] && strcmp(lastName, name) == 0 && strcmp(lastPathVariable, variable) == 0)
+    {
+        snprintf(path, size, "%s", lastPath);
+        return 0;
+    }
+
+    const char *dir = variable;
+    while (1) // try every directory of PATH in order
+    {
+        const char *end = strchrnul(dir, ':');
+        int n = snprintf(path, size, "%.*s/%s", end > dir ? (int)(end - dir) : 1,
+                         end > dir ? dir : ".", name);
+        if (n < (int)size && access(path, X_OK) == 0 && stat(path, &st) == 0 && !S_ISDIR(st.st_mode))
+        {
+            if (strlen(name) <= NAME_MAX && strlen(variable) < sizeof(lastPathVariable))
+            {
+                strcpy(lastName, name);
+                snprintf(lastPath, sizeof(lastPath), "%s", path);
+                strcpy(lastPathVariable, variable);
+            }
+            return 0;
+        }
+        if (*end == 0)
+            return -1;
+        dir = end + 1;
+    }
+}
+
+/**
+ * Run a command in the current (child) process: builtins that run without exec
+ * are called here, anything else is exec'ed after a PATH lookup.
+ * Only returns if the command could not be started.
+ */
+void runCommand(struct command_t *command)
+{
+    applyChildLimits();
+    applyPlacement();
+    const struct shellBuiltin *shellBuiltin = findShellBuiltin(command->name);
+    struct shellFunction *function = shellBuiltin ? NULL : findFunction(command->name);
+    if (shellBuiltin || function) // echo, test, ... or a function as a pipeline stage
+    {
+        char **argv = malloc(sizeof(char *) * (command->arg_count + 2));
+        argv[0] = command->name;
+        memcpy(argv + 1, command->args, sizeof(char *) * command->arg_count);
+        argv[command->arg_count + 1] = NULL;
+        int status = shellBuiltin ? shellBuiltin->run(command->arg_count + 1, argv)
+                                  : callFunction(function, command->arg_count + 1, argv);
+        outFlush();
+        exit(status);
+    }
+
+    const struct textBuiltin *builtin = findTextBuiltin(command);
+    if (builtin != NULL) // text commands in a pipeline run in this process
+        exit(runTextBuiltin(builtin, command));
+    if (strcmp(command->name, "parallel") == 0)
+        exit(parallelCommand(command));
+
+    // increase args size by 2
+    command->args = (char **)realloc(
+        command->args, sizeof(char *) * (command->arg_count += 2));
+
+    // shift everything forward by 1
+    for (int i = command->arg_count - 2; i > 0; --i)
+        command->args[i] = command->args[i - 1];
+
+    command->args[0] = strdup(command->name);
+    command->args[command->arg_count - 1] = NULL;
+
+    char pathOfCommand[PATH_MAX];
+    if (resolveCommand(command->name, pathOfCommand, sizeof(pathOfCommand)) == -1)
+    {
+        fprintf(stderr, "-%s: %s: command not found\n", sysname, command->name);
+        return;
+    }
+    execv(pathOfCommand, command->args); // call execv() with the path of the command and the arguments received from the user
+    fprintf(stderr, "-%s: %s: %s\n", sysname, command->name, strerror(errno));
+}
+
+/**
+ * Scanning kernels used by the text builtins. Each has a scalar, SSE2 and AVX2
+ * version, the fastest one the CPU supports is picked on first use
+ * (SHELLAX_SCAN=scalar|sse2|avx2 forces one).
+ */
+struct scanKernels
+{
+    const char *name;
+    const char *(*find)(const char *p, size_t n, char c);  // first c, or NULL
+    const char *(*rfind)(const char *p, size_t n, char c); // last c, or NULL
+    size_t (*count)(const char *p, size_t n, char c);      // number of c
+    // number of words starting in p, *inSpace tells if the previous byte was whitespace
+    size_t (*words)(const char *p, size_t n, int *inSpace);
+    // earliest occurrence of any of the (non empty) fixed strings, or NULL
+    const char *(*findFixed)(const char *p, size_t n, struct fixedStrings *set);
+};
+
+// does any string of the set start at p (with at least left bytes readable)?
+static inline int matchFixedAt(const char *p, size_t left, struct fixedStrings *set)
+{
+    for (int k = 0; k < set->count; k++)
+        if (set->lengths[k] <= left && memcmp(p, set->strings[k], set->lengths[k]) == 0)
+            return 1;
+    return 0;
+}
+
+/**
+ * memmem for every string, remembering where each one was found (or that it is
+ * not in the rest of the buffer) so the next calls over the same block don't search again.
+ * grepLines clears the cache before each block.
+ */
+static const char *findFixedScalar(const char *p, size_t n, struct fixedStrings *set)
+{
+    const char *end = p + n, *best = NULL;
+    if (set->cacheEnd != end) // a new buffer
+    {
+        set->cacheEnd = end;
+        for (int k = 0; k < set->count; k++)
+            set->found[k] = NULL;
+    }
+    for (int k = 0; k < set->count; k++)
+    {
+        const char *m = set->found[k];
+        if (m == end) // not in the rest of the buffer
+            continue;
+        if (m == NULL || m < p)
+        {
+            m = memmem(p, n, set->strings[k], set->lengths[k]);
+            set->found[k] = m ? m : end;
+            if (m == NULL)
+                continue;
+        }
+        if (best == NULL || m < best)
+            best = m;
+    }
+    return best;
+}
+
+static inline int isWordSpace(unsigned char c)
+{
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static const char *findByteScalar(const char *p, size_t n, char c)
+{
+    for (size_t i = 0; i < n; i++)
+        if (p[i] == c)
+            return p + i;
+    return NULL;
+}
+
+static const char *rfindByteScalar(const char *p, size_t n, char c)
+{
+    while (n > 0)
+        if (p[--n] == c)
+            return p + n;
+    return NULL;
+}
+
+static size_t countByteScalar(const char *p, size_t n, char c)
+{
+    size_t total = 0;
+    for (size_t i = 0; i < n; i++)
+        total += p[i] == c;
+    return total;
+}
+
+static size_t countWordsScalar(const char *p, size_t n, int *inSpace)
+{
+    size_t total = 0;
+    int space = *inSpace;
+    for (size_t i = 0; i < n; i++)
+    {
+        int s = isWordSpace(p[i]);
+        total += space & !s;
+        space = s;
+    }
+    *inSpace = space;
+    return total;
+}
+
+static const struct scanKernels scalarKernels = {
+    "scalar", findByteScalar, rfindByteScalar, countByteScalar, countWordsScalar, findFixedScalar};
+
+#if defined(__x86_64__)
+static const char *findByteSSE2(const char *p, size_t n, char c)
+{
+    __m128i needle = _mm_set1_epi8(c);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        int m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), needle));
+        if (m)
+            return p + i + __builtin_ctz(m);
+    }
+    return findByteScalar(p + i, n - i, c);
+}
+
+static const char *rfindByteSSE2(const char *p, size_t n, char c)
+{
+    __m128i needle = _mm_set1_epi8(c);
+    while (n >= 16)
+    {
+        n -= 16;
+        int m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + n)), needle));
+        if (m)
+            return p + n + 31 - __builtin_clz(m);
+    }
+    return rfindByteScalar(p, n, c);
+}
+
+static size_t countByteSSE2(const char *p, size_t n, char c)
+{
+    __m128i needle = _mm_set1_epi8(c);
+    size_t i = 0, total = 0;
+    for (; i + 16 <= n; i += 16)
+        total += __builtin_popcount(
+            _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), needle)));
+    return total + countByteScalar(p + i, n - i, c);
+}
+
+static size_t countWordsSSE2(const char *p, size_t n, int *inSpace)
+{
+    // whitespace is ' ' or '\t'..'\r', a word starts at a non-space after a space
+    const __m128i space = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t'), four = _mm_set1_epi8(4);
+    size_t i = 0, total = 0;
+    unsigned prev = *inSpace;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i t = _mm_sub_epi8(v, tab);
+        __m128i ws = _mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(_mm_min_epu8(t, four), t));
+        unsigned m = _mm_movemask_epi8(ws);
+        total += __builtin_popcount(~m & ((m << 1) | prev) & 0xffff);
+        prev = m >> 15;
+    }
+    *inSpace = prev;
+    return total + countWordsScalar(p + i, n - i, inSpace);
+}
+
+/**
+ * Candidate positions are where the first and the last byte of some string both
+ * match (16 positions per step), only those are compared in full
+ */
+static const char *findFixedSSE2(const char *p, size_t n, struct fixedStrings *set)
+{
+    if (set->count > FIXED_SIMD_MAX)
+        return findFixedScalar(p, n, set);
+    __m128i first[FIXED_SIMD_MAX], last[FIXED_SIMD_MAX];
+    for (int k = 0; k < set->count; k++)
+    {
+        first[k] = _mm_set1_epi8(set->strings[k][0]);
+        last[k] = _mm_set1_epi8(set->strings[k][set->lengths[k] - 1]);
+    }
+    size_t i = 0;
+    for (; i + 16 + set->maxLength - 1 <= n; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        unsigned m = 0;
+        for (int k = 0; k < set->count; k++)
+        {
+            __m128i w = _mm_loadu_si128((const __m128i *)(p + i + set->lengths[k] - 1));
+            m |= _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(v, first[k]), _mm_cmpeq_epi8(w, last[k])));
+        }
+        for (; m; m &= m - 1)
+        {
+            size_t at = i + __builtin_ctz(m);
+            if (matchFixedAt(p + at, n - at, set))
+                return p + at;
+        }
+    }
+    return findFixedScalar(p + i, n - i, set);
+}
+
+static const struct scanKernels sse2Kernels = {
+    "sse2", findByteSSE2, rfindByteSSE2, countByteSSE2, countWordsSSE2, findFixedSSE2};
+
+__attribute__((target("avx2,popcnt"))) static const char *findByteAVX2(const char *p, size_t n, char c)
+{
+    __m256i needle = _mm256_set1_epi8(c);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        unsigned m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), needle));
+        if (m)
+            return p + i + __builtin_ctz(m);
+    }
+    return findByteScalar(p + i, n - i, c);
+}
+
+__attribute__((target("avx2,popcnt"))) static const char *rfindByteAVX2(const char *p, size_t n, char c)
+{
+    __m256i needle = _mm256_set1_epi8(c);
+    while (n >= 32)
+    {
+        n -= 32;
+        unsigned m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + n)), needle));
+        if (m)
+            return p + n + 31 - __builtin_clz(m);
+    }
+    return rfindByteScalar(p, n, c);
+}
+
+__attribute__((target("avx2,popcnt"))) static size_t countByteAVX2(const char *p, size_t n, char c)
+{
+    __m256i needle = _mm256_set1_epi8(c);
+    size_t i = 0, total = 0;
+    for (; i + 32 <= n; i += 32)
+        total += __builtin_popcount(
+            _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), needle)));
+    return total + countByteScalar(p + i, n - i, c);
+}
+
+__attribute__((target("avx2,popcnt"))) static size_t countWordsAVX2(const char *p, size_t n, int *inSpace)
+{
+    const __m256i space = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t'), four = _mm256_set1_epi8(4);
+    size_t i = 0, total = 0;
+    uint32_t prev = *inSpace;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i t = _mm256_sub_epi8(v, tab);
+        __m256i ws = _mm256_or_si256(_mm256_cmpeq_epi8(v, space),
+                                     _mm256_cmpeq_epi8(_mm256_min_epu8(t, four), t));
+        uint32_t m = _mm256_movemask_epi8(ws);
+        total += __builtin_popcount(~m & ((m << 1) | prev));
+        prev = m >> 31;
+    }
+    *inSpace = prev;
+    return total + countWordsScalar(p + i, n - i, inSpace);
+}
+
+__attribute__((target("avx2,popcnt"))) static const char *findFixedAVX2(const char *p, size_t n,
+                                                                      struct fixedStrings *set)
+{
+    if (set->count > FIXED_SIMD_MAX)
+        return findFixedScalar(p, n, set);
+    __m256i first[FIXED_SIMD_MAX], last[FIXED_SIMD_MAX];
+    for (int k = 0; k < set->count; k++)
+    {
+        first[k] = _mm256_set1_epi8(set->strings[k][0]);
+        last[k] = _mm256_set1_epi8(set->strings[k][set->lengths[k] - 1]);
+    }
+    size_t i = 0;
+    for (; i + 32 + set->maxLength - 1 <= n; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        uint32_t m = 0;
+        for (int k = 0; k < set->count; k++)
+        {
+            __m256i w = _mm256_loadu_si256((const __m256i *)(p + i + set->lengths[k] - 1));
+            m |= _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(v, first[k]),
+                                                       _mm256_cmpeq_epi8(w, last[k])));
+        }
+        for (; m; m &= m - 1)
+        {
+            size_t at = i + __builtin_ctz(m);
+            if (matchFixedAt(p + at, n - at, set))
+                return p + at;
+        }
+    }
+    return findFixedScalar(p + i, n - i, set);
+}
+
+static const struct scanKernels avx2Kernels = {
+    "avx2", findByteAVX2, rfindByteAVX2, countByteAVX2, countWordsAVX2, findFixedAVX2};
+#endif
+
+const struct scanKernels *getScanKernels()
+{
+    static const struct scanKernels *selected = NULL;
+    if (selected)
+        return selected;
+
+    const char *forced = getenv("SHELLAX_SCAN");
+    selected = &scalarKernels;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    selected = &sse2Kernels; // always there on x86-64
+    if (__builtin_cpu_supports("avx2"))
+        selected = &avx2Kernels;
+    if (forced && strcmp(forced, "sse2") == 0)
+        selected = &sse2Kernels;
+#endif
+    if (forced && strcmp(forced, "scalar") == 0)
+        selected = &scalarKernels;
+    return selected;
+}
+
+/**
+ * Write out (or pass to the next stage) the output of a stage
+ * @return 1 if nothing more should be sent (the reader went away), 0 otherwise
+ */
+int streamEmit(struct stream_t *s, const char *data, size_t len)
+{
+    if (s->closed)
+        return 1;
+    if (s->next)
+        return s->closed = s->next->feed(s->next, data, len);
+
+    if (s->outLen + len > STREAM_OUT_SIZE) // what is pending and the new data leave in one writev
+    {
+        struct iovec iov[2] = {{s->out, s->outLen}, {(char *)data, len}};
+        int first = s->outLen == 0;
+        s->outLen = 0;
+        return s->closed = writevAll(s->fd, iov + first, 2 - first) == -1;
+    }
+    if (s->out == NULL)
+        s->out = malloc(STREAM_OUT_SIZE);
+    memcpy(s->out + s->outLen, data, len);
+    s->outLen += len;
+    return 0;
+}
+
+int streamFlush(struct stream_t *s)
+{
+    if (s->outLen == 0)
+        return 0;
+    int r = writeAll(s->fd, s->out, s->outLen);
+    s->outLen = 0;
+    return s->closed = r == -1;
+}
+
+int writeAll(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t w = write(fd, data, len);
+        if (w == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += w;
+        len -= w;
+    }
+    return 0;
+}
+
+/**
+ * Copy everything from in to out without going through user space when the
+ * kernel can: copy_file_range between regular files, splice when one side is a
+ * pipe, sendfile from a regular file to anything else. A large aligned buffer
+ * is used when those are not supported for the pair.
+ * @return bytes copied, or -1 on error (errno set)
+ */
+ssize_t copyFd(int in, int out)
+{
+    struct stat inStat, outStat;
+    ssize_t total = 0, n;
+    if (fstat(in, &inStat) == -1 || fstat(out, &outStat) == -1)
+        return -1;
+    int appending = fcntl(out, F_GETFL) & O_APPEND;
+
+    if (S_ISREG(inStat.st_mode) && S_ISREG(outStat.st_mode) && !appending)
+    {
+        while ((n = copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0)) > 0)
+            total += n;
+        if (n == 0)
+            return total;
+        if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP)
+            return -1;
+    }
+    if ((S_ISFIFO(inStat.st_mode) || S_ISFIFO(outStat.st_mode)) && !appending)
+    {
+        while ((n = splice(in, NULL, out, NULL, COPY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE)) > 0 ||
+               (n == -1 && errno == EINTR))
+            total += n > 0 ? n : 0;
+        if (n == 0)
+            return total;
+        if (errno != EINVAL && errno != ENOSYS)
+            return -1;
+    }
+    else if (S_ISREG(inStat.st_mode))
+    {
+        while ((n = sendfile(out, in, NULL, COPY_CHUNK)) > 0 || (n == -1 && errno == EINTR))
+            total += n > 0 ? n : 0;
+        if (n == 0)
+            return total;
+        if (errno != EINVAL && errno != ENOSYS)
+            return -1;
+    }
+
+    // the offsets moved with whatever was copied above, go on from there
+    static char *buffer = NULL;
+    if (buffer == NULL && posix_memalign((void **)&buffer, 4096, COPY_BUFFER_SIZE) != 0)
+        return -1;
+    while (1)
+    {
+        n = read(in, buffer, COPY_BUFFER_SIZE);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return n == 0 ? total : -1;
+        if (writeAll(out, buffer, n) == -1)
+            return -1;
+        total += n;
+    }
+}
+
+/**
+ * feed function of the line based stages: hands s->lines blocks made only of
+ * complete lines, a line cut at the end of a chunk is kept until its newline arrives
+ */
+int streamFeedLines(struct stream_t *s, const char *data, size_t len)
+{
+    const struct scanKernels *scan = getScanKernels();
+    if (s->carryLen > 0)
+    {
+        const char *nl = scan->find(data, len, '\n');
+        size_t take = nl ? (size_t)(nl - data) + 1 : len;
+        if (s->carryLen + take > s->carryCap)
+        {
+            while (s->carryLen + take > s->carryCap)
+                s->carryCap = s->carryCap ? s->carryCap * 2 : 4096;
+            s->carry = realloc(s->carry, s->carryCap);
+        }
+        memcpy(s->carry + s->carryLen, data, take);
+        s->carryLen += take;
+        data += take;
+        len -= take;
+        if (!nl)
+            return 0;
+        size_t n = s->carryLen;
+        s->carryLen = 0;
+        if (s->lines(s, s->carry, n))
+            return 1;
+    }
+    if (len == 0)
+        return 0;
+
+    const char *last = scan->rfind(data, len, '\n');
+    size_t complete = last ? (size_t)(last - data) + 1 : 0;
+    if (complete > 0 && s->lines(s, data, complete))
+        return 1;
+    if (complete < len) // keep the partial line
+    {
+        size_t rest = len - complete;
+        if (rest > s->carryCap)
+        {
+            s->carryCap = rest > 4096 ? rest : 4096;
+            s->carry = realloc(s->carry, s->carryCap);
+        }
+        memcpy(s->carry, data + complete, rest);
+        s->carryLen = rest;
+    }
+    return 0;
+}
+
+// pass the last line without a newline (if any) to s->lines
+int streamFinishLines(struct stream_t *s)
+{
+    if (s->carryLen == 0)
+        return 0;
+    size_t n = s->carryLen;
+    s->carryLen = 0;
+    return s->lines(s, s->carry, n);
+}
+
+/**
+ * Read fd in big chunks and push it through the stage
+ * @return 1 if the stage asked to stop, -1 on read error, 0 at end of file
+ */
+int streamPump(struct stream_t *s, int fd)
+{
+    static char *chunk = NULL;
+    if (chunk == NULL)
+        chunk = malloc(STREAM_CHUNK);
+    while (1)
+    {
+        ssize_t n = read(fd, chunk, STREAM_CHUNK);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return n == 0 ? 0 : -1;
+        if (s->feed(s, chunk, n))
+            return 1;
+    }
+}
+
+/**
+ * Run a text builtin stage over its file arguments (or stdin if there are none),
+ * then let it finish and flush its output
+ * @return exit status of the builtin
+ */
+int streamRun(struct stream_t *s)
+{
+    int nfiles = s->fileCount;
+    for (int i = 0; i < (nfiles > 0 ? nfiles : 1); i++)
+    {
+        const char *name = nfiles > 0 ? s->files[i] : NULL;
+        int fd = STDIN_FILENO;
+        if (name && strcmp(name, "-") != 0)
+        {
+            fd = open(name, O_RDONLY);
+            if (fd == -1)
+            {
+                fprintf(stderr, "-%s: %s: %s: %s\n", sysname, s->command->name, name, strerror(errno));
+                s->status = 2;
+                continue;
+            }
+        }
+        if (s->beginFile && nfiles > 1)
+            s->beginFile(s, name);
+        int r = s->pump ? s->pump(s, fd) : streamPump(s, fd);
+        if (fd != STDIN_FILENO)
+            close(fd);
+        if (r == -1)
+        {
+            fprintf(stderr, "-%s: %s: %s: %s\n", sysname, s->command->name,
+                    name ? name : "stdin", strerror(errno));
+            s->status = 2;
+        }
+        if (s->endFile)
+            s->endFile(s, name);
+        if (s->closed) // nobody reads the output anymore
+            break;
+    }
+    if (s->finish)
+        s->finish(s);
+    streamFlush(s);
+    return s->status;
+}
+
+void streamFree(struct stream_t *s)
+{
+    if (s->release)
+        s->release(s);
+    free(s->out);
+    free(s->carry);
+    free(s->state);
+    free(s);
+}
+
+// a new stage writing to stdout
+struct stream_t *streamCreate(struct command_t *command)
+{
+    struct stream_t *s = calloc(1, sizeof(struct stream_t));
+    s->command = command;
+    s->fd = STDOUT_FILENO;
+    return s;
+}
+
+// cat [files]: copies its input
+int catFeed(struct stream_t *s, const char *data, size_t len)
+{
+    return streamEmit(s, data, len);
+}
+
+// last stage: hand the whole file to copyFd
+int catPump(struct stream_t *s, int fd)
+{
+    if (s->next != NULL)
+        return streamPump(s, fd);
+    if (streamFlush(s))
+        return 1;
+    if (copyFd(fd, s->fd) == -1)
+    {
+        if (errno == EPIPE)
+            s->closed = 1;
+        return errno == EPIPE ? 1 : -1;
+    }
+    return 0;
+}
+
+struct stream_t *catCreate(struct command_t *command)
+{
+    struct stream_t *s = streamCreate(command);
+    s->feed = catFeed;
+    s->pump = catPump;
+    s->files = command->args;
+    s->fileCount = command->arg_count;
+    return s;
+}
+
+// wc [-l] [-w] [-c] [files]: counts lines, words and bytes
+struct wcState
+{
+    int showLines, showWords, showBytes;
+    int inSpace;
+    long lines, words, bytes;
+    long totalLines, totalWords, totalBytes;
+};
+
+int wcFeed(struct stream_t *s, const char *data, size_t len)
+{
+    struct wcState *wc = s->state;
+    const struct scanKernels *scan = getScanKernels();
+    if (wc->showLines)
+        wc->lines += scan->count(data, len, '\n');
+    if (wc->showWords)
+        wc->words += scan->words(data, len, &wc->inSpace);
+    wc->bytes += len;
+    return 0;
+}
+
+void wcPrint(struct stream_t *s, long lines, long words, long bytes, const char *name)
+{
+    struct wcState *wc = s->state;
+    char line[128];
+    int n = 0;
+    int single = wc->showLines + wc->showWords + wc->showBytes == 1;
+    const char *format = single ? "%ld" : "%7ld";
+    if (wc->showLines)
+        n += snprintf(line + n, sizeof(line) - n, format, lines);
+    if (wc->showWords)
+        n += snprintf(line + n, sizeof(line) - n, n ? " %7ld" : format, words);
+    if (wc->showBytes)
+        n += snprintf(line + n, sizeof(line) - n, n ? " %7ld" : format, bytes);
+    streamEmit(s, line, n);
+    if (name)
+    {
+        streamEmit(s, " ", 1);
+        streamEmit(s, name, strlen(name));
+    }
+    streamEmit(s, "\n", 1);
+}
+
+int wcEndFile(struct stream_t *s, const char *name)
+{
+    struct wcState *wc = s->state;
+    if (name != NULL) // counts of stdin are printed by wcFinish
+    {
+        wcPrint(s, wc->lines, wc->words, wc->bytes, name);
+        wc->totalLines += wc->lines;
+        wc->totalWords += wc->words;
+        wc->totalBytes += wc->bytes;
+        wc->lines = wc->words = wc->bytes = 0;
+    }
+    wc->inSpace = 1;
+    return 0;
+}
+
+int wcFinish(struct stream_t *s)
+{
+    struct wcState *wc = s->state;
+    if (s->fileCount == 0 || s->next) // reading stdin (or a previous stage)
+        wcPrint(s, wc->lines, wc->words, wc->bytes, NULL);
+    else if (s->fileCount > 1)
+        wcPrint(s, wc->totalLines, wc->totalWords, wc->totalBytes, "total");
+    return 0;
+}
+
+struct stream_t *wcCreate(struct command_t *command)
+{
+    struct stream_t *s = streamCreate(command);
+    struct wcState *wc = calloc(1, sizeof(struct wcState));
+    s->state = wc;
+    s->feed = wcFeed;
+    s->endFile = wcEndFile;
+    s->finish = wcFinish;
+    wc->inSpace = 1;
+
+    int i = 0;
+    for (; i < command->arg_count && command->args[i][0] == '-' && command->args[i][1]; i++)
+    {
+        for (char *opt = command->args[i] + 1; *opt; opt++)
+        {
+            if (*opt == 'l')
+                wc->showLines = 1;
+            else if (*opt == 'w')
+                wc->showWords = 1;
+            else if (*opt == 'c')
+                wc->showBytes = 1;
+            else
+            {
+                fprintf(stderr, "-%s: wc: invalid option -%c\n", sysname, *opt);
+                streamFree(s);
+                return NULL;
+            }
+        }
+    }
+    if (!wc->showLines && !wc->showWords && !wc->showBytes)
+        wc->showLines = wc->showWords = wc->showBytes = 1;
+    s->files = command->args + i;
+    s->fileCount = command->arg_count - i;
+    return s;
+}
+
+// head [-n N | -N] [files]: first N lines of each file
+struct headState
+{
+    long limit, left;
+    int titles; // file titles printed so far
+};
+
+int headLines(struct stream_t *s, const char *data, size_t len)
+{
+    struct headState *head = s->state;
+    const struct scanKernels *scan = getScanKernels();
+    const char *p = data, *end = data + len;
+    while (head->left > 0 && p < end)
+    {
+        const char *nl = scan->find(p, end - p, '\n');
+        p = nl ? nl + 1 : end;
+        head->left--;
+    }
+    if (p > data && streamEmit(s, data, p - data))
+        return 1;
+    return head->left == 0; // got enough, stop reading
+}
+
+int headBeginFile(struct stream_t *s, const char *name)
+{
+    struct headState *head = s->state;
+    char title[PATH_MAX + 16];
+    int n = snprintf(title, sizeof(title), "%s==> %s <==\n", head->titles++ ? "\n" : "",
+                     name ? name : "standard input");
+    head->left = head->limit;
+    s->carryLen = 0;
+    return streamEmit(s, title, n);
+}
+
+struct stream_t *headCreate(struct command_t *command)
+{
+    struct stream_t *s = streamCreate(command);
+    struct headState *head = calloc(1, sizeof(struct headState));
+    s->state = head;
+    s->feed = streamFeedLines;
+    s->lines = headLines;
+    s->finish = streamFinishLines;
+    s->beginFile = headBeginFile;
+    head->limit = 10;
+
+    int i = 0;
+    for (; i < command->arg_count && command->args[i][0] == '-' && command->args[i][1]; i++)
+    {
+        char *arg = command->args[i];
+        if (strcmp(arg, "-n") == 0 && i + 1 < command->arg_count)
+            head->limit = atol(command->args[++i]);
+        else if (strncmp(arg, "-n", 2) == 0)
+            head->limit = atol(arg + 2);
+        else if (arg[1] >= '0' && arg[1] <= '9')
+            head->limit = atol(arg + 1);
+        else
+        {
+            fprintf(stderr, "-%s: head: invalid option %s\n", sysname, arg);
+            streamFree(s);
+            return NULL;
+        }
+    }
+    head->left = head->limit;
+    s->files = command->args + i;
+    s->fileCount = command->arg_count - i;
+    return s;
+}
+
+// grep -F [-v] [-c] [-n] [-e PATTERN]... [PATTERN] [file]: lines containing any of the fixed strings
+struct grepState
+{
+    int invert, countOnly, numbers;
+    int matchAll; // an empty pattern matches every line
+    struct fixedStrings patterns;
+    long matches, lineNumber;
+};
+
+// print lines [from, to) which all have the same match state, with line numbers if asked
+int grepEmitLines(struct stream_t *s, const char *from, const char *to)
+{
+    struct grepState *grep = s->state;
+    if (!grep->numbers)
+        return streamEmit(s, from, to - from);
+    const struct scanKernels *scan = getScanKernels();
+    while (from < to)
+    {
+        const char *nl = scan->find(from, to - from, '\n');
+        const char *next = nl ? nl + 1 : to;
+        char number[32];
+        int n = snprintf(number, sizeof(number), "%ld:", ++grep->lineNumber);
+        if (streamEmit(s, number, n) || streamEmit(s, from, next - from))
+            return 1;
+        from = next;
+    }
+    return 0;
+}
+
+int grepLines(struct stream_t *s, const char *data, size_t len)
+{
+    struct grepState *grep = s->state;
+    const struct scanKernels *scan = getScanKernels();
+    const char *p = data, *end = data + len;
+    grep->patterns.cacheEnd = NULL; // the chunk buffer is reused, nothing found in the last block is still there
+
+    while (p < end)
+    {
+        const char *m = grep->matchAll ? p : scan->findFixed(p, end - p, &grep->patterns);
+        if (m == NULL) // the rest of the block does not match
+        {
+            if (grep->invert)
+            {
+                grep->matches += scan->count(p, end - p, '\n') + (end[-1] != '\n');
+                return grep->countOnly ? 0 : grepEmitLines(s, p, end);
+            }
+            if (grep->numbers)
+                grep->lineNumber += scan->count(p, end - p, '\n');
+            return 0;
+        }
+        const char *lineStart = scan->rfind(p, m - p, '\n');
+        lineStart = lineStart ? lineStart + 1 : p;
+        const char *nl = scan->find(m, end - m, '\n');
+        const char *lineEnd = nl ? nl + 1 : end;
+
+        if (grep->invert) // lines before the matching one
+        {
+            grep->matches += scan->count(p, lineStart - p, '\n');
+            if (!grep->countOnly && lineStart > p && grepEmitLines(s, p, lineStart))
+                return 1;
+            if (grep->numbers)
+                grep->lineNumber++;
+        }
+        else
+        {
+            grep->matches++;
+            if (grep->numbers)
+                grep->lineNumber += scan->count(p, lineStart - p, '\n');
+            if (!grep->countOnly)
+            {
+                if (grepEmitLines(s, lineStart, lineEnd))
+                    return 1;
+                if (!nl && streamEmit(s, "\n", 1)) // last line without a newline
+                    return 1;
+            }
+            else if (grep->numbers)
+                grep->lineNumber++;
+        }
+        p = lineEnd;
+    }
+    return 0;
+}
+
+void grepRelease(struct stream_t *s)
+{
+    struct grepState *grep = s->state;
+    free(grep->patterns.strings);
+    free(grep->patterns.lengths);
+    free(grep->patterns.found);
+}
+
+int grepFinish(struct stream_t *s)
+{
+    struct grepState *grep = s->state;
+    streamFinishLines(s);
+    if (grep->countOnly)
+    {
+        char line[32];
+        int n = snprintf(line, sizeof(line), "%ld\n", grep->matches);
+        streamEmit(s, line, n);
+    }
+    if (s->status == 0 && grep->matches == 0)
+        s->status = 1; // like grep, nothing selected
+    return 0;
+}
+
+/**
+ * grep is only run in the shell for what grepCreate does: -F with -v, -c, -n
+ * and -e, on stdin or one file. Any other option, or several files (grep
+ * prints file: before their lines), is left to the real grep.
+ */
+int isFixedGrep(struct command_t *command)
+{
+    int fixed = 0, patterns = 0, i = 0;
+    for (; i < command->arg_count && command->args[i][0] == '-' && command->args[i][1]; i++)
+    {
+        const char *arg = command->args[i];
+        if (strcmp(arg, "--") == 0)
+        {
+            i++;
+            break;
+        }
+        if (strcmp(arg, "-e") == 0 && i + 1 < command->arg_count)
+        {
+            i++;
+            patterns++;
+            continue;
+        }
+        if (arg[1 + strspn(arg + 1, "Fvcn")] != 0)
+            return 0;
+        fixed |= strchr(arg, 'F') != NULL;
+    }
+    if (patterns == 0) // the first word left is the pattern
+        i++;
+    return fixed && command->arg_count - i <= 1;
+}
+
+struct stream_t *grepCreate(struct command_t *command)
+{
+    struct stream_t *s = streamCreate(command);
+    struct grepState *grep = calloc(1, sizeof(struct grepState));
+    s->state = grep;
+    s->feed = streamFeedLines;
+    s->lines = grepLines;
+    s->finish = grepFinish;
+    s->release = grepRelease;
+    struct fixedStrings *set = &grep->patterns;
+    set->strings = malloc(sizeof(char *) * (command->arg_count + 1));
+    set->lengths = malloc(sizeof(size_t) * (command->arg_count + 1));
+    set->found = malloc(sizeof(char *) * (command->arg_count + 1));
+
+    int i = 0;
+    for (; i < command->arg_count && command->args[i][0] == '-' && command->args[i][1]; i++)
+    {
+        char *arg = command->args[i];
+        if (strcmp(arg, "--") == 0)
+        {
+            i++;
+            break;
+        }
+        if (strcmp(arg, "-e") == 0 && i + 1 < command->arg_count)
+        {
+            set->strings[set->count++] = command->args[++i];
+            continue;
+        }
+        for (char *opt = arg + 1; *opt; opt++)
+        {
+            if (*opt == 'v')
+                grep->invert = 1;
+            else if (*opt == 'c')
+                grep->countOnly = 1;
+            else if (*opt == 'n')
+                grep->numbers = 1;
+            else if (*opt != 'F')
+            {
+                fprintf(stderr, "-%s: grep: invalid option -%c\n", sysname, *opt);
+                streamFree(s);
+                return NULL;
+            }
+        }
+    }
+    if (set->count == 0)
+    {
+        if (i == command->arg_count)
+        {
+            fprintf(stderr, "-%s: grep: no pattern given\n", sysname);
+            streamFree(s);
+            return NULL;
+        }
+        set->strings[set->count++] = command->args[i++];
+    }
+    for (int k = 0; k < set->count; k++)
+    {
+        set->lengths[k] = strlen(set->strings[k]);
+        if (set->lengths[k] == 0)
+            grep->matchAll = 1;
+        if (set->lengths[k] > set->maxLength)
+            set->maxLength = set->lengths[k];
+    }
+    s->files = command->args + i;
+    s->fileCount = command->arg_count - i;
+    return s;
+}
+
+/**
+ * uniq [-c]: drops repeated lines. As in the first version of this command every
+ * line is compared with all the lines before it (not only the previous one) and
+ * empty lines are skipped; lines are looked up in a hash table so the whole input
+ * is handled, not only its first 4 KB. With -c the counts are printed at the end
+ * in first seen order.
+ */
+struct uniqEntry
+{
+    uint64_t hash;
+    size_t offset, length; // text in uniqState.text
+    long count;
+};
+
+struct uniqState
+{
+    int withCount;
+    struct uniqEntry *entries; // in first seen order
+    size_t entryCount, entryCap;
+    int32_t *table; // index + 1 into entries, 0 is empty
+    size_t tableSize;
+    char *text;
+    size_t textLen, textCap;
+};
+
+static inline uint64_t hashBytes(const char *p, size_t n)
+{
+    uint64_t h = 1469598103934665603ULL; // FNV-1a
+    for (size_t i = 0; i < n; i++)
+        h = (h ^ (unsigned char)p[i]) * 1099511628211ULL;
+    return h;
+}
+
+// find the line in the table, adding it if it is new; returns its entry
+struct uniqEntry *uniqLookup(struct uniqState *uniq, const char *line, size_t len, int *isNew)
+{
+    if (uniq->entryCount * 2 >= uniq->tableSize) // keep the table at most half full
+    {
+        size_t size = uniq->tableSize ? uniq->tableSize * 2 : 1024;
+        int32_t *table = calloc(size, sizeof(int32_t));
+        for (size_t i = 0; i < uniq->entryCount; i++)
+        {
+            size_t slot = uniq->entries[i].hash & (size - 1);
+            while (table[slot])
+                slot = (slot + 1) & (size - 1);
+            table[slot] = i + 1;
+        }
+        free(uniq->table);
+        uniq->table = table;
+        uniq->tableSize = size;
+    }
+
+    uint64_t hash = hashBytes(line, len);
+    size_t slot = hash & (uniq->tableSize - 1);
+    while (uniq->table[slot])
+    {
+        struct uniqEntry *e = &uniq->entries[uniq->table[slot] - 1];
+        if (e->hash == hash && e->length == len && memcmp(uniq->text + e->offset, line, len) == 0)
+        {
+            *isNew = 0;
+            return e;
+        }
+        slot = (slot + 1) & (uniq->tableSize - 1);
+    }
+
+    if (uniq->entryCount == uniq->entryCap)
+    {
+        uniq->entryCap = uniq->entryCap ? uniq->entryCap * 2 : 1024;
+        uniq->entries = realloc(uniq->entries, sizeof(struct uniqEntry) * uniq->entryCap);
+    }
+    if (uniq->textLen + len > uniq->textCap)
+    {
+        while (uniq->textLen + len > uniq->textCap)
+            uniq->textCap = uniq->textCap ? uniq->textCap * 2 : 65536;
+        uniq->text = realloc(uniq->text, uniq->textCap);
+    }
+    struct uniqEntry *e = &uniq->entries[uniq->entryCount++];
+    e->hash = hash;
+    e->offset = uniq->textLen;
+    e->length = len;
+    e->count = 0;
+    memcpy(uniq->text + uniq->textLen, line, len);
+    uniq->textLen += len;
+    uniq->table[slot] = uniq->entryCount;
+    *isNew = 1;
+    return e;
+}
+
+int uniqLines(struct stream_t *s, const char *data, size_t len)
+{
+    struct uniqState *uniq = s->state;
+    const struct scanKernels *scan = getScanKernels();
+    const char *p = data, *end = data + len;
+    while (p < end)
+    {
+        const char *nl = scan->find(p, end - p, '\n');
+        const char *lineEnd = nl ? nl : end;
+        if (lineEnd > p) // empty lines are skipped
+        {
+            int isNew;
+            struct uniqEntry *e = uniqLookup(uniq, p, lineEnd - p, &isNew);
+            e->count++;
+            if (isNew && !uniq->withCount &&
+                (streamEmit(s, p, lineEnd - p) || streamEmit(s, "\n", 1)))
+                return 1;
+        }
+        p = lineEnd + 1;
+    }
+    return 0;
+}
+
+int uniqFinish(struct stream_t *s)
+{
+    struct uniqState *uniq = s->state;
+    streamFinishLines(s);
+    if (!uniq->withCount)
+        return 0;
+    for (size_t i = 0; i < uniq->entryCount; i++) // print the lines with their counts
+    {
+        struct uniqEntry *e = &uniq->entries[i];
+        char count[32];
+        int n = snprintf(count, sizeof(count), "%ld ", e->count);
+        if (streamEmit(s, count, n) || streamEmit(s, uniq->text + e->offset, e->length) ||
+            streamEmit(s, "\n", 1))
+            return 1;
+    }
+    return 0;
+}
+
+void uniqRelease(struct stream_t *s)
+{
+    struct uniqState *uniq = s->state;
+    free(uniq->entries);
+    free(uniq->table);
+    free(uniq->text);
+}
+
+struct stream_t *uniqCreate(struct command_t *command)
+{
+    struct stream_t *s = streamCreate(command);
+    struct uniqState *uniq = calloc(1, sizeof(struct uniqState));
+    s->state = uniq;
+    s->feed = streamFeedLines;
+    s->lines = uniqLines;
+    s->finish = uniqFinish;
+    s->release = uniqRelease;
+
+    int i = 0;
+    for (; i < command->arg_count && command->args[i][0] == '-' && command->args[i][1]; i++)
+    {
+        if (strcmp(command->args[i], "-c") == 0) // handles uniq -c
+            uniq->withCount = 1;
+        else
+        {
+            fprintf(stderr, "-%s: uniq: invalid option %s\n", sysname, command->args[i]);
+            streamFree(s);
+            return NULL;
+        }
+    }
+    s->files = command->args + i;
+    s->fileCount = command->arg_count - i;
+    return s;
+}
+
+/**
+ * sort [-n] [-r] [-u] [-k N[,M]] [-S size] [files]
+ * Lines are kept in memory until the budget (-S, default SORT_DEFAULT_BUDGET) is
+ * used up, then sorted and written to a temporary file as a sorted run. At the
+ * end the runs (and the lines still in memory) are merged with a loser tree.
+ * In memory, lines are sorted by a multikey quicksort on 8-byte key chunks (by
+ * number with -n) in up to one part per core, the parts are merged the same way
+ * as runs from files. Comparison is bytewise, like sort with LC_ALL=C.
+ */
+struct sortRecord
+{
+    const char *line;
+    uint32_t length;
+    uint32_t keyOffset, keyLength;
+    uint32_t order;  // position in the input, keeps -u stable
+    uint64_t prefix; // first 8 key bytes, big endian
+    double number;   // key value for -n
+};
+
+struct sortState
+{
+    int numeric, reverse, unique;
+    int keyStart, keyEnd; // fields, 1 based, 0 means to the end of the line
+    size_t budget;        // bytes of lines and records before a run is spilled
+    struct sortRecord *records;
+    size_t count, capacity, used;
+    char **blocks; // copies of the lines
+    int blockCount;
+    size_t blockUsed, blockSize;
+    int *runs; // sorted runs in temporary files
+    int runCount;
+    char *lastKey; // with -u: key of the last line written
+    size_t lastKeyLength, lastKeyCap;
+    double lastNumber;
+    int haveLast;
+};
+
+// where a sorted sequence goes: the next stage / stdout, or a run file
+struct sortOutput
+{
+    struct stream_t *stream;
+    int fd;
+    char *buffer;
+    size_t length;
+};
+
+// a sorted input of the merge: a part of the records array, or a run file
+struct mergeSource
+{
+    struct sortRecord current;
+    int done;
+    struct sortRecord *records; // memory part: walked from first towards last
+    ssize_t position, last, step;
+    int fd; // run file
+    char *buffer;
+    size_t start, length, capacity;
+};
+
+static inline int isSortBlank(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+// fill a record for a line: find the key fields and cache its first bytes (or number)
+void sortMakeRecord(struct sortState *sort, const char *line, size_t length, struct sortRecord *r)
+{
+    size_t start = 0, end = length;
+    if (sort->keyStart > 1 || sort->keyEnd > 0)
+    {
+        // a field is its leading blanks and the non-blanks after them
+        int field = 1;
+        size_t i = 0;
+        while (i < length && field < sort->keyStart)
+        {
+            while (i < length && isSortBlank(line[i]))
+                i++;
+            while (i < length && !isSortBlank(line[i]))
+                i++;
+            field++;
+        }
+        start = i;
+        if (sort->keyEnd > 0)
+        {
+            while (i < length && field <= sort->keyEnd)
+            {
+                while (i < length && isSortBlank(line[i]))
+                    i++;
+                while (i < length && !isSortBlank(line[i]))
+                    i++;
+                field++;
+            }
+            end = i;
+        }
+    }
+    r->line = line;
+    r->length = length;
+    r->order = 0;
+    r->keyOffset = start;
+    r->keyLength = end > start ? end - start : 0;
+    r->prefix = 0;
+    const unsigned char *key = (const unsigned char *)line + start;
+    for (size_t i = 0; i < 8; i++)
+        r->prefix = (r->prefix << 8) | (i < r->keyLength ? key[i] : 0);
+    if (sort->numeric)
+    {
+        // leading blanks, sign, digits and a fraction; anything else counts as 0
+        const char *p = line + start, *e = line + start + r->keyLength;
+        while (p < e && isSortBlank(*p))
+            p++;
+        int negative = p < e && *p == '-';
+        p += negative;
+        double value = 0, scale = 0.1;
+        while (p < e && *p >= '0' && *p <= '9')
+            value = value * 10 + (*p++ - '0');
+        if (p < e && *p == '.')
+            for (p++; p < e && *p >= '0' && *p <= '9'; p++, scale /= 10)
+                value += (*p - '0') * scale;
+        r->number = negative ? -value : value;
+    }
+}
+
+// compare keys only: 0 means the lines are duplicates for -u
+static inline int sortCompareKeys(const struct sortState *sort, const struct sortRecord *a,
+                                  const struct sortRecord *b)
+{
+    if (sort->numeric)
+        return a->number < b->number ? -1 : a->number > b->number;
+    if (a->prefix != b->prefix)
+        return a->prefix < b->prefix ? -1 : 1;
+    size_t n = a->keyLength < b->keyLength ? a->keyLength : b->keyLength;
+    int c = memcmp(a->line + a->keyOffset, b->line + b->keyOffset, n);
+    if (c)
+        return c;
+    return a->keyLength < b->keyLength ? -1 : a->keyLength > b->keyLength;
+}
+
+/**
+ * Ascending order; lines with equal keys are ordered by the whole line, or with
+ * -u by their input position, so the first of the duplicates is the one kept
+ * (against the position in reverse, since -r output is read from the end)
+ */
+static int sortCompare(const struct sortState *sort, const struct sortRecord *a, const struct sortRecord *b)
+{
+    int c = sortCompareKeys(sort, a, b);
+    if (c)
+        return c;
+    if (sort->unique)
+    {
+        c = a->order < b->order ? -1 : a->order > b->order;
+        return sort->reverse ? -c : c;
+    }
+    size_t n = a->length < b->length ? a->length : b->length;
+    c = memcmp(a->line, b->line, n);
+    if (c)
+        return c;
+    return a->length < b->length ? -1 : a->length > b->length;
+}
+
+static int sortCompareQsort(const void *a, const void *b, void *sort)
+{
+    return sortCompare(sort, a, b);
+}
+
+// key bytes [8 * depth, 8 * depth + 8) as a big endian number
+static inline uint64_t sortKeyChunk(const struct sortRecord *r, size_t depth)
+{
+    if (depth == 0)
+        return r->prefix;
+    size_t offset = depth * 8;
+    if (offset >= r->keyLength)
+        return 0;
+    const unsigned char *key = (const unsigned char *)r->line + r->keyOffset + offset;
+    size_t n = r->keyLength - offset < 8 ? r->keyLength - offset : 8;
+    uint64_t chunk = 0;
+    for (size_t i = 0; i < 8; i++)
+        chunk = (chunk << 8) | (i < n ? key[i] : 0);
+    return chunk;
+}
+
+static void sortInsertion(const struct sortState *sort, struct sortRecord *a, size_t n)
+{
+    for (size_t i = 1; i < n; i++)
+    {
+        struct sortRecord r = a[i];
+        size_t j = i;
+        while (j > 0 && sortCompare(sort, &r, &a[j - 1]) < 0)
+        {
+            a[j] = a[j - 1];
+            j--;
+        }
+        a[j] = r;
+    }
+}
+
+/**
+ * Multikey quicksort with 8 key bytes as the "character": three way partition
+ * on the chunk at this depth, only the equal part goes one chunk deeper. The
+ * first chunk is stored in the record, so the top levels don't touch the lines.
+ */
+static void sortMultikey(const struct sortState *sort, struct sortRecord *a, size_t n, size_t depth)
+{
+    while (n > SORT_INSERTION_THRESHOLD)
+    {
+        uint64_t x = sortKeyChunk(&a[0], depth), y = sortKeyChunk(&a[n / 2], depth),
+                 z = sortKeyChunk(&a[n - 1], depth);
+        uint64_t pivot = x < y ? (y < z ? y : (x < z ? z : x)) : (x < z ? x : (y < z ? z : y));
+
+        size_t lt = 0, i = 0, gt = n; // [0,lt) < pivot, [lt,i) == pivot, [gt,n) > pivot
+        while (i < gt)
+        {
+            uint64_t c = sortKeyChunk(&a[i], depth);
+            if (c < pivot)
+            {
+                struct sortRecord t = a[lt];
+                a[lt++] = a[i];
+                a[i++] = t;
+            }
+            else if (c > pivot)
+            {
+                struct sortRecord t = a[--gt];
+                a[gt] = a[i];
+                a[i] = t;
+            }
+            else
+                i++;
+        }
+
+        sortMultikey(sort, a, lt, depth);
+        sortMultikey(sort, a + gt, n - gt, depth);
+
+        // equal part: go deeper unless every key in it has ended
+        struct sortRecord *equal = a + lt;
+        size_t count = gt - lt;
+        int ended = 1;
+        for (size_t k = 0; k < count && ended; k++)
+            ended = equal[k].keyLength <= (depth + 1) * 8;
+        if (ended)
+        {
+            if (count > SORT_INSERTION_THRESHOLD)
+                qsort_r(equal, count, sizeof(struct sortRecord), sortCompareQsort, (void *)sort);
+            else
+                sortInsertion(sort, equal, count);
+            return;
+        }
+        a = equal;
+        n = count;
+        depth++;
+    }
+    sortInsertion(sort, a, n);
+}
+
+struct sortPart
+{
+    struct sortState *sort;
+    struct sortRecord *records;
+    size_t count;
+};
+
+void *sortPartWorker(void *arg)
+{
+    struct sortPart *part = arg;
+    if (part->sort->numeric)
+        qsort_r(part->records, part->count, sizeof(struct sortRecord), sortCompareQsort, part->sort);
+    else
+        sortMultikey(part->sort, part->records, part->count, 0);
+    return NULL;
+}
+
+/**
+ * Sort the records in memory, split into parts sorted on separate threads
+ * @return number of parts, their bounds are in bounds[0..parts]
+ */
+int sortRecordsParallel(struct sortState *sort, size_t *bounds)
+{
+    int parts = sysconf(_SC_NPROCESSORS_ONLN);
+    if (parts > SORT_MAX_THREADS)
+        parts = SORT_MAX_THREADS;
+    if ((size_t)parts > sort->count / SORT_MIN_PART + 1)
+        parts = sort->count / SORT_MIN_PART + 1;
+    if (parts < 1)
+        parts = 1;
+
+    struct sortPart work[SORT_MAX_THREADS];
+    pthread_t threads[SORT_MAX_THREADS];
+    for (int p = 0; p <= parts; p++)
+        bounds[p] = sort->count * p / parts;
+    for (int p = 0; p < parts; p++)
+    {
+        work[p].sort = sort;
+        work[p].records = sort->records + bounds[p];
+        work[p].count = bounds[p + 1] - bounds[p];
+        if (p > 0 && pthread_create(&threads[p], NULL, sortPartWorker, &work[p]) != 0)
+            sortPartWorker(&work[p]), threads[p] = 0;
+    }
+    sortPartWorker(&work[0]); // this thread sorts the first part
+    for (int p = 1; p < parts; p++)
+        if (threads[p])
+            pthread_join(threads[p], NULL);
+    return parts;
+}
+
+int sortWrite(struct sortOutput *out, const char *data, size_t length)
+{
+    if (out->stream)
+        return streamEmit(out->stream, data, length);
+    if (out->length + length > SORT_IO_SIZE)
+    {
+        if (writeAll(out->fd, out->buffer, out->length) == -1)
+            return 1;
+        out->length = 0;
+    }
+    if (length > SORT_IO_SIZE)
+        return writeAll(out->fd, data, length) == -1;
+    memcpy(out->buffer + out->length, data, length);
+    out->length += length;
+    return 0;
+}
+
+// write one line of the sorted output, dropping duplicates with -u
+int sortOutputRecord(struct sortState *sort, struct sortOutput *out, const struct sortRecord *r)
+{
+    if (sort->unique)
+    {
+        struct sortRecord last = {0};
+        if (sort->haveLast)
+        {
+            last.line = sort->lastKey;
+            last.keyLength = last.length = sort->lastKeyLength;
+            last.number = sort->lastNumber;
+            for (size_t i = 0; i < 8; i++)
+                last.prefix = (last.prefix << 8) | (i < last.keyLength ? (unsigned char)last.line[i] : 0);
+            if (sortCompareKeys(sort, &last, r) == 0)
+                return 0;
+        }
+        if (r->keyLength > sort->lastKeyCap)
+        {
+            sort->lastKeyCap = r->keyLength * 2 + 64;
+            sort->lastKey = realloc(sort->lastKey, sort->lastKeyCap);
+        }
+        memcpy(sort->lastKey, r->line + r->keyOffset, r->keyLength);
+        sort->lastKeyLength = r->keyLength;
+        sort->lastNumber = r->number;
+        sort->haveLast = 1;
+    }
+    return sortWrite(out, r->line, r->length) || sortWrite(out, "\n", 1);
+}
+
+// move a source to its next line
+void mergeAdvance(struct sortState *sort, struct mergeSource *src)
+{
+    if (src->records)
+    {
+        if (src->position == src->last + src->step)
+            src->done = 1;
+        else
+        {
+            src->current = src->records[src->position];
+            src->position += src->step;
+        }
+        return;
+    }
+
+    const struct scanKernels *scan = getScanKernels();
+    while (1) // next line of a run file
+    {
+        const char *nl = scan->find(src->buffer + src->start, src->length - src->start, '\n');
+        if (nl)
+        {
+            size_t lineStart = src->start;
+            src->start = nl - src->buffer + 1;
+            sortMakeRecord(sort, src->buffer + lineStart, nl - src->buffer - lineStart, &src->current);
+            return;
+        }
+        // keep the partial line, read more after it
+        memmove(src->buffer, src->buffer + src->start, src->length - src->start);
+        src->length -= src->start;
+        src->start = 0;
+        if (src->length == src->capacity)
+            src->buffer = realloc(src->buffer, src->capacity *= 2);
+        ssize_t n = read(src->fd, src->buffer + src->length, src->capacity - src->length);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0) // runs always end with a newline
+        {
+            src->done = 1;
+            return;
+        }
+        src->length += n;
+    }
+}
+
+// does source a come before source b? Finished sources lose, ties go to the lower index
+static inline int mergeBefore(struct sortState *sort, struct mergeSource *sources, int a, int b)
+{
+    if (sources[a].done)
+        return 0;
+    if (sources[b].done)
+        return 1;
+    int c = sortCompare(sort, &sources[a].current, &sources[b].current);
+    if (sort->reverse)
+        c = -c;
+    return c < 0 || (c == 0 && a < b);
+}
+
+int loserTreeBuild(struct sortState *sort, struct mergeSource *sources, int *tree, int k, int node)
+{
+    if (node >= k)
+        return node - k;
+    int a = loserTreeBuild(sort, sources, tree, k, 2 * node);
+    int b = loserTreeBuild(sort, sources, tree, k, 2 * node + 1);
+    if (mergeBefore(sort, sources, a, b))
+    {
+        tree[node] = b;
+        return a;
+    }
+    tree[node] = a;
+    return b;
+}
+
+/**
+ * k-way merge with a loser tree: tree[0] is the source with the next line,
+ * every inner node keeps the loser of its match, so after taking a line only
+ * the matches on the winner's path to the root are replayed (log k compares)
+ */
+int mergeSources(struct sortState *sort, struct mergeSource *sources, int k, struct sortOutput *out)
+{
+    int *tree = malloc(sizeof(int) * (k + 1));
+    for (int i = 0; i < k; i++)
+        mergeAdvance(sort, &sources[i]);
+    tree[0] = k == 1 ? 0 : loserTreeBuild(sort, sources, tree, k, 1);
+
+    int stopped = 0;
+    while (!sources[tree[0]].done)
+    {
+        int winner = tree[0];
+        if (sortOutputRecord(sort, out, &sources[winner].current))
+        {
+            stopped = 1; // output closed, nothing more to write
+            break;
+        }
+        mergeAdvance(sort, &sources[winner]);
+        for (int node = (winner + k) / 2; node >= 1; node /= 2)
+        {
+            if (mergeBefore(sort, sources, tree[node], winner))
+            {
+                int t = tree[node];
+                tree[node] = winner;
+                winner = t;
+            }
+        }
+        tree[0] = winner;
+    }
+    free(tree);
+    return stopped;
+}
+
+// sort what is in memory and write it out merged (to a run or the output)
+int sortFlushMemory(struct sortState *sort, struct sortOutput *out)
+{
+    size_t bounds[SORT_MAX_THREADS + 1];
+    int parts = sortRecordsParallel(sort, bounds);
+    struct mergeSource *sources = calloc(parts, sizeof(struct mergeSource));
+    for (int p = 0; p < parts; p++)
+    {
+        sources[p].records = sort->records;
+        sources[p].step = sort->reverse ? -1 : 1;
+        sources[p].position = sort->reverse ? (ssize_t)bounds[p + 1] - 1 : (ssize_t)bounds[p];
+        sources[p].last = sort->reverse ? (ssize_t)bounds[p] : (ssize_t)bounds[p + 1] - 1;
+        if (bounds[p] == bounds[p + 1])
+            sources[p].done = 1, sources[p].position = sources[p].last + sources[p].step;
+    }
+    int stopped = mergeSources(sort, sources, parts, out);
+    free(sources);
+    return stopped;
+}
+
+void sortClearMemory(struct sortState *sort)
+{
+    for (int b = 0; b < sort->blockCount; b++)
+        free(sort->blocks[b]);
+    sort->blockCount = 0;
+    sort->blockUsed = sort->blockSize = 0;
+    sort->count = 0;
+    sort->used = 0;
+}
+
+void mergeOpenRun(struct mergeSource *src, int fd)
+{
+    src->fd = fd;
+    src->capacity = SORT_IO_SIZE;
+    src->buffer = malloc(SORT_IO_SIZE);
+}
+
+// write the sorted lines of the memory (or of all runs) to a new run file
+int sortWriteRun(struct sortState *sort, int fromRuns)
+{
+    int fd = makeTempFd("sort");
+    if (fd == -1)
+    {
+        fprintf(stderr, "-%s: sort: can not make a temporary file: %s\n", sysname, strerror(errno));
+        return -1;
+    }
+    struct sortOutput out = {NULL, fd, malloc(SORT_IO_SIZE), 0};
+    sort->haveLast = 0;
+    if (fromRuns)
+    {
+        struct mergeSource *sources = calloc(sort->runCount, sizeof(struct mergeSource));
+        for (int r = 0; r < sort->runCount; r++)
+            mergeOpenRun(&sources[r], sort->runs[r]);
+        mergeSources(sort, sources, sort->runCount, &out);
+        for (int r = 0; r < sort->runCount; r++)
+        {
+            free(sources[r].buffer);
+            close(sort->runs[r]);
+        }
+        free(sources);
+        sort->runCount = 0;
+    }
+    else
+        sortFlushMemory(sort, &out);
+    int failed = out.length > 0 && writeAll(fd, out.buffer, out.length) == -1;
+    free(out.buffer);
+    if (failed)
+    {
+        fprintf(stderr, "-%s: sort: writing a temporary file: %s\n", sysname, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    lseek(fd, 0, SEEK_SET);
+    sort->runs = realloc(sort->runs, sizeof(int) * (sort->runCount + 1));
+    sort->runs[sort->runCount++] = fd;
+    return 0;
+}
+
+// memory is full: write the lines out as a sorted run, keeping few enough runs to merge at once
+int sortSpill(struct stream_t *s)
+{
+    struct sortState *sort = s->state;
+    if (sortWriteRun(sort, 0) == -1)
+        return -1;
+    sortClearMemory(sort);
+    if (sort->runCount == SORT_MAX_RUNS)
+        return sortWriteRun(sort, 1);
+    return 0;
+}
+
+int sortLines(struct stream_t *s, const char *data, size_t len)
+{
+    struct sortState *sort = s->state;
+    const struct scanKernels *scan = getScanKernels();
+    const char *p = data, *end = data + len;
+    while (p < end)
+    {
+        const char *nl = scan->find(p, end - p, '\n');
+        size_t length = (nl ? nl : end) - p;
+
+        if (sort->blockUsed + length > sort->blockSize) // copy the line into the current block
+        {
+            size_t size = sort->budget / 8 < SORT_BLOCK_SIZE ? sort->budget / 8 : SORT_BLOCK_SIZE;
+            if (size < length)
+                size = length;
+            sort->blocks = realloc(sort->blocks, sizeof(char *) * (sort->blockCount + 1));
+            sort->blocks[sort->blockCount++] = malloc(size);
+            sort->blockSize = size;
+            sort->blockUsed = 0;
+            sort->used += size;
+        }
+        char *copy = sort->blocks[sort->blockCount - 1] + sort->blockUsed;
+        memcpy(copy, p, length);
+        sort->blockUsed += length;
+
+        if (sort->count == sort->capacity)
+        {
+            sort->capacity = sort->capacity ? sort->capacity * 2 : 65536;
+            sort->records = realloc(sort->records, sizeof(struct sortRecord) * sort->capacity);
+        }
+        sortMakeRecord(sort, copy, length, &sort->records[sort->count]);
+        sort->records[sort->count].order = sort->count;
+        sort->count++;
+        sort->used += sizeof(struct sortRecord);
+
+        if (sort->used >= sort->budget && sortSpill(s) == -1)
+        {
+            s->status = 2;
+            return 1;
+        }
+        p = nl ? nl + 1 : end;
+    }
+    return 0;
+}
+
+int sortFinish(struct stream_t *s)
+{
+    struct sortState *sort = s->state;
+    streamFinishLines(s);
+    if (s->status != 0)
+        return 0;
+    struct sortOutput out = {s, -1, NULL, 0};
+    sort->haveLast = 0;
+    if (sort->runCount == 0) // everything fit in memory
+        return sortFlushMemory(sort, &out);
+
+    // merge the runs, and what is still in memory as one more sorted source
+    size_t bounds[SORT_MAX_THREADS + 1];
+    int parts = sort->count > 0 ? sortRecordsParallel(sort, bounds) : 0;
+    int k = sort->runCount + parts;
+    struct mergeSource *sources = calloc(k, sizeof(struct mergeSource));
+    for (int r = 0; r < sort->runCount; r++)
+        mergeOpenRun(&sources[r], sort->runs[r]);
+    for (int p = 0; p < parts; p++)
+    {
+        struct mergeSource *src = &sources[sort->runCount + p];
+        src->records = sort->records;
+        src->step = sort->reverse ? -1 : 1;
+        src->position = sort->reverse ? (ssize_t)bounds[p + 1] - 1 : (ssize_t)bounds[p];
+        src->last = sort->reverse ? (ssize_t)bounds[p] : (ssize_t)bounds[p + 1] - 1;
+    }
+    int stopped = mergeSources(sort, sources, k, &out);
+    for (int r = 0; r < sort->runCount; r++)
+        free(sources[r].buffer);
+    free(sources);
+    return stopped;
+}
+
+void sortRelease(struct stream_t *s)
+{
+    struct sortState *sort = s->state;
+    sortClearMemory(sort);
+    free(sort->blocks);
+    free(sort->records);
+    for (int r = 0; r < sort->runCount; r++)
+        close(sort->runs[r]);
+    free(sort->runs);
+    free(sort->lastKey);
+}
+
+// parse a size like 100M for -S
+size_t parseSortSize(const char *text)
+{
+    char *end;
+    double value = strtod(text, &end);
+    switch (*end)
+    {
+    case 'k':
+    case 'K':
+        value *= 1024;
+        break;
+    case 'm':
+    case 'M':
+        value *= 1024 * 1024;
+        break;
+    case 'g':
+    case 'G':
+        value *= 1024.0 * 1024 * 1024;
+        break;
+    }
+    return value > 0 ? (size_t)value : 0;
+}
+
+struct stream_t *sortCreate(struct command_t *command)
+{
+    struct stream_t *s = streamCreate(command);
+    struct sortState *sort = calloc(1, sizeof(struct sortState));
+    s->state = sort;
+    s->feed = streamFeedLines;
+    s->lines = sortLines;
+    s->finish = sortFinish;
+    s->release = sortRelease;
+    sort->budget = SORT_DEFAULT_BUDGET;
+
+    int i = 0;
+    for (; i < command->arg_count && command->args[i][0] == '-' && command->args[i][1]; i++)
+    {
+        char *arg = command->args[i];
+        char *value = NULL;
+        if ((strcmp(arg, "-k") == 0 || strcmp(arg, "-S") == 0) && i + 1 < command->arg_count)
+            value = command->args[++i];
+        else if (arg[1] == 'k' || arg[1] == 'S')
+            value = arg + 2;
+        if (arg[1] == 'k' && value)
+        {
+            char *comma;
+            sort->keyStart = strtol(value, &comma, 10);
+            sort->keyEnd = *comma == ',' ? atoi(comma + 1) : 0;
+            if (sort->keyStart < 1)
+                sort->keyStart = 1;
+            continue;
+        }
+        if (arg[1] == 'S' && value)
+        {
+            sort->budget = parseSortSize(value);
+            if (sort->budget < SORT_MIN_BUDGET)
+                sort->budget = SORT_MIN_BUDGET;
+            continue;
+        }
+        for (char *opt = arg + 1; *opt; opt++)
+        {
+            if (*opt == 'n')
+                sort->numeric = 1;
+            else if (*opt == 'r')
+                sort->reverse = 1;
+            else if (*opt == 'u')
+                sort->unique = 1;
+            else
+            {
+                fprintf(stderr, "-%s: sort: invalid option -%c\n", sysname, *opt);
+                streamFree(s);
+                return NULL;
+            }
+        }
+    }
+    s->files = command->args + i;
+    s->fileCount = command->arg_count - i;
+    return s;
+}
+
+// tee [-a] [files]: copies its input to stdout and to every file
+struct teeState
+{
+    int count;
+    int *fds;
+    char **names; // opened when the stage runs, see teeOpen
+    int flags;
+    bool opened;
+};
+
+/**
+ * Open the files on the first input (or at the end of an empty one). A stage
+ * is made before its pipeline forks and may never run, so creating it must
+ * not truncate them; close-on-exec keeps them out of the other commands.
+ */
+static void teeOpen(struct stream_t *s)
+{
+    struct teeState *tee = s->state;
+    if (tee->opened)
+        return;
+    tee->opened = true;
+    for (int i = 0; i < tee->count; i++)
+    {
+        tee->fds[i] = open(tee->names[i], tee->flags | O_CLOEXEC, 0666);
+        if (tee->fds[i] == -1)
+        {
+            fprintf(stderr, "-%s: tee: %s: %s\n", sysname, tee->names[i], strerror(errno));
+            s->status = 1;
+        }
+    }
+}
+
+int teeFeed(struct stream_t *s, const char *data, size_t len)
+{
+    struct teeState *tee = s->state;
+    teeOpen(s);
+    for (int i = 0; i < tee->count; i++)
+        if (tee->fds[i] != -1 && writeAll(tee->fds[i], data, len) == -1)
+        {
+            fprintf(stderr, "-%s: tee: %s\n", sysname, strerror(errno));
+            close(tee->fds[i]);
+            tee->fds[i] = -1;
+            s->status = 1;
+        }
+    streamEmit(s, data, len);
+    return 0; // keep reading even if stdout went away, the files still want it
+}
+
+int teeFinish(struct stream_t *s)
+{
+    teeOpen(s); // no input at all, the files are still made
+    return 0;
+}
+
+/**
+ * tee(2) already gave stdout the n bytes at the head of the input pipe, but
+ * the file can't be spliced to: read them and write them to it by hand
+ * @return 0, or -1 on read error
+ */
+static int teeCatchUp(struct stream_t *s, int fd, size_t n)
+{
+    struct teeState *tee = s->state;
+    char buffer[1 << 16];
+    while (n > 0)
+    {
+        ssize_t r = read(fd, buffer, n < sizeof(buffer) ? n : sizeof(buffer));
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        n -= r;
+        if (tee->count == 1 && tee->fds[0] != -1 && writeAll(tee->fds[0], buffer, r) == -1)
+        {
+            fprintf(stderr, "-%s: tee: %s\n", sysname, strerror(errno));
+            close(tee->fds[0]);
+            tee->fds[0] = -1;
+            s->status = 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * From a pipe to a pipe with at most one file: tee(2) duplicates the pipe
+ * into stdout and splice moves the same bytes into the file (or /dev/null),
+ * nothing is copied to user space. Where either call is not supported, the
+ * rest is copied through teeFeed.
+ */
+int teePump(struct stream_t *s, int fd)
+{
+    struct teeState *files = s->state;
+    struct stat inStat, outStat;
+    teeOpen(s);
+    if (s->next != NULL || files->count > 1 || fstat(fd, &inStat) == -1 ||
+        fstat(s->fd, &outStat) == -1 || !S_ISFIFO(inStat.st_mode) || !S_ISFIFO(outStat.st_mode) ||
+        (files->count == 1 && (files->fds[0] == -1 || fcntl(files->fds[0], F_GETFL) & O_APPEND)))
+        return streamPump(s, fd);
+
+    int sink = files->count == 1 ? files->fds[0] : open("/dev/null", O_WRONLY | O_CLOEXEC);
+    int copied = 0, status = 0;
+    while (status == 0)
+    {
+        ssize_t n = tee(fd, s->fd, COPY_CHUNK, 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && !copied && (errno == EINVAL || errno == ENOSYS))
+            break; // not supported here, copy by hand
+        if (n <= 0)
+        {
+            if (n == -1 && errno == EPIPE)
+                s->closed = 1;
+            status = n == 0 ? 1 : -1;
+            break;
+        }
+        copied = 1;
+        while (n > 0) // the same bytes are still at the head of the input pipe
+        {
+            ssize_t m = splice(fd, NULL, sink, NULL, n, SPLICE_F_MOVE);
+            if (m == -1 && errno == EINTR)
+                continue;
+            if (m == -1 && (errno == EINVAL || errno == ESPIPE))
+            {
+                status = teeCatchUp(s, fd, n) == -1 ? -1 : 2;
+                break;
+            }
+            if (m <= 0)
+            {
+                status = -1;
+                break;
+            }
+            n -= m;
+        }
+    }
+    if (files->count == 0)
+        close(sink);
+    if (status == 1 || status == -1) // end of input, or an error
+        return status == 1 ? 0 : -1;
+    return streamPump(s, fd);
+}
+
+void teeRelease(struct stream_t *s)
+{
+    struct teeState *tee = s->state;
+    for (int i = 0; i < tee->count && tee->opened; i++)
+        if (tee->fds[i] != -1)
+            close(tee->fds[i]);
+    free(tee->fds);
+}
+
+struct stream_t *teeCreate(struct command_t *command)
+{
+    struct stream_t *s = streamCreate(command);
+    struct teeState *tee = calloc(1, sizeof(struct teeState));
+    s->state = tee;
+    s->feed = teeFeed;
+    s->finish = teeFinish;
+    s->pump = teePump;
+    s->release = teeRelease;
+
+    tee->flags = O_WRONLY | O_CREAT | O_TRUNC;
+    int i = 0;
+    for (; i < command->arg_count && command->args[i][0] == '-' && command->args[i][1]; i++)
+    {
+        if (strcmp(command->args[i], "-a") == 0)
+            tee->flags = O_WRONLY | O_CREAT | O_APPEND;
+        else
+        {
+            fprintf(stderr, "-%s: tee: invalid option %s\n", sysname, command->args[i]);
+            streamFree(s);
+            return NULL;
+        }
+    }
+    tee->names = command->args + i; // the files are outputs, input is always stdin
+    tee->count = command->arg_count - i;
+    tee->fds = malloc(sizeof(int) * (tee->count + 1));
+    return s;
+}
+
+/**
+ * find PATH... [-name GLOB] [-iname GLOB] [-path GLOB] [-type f,d,l,...]
+ *      [-mtime [+-]N] [-mmin [+-]N] [-mindepth N] [-maxdepth N] [-print | -print0]
+ * The tests are and-ed, like find without -o. Directories are read by a pool
+ * of threads with getdents64 in big chunks; a directory is opened relative
+ * to its parent's fd, and stat is only called when d_type does not tell or
+ * for -mtime. Each thread takes the directories it found last (depth first),
+ * and an idle one steals the oldest of another thread's. The order of the
+ * output is not that of find, the lines are. Other find expressions go to
+ * the real find, see isSimpleFind.
+ */
+#define FIND_MAX_THREADS 16
+#define FIND_DENTS_SIZE (1 << 17) // read by each getdents64
+#define FIND_OUT_SIZE (1 << 16)   // output of a thread, passed on when full
+
+struct findDir
+{
+    struct findDir *parent; // its fd is open while this one waits
+    int fd;
+    atomic_int references; // for its fd: itself until read, then each subdirectory waiting to be opened
+    int depth;
+    char *path; // also the name, at nameOffset
+    size_t nameOffset;
+};
+
+struct findQueue
+{
+    pthread_mutex_t lock;
+    struct findDir **items; // the owner takes from the end, thieves from head
+    size_t head, count, capacity;
+};
+
+struct findState
+{
+    // the tests
+    const char *name, *iname, *path;
+    unsigned types; // bit per DT_ type, 0: any
+    char mtimeSign;  // '+', '-' or '=' (0: no -mtime/-mmin)
+    long mtimeValue, mtimeUnit;
+    time_t now;
+    int minDepth, maxDepth;
+    char terminator;
+    char **starts;
+    int startCount;
+    // the walk
+    int threads;
+    struct findQueue queues[FIND_MAX_THREADS];
+    atomic_long pending; // directories queued or being read
+    atomic_long queued;  // directories queued
+    atomic_int sleepers;
+    atomic_bool stop; // output is closed
+    pthread_mutex_t idleLock;
+    pthread_cond_t idle;
+    pthread_mutex_t outputLock; // the stage and stderr are used by one thread at a time
+    struct stream_t *stream;
+    int status;
+};
+
+struct findWorker
+{
+    struct findState *find;
+    int index;
+    char *dents;
+    char out[FIND_OUT_SIZE];
+    size_t outLen;
+};
+
+struct linuxDirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static unsigned findTypeBit(unsigned char type)
+{
+    return 1u << type;
+}
+
+// -type f,d: the DT_ types as bits, 0 if one is not known
+static unsigned parseFindTypes(const char *text)
+{
+    unsigned bits = 0;
+    for (const char *p = text; *p; p++)
+    {
+        const char *types = "fdlpscb";
+        const unsigned char dt[] = {DT_REG, DT_DIR, DT_LNK, DT_FIFO, DT_SOCK, DT_CHR, DT_BLK};
+        const char *at = strchr(types, *p);
+        if (at == NULL || *p == 0)
+            return 0;
+        bits |= findTypeBit(dt[at - types]);
+        if (p[1] == ',')
+            p++;
+    }
+    return bits;
+}
+
+static unsigned char modeType(mode_t mode)
+{
+    return S_ISREG(mode) ? DT_REG : S_ISDIR(mode) ? DT_DIR : S_ISLNK(mode) ? DT_LNK : S_ISFIFO(mode) ? DT_FIFO
+         : S_ISSOCK(mode) ? DT_SOCK : S_ISCHR(mode) ? DT_CHR : S_ISBLK(mode) ? DT_BLK : DT_UNKNOWN;
+}
+
+/**
+ * Can find with these arguments run in the shell? Only paths followed by the
+ * tests and actions above can, anything else (-exec, -o, !, ...) is exec'ed.
+ */
+int isSimpleFind(struct command_t *command)
+{
+    int i = 0;
+    while (i < command->arg_count && command->args[i][0] != '-' && strcmp(command->args[i], "!") != 0 &&
+           strcmp(command->args[i], "(") != 0)
+        i++;
+    int prints = 0;
+    for (; i < command->arg_count; i++)
+    {
+        const char *arg = command->args[i];
+        if (strcmp(arg, "-print") == 0 || strcmp(arg, "-print0") == 0)
+        {
+            if (++prints > 1 || i + 1 != command->arg_count) // an action in the middle is a different find
+                return 0;
+            continue;
+        }
+        static const char *withValue[] = {"-name", "-iname", "-path", "-type", "-mtime", "-mmin", "-mindepth",
+                                          "-maxdepth", NULL};
+        int k = 0;
+        while (withValue[k] && strcmp(arg, withValue[k]) != 0)
+            k++;
+        if (withValue[k] == NULL || i + 1 == command->arg_count)
+            return 0;
+        if (strcmp(arg, "-type") == 0 && parseFindTypes(command->args[i + 1]) == 0)
+            return 0;
+        i++;
+    }
+    return 1;
+}
+
+// with the output lock held
+static void findError(struct findState *find, const char *path)
+{
+    fprintf(stderr, "-%s: find: '%s': %s\n", sysname, path, strerror(errno));
+    find->status = 1;
+}
+
+static void findOutputFlush(struct findWorker *w)
+{
+    struct findState *find = w->find;
+    if (w->outLen == 0)
+        return;
+    pthread_mutex_lock(&find->outputLock);
+    if (streamEmit(find->stream, w->out, w->outLen))
+        find->stop = true;
+    pthread_mutex_unlock(&find->outputLock);
+    w->outLen = 0;
+}
+
+static void findOutput(struct findWorker *w, const char *path, size_t length)
+{
+    if (w->outLen + length + 1 > FIND_OUT_SIZE)
+        findOutputFlush(w);
+    if (length + 1 > FIND_OUT_SIZE)
+    {
+        pthread_mutex_lock(&w->find->outputLock);
+        streamEmit(w->find->stream, path, length);
+        streamEmit(w->find->stream, &w->find->terminator, 1);
+        pthread_mutex_unlock(&w->find->outputLock);
+        return;
+    }
+    memcpy(w->out + w->outLen, path, length);
+    w->out[w->outLen + length] = w->find->terminator;
+    w->outLen += length + 1;
+}
+
+/**
+ * Do the tests pass for the entry file in directory fd (at depth), named name
+ * for -name? type is filled in if a test has to stat it.
+ */
+static bool findMatches(struct findState *find, int fd, const char *file, const char *name, const char *path,
+                        unsigned char *type, int depth)
+{
+    if (depth < find->minDepth)
+        return false;
+    if (find->name && fnmatch(find->name, name, 0) != 0)
+        return false;
+    if (find->iname && fnmatch(find->iname, name, FNM_CASEFOLD) != 0)
+        return false;
+    if (find->path && fnmatch(find->path, path, 0) != 0)
+        return false;
+    struct stat st;
+    bool statted = false;
+    if ((find->types && *type == DT_UNKNOWN) || find->mtimeSign)
+    {
+        if (fstatat(fd, file, &st, AT_SYMLINK_NOFOLLOW) == -1)
+            return false;
+        *type = modeType(st.st_mode);
+        statted = true;
+    }
+    if (find->types && !(find->types & findTypeBit(*type)))
+        return false;
+    if (find->mtimeSign && statted)
+    {
+        long age = (long)(find->now - st.st_mtime) / find->mtimeUnit; // whole days (minutes), rounded down
+        if (find->now < st.st_mtime)
+            age = -1;
+        if ((find->mtimeSign == '+' && age <= find->mtimeValue) ||
+            (find->mtimeSign == '-' && age >= find->mtimeValue) ||
+            (find->mtimeSign == '=' && age != find->mtimeValue))
+            return false;
+    }
+    return true;
+}
+
+static void findPush(struct findState *find, int index, struct findDir *dir)
+{
+    struct findQueue *q = &find->queues[index];
+    pthread_mutex_lock(&q->lock);
+    if (q->head > 0 && q->head == q->count)
+        q->head = q->count = 0;
+    if (q->count == q->capacity)
+    {
+        q->capacity = q->capacity ? q->capacity * 2 : 256;
+        q->items = realloc(q->items, sizeof(struct findDir *) * q->capacity);
+    }
+    q->items[q->count++] = dir;
+    pthread_mutex_unlock(&q->lock);
+    find->pending++;
+    find->queued++;
+    if (find->sleepers > 0)
+    {
+        pthread_mutex_lock(&find->idleLock);
+        pthread_cond_signal(&find->idle);
+        pthread_mutex_unlock(&find->idleLock);
+    }
+}
+
+// the newest of our own, or the oldest of someone else's
+static struct findDir *findTake(struct findState *find, int index)
+{
+    for (int k = 0; k < find->threads; k++)
+    {
+        struct findQueue *q = &find->queues[(index + k) % find->threads];
+        struct findDir *dir = NULL;
+        pthread_mutex_lock(&q->lock);
+        if (q->count > q->head)
+            dir = k == 0 ? q->items[--q->count] : q->items[q->head++];
+        pthread_mutex_unlock(&q->lock);
+        if (dir)
+        {
+            find->queued--;
+            return dir;
+        }
+    }
+    return NULL;
+}
+
+static void findRelease(struct findDir *dir)
+{
+    while (dir && --dir->references == 0)
+    {
+        struct findDir *parent = dir->parent;
+        if (dir->fd != -1)
+            close(dir->fd);
+        free(dir->path);
+        free(dir);
+        dir = parent;
+    }
+}
+
+// read one directory: print what passes the tests, queue the subdirectories
+static void findRead(struct findWorker *w, struct findDir *dir)
+{
+    struct findState *find = w->find;
+    int parentFd = dir->parent ? dir->parent->fd : AT_FDCWD;
+    dir->fd = openat(parentFd, dir->parent ? dir->path + dir->nameOffset : dir->path,
+                     O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dir->fd == -1)
+    {
+        pthread_mutex_lock(&find->outputLock);
+        findError(find, dir->path);
+        pthread_mutex_unlock(&find->outputLock);
+    }
+    struct findDir *parent = dir->parent; // we don't need its fd anymore
+    dir->parent = NULL;
+    findRelease(parent);
+    if (dir->fd == -1)
+        return;
+
+    size_t pathLength = strlen(dir->path);
+    bool slash = pathLength > 0 && dir->path[pathLength - 1] == '/';
+    char path[PATH_MAX];
+    memcpy(path, dir->path, pathLength);
+    if (!slash)
+        path[pathLength++] = '/';
+    long n = 0; // stays 0 if find stopped before the first read
+    while (!find->stop && (n = syscall(SYS_getdents64, dir->fd, w->dents, FIND_DENTS_SIZE)) > 0)
+    {
+        for (long offset = 0; offset < n;)
+        {
+            struct linuxDirent64 *entry = (struct linuxDirent64 *)(w->dents + offset);
+            offset += entry->d_reclen;
+            const char *name = entry->d_name;
+            if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+                continue;
+            size_t nameLength = strlen(name);
+            if (pathLength + nameLength >= PATH_MAX)
+                continue;
+            memcpy(path + pathLength, name, nameLength + 1);
+            unsigned char type = entry->d_type;
+            if (findMatches(find, dir->fd, name, name, path, &type, dir->depth + 1))
+                findOutput(w, path, pathLength + nameLength);
+            if (dir->depth + 1 >= find->maxDepth)
+                continue;
+            if (type == DT_UNKNOWN)
+            {
+                struct stat st;
+                if (fstatat(dir->fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+                    type = modeType(st.st_mode);
+            }
+            if (type != DT_DIR)
+                continue;
+            struct findDir *sub = malloc(sizeof(struct findDir));
+            sub->parent = dir;
+            sub->fd = -1;
+            sub->references = 1;
+            sub->depth = dir->depth + 1;
+            sub->path = strndup(path, pathLength + nameLength);
+            sub->nameOffset = pathLength;
+            dir->references++;
+            findPush(find, w->index, sub);
+        }
+    }
+    if (n == -1)
+    {
+        pthread_mutex_lock(&find->outputLock);
+        findError(find, dir->path);
+        pthread_mutex_unlock(&find->outputLock);
+    }
+}
+
+static void *findWorker(void *arg)
+{
+    struct findWorker *w = arg;
+    struct findState *find = w->find;
+    while (1)
+    {
+        struct findDir *dir = findTake(find, w->index);
+        if (dir)
+        {
+            if (!find->stop)
+                findRead(w, dir);
+            else
+            {
+                findRelease(dir->parent);
+                dir->parent = NULL;
+            }
+            findRelease(dir);
+            if (--find->pending == 0)
+            {
+                pthread_mutex_lock(&find->idleLock);
+                pthread_cond_broadcast(&find->idle);
+                pthread_mutex_unlock(&find->idleLock);
+            }
+            continue;
+        }
+        pthread_mutex_lock(&find->idleLock);
+        find->sleepers++;
+        while (find->queued == 0 && find->pending > 0)
+            pthread_cond_wait(&find->idle, &find->idleLock);
+        find->sleepers--;
+        bool done = find->pending == 0;
+        pthread_mutex_unlock(&find->idleLock);
+        if (done)
+            break;
+    }
+    findOutputFlush(w);
+    return NULL;
+}
+
+// the starting points are tested here, their directories are read by the threads
+static int findFinish(struct stream_t *s)
+{
+    struct findState *find = s->state;
+    find->stream = s;
+    struct findWorker *workers = calloc(find->threads, sizeof(struct findWorker));
+    for (int t = 0; t < find->threads; t++)
+    {
+        workers[t].find = find;
+        workers[t].index = t;
+        workers[t].dents = malloc(FIND_DENTS_SIZE);
+    }
+    for (int i = 0; i < find->startCount; i++)
+    {
+        const char *start = find->starts[i];
+        struct stat st;
+        if (lstat(start, &st) == -1)
+        {
+            findError(find, start);
+            continue;
+        }
+        char base[PATH_MAX]; // -name looks at the last part, without the trailing slashes
+        snprintf(base, sizeof(base), "%s", start);
+        for (size_t n = strlen(base); n > 1 && base[n - 1] == '/'; n--)
+            base[n - 1] = 0;
+        const char *name = strrchr(base, '/') && base[1] ? strrchr(base, '/') + 1 : base;
+        unsigned char type = modeType(st.st_mode);
+        if (findMatches(find, AT_FDCWD, start, name, start, &type, 0))
+            findOutput(&workers[0], start, strlen(start));
+        if (S_ISDIR(st.st_mode) && find->maxDepth > 0)
+        {
+            struct findDir *dir = calloc(1, sizeof(struct findDir));
+            dir->fd = -1;
+            dir->references = 1;
+            dir->path = strdup(start);
+            findPush(find, 0, dir);
+        }
+    }
+    findOutputFlush(&workers[0]);
+    pthread_t threads[FIND_MAX_THREADS];
+    for (int t = 1; t < find->threads; t++)
+        if (pthread_create(&threads[t], NULL, findWorker, &workers[t]) != 0)
+            threads[t] = 0;
+    findWorker(&workers[0]); // this thread is one of them
+    for (int t = 1; t < find->threads; t++)
+        if (threads[t])
+            pthread_join(threads[t], NULL);
+    for (int t = 0; t < find->threads; t++)
+        free(workers[t].dents);
+    free(workers);
+    if (s->status == 0)
+        s->status = find->status;
+    return 0;
+}
+
+// find reads no input
+static int findFeed(struct stream_t *s, const char *data, size_t len)
+{
+    (void)s, (void)data, (void)len;
+    return 1;
+}
+
+static int findPump(struct stream_t *s, int fd)
+{
+    (void)s, (void)fd;
+    return 0;
+}
+
+static void findFree(struct stream_t *s)
+{
+    struct findState *find = s->state;
+    for (int t = 0; t < FIND_MAX_THREADS; t++)
+    {
+        pthread_mutex_destroy(&find->queues[t].lock);
+        free(find->queues[t].items);
+    }
+    pthread_mutex_destroy(&find->idleLock);
+    pthread_mutex_destroy(&find->outputLock);
+    pthread_cond_destroy(&find->idle);
+}
+
+struct stream_t *findCreate(struct command_t *command)
+{
+    struct stream_t *s = streamCreate(command);
+    struct findState *find = calloc(1, sizeof(struct findState));
+    s->state = find;
+    s->feed = findFeed;
+    s->pump = findPump;
+    s->finish = findFinish;
+    s->release = findFree;
+    find->maxDepth = INT_MAX;
+    find->terminator = '\n';
+    find->now = time(NULL);
+    find->threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (find->threads > FIND_MAX_THREADS)
+        find->threads = FIND_MAX_THREADS;
+    if (find->threads < 1)
+        find->threads = 1;
+    for (int t = 0; t < FIND_MAX_THREADS; t++)
+        pthread_mutex_init(&find->queues[t].lock, NULL);
+    pthread_mutex_init(&find->idleLock, NULL);
+    pthread_mutex_init(&find->outputLock, NULL);
+    pthread_cond_init(&find->idle, NULL);
+
+    int i = 0;
+    while (i < command->arg_count && command->args[i][0] != '-')
+        i++;
+    find->starts = command->args;
+    find->startCount = i;
+    static char *dot[] = {"."};
+    if (i == 0)
+        find->starts = dot, find->startCount = 1;
+    for (; i < command->arg_count; i++)
+    {
+        const char *arg = command->args[i], *value = command->args[i + 1];
+        if (strcmp(arg, "-print") == 0)
+            continue;
+        if (strcmp(arg, "-print0") == 0)
+            find->terminator = 0;
+        else if (strcmp(arg, "-name") == 0)
+            find->name = value;
+        else if (strcmp(arg, "-iname") == 0)
+            find->iname = value;
+        else if (strcmp(arg, "-path") == 0)
+            find->path = value;
+        else if (strcmp(arg, "-type") == 0)
+            find->types = parseFindTypes(value);
+        else if (strcmp(arg, "-mindepth") == 0)
+            find->minDepth = atoi(value);
+        else if (strcmp(arg, "-maxdepth") == 0)
+            find->maxDepth = atoi(value);
+        else // -mtime, -mmin
+        {
+            char *end;
+            find->mtimeSign = value[0] == '+' || value[0] == '-' ? value[0] : '=';
+            find->mtimeValue = strtol(value + (find->mtimeSign != '='), &end, 10);
+            find->mtimeUnit = strcmp(arg, "-mtime") == 0 ? 86400 : 60;
+            if (*end || end == value + (find->mtimeSign != '='))
+            {
+                fprintf(stderr, "-%s: find: invalid argument `%s' to `%s'\n", sysname, value, arg);
+                streamFree(s);
+                return NULL;
+            }
+        }
+        i++;
+    }
+    return s;
+}
+
+static const struct textBuiltin textBuiltins[] = {
+    {"cat", catCreate},
+    {"wc", wcCreate},
+    {"head", headCreate},
+    {"grep", grepCreate},
+    {"uniq", uniqCreate},
+    {"tee", teeCreate},
+    {"sort", sortCreate},
+    {"find", findCreate},
+    {NULL, NULL},
+};
+
+/**
+ * Find the in-shell implementation of a text command
+ * @return the builtin, or NULL if the command should be exec'ed
+ */
+const struct textBuiltin *findTextBuiltin(struct command_t *command)
+{
+    for (int i = 0; textBuiltins[i].name; i++)
+    {
+        if (strcmp(command->name, textBuiltins[i].name) != 0)
+            continue;
+        if (strcmp(command->name, "grep") == 0 && !isFixedGrep(command))
+            return NULL;
+        if (strcmp(command->name, "find") == 0 && !isSimpleFind(command))
+            return NULL;
+        return &textBuiltins[i];
+    }
+    return NULL;
+}
+
+/**
+ * Make the stage of a text builtin
+ * @return the stage, NULL if the command is not a text builtin or has bad arguments
+ */
+struct stream_t *createStage(struct command_t *command)
+{
+    const struct textBuiltin *builtin = findTextBuiltin(command);
+    return builtin ? builtin->create(command) : NULL;
+}
+
+/**
+ * Run fused stages: the first one reads its files or stdin, every stage feeds
+ * the next one and the last one writes to stdout
+ * @return exit status of the last stage
+ */
+int streamRunChain(struct stream_t *first)
+{
+    outFlush(); // the stages write to their fd themselves
+    streamRun(first);
+    struct stream_t *last = first;
+    for (struct stream_t *s = first->next; s; s = s->next) // input is over for each stage in turn
+    {
+        if (s->finish)
+            s->finish(s);
+        last = s;
+    }
+    streamFlush(last);
+    return last->status;
+}
+
+/**
+ * Run a text builtin on stdin/its files, writing to stdout
+ * @return exit status
+ */
+int runTextBuiltin(const struct textBuiltin *builtin, struct command_t *command)
+{
+    struct stream_t *s = builtin->create(command);
+    if (s == NULL)
+        return 2;
+    int status = streamRun(s);
+    streamFree(s);
+    return status;
+}
+
+/**
+ * An anonymous temporary file: memfd, or an unlinked file in /tmp where memfd
+ * is not available
+ * @return fd (close on exec), or -1
+ */
+int makeTempFd(const char *name)
+{
+    int fd = memfd_create(name, MFD_CLOEXEC);
+    if (fd == -1)
+        fd = open(P_tmpdir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    return fd;
+}
+
+/**
+ * Child supervision. Every child the shell waits for without blocking on it
+ * alone (background jobs, timeout, parallel) gets a pidfd in one epoll set,
+ * so any number of them are waited for at once and only the child that ended
+ * is reaped, never someone else's. Deadlines are timerfds in the same set.
+ * Where pidfd_open is not available, a SIGCHLD handler writes to a pipe in
+ * the set and the children without a pidfd are checked with WNOHANG.
+ */
+struct supervisedChild
+{
+    pid_t pid; // 0: free slot
+    int pidfd; // -1 on the SIGCHLD fallback
+    int timerfd; // deadline, -1 if none
+    int signal;  // sent at the deadline, then SIGKILL after grace
+    long graceMs;
+    bool timedOut, killed;
+    bool exited;
+    int status; // wait status
+    long order; // exits are numbered in the order they were seen
+    struct rusage usage;
+    struct timespec started;
+};
+
+struct supervisor
+{
+    pid_t owner; // forked children start over with their own
+    int epoll;
+    int sigchldPipe[2]; // made up front: pidfd_open may fail for running out of fds
+    bool noPidfd, sigchldHandled;
+    struct supervisedChild *children;
+    int capacity;
+    int *freeSlots;
+    int freeCount;
+    long exits;
+} supervisor = {.epoll = -1, .sigchldPipe = {-1, -1}};
+
+#define SUPERVISOR_TIMER (1ULL << 32)
+#define SUPERVISOR_SIGCHLD UINT64_MAX
+
+static void supervisorSigchld(int signal)
+{
+    (void)signal;
+    int saved = errno;
+    if (write(supervisor.sigchldPipe[1], "", 1) == -1)
+    {
+        // full already, there is a wakeup pending
+    }
+    errno = saved;
+}
+
+static int openPidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// no pidfd for some child: its end is noticed through SIGCHLD instead
+static int supervisorFallback()
+{
+    if (supervisor.sigchldHandled)
+        return 0;
+    supervisor.sigchldHandled = true;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = supervisorSigchld;
+    action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    return sigaction(SIGCHLD, &action, NULL);
+}
+
+// set up the supervisor of this process (again, in a forked child)
+static int supervisorStart()
+{
+    pid_t self = getpid();
+    if (supervisor.owner == self)
+        return 0;
+    if (supervisor.owner != 0) // inherited from the parent: its children are not ours
+    {
+        if (supervisor.epoll != -1)
+            close(supervisor.epoll);
+        for (int i = 0; i < supervisor.capacity; i++)
+        {
+            if (supervisor.children[i].pid == 0)
+                continue;
+            if (supervisor.children[i].pidfd != -1)
+                close(supervisor.children[i].pidfd);
+            if (supervisor.children[i].timerfd != -1)
+                close(supervisor.children[i].timerfd);
+        }
+        free(supervisor.children);
+        free(supervisor.freeSlots);
+        if (supervisor.sigchldPipe[0] != -1)
+        {
+            close(supervisor.sigchldPipe[0]);
+            close(supervisor.sigchldPipe[1]);
+        }
+        forgetJobs();
+    }
+    memset(&supervisor, 0, sizeof(supervisor));
+    supervisor.sigchldPipe[0] = supervisor.sigchldPipe[1] = -1;
+    supervisor.owner = self;
+    supervisor.epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (supervisor.epoll == -1)
+    {
+        fprintf(stderr, "-%s: epoll: %s\n", sysname, strerror(errno));
+        return -1;
+    }
+    if (pipe2(supervisor.sigchldPipe, O_CLOEXEC | O_NONBLOCK) == -1)
+        return -1;
+    struct epoll_event event = {EPOLLIN, {.u64 = SUPERVISOR_SIGCHLD}};
+    epoll_ctl(supervisor.epoll, EPOLL_CTL_ADD, supervisor.sigchldPipe[0], &event);
+    int probe = openPidfd(self);
+    if (probe == -1)
+    {
+        supervisor.noPidfd = true;
+        return supervisorFallback();
+    }
+    close(probe);
+    return 0;
+}
+
+static void supervisorReap(int slot, int status)
+{
+    struct supervisedChild *c = &supervisor.children[slot];
+    c->exited = true;
+    c->status = status;
+    c->order = ++supervisor.exits;
+    if (c->pidfd != -1)
+    {
+        close(c->pidfd); // also takes it out of the epoll set
+        c->pidfd = -1;
+    }
+    if (c->timerfd != -1)
+    {
+        close(c->timerfd);
+        c->timerfd = -1;
+    }
+}
+
+/**
+ * Start watching a child
+ * @return its slot, or -1
+ */
+int superviseChild(pid_t pid)
+{
+    if (supervisorStart() == -1)
+        return -1;
+    if (supervisor.freeCount == 0)
+    {
+        int old = supervisor.capacity;
+        supervisor.capacity = old ? old * 2 : 64;
+        supervisor.children = realloc(supervisor.children, sizeof(struct supervisedChild) * supervisor.capacity);
+        supervisor.freeSlots = realloc(supervisor.freeSlots, sizeof(int) * supervisor.capacity);
+        memset(supervisor.children + old, 0, sizeof(struct supervisedChild) * (supervisor.capacity - old));
+        for (int i = supervisor.capacity - 1; i >= old; i--)
+            supervisor.freeSlots[supervisor.freeCount++] = i;
+    }
+    int slot = supervisor.freeSlots[--supervisor.freeCount];
+    struct supervisedChild *c = &supervisor.children[slot];
+    memset(c, 0, sizeof(*c));
+    c->pid = pid;
+    c->timerfd = -1;
+    clock_gettime(CLOCK_MONOTONIC, &c->started);
+    c->pidfd = supervisor.noPidfd ? -1 : openPidfd(pid);
+    if (c->pidfd != -1)
+    {
+        fcntl(c->pidfd, F_SETFD, FD_CLOEXEC);
+        struct epoll_event event = {EPOLLIN, {.u64 = (uint64_t)slot}};
+        epoll_ctl(supervisor.epoll, EPOLL_CTL_ADD, c->pidfd, &event);
+    }
+    else // out of fds, or an old kernel; it may have ended before the SIGCHLD handler could see it
+    {
+        supervisorFallback();
+        int status;
+        if (wait4(pid, &status, WNOHANG, &c->usage) == pid)
+            supervisorReap(slot, status);
+    }
+    return slot;
+}
+
+/**
+ * Send signal to the child's process group after ms, then SIGKILL after
+ * graceMs more (never if graceMs is 0)
+ */
+int superviseDeadline(int slot, long ms, int signal, long graceMs)
+{
+    struct supervisedChild *c = &supervisor.children[slot];
+    c->signal = signal;
+    c->graceMs = graceMs;
+    c->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (c->timerfd == -1)
+        return -1;
+    struct itimerspec when = {{0, 0}, {ms / 1000, (ms % 1000) * 1000000}};
+    if (ms == 0)
+        when.it_value.tv_nsec = 1; // 0 would disarm it
+    timerfd_settime(c->timerfd, 0, &when, NULL);
+    struct epoll_event event = {EPOLLIN, {.u64 = SUPERVISOR_TIMER | (uint64_t)slot}};
+    return epoll_ctl(supervisor.epoll, EPOLL_CTL_ADD, c->timerfd, &event);
+}
+
+static void supervisorTimer(int slot)
+{
+    struct supervisedChild *c = &supervisor.children[slot];
+    uint64_t expirations;
+    if (read(c->timerfd, &expirations, sizeof(expirations)) == -1)
+        return;
+    if (!c->timedOut)
+    {
+        c->timedOut = true;
+        kill(-c->pid, c->signal);
+        kill(c->pid, c->signal); // in case it is not a group leader (yet)
+        if (c->graceMs > 0 && c->signal != SIGKILL)
+        {
+            struct itimerspec when = {{0, 0}, {c->graceMs / 1000, (c->graceMs % 1000) * 1000000}};
+            timerfd_settime(c->timerfd, 0, &when, NULL);
+        }
+    }
+    else
+    {
+        c->killed = true;
+        kill(-c->pid, SIGKILL);
+        kill(c->pid, SIGKILL);
+    }
+}
+
+/**
+ * Handle what happened to the children: reap those that ended, signal those
+ * past their deadline. Waits up to timeoutMs (-1: until a child ends).
+ * @return number of children that ended, their slots go to exited (up to max)
+ */
+int supervisorWait(int timeoutMs, int *exited, int max)
+{
+    if (supervisorStart() == -1)
+        return -1;
+    int count = 0;
+    struct epoll_event events[64];
+    while (1)
+    {
+        int n = epoll_wait(supervisor.epoll, events, 64, count > 0 ? 0 : timeoutMs);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return count;
+        for (int i = 0; i < n; i++)
+        {
+            uint64_t data = events[i].data.u64;
+            if (data == SUPERVISOR_SIGCHLD) // fallback: check every child without a pidfd
+            {
+                char drain[64];
+                while (read(supervisor.sigchldPipe[0], drain, sizeof(drain)) > 0)
+                    ;
+                for (int slot = 0; slot < supervisor.capacity; slot++)
+                {
+                    struct supervisedChild *c = &supervisor.children[slot];
+                    int status;
+                    if (c->pid != 0 && !c->exited && c->pidfd == -1 &&
+                        wait4(c->pid, &status, WNOHANG, &c->usage) == c->pid)
+                    {
+                        supervisorReap(slot, status);
+                        if (count < max)
+                            exited[count] = slot;
+                        count++;
+                    }
+                }
+            }
+            else if (data & SUPERVISOR_TIMER)
+            {
+                int slot = data & 0xffffffff;
+                if (!supervisor.children[slot].exited)
+                    supervisorTimer(slot);
+            }
+            else
+            {
+                int slot = data, status = 0;
+                struct supervisedChild *c = &supervisor.children[slot];
+                if (c->exited)
+                    continue;
+                pid_t r = wait4(c->pid, &status, WNOHANG, &c->usage);
+                if (r == 0 || (r == -1 && errno != ECHILD))
+                    continue;
+                supervisorReap(slot, status); // ECHILD: reaped by someone else, status unknown
+                if (count < max)
+                    exited[count] = slot;
+                count++;
+            }
+        }
+        if (count > 0 || timeoutMs == 0)
+            return count;
+    }
+}
+
+// block until the child in slot ends (other children are handled meanwhile)
+int superviseUntilExit(int slot)
+{
+    while (!supervisor.children[slot].exited)
+        if (supervisorWait(-1, NULL, 0) == -1)
+            return -1;
+    return 0;
+}
+
+// stop watching a child that ended (or kill -9 and reap it if not)
+void releaseChild(int slot)
+{
+    struct supervisedChild *c = &supervisor.children[slot];
+    if (!c->exited)
+    {
+        kill(c->pid, SIGKILL);
+        int status;
+        wait4(c->pid, &status, 0, &c->usage);
+        supervisorReap(slot, status);
+    }
+    c->pid = 0;
+    supervisor.freeSlots[supervisor.freeCount++] = slot;
+}
+
+// exit status for $? from a wait status
+static inline int exitStatus(int wstatus)
+{
+    return WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128 + WTERMSIG(wstatus);
+}
+
+struct parallelJob
+{
+    char *arg;
+    pid_t pid;
+    int slot; // in the supervisor, -1 if it could not start
+    int out; // stdout of the job, -1 once printed
+    int status;
+    int done;
+};
+
+#define PARALLEL_NOT_STARTED -1 // status of a job that could not be started
+
+// put the argument in place of every {} of the template word
+char *fillTemplate(const char *word, const char *arg)
+{
+    size_t argLen = strlen(arg), len = 0;
+    for (const char *p = word; *p; p++)
+        len += (p[0] == '{' && p[1] == '}') ? argLen : 1;
+    char *filled = malloc(len + 1), *out = filled;
+    for (const char *p = word; *p; p++)
+    {
+        if (p[0] == '{' && p[1] == '}')
+        {
+            memcpy(out, arg, argLen);
+            out += argLen;
+            p++;
+        }
+        else
+            *out++ = *p;
+    }
+    *out = 0;
+    return filled;
+}
+
+// start one job: template filled with its argument, stdout into a temp file
+pid_t startParallelJob(struct command_t *command, int first, int last, int hasPlaceholder,
+                       struct parallelJob *job, int stdinIsInput)
+{
+    job->out = makeTempFd("parallel");
+    if (job->out == -1)
+        return -1;
+    outFlush();
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        int error = errno;
+        close(job->out);
+        job->out = -1;
+        errno = error;
+    }
+    if (pid != 0)
+        return pid;
+
+    dup2(job->out, STDOUT_FILENO);
+    if (stdinIsInput) // arguments came from stdin, the jobs must not read it
+    {
+        int null = open("/dev/null", O_RDONLY);
+        dup2(null, STDIN_FILENO);
+        close(null);
+    }
+
+    struct command_t *c = calloc(1, sizeof(struct command_t));
+    c->name = fillTemplate(command->args[first], job->arg);
+    c->args = malloc(sizeof(char *) * (last - first + 1));
+    for (int i = first + 1; i < last; i++)
+        c->args[c->arg_count++] = fillTemplate(command->args[i], job->arg);
+    if (!hasPlaceholder)
+        c->args[c->arg_count++] = strdup(job->arg);
+    runCommand(c);
+    exit(127);
+}
+
+// copy out the output of a finished job
+void printParallelJob(struct parallelJob *job)
+{
+    if (job->out == -1)
+        return;
+    lseek(job->out, 0, SEEK_SET);
+    copyFd(job->out, STDOUT_FILENO);
+    close(job->out);
+    job->out = -1;
+}
+
+// a job ended: count it, report it if it failed, print what can be printed
+void finishParallelJob(struct parallelJob *jobs, int k, int jobCount, int keepOrder, int *nextToPrint,
+                       int *finished, int *failed)
+{
+    struct parallelJob *job = &jobs[k];
+    job->done = 1;
+    (*finished)++;
+    if (job->status != 0)
+    {
+        (*failed)++;
+        if (job->status != PARALLEL_NOT_STARTED) // that one was reported when it failed to start
+            fprintf(stderr, "parallel: job %d (%s) exited with status %d\n", k + 1, job->arg, job->status);
+    }
+    if (!keepOrder)
+        printParallelJob(job);
+    else // with -k, every finished job in input order
+        while (*nextToPrint < jobCount && jobs[*nextToPrint].done)
+            printParallelJob(&jobs[(*nextToPrint)++]);
+}
+
+/**
+ * parallel [-j N] [-k] [--progress] command [args, {} is the input] [::: inputs...]
+ * Runs the command once per input (lines of stdin when there is no :::), at most
+ * N at a time (default: number of cores), started in input order from one FIFO
+ * as jobs end. Output of each job is printed when it ends, or in input order
+ * with -k. Failed jobs, and jobs that could not start, are reported on stderr.
+ * @return number of failed jobs (at most 101)
+ */
+int parallelCommand(struct command_t *command)
+{
+    int workers = sysconf(_SC_NPROCESSORS_ONLN), keepOrder = 0, progress = 0;
+    int i = 0;
+    for (; i < command->arg_count && command->args[i][0] == '-'; i++)
+    {
+        if (strcmp(command->args[i], "-j") == 0 && i + 1 < command->arg_count)
+            workers = atoi(command->args[++i]);
+        else if (strncmp(command->args[i], "-j", 2) == 0 && command->args[i][2])
+            workers = atoi(command->args[i] + 2);
+        else if (strcmp(command->args[i], "-k") == 0)
+            keepOrder = 1;
+        else if (strcmp(command->args[i], "--progress") == 0)
+            progress = 1;
+        else
+        {
+            fprintf(stderr, "-%s: parallel: invalid option %s\n", sysname, command->args[i]);
+            return 101;
+        }
+    }
+    int first = i, last = i;
+    while (last < command->arg_count && strcmp(command->args[last], ":::") != 0)
+        last++;
+    if (first == last)
+    {
+        fprintf(stderr, "usage: parallel [-j N] [-k] [--progress] command [args] [::: inputs]\n");
+        return 101;
+    }
+    if (workers < 1)
+        workers = 1;
+    int hasPlaceholder = 0;
+    for (int k = first; k < last; k++)
+        if (strstr(command->args[k], "{}"))
+            hasPlaceholder = 1;
+
+    // inputs: after ::: or one per line of stdin
+    int jobCount = 0, stdinIsInput = last == command->arg_count;
+    struct parallelJob *jobs;
+    char *input = NULL;
+    if (!stdinIsInput)
+    {
+        jobCount = command->arg_count - last - 1;
+        jobs = calloc(jobCount + 1, sizeof(struct parallelJob));
+        for (int k = 0; k < jobCount; k++)
+            jobs[k].arg = command->args[last + 1 + k];
+    }
+    else
+    {
+        size_t len = 0, cap = 65536;
+        ssize_t n;
+        input = malloc(cap + 1);
+        while ((n = read(STDIN_FILENO, input + len, cap - len)) > 0 || (n == -1 && errno == EINTR))
+            if (n > 0 && (len += n) == cap)
+                input = realloc(input, (cap *= 2) + 1);
+        input[len] = 0;
+        jobs = calloc(getScanKernels()->count(input, len, '\n') + 2, sizeof(struct parallelJob));
+        for (char *line = input; *line;)
+        {
+            char *nl = strchrnul(line, '\n');
+            int more = *nl != 0;
+            *nl = 0;
+            if (nl > line)
+                jobs[jobCount++].arg = line;
+            line = more ? nl + 1 : nl;
+        }
+    }
+    if (workers > jobCount)
+        workers = jobCount > 0 ? jobCount : 1;
+
+    // one FIFO of jobs, at most workers of them running; running[w] is the job worker w runs
+    int *running = malloc(sizeof(int) * workers);
+
+    char pathOfCommand[PATH_MAX];
+    if (!hasPlaceholder || strstr(command->args[first], "{}") == NULL) // look the command up once for all jobs
+        resolveCommand(command->args[first], pathOfCommand, sizeof(pathOfCommand));
+
+    int next = 0, active = 0, finished = 0, failed = 0, nextToPrint = 0;
+    for (int w = 0; w < workers; w++)
+        running[w] = -1;
+    while (1)
+    {
+        // give the idle workers the next jobs, a job that cannot start is finished and failed right away
+        for (int w = 0; w < workers && next < jobCount; w++)
+            while (running[w] == -1 && next < jobCount)
+            {
+                int k = next++;
+                struct parallelJob *job = &jobs[k];
+                job->pid = startParallelJob(command, first, last, hasPlaceholder, job, stdinIsInput);
+                job->slot = job->pid > 0 ? superviseChild(job->pid) : -1;
+                if (job->slot != -1)
+                {
+                    running[w] = k;
+                    active++;
+                    continue;
+                }
+                if (job->pid > 0) // no supervisor: wait for this one alone
+                {
+                    int status = 0;
+                    waitpid(job->pid, &status, 0);
+                    job->status = exitStatus(status);
+                }
+                else
+                {
+                    job->status = PARALLEL_NOT_STARTED;
+                    fprintf(stderr, "-%s: parallel: job %d (%s) could not start: %s\n", sysname, k + 1,
+                            job->arg, strerror(errno));
+                }
+                finishParallelJob(jobs, k, jobCount, keepOrder, &nextToPrint, &finished, &failed);
+            }
+        if (active == 0)
+            break;
+
+        // a worker whose job ended, else sleep in the supervisor until one does
+        int w = 0;
+        while (w < workers && (running[w] == -1 || !supervisor.children[jobs[running[w]].slot].exited))
+            w++;
+        if (w == workers)
+        {
+            if (supervisorWait(-1, NULL, 0) <= 0)
+                break;
+            continue;
+        }
+
+        struct parallelJob *job = &jobs[running[w]];
+        job->status = exitStatus(supervisor.children[job->slot].status);
+        releaseChild(job->slot);
+        active--;
+        finishParallelJob(jobs, running[w], jobCount, keepOrder, &nextToPrint, &finished, &failed);
+        running[w] = -1;
+        if (progress)
+            fprintf(stderr, "\rparallel: %d/%d done, %d running, %d failed", finished, jobCount, active, failed);
+    }
+    if (progress)
+        fprintf(stderr, "\n");
+
+    for (int k = 0; k < jobCount; k++) // left over if the supervisor failed
+        if (jobs[k].out != -1)
+            close(jobs[k].out);
+    free(running);
+    free(jobs);
+    free(input);
+    return failed > 101 ? 101 : failed;
+}
+
+/**
+ * Find where a word starting at p ends: quotes, $(...), ${...} and `...` are
+ * part of the word, whatever is in them
+ * @return the end, or NULL if a quote or paren is not closed yet
+ */
+const char *scanWord(const char *p)
+{
+    if ((*p == '<' || *p == '>') && p[1] == '(') // process substitution
+    {
+        const char *end = findClosingParen(p + 2);
+        if (!end)
+            return NULL;
+        p = end + 1;
+    }
+    while (*p && !strchr(" \t\n;&|()<>", *p))
+    {
+        if (*p == '\\')
+            p += p[1] ? 2 : 1;
+        else if (*p == '\'')
+        {
+            p = strchr(p + 1, '\'');
+            if (!p)
+                return NULL;
+            p++;
+        }
+        else if (*p == '"')
+        {
+            for (p++; *p && *p != '"'; p++)
+            {
+                if (*p == '\\' && p[1])
+                    p++;
+                else if (*p == '$' && p[1] == '(')
+                {
+                    p = findClosingParen(p + 2);
+                    if (!p)
+                        return NULL;
+                }
+                else if (*p == '`')
+                {
+                    p = strchr(p + 1, '`');
+                    if (!p)
+                        return NULL;
+                }
+            }
+            if (!*p)
+                return NULL;
+            p++;
+        }
+        else if (*p == '`')
+        {
+            p = strchr(p + 1, '`');
+            if (!p)
+                return NULL;
+            p++;
+        }
+        else if (*p == '$' && p[1] == '(')
+        {
+            p = findClosingParen(p + 2);
+            if (!p)
+                return NULL;
+            p++;
+        }
+        else if (*p == '$' && p[1] == '{')
+        {
+            p = strchr(p + 2, '}');
+            if (!p)
+                return NULL;
+            p++;
+        }
+        else
+            p++;
+    }
+    return p;
+}
+
+static void addToken(struct token **tokens, int *count, enum tokenType type, char *text)
+{
+    *tokens = realloc(*tokens, sizeof(struct token) * (*count + 1));
+    (*tokens)[*count].type = type;
+    (*tokens)[*count].text = text;
+    (*tokens)[*count].quoted = false;
+    (*tokens)[*count].fd = -1;
+    (*tokens)[*count].start = (*tokens)[*count].end = -1;
+    (*count)++;
+}
+
+void freeTokens(struct token *tokens, int count)
+{
+    for (int i = 0; i < count; i++)
+        free(tokens[i].text);
+    free(tokens);
+}
+
+/**
+ * Split a script into tokens. The bodies of here-documents are taken from the
+ * lines after the one they are on.
+ * @return 0, 1 if the script ends inside a quote or here-document (more lines
+ *         may complete it), -1 on error
+ */
+int scriptLex(const char *source, struct token **tokensOut, int *countOut)
+{
+    struct token *tokens = NULL;
+    int count = 0;
+    int pending[16], pendingCount = 0; // here-documents waiting for their body
+    const char *p = source;
+    while (1)
+    {
+        while (*p == ' ' || *p == '\t' || (*p == '\\' && p[1] == '\n'))
+            p += *p == '\\' ? 2 : 1;
+        if (*p == '#')
+            while (*p && *p != '\n')
+                p++;
+        if (!*p)
+            break;
+
+        if (*p == '\n')
+        {
+            addToken(&tokens, &count, TOKEN_NEWLINE, NULL);
+            p++;
+            for (int h = 0; h < pendingCount; h++) // the bodies follow this line
+            {
+                struct token *t = &tokens[pending[h]];
+                bool stripTabs = t->text[0] == '-';
+                const char *delimiter = t->text + stripTabs;
+                size_t delimiterLength = strlen(delimiter);
+                size_t length = 0, capacity = 256;
+                char *body = malloc(capacity);
+                while (1)
+                {
+                    if (!*p)
+                    {
+                        free(body);
+                        freeTokens(tokens, count);
+                        return 1;
+                    }
+                    if (stripTabs)
+                        while (*p == '\t')
+                            p++;
+                    const char *eol = strchr(p, '\n');
+                    size_t n = eol ? (size_t)(eol - p) : strlen(p);
+                    if (n == delimiterLength && strncmp(p, delimiter, n) == 0)
+                    {
+                        p += n + (eol != NULL);
+                        break;
+                    }
+                    if (length + n + 2 > capacity)
+                        body = realloc(body, capacity = (length + n + 2) * 2);
+                    memcpy(body + length, p, n);
+                    body[length + n] = '\n';
+                    length += n + 1;
+                    p += n + (eol != NULL);
+                }
+                body[length] = 0;
+                free(t->text);
+                t->text = body;
+            }
+            pendingCount = 0;
+            continue;
+        }
+
+        const char *op = p;
+        int fd = -1; // 2>file: the digit is the fd the redirect is for
+        if (*p >= '0' && *p <= '9' && (p[1] == '>' || (p[1] == '<' && p[2] != '<')) && p[2] != '(')
+            fd = *p++ - '0';
+        if (*p == ';')
+            addToken(&tokens, &count, p[1] == ';' ? TOKEN_DSEMI : TOKEN_SEMI, NULL), p += p[1] == ';' ? 2 : 1;
+        else if (*p == '&')
+            addToken(&tokens, &count, p[1] == '&' ? TOKEN_AND : TOKEN_AMP, NULL), p += p[1] == '&' ? 2 : 1;
+        else if (*p == '|')
+            addToken(&tokens, &count, p[1] == '|' ? TOKEN_OR : TOKEN_PIPE, NULL), p += p[1] == '|' ? 2 : 1;
+        else if (*p == '(')
+            addToken(&tokens, &count, TOKEN_LPAREN, NULL), p++;
+        else if (*p == ')')
+            addToken(&tokens, &count, TOKEN_RPAREN, NULL), p++;
+        else if (*p == '>' && p[1] == '&')
+            addToken(&tokens, &count, TOKEN_GREATAND, NULL), p += 2;
+        else if (*p == '<' && p[1] == '&')
+            addToken(&tokens, &count, TOKEN_LESSAND, NULL), p += 2;
+        else if (*p == '>' && p[1] != '(')
+            addToken(&tokens, &count, p[1] == '>' ? TOKEN_DGREAT : TOKEN_GREAT, NULL), p += p[1] == '>' ? 2 : 1;
+        else if (*p == '<' && p[1] == '<' && p[2] == '<')
+            addToken(&tokens, &count, TOKEN_TLESS, NULL), p += 3;
+        else if (*p == '<' && p[1] == '<') // here-document: read its delimiter now, its body after this line
+        {
+            p += 2;
+            bool stripTabs = *p == '-';
+            p += stripTabs;
+            while (*p == ' ' || *p == '\t')
+                p++;
+            const char *end = scanWord(p);
+            if (!end || end == p)
+            {
+                fprintf(stderr, "-%s: syntax error: here-document without a delimiter\n", sysname);
+                freeTokens(tokens, count);
+                return -1;
+            }
+            char *delimiter = malloc(end - p + 2), *to = delimiter;
+            bool quoted = false;
+            if (stripTabs)
+                *to++ = '-';
+            for (const char *from = p; from < end; from++)
+            {
+                if (*from == '\'' || *from == '"' || *from == '\\')
+                    quoted = true;
+                else
+                    *to++ = *from;
+            }
+            *to = 0;
+            if (pendingCount == 16)
+            {
+                fprintf(stderr, "-%s: too many here-documents on one line\n", sysname);
+                free(delimiter);
+                freeTokens(tokens, count);
+                return -1;
+            }
+            addToken(&tokens, &count, TOKEN_HEREDOC, delimiter);
+            tokens[count - 1].quoted = quoted;
+            pending[pendingCount++] = count - 1;
+            p = end;
+        }
+        else if (*p == '<' && p[1] != '(')
+            addToken(&tokens, &count, TOKEN_LESS, NULL), p++;
+        if (p != op)
+        {
+            tokens[count - 1].fd = fd;
+            tokens[count - 1].start = op - source;
+            tokens[count - 1].end = p - source;
+            continue;
+        }
+
+        const char *end = scanWord(p);
+        if (!end)
+        {
+            freeTokens(tokens, count);
+            return 1;
+        }
+        addToken(&tokens, &count, TOKEN_WORD, strndup(p, end - p));
+        tokens[count - 1].start = p - source;
+        tokens[count - 1].end = end - source;
+        p = end;
+    }
+    if (pendingCount > 0) // here-document on the last line, its body is still to come
+    {
+        freeTokens(tokens, count);
+        return 1;
+    }
+    addToken(&tokens, &count, TOKEN_END, NULL);
+    *tokensOut = tokens;
+    *countOut = count;
+    return 0;
+}
+
+struct scriptParser
+{
+    const char *source;
+    struct token *tokens;
+    int count;
+    int position;
+    int status; // 0, 1 when the script ended too early, -1 on a syntax error
+    struct alias *aliases[ALIAS_DEPTH]; // being expanded, up to the token in aliasEnds
+    int aliasEnds[ALIAS_DEPTH];
+    int aliasDepth;
+};
+
+static inline struct token *peekToken(struct scriptParser *ps)
+{
+    return &ps->tokens[ps->position];
+}
+
+static inline bool isKeyword(struct token *t, const char *word)
+{
+    return t->type == TOKEN_WORD && strcmp(t->text, word) == 0;
+}
+
+static void skipNewlines(struct scriptParser *ps)
+{
+    while (peekToken(ps)->type == TOKEN_NEWLINE)
+        ps->position++;
+}
+
+// report a syntax error at the current token (or that the script is not finished yet)
+static void syntaxError(struct scriptParser *ps)
+{
+    if (ps->status != 0)
+        return;
+    struct token *t = peekToken(ps);
+    if (t->type == TOKEN_END)
+    {
+        ps->status = 1;
+        return;
+    }
+    static const char *names[] = {"", "newline", ";", ";;", "&&", "||", "|", "&", "(", ")", "<", ">", ">>", "<<<", "<&", ">&", "<<"};
+    fprintf(stderr, "-%s: syntax error near `%s'\n", sysname, t->type == TOKEN_WORD ? t->text : names[t->type]);
+    ps->status = -1;
+}
+
+static bool expectKeyword(struct scriptParser *ps, const char *word)
+{
+    if (isKeyword(peekToken(ps), word))
+    {
+        ps->position++;
+        return true;
+    }
+    syntaxError(ps);
+    return false;
+}
+
+static struct scriptNode *newNode(enum scriptNodeType type)
+{
+    struct scriptNode *node = calloc(1, sizeof(struct scriptNode));
+    node->type = type;
+    node->references = 1;
+    return node;
+}
+
+static void addChild(struct scriptNode *node, struct scriptNode *child)
+{
+    node->children = realloc(node->children, sizeof(struct scriptNode *) * (node->childCount + 1));
+    node->children[node->childCount++] = child;
+}
+
+/**
+ * Compile one word: words without expansions get their quotes removed now,
+ * the others keep their source text for expandWord
+ */
+struct scriptWord compileWord(const char *text)
+{
+    struct scriptWord word = {NULL, false};
+    bool single = false, dbl = false;
+    if (text[0] == '~' || ((text[0] == '<' || text[0] == '>') && text[1] == '('))
+        word.dynamic = true;
+    for (const char *p = text; *p && !word.dynamic; p++)
+    {
+        if (*p == '\\' && !single && p[1])
+            p++;
+        else if (*p == '\'' && !dbl)
+            single = !single;
+        else if (*p == '"' && !single)
+            dbl = !dbl;
+        else if (!single && (*p == '$' || *p == '`'))
+            word.dynamic = true;
+        else if (!single && !dbl && (*p == '*' || *p == '?' || (*p == '[' && strchr(p + 1, ']'))))
+            word.dynamic = true; // glob, a lone [ (the test command) is not one
+    }
+    if (word.dynamic)
+    {
+        word.text = strdup(text);
+        return word;
+    }
+
+    char *out = malloc(strlen(text) + 1), *to = out;
+    single = dbl = false;
+    for (const char *p = text; *p; p++)
+    {
+        if (*p == '\'' && !dbl)
+            single = !single;
+        else if (*p == '"' && !single)
+            dbl = !dbl;
+        else if (*p == '\\' && !single && p[1] && (!dbl || strchr("$`\"\\\n", p[1])))
+            *to++ = *++p;
+        else
+            *to++ = *p;
+    }
+    *to = 0;
+    word.text = out;
+    return word;
+}
+
+static void addWord(struct scriptWord **words, int *count, const char *text)
+{
+    *words = realloc(*words, sizeof(struct scriptWord) * (*count + 1));
+    (*words)[(*count)++] = compileWord(text);
+}
+
+// NAME=value
+static bool isAssignment(const char *text)
+{
+    if (!(text[0] == '_' || (text[0] >= 'a' && text[0] <= 'z') || (text[0] >= 'A' && text[0] <= 'Z')))
+        return false;
+    const char *p = text + 1;
+    while (*p == '_' || (*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9'))
+        p++;
+    return *p == '=';
+}
+
+/**
+ * Parse a redirect at the current token, if there is one
+ * @return true if one was added
+ */
+static bool parseRedirect(struct scriptParser *ps, struct scriptRedirect **redirects, int *count)
+{
+    struct token *t = peekToken(ps);
+    enum redirectKind kind;
+    switch (t->type)
+    {
+    case TOKEN_LESS:
+        kind = REDIRECT_IN;
+        break;
+    case TOKEN_GREAT:
+        kind = REDIRECT_OUT;
+        break;
+    case TOKEN_DGREAT:
+        kind = REDIRECT_APPEND;
+        break;
+    case TOKEN_TLESS:
+        kind = REDIRECT_STRING;
+        break;
+    case TOKEN_HEREDOC:
+        kind = REDIRECT_HEREDOC;
+        break;
+    case TOKEN_LESSAND:
+    case TOKEN_GREATAND:
+        kind = REDIRECT_DUP;
+        break;
+    default:
+        return false;
+    }
+    ps->position++;
+    int fd = t->type == TOKEN_GREAT || t->type == TOKEN_DGREAT || t->type == TOKEN_GREATAND ? 1 : 0;
+    struct scriptRedirect redirect = {kind, {NULL, false}, t->fd != -1 ? t->fd : fd};
+    if (kind == REDIRECT_HEREDOC)
+    {
+        redirect.target.text = strdup(t->text);
+        redirect.target.dynamic = !t->quoted && strpbrk(t->text, "$`") != NULL;
+    }
+    else
+    {
+        if (peekToken(ps)->type != TOKEN_WORD)
+        {
+            syntaxError(ps);
+            return false;
+        }
+        redirect.target = compileWord(peekToken(ps)->text);
+        ps->position++;
+    }
+    *redirects = realloc(*redirects, sizeof(struct scriptRedirect) * (*count + 1));
+    (*redirects)[(*count)++] = redirect;
+    return true;
+}
+
+struct scriptNode *parseList(struct scriptParser *ps, const char **stops);
+struct scriptNode *parseCommand(struct scriptParser *ps);
+
+static const char *stopThen[] = {"then", NULL};
+static const char *stopElse[] = {"elif", "else", "fi", NULL};
+static const char *stopFi[] = {"fi", NULL};
+static const char *stopDo[] = {"do", NULL};
+static const char *stopDone[] = {"done", NULL};
+static const char *stopEsac[] = {"esac", NULL};
+static const char *stopBrace[] = {"}", NULL};
+static const char *stopNone[] = {NULL};
+
+/**
+ * Replace an alias at the start of a command with the tokens of its value.
+ * An alias is not expanded again inside its own value, so alias ls='ls -F'
+ * ends.
+ */
+static void expandAliases(struct scriptParser *ps)
+{
+    while (ps->aliasDepth < ALIAS_DEPTH)
+    {
+        while (ps->aliasDepth > 0 && ps->position >= ps->aliasEnds[ps->aliasDepth - 1])
+            ps->aliasDepth--;
+        struct token *t = peekToken(ps);
+        if (t->type != TOKEN_WORD || strpbrk(t->text, "'\"\\"))
+            return;
+        struct alias *a = findAlias(t->text);
+        for (int i = 0; a && i < ps->aliasDepth; i++)
+            if (ps->aliases[i] == a)
+                a = NULL;
+        struct token *value;
+        int count;
+        if (a == NULL || scriptLex(a->value, &value, &count) != 0)
+            return;
+        count--; // without its TOKEN_END
+        for (int i = 0; i < count; i++)
+            value[i].start = value[i].end = -1; // not in the source
+        ps->tokens = realloc(ps->tokens, sizeof(struct token) * (ps->count + count));
+        free(ps->tokens[ps->position].text);
+        memmove(&ps->tokens[ps->position + count], &ps->tokens[ps->position + 1],
+                sizeof(struct token) * (ps->count - ps->position - 1));
+        memcpy(&ps->tokens[ps->position], value, sizeof(struct token) * count);
+        free(value);
+        ps->count += count - 1;
+        for (int i = 0; i < ps->aliasDepth; i++)
+            ps->aliasEnds[i] += count - 1;
+        ps->aliases[ps->aliasDepth] = a;
+        ps->aliasEnds[ps->aliasDepth++] = ps->position + count;
+    }
+}
+
+struct scriptNode *parseSimple(struct scriptParser *ps)
+{
+    struct scriptNode *node = newNode(NODE_COMMAND);
+    node->stages = calloc(1, sizeof(struct scriptStage));
+    node->stageCount = 1;
+    struct scriptStage *stage = node->stages;
+    while (ps->status == 0)
+    {
+        struct token *t = peekToken(ps);
+        if (t->type == TOKEN_WORD)
+        {
+            if (stage->wordCount == 0 && isAssignment(t->text))
+                addWord(&stage->assignments, &stage->assignmentCount, t->text);
+            else
+                addWord(&stage->words, &stage->wordCount, t->text);
+            ps->position++;
+        }
+        else if (!parseRedirect(ps, &stage->redirects, &stage->redirectCount))
+            break;
+    }
+    if (ps->status == 0 && stage->wordCount + stage->assignmentCount + stage->redirectCount == 0)
+        syntaxError(ps);
+    return node;
+}
+
+struct scriptNode *parseIf(struct scriptParser *ps)
+{
+    // "if" or "elif" is already read
+    struct scriptNode *node = newNode(NODE_IF);
+    node->first = parseList(ps, stopThen);
+    if (!expectKeyword(ps, "then"))
+        return node;
+    node->second = parseList(ps, stopElse);
+    if (isKeyword(peekToken(ps), "elif"))
+    {
+        ps->position++;
+        node->third = parseIf(ps);
+        return node;
+    }
+    if (isKeyword(peekToken(ps), "else"))
+    {
+        ps->position++;
+        node->third = parseList(ps, stopFi);
+    }
+    expectKeyword(ps, "fi");
+    return node;
+}
+
+struct scriptNode *parseLoopBody(struct scriptParser *ps, struct scriptNode *node)
+{
+    skipNewlines(ps);
+    if (!expectKeyword(ps, "do"))
+        return node;
+    node->second = parseList(ps, stopDone);
+    expectKeyword(ps, "done");
+    return node;
+}
+
+struct scriptNode *parseFor(struct scriptParser *ps)
+{
+    struct scriptNode *node = newNode(NODE_FOR);
+    struct token *t = peekToken(ps);
+    if (t->type != TOKEN_WORD || isAssignment(t->text))
+    {
+        syntaxError(ps);
+        return node;
+    }
+    node->name = strdup(t->text);
+    ps->position++;
+    skipNewlines(ps);
+    if (isKeyword(peekToken(ps), "in"))
+    {
+        ps->position++;
+        node->words = calloc(1, sizeof(struct scriptWord)); // not NULL, even for an empty list
+        while (peekToken(ps)->type == TOKEN_WORD)
+        {
+            addWord(&node->words, &node->wordCount, peekToken(ps)->text);
+            ps->position++;
+        }
+    }
+    if (peekToken(ps)->type == TOKEN_SEMI)
+        ps->position++;
+    return parseLoopBody(ps, node);
+}
+
+struct scriptNode *parseCase(struct scriptParser *ps)
+{
+    struct scriptNode *node = newNode(NODE_CASE);
+    if (peekToken(ps)->type != TOKEN_WORD)
+    {
+        syntaxError(ps);
+        return node;
+    }
+    addWord(&node->words, &node->wordCount, peekToken(ps)->text);
+    ps->position++;
+    skipNewlines(ps);
+    if (!expectKeyword(ps, "in"))
+        return node;
+    skipNewlines(ps);
+    while (ps->status == 0 && !isKeyword(peekToken(ps), "esac"))
+    {
+        struct caseArm arm = {NULL, 0, NULL};
+        if (peekToken(ps)->type == TOKEN_LPAREN)
+            ps->position++;
+        while (1)
+        {
+            if (peekToken(ps)->type != TOKEN_WORD)
+            {
+                syntaxError(ps);
+                break;
+            }
+            addWord(&arm.patterns, &arm.patternCount, peekToken(ps)->text);
+            ps->position++;
+            if (peekToken(ps)->type != TOKEN_PIPE)
+                break;
+            ps->position++;
+        }
+        if (ps->status == 0 && peekToken(ps)->type != TOKEN_RPAREN)
+            syntaxError(ps);
+        ps->position += ps->status == 0;
+        arm.body = parseList(ps, stopEsac);
+        node->arms = realloc(node->arms, sizeof(struct caseArm) * (node->armCount + 1));
+        node->arms[node->armCount++] = arm;
+        if (peekToken(ps)->type == TOKEN_DSEMI)
+            ps->position++;
+        else if (!isKeyword(peekToken(ps), "esac"))
+            syntaxError(ps);
+        skipNewlines(ps);
+    }
+    expectKeyword(ps, "esac");
+    return node;
+}
+
+struct scriptNode *parseFunction(struct scriptParser *ps, const char *name)
+{
+    struct scriptNode *node = newNode(NODE_FUNCTION);
+    node->name = strdup(name);
+    skipNewlines(ps);
+    node->first = parseCommand(ps);
+    if (ps->status == 0 && node->first->type != NODE_GROUP && node->first->type != NODE_SUBSHELL &&
+        node->first->type != NODE_IF && node->first->type != NODE_WHILE && node->first->type != NODE_UNTIL &&
+        node->first->type != NODE_FOR && node->first->type != NODE_CASE)
+    {
+        fprintf(stderr, "-%s: syntax error: the body of function %s must be a compound command\n", sysname, name);
+        ps->status = -1;
+    }
+    return node;
+}
+
+// name() body, with the source of the whole definition kept
+static struct scriptNode *parseDefinition(struct scriptParser *ps, const char *name, int start)
+{
+    struct scriptNode *node = parseFunction(ps, name);
+    int end = ps->tokens[ps->position - 1].end;
+    if (ps->status == 0 && start != -1 && end != -1)
+        node->definition = strndup(ps->source + start, end - start);
+    return node;
+}
+
+struct scriptNode *parseCommand(struct scriptParser *ps)
+{
+    expandAliases(ps);
+    struct token *t = peekToken(ps);
+    struct scriptNode *node = NULL;
+    if (t->type == TOKEN_LPAREN)
+    {
+        ps->position++;
+        node = newNode(NODE_SUBSHELL);
+        node->first = parseList(ps, stopNone);
+        if (peekToken(ps)->type == TOKEN_RPAREN)
+            ps->position++;
+        else
+            syntaxError(ps);
+    }
+    else if (t->type != TOKEN_WORD)
+    {
+        syntaxError(ps);
+        return newNode(NODE_LIST);
+    }
+    else if (strcmp(t->text, "if") == 0)
+    {
+        ps->position++;
+        node = parseIf(ps);
+    }
+    else if (strcmp(t->text, "while") == 0 || strcmp(t->text, "until") == 0)
+    {
+        ps->position++;
+        node = newNode(t->text[0] == 'w' ? NODE_WHILE : NODE_UNTIL);
+        node->first = parseList(ps, stopDo);
+        parseLoopBody(ps, node);
+    }
+    else if (strcmp(t->text, "for") == 0)
+    {
+        ps->position++;
+        node = parseFor(ps);
+    }
+    else if (strcmp(t->text, "case") == 0)
+    {
+        ps->position++;
+        node = parseCase(ps);
+    }
+    else if (strcmp(t->text, "{") == 0)
+    {
+        ps->position++;
+        node = newNode(NODE_GROUP);
+        node->first = parseList(ps, stopBrace);
+        expectKeyword(ps, "}");
+    }
+    else if (strcmp(t->text, "function") == 0 && ps->tokens[ps->position + 1].type == TOKEN_WORD)
+    {
+        const char *name = ps->tokens[ps->position + 1].text;
+        int start = t->start;
+        ps->position += 2;
+        if (peekToken(ps)->type == TOKEN_LPAREN && ps->tokens[ps->position + 1].type == TOKEN_RPAREN)
+            ps->position += 2;
+        return parseDefinition(ps, name, start);
+    }
+    else if (ps->tokens[ps->position + 1].type == TOKEN_LPAREN && ps->tokens[ps->position + 2].type == TOKEN_RPAREN)
+    {
+        const char *name = t->text; // name() body
+        ps->position += 3;
+        return parseDefinition(ps, name, t->start);
+    }
+    else
+        return parseSimple(ps);
+
+    while (ps->status == 0 && parseRedirect(ps, &node->redirects, &node->redirectCount))
+        ;
+    return node;
+}
+
+struct scriptNode *parsePipeline(struct scriptParser *ps)
+{
+    bool negate = false;
+    while (isKeyword(peekToken(ps), "!"))
+    {
+        negate = !negate;
+        ps->position++;
+    }
+    struct scriptNode *node = parseCommand(ps);
+    while (ps->status == 0 && peekToken(ps)->type == TOKEN_PIPE)
+    {
+        ps->position++;
+        skipNewlines(ps);
+        struct scriptNode *next = parseCommand(ps);
+        if (node->type == NODE_COMMAND && next->type == NODE_COMMAND) // simple commands: one command_t chain
+        {
+            node->stages = realloc(node->stages, sizeof(struct scriptStage) * (node->stageCount + 1));
+            node->stages[node->stageCount++] = next->stages[0];
+            next->stageCount = 0;
+            freeNode(next);
+            continue;
+        }
+        if (node->type != NODE_PIPELINE)
+        {
+            struct scriptNode *pipeline = newNode(NODE_PIPELINE);
+            addChild(pipeline, node);
+            node = pipeline;
+        }
+        addChild(node, next);
+    }
+    if (negate)
+    {
+        struct scriptNode *not = newNode(NODE_NOT);
+        not->first = node;
+        node = not;
+    }
+    return node;
+}
+
+struct scriptNode *parseAndOr(struct scriptParser *ps)
+{
+    struct scriptNode *node = parsePipeline(ps);
+    while (ps->status == 0 && (peekToken(ps)->type == TOKEN_AND || peekToken(ps)->type == TOKEN_OR))
+    {
+        struct scriptNode *parent = newNode(peekToken(ps)->type == TOKEN_AND ? NODE_AND : NODE_OR);
+        ps->position++;
+        skipNewlines(ps);
+        parent->first = node;
+        parent->second = parsePipeline(ps);
+        node = parent;
+    }
+    return node;
+}
+
+/**
+ * Parse commands up to one of the stop keywords, a ), a ;; or the end
+ */
+struct scriptNode *parseList(struct scriptParser *ps, const char **stops)
+{
+    struct scriptNode *list = newNode(NODE_LIST);
+    skipNewlines(ps);
+    while (ps->status == 0)
+    {
+        struct token *t = peekToken(ps);
+        if (t->type == TOKEN_END || t->type == TOKEN_RPAREN || t->type == TOKEN_DSEMI)
+            break;
+        bool stop = false;
+        for (int i = 0; stops[i] && !stop; i++)
+            stop = isKeyword(t, stops[i]);
+        if (stop)
+            break;
+
+        struct scriptNode *node = parseAndOr(ps);
+        addChild(list, node);
+        t = peekToken(ps);
+        if (t->type == TOKEN_AMP)
+            node->background = true;
+        if (t->type == TOKEN_AMP || t->type == TOKEN_SEMI || t->type == TOKEN_NEWLINE)
+        {
+            ps->position++;
+            skipNewlines(ps);
+        }
+        else
+            break;
+    }
+    if (list->childCount == 1) // no list around a single command
+    {
+        struct scriptNode *only = list->children[0];
+        list->childCount = 0;
+        freeNode(list);
+        return only;
+    }
+    return list;
+}
+
+/**
+ * Compile a script
+ * @return 0 and the script in program, 1 if the script is not finished (an
+ *         open quote, if, loop...), -1 on a syntax error (already reported)
+ */
+// and-or lists separated by ; or &, up to the end of the line
+struct scriptNode *parseLine(struct scriptParser *ps)
+{
+    struct scriptNode *list = newNode(NODE_LIST);
+    while (ps->status == 0)
+    {
+        struct scriptNode *node = parseAndOr(ps);
+        addChild(list, node);
+        struct token *t = peekToken(ps);
+        if (t->type == TOKEN_AMP)
+            node->background = true;
+        if (t->type != TOKEN_AMP && t->type != TOKEN_SEMI)
+            break;
+        ps->position++;
+        t = peekToken(ps);
+        if (t->type == TOKEN_NEWLINE || t->type == TOKEN_END)
+            break;
+    }
+    struct token *t = peekToken(ps);
+    if (ps->status == 0 && t->type != TOKEN_NEWLINE && t->type != TOKEN_END)
+        syntaxError(ps);
+    return list;
+}
+
+int compileScript(const char *source, struct scriptNode **program)
+{
+    struct scriptParser ps = {.source = source};
+    int status = scriptLex(source, &ps.tokens, &ps.count);
+    if (status != 0)
+        return status;
+    struct scriptNode *node = parseList(&ps, stopNone);
+    if (ps.status == 0 && peekToken(&ps)->type != TOKEN_END)
+        syntaxError(&ps);
+    freeTokens(ps.tokens, ps.count);
+    if (ps.status != 0)
+    {
+        freeNode(node);
+        return ps.status;
+    }
+    *program = node;
+    return 0;
+}
+
+static void freeWords(struct scriptWord *words, int count)
+{
+    for (int i = 0; i < count; i++)
+        free(words[i].text);
+    free(words);
+}
+
+static void freeRedirects(struct scriptRedirect *redirects, int count)
+{
+    for (int i = 0; i < count; i++)
+        free(redirects[i].target.text);
+    free(redirects);
+}
+
+void freeNode(struct scriptNode *node)
+{
+    if (node == NULL || --node->references > 0)
+        return;
+    freeNode(node->first);
+    freeNode(node->second);
+    freeNode(node->third);
+    for (int i = 0; i < node->childCount; i++)
+        freeNode(node->children[i]);
+    free(node->children);
+    free(node->name);
+    freeWords(node->words, node->wordCount);
+    for (int i = 0; i < node->armCount; i++)
+    {
+        freeWords(node->arms[i].patterns, node->arms[i].patternCount);
+        freeNode(node->arms[i].body);
+    }
+    free(node->arms);
+    for (int i = 0; i < node->stageCount; i++)
+    {
+        freeWords(node->stages[i].words, node->stages[i].wordCount);
+        freeWords(node->stages[i].assignments, node->stages[i].assignmentCount);
+        freeRedirects(node->stages[i].redirects, node->stages[i].redirectCount);
+    }
+    free(node->stages);
+    if (node->compiled)
+        free_command(node->compiled);
+    freeRedirects(node->redirects, node->redirectCount);
+    free(node->definition);
+    free(node);
+}
+
+static inline unsigned variableBucket(const char *name, unsigned buckets)
+{
+    return hashBytes(name, strlen(name)) & (buckets - 1);
+}
+
+struct shellVariable *findVariable(const char *name)
+{
+    for (struct shellVariable *v = variables[variableBucket(name, VARIABLE_BUCKETS)]; v; v = v->next)
+        if (strcmp(v->name, name) == 0)
+            return v;
+    return NULL;
+}
+
+/**
+ * Value of a shell variable, or of the environment variable with that name
+ * @return the value, NULL if it is not set
+ */
+const char *getVariable(const char *name)
+{
+    struct shellVariable *v = findVariable(name);
+    return v ? v->value : rcGetenv(name);
+}
+
+// a variable, or with a number a positional parameter ($0 is the script name)
+const char *getParameter(const char *name)
+{
+    if (name[0] < '0' || name[0] > '9')
+        return getVariable(name);
+    int index = atoi(name);
+    if (index == 0)
+        return scriptName;
+    return index <= positionalCount ? positional[index - 1] : NULL;
+}
+
+void setVariable(const char *name, const char *value, bool export)
+{
+    struct shellVariable *v = findVariable(name);
+    if (v == NULL)
+    {
+        unsigned bucket = variableBucket(name, VARIABLE_BUCKETS);
+        v = calloc(1, sizeof(struct shellVariable));
+        v->name = strdup(name);
+        v->exported = rcGetenv(name) != NULL; // came from the environment
+        v->next = variables[bucket];
+        variables[bucket] = v;
+    }
+    if (v->value != value)
+    {
+        size_t length = strlen(value);
+        v->value = realloc(inRcSnapshot(v->value) ? NULL : v->value, length + 1);
+        memcpy(v->value, value, length + 1);
+    }
+    v->exported |= export;
+    if (v->exported)
+        setenv(name, value, 1);
+}
+
+void unsetVariable(const char *name)
+{
+    if (rcRecording.active && getenv(name)) // the snapshot can't take it out of the environment
+        rcImpure();
+    struct shellVariable **link = &variables[variableBucket(name, VARIABLE_BUCKETS)];
+    while (*link && strcmp((*link)->name, name) != 0)
+        link = &(*link)->next;
+    if (*link)
+    {
+        struct shellVariable *v = *link;
+        *link = v->next;
+        snapshotFree(v->name);
+        snapshotFree(v->value);
+        snapshotFree(v);
+    }
+    unsetenv(name);
+}
+
+struct shellFunction *findFunction(const char *name)
+{
+    for (struct shellFunction *f = functions[variableBucket(name, FUNCTION_BUCKETS)]; f; f = f->next)
+        if (strcmp(f->name, name) == 0)
+            return f;
+    return NULL;
+}
+
+/**
+ * Define (or redefine) a function. The body may be NULL with only the
+ * definition: it is compiled when the function is first called.
+ */
+void defineFunction(const char *name, struct scriptNode *body, const char *definition)
+{
+    struct shellFunction *f = findFunction(name);
+    if (f == NULL)
+    {
+        unsigned bucket = variableBucket(name, FUNCTION_BUCKETS);
+        f = calloc(1, sizeof(struct shellFunction));
+        f->name = strdup(name);
+        f->next = functions[bucket];
+        functions[bucket] = f;
+    }
+    else
+    {
+        freeNode(f->body);
+        snapshotFree(f->definition);
+    }
+    if (body)
+        body->references++;
+    f->body = body;
+    f->definition = definition ? strdup(definition) : NULL;
+}
+
+static void addField(struct fieldList *fields, char *text)
+{
+    if (fields->count == fields->capacity)
+    {
+        fields->capacity = fields->capacity ? fields->capacity * 2 : 8;
+        fields->items = realloc(fields->items, sizeof(char *) * fields->capacity);
+    }
+    fields->items[fields->count++] = text;
+}
+
+void freeFields(struct fieldList *fields)
+{
+    for (int i = 0; i < fields->count; i++)
+        free(fields->items[i]);
+    free(fields->items);
+    fields->items = NULL;
+    fields->count = fields->capacity = 0;
+}
+
+// state of expandWord while it builds fields
+struct expansion
+{
+    struct fieldList *fields;
+    char *text; // field being built
+    size_t length, capacity;
+    bool haveField; // quotes make a field even if it is empty
+    bool glob;      // the field has unquoted glob characters
+    int mode;
+};
+
+static void expandAppend(struct expansion *e, const char *text, size_t n, bool quoted)
+{
+    if (e->length + 2 * n + 1 > e->capacity)
+    {
+        e->capacity = (e->length + 2 * n + 1) * 2;
+        e->text = realloc(e->text, e->capacity);
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        if (e->mode == EXPAND_PATTERN && quoted && strchr("*?[]\\", text[i]))
+            e->text[e->length++] = '\\';
+        e->text[e->length++] = text[i];
+    }
+    e->text[e->length] = 0;
+}
+
+static void expandEndField(struct expansion *e)
+{
+    if (e->length == 0 && !e->haveField)
+        return;
+    char *text = strndup(e->text ? e->text : "", e->length);
+    glob_t matches;
+    if (e->glob && e->mode == EXPAND_FIELDS)
+        rcImpure(); // depends on the files there are
+    if (e->glob && e->mode == EXPAND_FIELDS && glob(text, 0, NULL, &matches) == 0)
+    {
+        for (size_t i = 0; i < matches.gl_pathc; i++)
+            addField(e->fields, strdup(matches.gl_pathv[i]));
+        globfree(&matches);
+        free(text);
+    }
+    else
+        addField(e->fields, text);
+    e->length = 0;
+    e->haveField = e->glob = false;
+}
+
+// add the result of an expansion: split on blanks unless it is quoted
+static void expandInsert(struct expansion *e, const char *text, size_t n, bool quoted)
+{
+    if (quoted || e->mode != EXPAND_FIELDS)
+    {
+        expandAppend(e, text, n, quoted);
+        return;
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        if (text[i] == ' ' || text[i] == '\t' || text[i] == '\n')
+            expandEndField(e);
+        else
+            expandAppend(e, text + i, 1, false);
+    }
+}
+
+/**
+ * Expand a word to a single string (no field splitting or globbing)
+ * @return the string (malloc'd)
+ */
+char *expandString(const char *text, int mode)
+{
+    struct fieldList fields = {NULL, 0, 0};
+    expandWord(text, &fields, mode);
+    char *result = fields.count > 0 ? fields.items[0] : strdup("");
+    for (int i = 1; i < fields.count; i++)
+        free(fields.items[i]);
+    free(fields.items);
+    return result;
+}
+
+static inline bool isNameChar(char c, bool first)
+{
+    return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (!first && c >= '0' && c <= '9');
+}
+
+/**
+ * Expand what follows a $: a variable, a special parameter, $(...) or $((...))
+ * @return where the expansion ends
+ */
+static const char *expandDollar(struct expansion *e, const char *p, bool quoted)
+{
+    char number[32];
+    if (p[1] == '(' && p[2] == '(') // arithmetic
+    {
+        const char *end = findClosingParen(p + 2);
+        if (end && end[-1] == ')')
+        {
+            char *inner = strndup(p + 3, end - p - 4);
+            long value = 0;
+            if (strpbrk(inner, "$`'\"\\")) // names in it are read by evalArithmetic, only $ needs expanding
+            {
+                char *expression = expandString(inner, EXPAND_STRING);
+                if (evalArithmetic(expression, &value) == -1)
+                    expansionFailed = true;
+                free(expression);
+            }
+            else if (evalArithmetic(inner, &value) == -1)
+                expansionFailed = true;
+            free(inner);
+            int n = snprintf(number, sizeof(number), "%ld", value);
+            expandInsert(e, number, n, quoted);
+            return end + 1;
+        }
+    }
+    if (p[1] == '(') // command substitution
+    {
+        const char *end = findClosingParen(p + 2);
+        if (!end)
+            return p + strlen(p);
+        char *inner = strndup(p + 2, end - p - 2);
+        size_t n = 0;
+        char *output = captureCommand(inner, &n);
+        free(inner);
+        if (output)
+            expandInsert(e, output, n, quoted);
+        free(output);
+        return end + 1;
+    }
+    if (p[1] == '{')
+    {
+        const char *end = strchr(p + 2, '}');
+        if (!end)
+            return p + strlen(p);
+        char *inner = strndup(p + 2, end - p - 2);
+        const char *value;
+        if (inner[0] == '#') // ${#name}: length
+        {
+            value = getVariable(inner + 1);
+            int n = snprintf(number, sizeof(number), "%zu", value ? strlen(value) : 0);
+            expandInsert(e, number, n, quoted);
+        }
+        else
+        {
+            char *op = inner;
+            while (isNameChar(*op, false))
+                op++;
+            bool colon = *op == ':';
+            char kind = op[colon];
+            char *word = op + colon + (kind != 0);
+            *op = 0;
+            value = getParameter(inner);
+            bool unset = value == NULL || (colon && value[0] == 0);
+            if (unset && (kind == '-' || kind == '='))
+            {
+                char *expanded = expandString(word, EXPAND_STRING);
+                if (kind == '=')
+                    setVariable(inner, expanded, false);
+                expandInsert(e, expanded, strlen(expanded), quoted);
+                free(expanded);
+            }
+            else if (!unset && kind == '+')
+            {
+                char *expanded = expandString(word, EXPAND_STRING);
+                expandInsert(e, expanded, strlen(expanded), quoted);
+                free(expanded);
+            }
+            else if (value && kind != '+')
+                expandInsert(e, value, strlen(value), quoted);
+        }
+        free(inner);
+        return end + 1;
+    }
+
+    char c = p[1];
+    if (c == '?' || c == '#' || c == '$' || c == '!')
+    {
+        if (c == '$' || c == '!')
+            rcImpure(); // different in every shell
+        long value = c == '?' ? lastStatus : c == '#' ? positionalCount : c == '$' ? (long)getpid() : lastBackground;
+        int n = snprintf(number, sizeof(number), "%ld", value);
+        expandInsert(e, number, n, quoted);
+        return p + 2;
+    }
+    if (c >= '0' && c <= '9')
+    {
+        char name[2] = {c, 0};
+        const char *value = getParameter(name);
+        if (value)
+            expandInsert(e, value, strlen(value), quoted);
+        return p + 2;
+    }
+    if (c == '@' || c == '*')
+    {
+        for (int i = 0; i < positionalCount; i++)
+        {
+            if (i > 0)
+            {
+                if (quoted && c == '@') // "$@": one field each
+                {
+                    e->haveField = true;
+                    expandEndField(e);
+                }
+                else
+                    expandInsert(e, " ", 1, quoted);
+            }
+            expandInsert(e, positional[i], strlen(positional[i]), quoted);
+        }
+        return p + 2;
+    }
+    if (isNameChar(c, true))
+    {
+        const char *end = p + 1;
+        while (isNameChar(*end, false))
+            end++;
+        char name[256];
+        size_t n = (size_t)(end - p - 1) < sizeof(name) - 1 ? (size_t)(end - p - 1) : sizeof(name) - 1;
+        memcpy(name, p + 1, n);
+        name[n] = 0;
+        const char *value = getVariable(name);
+        if (value)
+            expandInsert(e, value, strlen(value), quoted);
+        return end;
+    }
+    expandAppend(e, "$", 1, quoted);
+    return p + 1;
+}
+
+/**
+ * Expand a word: quotes, \, variables, $(...), `...`, $((...)), <(...), >(...)
+ * and ~, then split unquoted expansions into fields and glob (EXPAND_FIELDS)
+ */
+void expandWord(const char *text, struct fieldList *fields, int mode)
+{
+    struct expansion e = {fields, NULL, 0, 0, false, false, mode};
+    bool dbl = false;
+    const char *p = text;
+    if ((p[0] == '<' || p[0] == '>') && p[1] == '(')
+    {
+        const char *end = findClosingParen(p + 2);
+        if (end)
+        {
+            char *inner = strndup(p + 2, end - p - 2);
+            char path[32];
+            int n = snprintf(path, sizeof(path), "/dev/fd/%d", startProcessSubstitution(inner, p[0] == '>'));
+            free(inner);
+            expandAppend(&e, path, n, true);
+            p = end + 1;
+        }
+    }
+    else if (p[0] == '~' && (p[1] == '/' || p[1] == 0))
+    {
+        const char *home = rcGetenv("HOME");
+        expandAppend(&e, home ? home : "~", strlen(home ? home : "~"), true);
+        p++;
+    }
+
+    while (*p)
+    {
+        if (*p == '"')
+        {
+            dbl = !dbl;
+            e.haveField = true;
+            p++;
+        }
+        else if (*p == '\'' && !dbl)
+        {
+            const char *end = strchr(p + 1, '\'');
+            if (!end)
+                end = p + strlen(p);
+            expandAppend(&e, p + 1, end - p - 1, true);
+            e.haveField = true;
+            p = *end ? end + 1 : end;
+        }
+        else if (*p == '\\' && p[1])
+        {
+            if (dbl && !strchr("$`\"\\\n", p[1]))
+                expandAppend(&e, p, 2, true);
+            else
+                expandAppend(&e, p + 1, 1, true);
+            p += 2;
+        }
+        else if (*p == '$')
+            p = expandDollar(&e, p, dbl);
+        else if (*p == '`')
+        {
+            const char *end = strchr(p + 1, '`');
+            if (!end)
+                end = p + strlen(p);
+            char *inner = strndup(p + 1, end - p - 1);
+            size_t n = 0;
+            char *output = captureCommand(inner, &n);
+            free(inner);
+            if (output)
+                expandInsert(&e, output, n, dbl);
+            free(output);
+            p = *end ? end + 1 : end;
+        }
+        else
+        {
+            if (!dbl && (*p == '*' || *p == '?' || (*p == '[' && strchr(p + 1, ']'))))
+                e.glob = true;
+            expandAppend(&e, p, 1, dbl);
+            p++;
+        }
+    }
+    if (mode != EXPAND_FIELDS)
+        e.haveField = true; // a string is never dropped, even if empty
+    expandEndField(&e);
+    free(e.text);
+}
+
+/**
+ * Expand compiled words into fields; static words are copied as they are
+ */
+void expandWords(struct scriptWord *words, int count, struct fieldList *fields)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (words[i].dynamic)
+            expandWord(words[i].text, fields, EXPAND_FIELDS);
+        else
+            addField(fields, strdup(words[i].text));
+    }
+}
+
+// ---- arithmetic for $((...)), a recursive descent over C operators on longs ----
+
+struct arithmetic
+{
+    const char *p;
+    const char *error; // what went wrong, NULL if nothing
+    bool skip;         // the side && || ?: don't take: no assignments, no division error
+};
+
+static long arithTernary(struct arithmetic *a);
+
+// value / right or value % right; LONG_MIN / -1 would trap, so -1 is done by hand
+static long arithDivide(struct arithmetic *a, long value, long right, bool divide)
+{
+    if (right == 0)
+    {
+        if (!a->skip)
+            a->error = "division by 0";
+        return 0;
+    }
+    if (right == -1)
+        return divide ? (long)(0UL - (unsigned long)value) : 0;
+    return divide ? value / right : value % right;
+}
+
+static void arithSkip(struct arithmetic *a)
+{
+    while (*a->p == ' ' || *a->p == '\t' || *a->p == '\n')
+        a->p++;
+}
+
+static bool arithAccept(struct arithmetic *a, const char *op)
+{
+    arithSkip(a);
+    if (*a->p != op[0]) // most operators are tried at every level, rule them out quickly
+        return false;
+    size_t n = op[1] ? 2 : 1;
+    if (n == 2 && a->p[1] != op[1])
+        return false;
+    // don't take < out of <=, = out of ==, & out of && ...
+    if (n == 1 && (a->p[1] == '=' || (strchr("<>&|", op[0]) && a->p[1] == op[0])) && op[0] != '!')
+        return false;
+    if (n == 1 && op[0] == '!' && a->p[1] == '=')
+        return false;
+    a->p += n;
+    return true;
+}
+
+static long arithPrimary(struct arithmetic *a)
+{
+    arithSkip(a);
+    if (arithAccept(a, "("))
+    {
+        long value = arithTernary(a);
+        if (!a->error && !arithAccept(a, ")"))
+            a->error = "arithmetic syntax error";
+        return value;
+    }
+    if (arithAccept(a, "-"))
+        return -arithPrimary(a);
+    if (arithAccept(a, "+"))
+        return arithPrimary(a);
+    if (arithAccept(a, "!"))
+        return !arithPrimary(a);
+    if (arithAccept(a, "~"))
+        return ~arithPrimary(a);
+    if (*a->p >= '0' && *a->p <= '9')
+    {
+        char *end;
+        long value = strtol(a->p, &end, 0);
+        a->p = end;
+        return value;
+    }
+    if (isNameChar(*a->p, true))
+    {
+        char name[256];
+        size_t n = 0;
+        while (isNameChar(*a->p, false) && n < sizeof(name) - 1)
+            name[n++] = *a->p++;
+        name[n] = 0;
+        const char *text = getVariable(name);
+        long value = text ? strtol(text, NULL, 0) : 0;
+
+        arithSkip(a);
+        static const char *assignOps[] = {"+=", "-=", "*=", "/=", "%=", "="};
+        for (int i = 0; i < 6; i++)
+        {
+            size_t length = strlen(assignOps[i]);
+            if (strncmp(a->p, assignOps[i], length) != 0 || (length == 1 && a->p[1] == '='))
+                continue;
+            a->p += length;
+            long right = arithTernary(a);
+            if (a->error || a->skip)
+                return 0;
+            if (i == 3 || i == 4)
+                value = arithDivide(a, value, right, i == 3);
+            else
+                value = i == 0 ? value + right : i == 1 ? value - right : i == 2 ? value * right : right;
+            if (a->error)
+                return 0;
+            char number[32];
+            snprintf(number, sizeof(number), "%ld", value);
+            setVariable(name, number, false);
+            break;
+        }
+        return value;
+    }
+    a->error = "arithmetic syntax error";
+    return 0;
+}
+
+static long arithMultiply(struct arithmetic *a)
+{
+    long value = arithPrimary(a);
+    while (!a->error)
+    {
+        if (arithAccept(a, "*"))
+            value *= arithPrimary(a);
+        else if (arithAccept(a, "/") || arithAccept(a, "%"))
+        {
+            bool divide = a->p[-1] == '/';
+            long right = arithPrimary(a);
+            value = arithDivide(a, value, right, divide);
+        }
+        else
+            break;
+    }
+    return value;
+}
+
+static long arithAdd(struct arithmetic *a)
+{
+    long value = arithMultiply(a);
+    while (!a->error)
+    {
+        if (arithAccept(a, "+"))
+            value += arithMultiply(a);
+        else if (arithAccept(a, "-"))
+            value -= arithMultiply(a);
+        else
+            break;
+    }
+    return value;
+}
+
+static long arithShift(struct arithmetic *a)
+{
+    long value = arithAdd(a);
+    while (!a->error)
+    {
+        if (arithAccept(a, "<<"))
+            value <<= arithAdd(a);
+        else if (arithAccept(a, ">>"))
+            value >>= arithAdd(a);
+        else
+            break;
+    }
+    return value;
+}
+
+static long arithCompare(struct arithmetic *a)
+{
+    long value = arithShift(a);
+    while (!a->error)
+    {
+        if (arithAccept(a, "<="))
+            value = value <= arithShift(a);
+        else if (arithAccept(a, ">="))
+            value = value >= arithShift(a);
+        else if (arithAccept(a, "<"))
+            value = value < arithShift(a);
+        else if (arithAccept(a, ">"))
+            value = value > arithShift(a);
+        else
+            break;
+    }
+    return value;
+}
+
+static long arithEquality(struct arithmetic *a)
+{
+    long value = arithCompare(a);
+    while (!a->error)
+    {
+        if (arithAccept(a, "=="))
+            value = value == arithCompare(a);
+        else if (arithAccept(a, "!="))
+            value = value != arithCompare(a);
+        else
+            break;
+    }
+    return value;
+}
+
+static long arithBitAnd(struct arithmetic *a)
+{
+    long value = arithEquality(a);
+    while (!a->error && arithAccept(a, "&"))
+        value &= arithEquality(a);
+    return value;
+}
+
+static long arithBitXor(struct arithmetic *a)
+{
+    long value = arithBitAnd(a);
+    while (!a->error && arithAccept(a, "^"))
+        value ^= arithBitAnd(a);
+    return value;
+}
+
+static long arithBitOr(struct arithmetic *a)
+{
+    long value = arithBitXor(a);
+    while (!a->error && arithAccept(a, "|"))
+        value |= arithBitXor(a);
+    return value;
+}
+
+// the right side of && and || is only parsed (a->skip) once the left side decides
+static long arithAnd(struct arithmetic *a)
+{
+    long value = arithBitOr(a);
+    while (!a->error && arithAccept(a, "&&"))
+    {
+        bool skip = a->skip;
+        a->skip = skip || !value;
+        long right = arithBitOr(a);
+        a->skip = skip;
+        value = value && right;
+    }
+    return value;
+}
+
+static long arithOr(struct arithmetic *a)
+{
+    long value = arithAnd(a);
+    while (!a->error && arithAccept(a, "||"))
+    {
+        bool skip = a->skip;
+        a->skip = skip || value;
+        long right = arithAnd(a);
+        a->skip = skip;
+        value = value || right;
+    }
+    return value;
+}
+
+static long arithTernary(struct arithmetic *a)
+{
+    long condition = arithOr(a);
+    if (a->error || !arithAccept(a, "?"))
+        return condition;
+    bool skip = a->skip;
+    a->skip = skip || !condition;
+    long yes = arithTernary(a);
+    if (!a->error && !arithAccept(a, ":"))
+        a->error = "arithmetic syntax error";
+    a->skip = skip || condition;
+    long no = a->error ? 0 : arithTernary(a);
+    a->skip = skip;
+    return condition ? yes : no;
+}
+
+/**
+ * Evaluate an arithmetic expression, printing what is wrong with it if it fails
+ * @return 0, or -1 on a syntax error or a division by 0 (value is then 0)
+ */
+int evalArithmetic(const char *expression, long *value)
+{
+    struct arithmetic a = {.p = expression};
+    *value = arithTernary(&a);
+    arithSkip(&a);
+    if (!a.error && *a.p)
+        a.error = "arithmetic syntax error";
+    if (!a.error)
+        return 0;
+    fprintf(stderr, "-%s: %s: %s\n", sysname, a.error, expression);
+    *value = 0;
+    return -1;
+}
+
+// ---- builtins that run inside the shell, without a fork ----
+
+static int builtinTrue(int argc, char **argv)
+{
+    (void)argc, (void)argv;
+    return 0;
+}
+
+static int builtinFalse(int argc, char **argv)
+{
+    (void)argc, (void)argv;
+    return 1;
+}
+
+static int builtinEcho(int argc, char **argv)
+{
+    bool newline = true, escapes = false;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] && strspn(argv[i] + 1, "ne") == strlen(argv[i] + 1); i++)
+    {
+        newline &= strchr(argv[i], 'n') == NULL;
+        escapes |= strchr(argv[i], 'e') != NULL;
+    }
+    for (; i < argc; i++)
+    {
+        if (!escapes)
+            outString(argv[i]);
+        else
+        {
+            for (const char *p = argv[i]; *p; p++)
+            {
+                if (*p != '\\' || !p[1])
+                {
+                    outChar(*p);
+                    continue;
+                }
+                switch (*++p)
+                {
+                case 'n':
+                    outChar('\n');
+                    break;
+                case 't':
+                    outChar('\t');
+                    break;
+                case '\\':
+                    outChar('\\');
+                    break;
+                case 'c': // no more output
+                    return 0;
+                default:
+                    outChar('\\');
+                    outChar(*p);
+                }
+            }
+        }
+        if (i + 1 < argc)
+            outChar(' ');
+    }
+    if (newline)
+        outChar('\n');
+    return 0;
+}
+
+static bool testUnary(const char *op, const char *arg)
+{
+    struct stat st;
+    if (op[1] != 'n' && op[1] != 'z') // looks at a file
+        rcImpure();
+    switch (op[1])
+    {
+    case 'n':
+        return arg[0] != 0;
+    case 'z':
+        return arg[0] == 0;
+    case 'e':
+        return stat(arg, &st) == 0;
+    case 'f':
+        return stat(arg, &st) == 0 && S_ISREG(st.st_mode);
+    case 'd':
+        return stat(arg, &st) == 0 && S_ISDIR(st.st_mode);
+    case 's':
+        return stat(arg, &st) == 0 && st.st_size > 0;
+    case 'L':
+    case 'h':
+        return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    case 'r':
+        return access(arg, R_OK) == 0;
+    case 'w':
+        return access(arg, W_OK) == 0;
+    case 'x':
+        return access(arg, X_OK) == 0;
+    }
+    return false;
+}
+
+// test with 1 to 3 arguments (and ! in front); -1 if the expression is not valid
+static int testExpression(int argc, char **argv)
+{
+    if (argc > 0 && strcmp(argv[0], "!") == 0)
+    {
+        int value = testExpression(argc - 1, argv + 1);
+        return value == -1 ? -1 : !value;
+    }
+    if (argc == 0)
+        return 0;
+    if (argc == 1)
+        return argv[0][0] != 0;
+    if (argc == 2 && argv[0][0] == '-' && strlen(argv[0]) == 2 && strchr("nzefdsLhrwx", argv[0][1]))
+        return testUnary(argv[0], argv[1]);
+    if (argc == 3)
+    {
+        const char *a = argv[0], *op = argv[1], *b = argv[2];
+        if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0)
+            return strcmp(a, b) == 0;
+        if (strcmp(op, "!=") == 0)
+            return strcmp(a, b) != 0;
+        static const char *numeric[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+        for (int i = 0; i < 6; i++)
+        {
+            if (strcmp(op, numeric[i]) != 0)
+                continue;
+            long x = strtol(a, NULL, 10), y = strtol(b, NULL, 10);
+            return i == 0 ? x == y : i == 1 ? x != y : i == 2 ? x < y : i == 3 ? x <= y : i == 4 ? x > y : x >= y;
+        }
+    }
+    for (int i = 1; i < argc - 1; i++) // expr -a expr, expr -o expr
+    {
+        if (strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "-a") == 0)
+        {
+            int left = testExpression(i, argv), right = testExpression(argc - i - 1, argv + i + 1);
+            if (left == -1 || right == -1)
+                return -1;
+            return argv[i][1] == 'o' ? left || right : left && right;
+        }
+    }
+    return -1;
+}
+
+static int builtinTest(int argc, char **argv)
+{
+    if (strcmp(argv[0], "[") == 0)
+    {
+        if (strcmp(argv[argc - 1], "]") != 0)
+        {
+            fprintf(stderr, "-%s: [: missing `]'\n", sysname);
+            return 2;
+        }
+        argc--;
+    }
+    int value = testExpression(argc - 1, argv + 1);
+    if (value == -1)
+    {
+        fprintf(stderr, "-%s: %s: bad expression\n", sysname, argv[0]);
+        return 2;
+    }
+    return !value;
+}
+
+static int builtinLoopControl(int argc, char **argv)
+{
+    int levels = argc > 1 ? atoi(argv[1]) : 1;
+    if (loopDepth == 0)
+    {
+        fprintf(stderr, "-%s: %s: only meaningful in a loop\n", sysname, argv[0]);
+        return 1;
+    }
+    if (levels < 1)
+        levels = 1;
+    if (levels > loopDepth)
+        levels = loopDepth;
+    if (argv[0][0] == 'b')
+        breakLevels = levels;
+    else
+        continueLevels = levels;
+    return 0;
+}
+
+static int builtinReturn(int argc, char **argv)
+{
+    returning = true;
+    return argc > 1 ? atoi(argv[1]) & 255 : lastStatus;
+}
+
+static int builtinExit(int argc, char **argv)
+{
+    exiting = true;
+    return argc > 1 ? atoi(argv[1]) & 255 : lastStatus;
+}
+
+static int builtinCd(int argc, char **argv)
+{
+    const char *dir = argc > 1 ? argv[1] : getenv("HOME");
+    if (dir && chdir(dir) == -1)
+    {
+        printf("-%s: %s: %s\n", sysname, argv[0], strerror(errno));
+        return 1;
+    }
+    if (dir)
+        zRecord();
+    return 0;
+}
+
+static int builtinExport(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        char *eq = strchr(argv[i], '=');
+        if (eq)
+        {
+            *eq = 0;
+            setVariable(argv[i], eq + 1, true);
+            *eq = '=';
+        }
+        else
+        {
+            const char *value = getVariable(argv[i]);
+            setVariable(argv[i], value ? value : "", true);
+        }
+    }
+    return 0;
+}
+
+static int builtinUnset(int argc, char **argv)
+{
+    bool function = argc > 1 && strcmp(argv[1], "-f") == 0;
+    for (int i = 1 + function; i < argc; i++)
+    {
+        if (!function)
+        {
+            unsetVariable(argv[i]);
+            continue;
+        }
+        struct shellFunction **link = &functions[variableBucket(argv[i], FUNCTION_BUCKETS)];
+        while (*link && strcmp((*link)->name, argv[i]) != 0)
+            link = &(*link)->next;
+        if (*link)
+        {
+            struct shellFunction *f = *link;
+            *link = f->next;
+            freeNode(f->body);
+            snapshotFree(f->name);
+            snapshotFree(f->definition);
+            snapshotFree(f);
+        }
+    }
+    return 0;
+}
+
+static int builtinShift(int argc, char **argv)
+{
+    int n = argc > 1 ? atoi(argv[1]) : 1;
+    if (n < 0 || n > positionalCount)
+        return 1;
+    positional += n;
+    positionalCount -= n;
+    return 0;
+}
+
+static int builtinLocal(int argc, char **argv)
+{
+    if (functionDepth == 0)
+    {
+        fprintf(stderr, "-%s: local: can only be used in a function\n", sysname);
+        return 1;
+    }
+    for (int i = 1; i < argc; i++)
+    {
+        char *eq = strchr(argv[i], '=');
+        if (eq)
+            *eq = 0;
+        // remember the old value, callFunction puts it back on return
+        const char *old = getVariable(argv[i]);
+        locals = realloc(locals, sizeof(struct savedVariable) * (localCount + 1));
+        locals[localCount].name = strdup(argv[i]);
+        locals[localCount].value = old ? strdup(old) : NULL;
+        localCount++;
+        setVariable(argv[i], eq ? eq + 1 : "", false);
+        if (eq)
+            *eq = '=';
+    }
+    return 0;
+}
+
+/**
+ * read [-r] [name...]: one line from stdin, split into the names (the last one
+ * takes the rest). Reads a byte at a time so the rest stays for the next reader.
+ */
+static int builtinRead(int argc, char **argv)
+{
+    bool raw = false;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++)
+        raw |= strcmp(argv[i], "-r") == 0;
+    size_t length = 0, capacity = 128;
+    char *line = malloc(capacity);
+    char c;
+    ssize_t n = 0;
+    outFlush();
+    while ((n = read(STDIN_FILENO, &c, 1)) == 1 && c != '\n')
+    {
+        if (c == '\\' && !raw)
+        {
+            if (read(STDIN_FILENO, &c, 1) != 1)
+                break;
+            if (c == '\n') // line continues
+                continue;
+        }
+        if (length + 2 > capacity)
+            line = realloc(line, capacity *= 2);
+        line[length++] = c;
+    }
+    line[length] = 0;
+
+    char *p = line;
+    if (i == argc)
+        setVariable("REPLY", line, false);
+    for (; i < argc; i++)
+    {
+        while (*p == ' ' || *p == '\t')
+            p++;
+        char *end = p;
+        if (i == argc - 1) // the rest of the line, without trailing blanks
+        {
+            end = p + strlen(p);
+            while (end > p && (end[-1] == ' ' || end[-1] == '\t'))
+                end--;
+        }
+        else
+            while (*end && *end != ' ' && *end != '\t')
+                end++;
+        char saved = *end;
+        *end = 0;
+        setVariable(argv[i], p, false);
+        *end = saved;
+        p = end;
+    }
+    free(line);
+    return n == 1 || length > 0 ? 0 : 1;
+}
+
+static int builtinEval(int argc, char **argv)
+{
+    size_t length = 0;
+    for (int i = 1; i < argc; i++)
+        length += strlen(argv[i]) + 1;
+    char *source = calloc(1, length + 1);
+    for (int i = 1; i < argc; i++)
+    {
+        strcat(source, argv[i]);
+        strcat(source, " ");
+    }
+    int status = runScript(source);
+    free(source);
+    return status;
+}
+
+static int builtinSource(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "-%s: %s: file name required\n", sysname, argv[0]);
+        return 2;
+    }
+    char *source = readScriptFile(argv[1]);
+    if (!source)
+    {
+        fprintf(stderr, "-%s: %s: %s\n", sysname, argv[1], strerror(errno));
+        return 1;
+    }
+    int status = runScript(source);
+    free(source);
+    return status;
+}
+
+struct alias *findAlias(const char *name)
+{
+    for (struct alias *a = aliases[variableBucket(name, ALIAS_BUCKETS)]; a; a = a->next)
+        if (strcmp(a->name, name) == 0)
+            return a;
+    return NULL;
+}
+
+void setAlias(const char *name, const char *value)
+{
+    struct alias *a = findAlias(name);
+    if (a == NULL)
+    {
+        unsigned bucket = variableBucket(name, ALIAS_BUCKETS);
+        a = calloc(1, sizeof(struct alias));
+        a->name = strdup(name);
+        a->next = aliases[bucket];
+        aliases[bucket] = a;
+    }
+    snapshotFree(a->value);
+    a->value = strdup(value);
+}
+
+bool removeAlias(const char *name)
+{
+    struct alias **link = &aliases[variableBucket(name, ALIAS_BUCKETS)];
+    while (*link && strcmp((*link)->name, name) != 0)
+        link = &(*link)->next;
+    if (*link == NULL)
+        return false;
+    struct alias *a = *link;
+    *link = a->next;
+    snapshotFree(a->name);
+    snapshotFree(a->value);
+    snapshotFree(a);
+    return true;
+}
+
+static int compareAliases(const void *a, const void *b)
+{
+    return strcmp((*(struct alias **)a)->name, (*(struct alias **)b)->name);
+}
+
+// print an alias so that it can be read back
+static void printAlias(struct alias *a)
+{
+    printf("alias %s='", a->name);
+    for (const char *p = a->value; *p; p++)
+    {
+        if (*p == '\'')
+            printf("'\\''");
+        else
+            putchar(*p);
+    }
+    printf("'\n");
+}
+
+static int builtinAlias(int argc, char **argv)
+{
+    if (argc == 1) // list them all, sorted
+    {
+        int count = 0;
+        for (int i = 0; i < ALIAS_BUCKETS; i++)
+            for (struct alias *a = aliases[i]; a; a = a->next)
+                count++;
+        struct alias **all = malloc(sizeof(struct alias *) * (count + 1));
+        count = 0;
+        for (int i = 0; i < ALIAS_BUCKETS; i++)
+            for (struct alias *a = aliases[i]; a; a = a->next)
+                all[count++] = a;
+        qsort(all, count, sizeof(struct alias *), compareAliases);
+        for (int i = 0; i < count; i++)
+            printAlias(all[i]);
+        free(all);
+        return 0;
+    }
+    int status = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        char *eq = strchr(argv[i], '=');
+        if (eq == NULL)
+        {
+            struct alias *a = findAlias(argv[i]);
+            if (a)
+                printAlias(a);
+            else
+            {
+                fprintf(stderr, "-%s: alias: %s: not found\n", sysname, argv[i]);
+                status = 1;
+            }
+            continue;
+        }
+        *eq = 0;
+        if (argv[i][0] == 0 || strpbrk(argv[i], " \t\n;&|()<>'\"\\$`/"))
+        {
+            fprintf(stderr, "-%s: alias: `%s': invalid alias name\n", sysname, argv[i]);
+            status = 1;
+        }
+        else
+            setAlias(argv[i], eq + 1);
+        *eq = '=';
+    }
+    return status;
+}
+
+static int builtinUnalias(int argc, char **argv)
+{
+    if (argc > 1 && strcmp(argv[1], "-a") == 0)
+    {
+        for (int i = 0; i < ALIAS_BUCKETS; i++)
+            while (aliases[i])
+                removeAlias(aliases[i]->name);
+        return 0;
+    }
+    int status = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!removeAlias(argv[i]))
+        {
+            fprintf(stderr, "-%s: unalias: %s: not found\n", sysname, argv[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+/**
+ * Resource limits for the commands the shell starts. ulimit does not limit
+ * the shell itself (ulimit -v or -t would bring it down): the limits are kept
+ * here and set in every child between fork and exec, see applyChildLimits.
+ */
+struct childLimit
+{
+    bool soft, hard; // set by ulimit, else inherited from the shell
+    struct rlimit limit;
+};
+
+struct childLimit childLimits[RLIM_NLIMITS];
+
+static const struct limitOption
+{
+    char option;
+    int resource;
+    const char *description;
+    const char *unit;
+    rlim_t scale; // ulimit values are in units, setrlimit takes bytes
+} limitOptions[] = {
+    {'c', RLIMIT_CORE, "core file size", "blocks", 512},
+    {'d', RLIMIT_DATA, "data seg size", "kbytes", 1024},
+    {'f', RLIMIT_FSIZE, "file size", "blocks", 512},
+    {'l', RLIMIT_MEMLOCK, "max locked memory", "kbytes", 1024},
+    {'m', RLIMIT_RSS, "max memory size", "kbytes", 1024},
+    {'n', RLIMIT_NOFILE, "open files", NULL, 1},
+    {'s', RLIMIT_STACK, "stack size", "kbytes", 1024},
+    {'t', RLIMIT_CPU, "cpu time", "seconds", 1},
+    {'u', RLIMIT_NPROC, "max user processes", NULL, 1},
+    {'v', RLIMIT_AS, "virtual memory", "kbytes", 1024},
+};
+
+#define LIMIT_OPTIONS (sizeof(limitOptions) / sizeof(limitOptions[0]))
+
+// the limit a command started now would get
+static struct rlimit childLimit(int resource)
+{
+    struct rlimit limit;
+    getrlimit(resource, &limit);
+    if (childLimits[resource].soft)
+        limit.rlim_cur = childLimits[resource].limit.rlim_cur;
+    if (childLimits[resource].hard)
+        limit.rlim_max = childLimits[resource].limit.rlim_max;
+    return limit;
+}
+
+// in the child, before exec: set the limits given to ulimit
+void applyChildLimits()
+{
+    for (size_t i = 0; i < LIMIT_OPTIONS; i++)
+    {
+        int resource = limitOptions[i].resource;
+        if (!childLimits[resource].soft && !childLimits[resource].hard)
+            continue;
+        struct rlimit limit = childLimit(resource);
+        if (setrlimit(resource, &limit) == -1)
+            fprintf(stderr, "-%s: ulimit: %s: %s\n", sysname, limitOptions[i].description, strerror(errno));
+    }
+}
+
+static void printLimit(const struct limitOption *o, rlim_t value, bool withName)
+{
+    if (withName)
+    {
+        char label[64];
+        if (o->unit)
+            snprintf(label, sizeof(label), "%s (%s, -%c)", o->description, o->unit, o->option);
+        else
+            snprintf(label, sizeof(label), "%s (-%c)", o->description, o->option);
+        printf("%-32s", label);
+    }
+    if (value == RLIM_INFINITY)
+        printf("unlimited\n");
+    else
+        printf("%llu\n", (unsigned long long)(value / o->scale));
+}
+
+/**
+ * ulimit [-SH] [-a | -cdflmnstuv] [value | unlimited | soft | hard]
+ * Without -S or -H a new value sets both limits, and the soft one is shown.
+ * Only the hard limit can not be raised, unless by root.
+ */
+static int builtinUlimit(int argc, char **argv)
+{
+    bool soft = false, hard = false, all = false;
+    const struct limitOption *selected[LIMIT_OPTIONS];
+    int selectedCount = 0, i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1]; i++)
+    {
+        for (const char *p = argv[i] + 1; *p; p++)
+        {
+            size_t k = 0;
+            while (k < LIMIT_OPTIONS && limitOptions[k].option != *p)
+                k++;
+            if (*p == 'S')
+                soft = true;
+            else if (*p == 'H')
+                hard = true;
+            else if (*p == 'a')
+                all = true;
+            else if (k < LIMIT_OPTIONS && selectedCount < (int)LIMIT_OPTIONS)
+                selected[selectedCount++] = &limitOptions[k];
+            else
+            {
+                fprintf(stderr, "-%s: ulimit: -%c: invalid option\n", sysname, *p);
+                return 2;
+            }
+        }
+    }
+    if (all)
+    {
+        for (size_t k = 0; k < LIMIT_OPTIONS; k++)
+        {
+            struct rlimit limit = childLimit(limitOptions[k].resource);
+            printLimit(&limitOptions[k], hard ? limit.rlim_max : limit.rlim_cur, true);
+        }
+        return 0;
+    }
+    if (selectedCount == 0)
+        selected[selectedCount++] = &limitOptions[2]; // -f
+    if (i == argc) // show them
+    {
+        for (int k = 0; k < selectedCount; k++)
+        {
+            struct rlimit limit = childLimit(selected[k]->resource);
+            printLimit(selected[k], hard ? limit.rlim_max : limit.rlim_cur, selectedCount > 1);
+        }
+        return 0;
+    }
+    if (!soft && !hard)
+        soft = hard = true;
+    for (int k = 0; k < selectedCount; k++)
+    {
+        const struct limitOption *o = selected[k];
+        struct rlimit now = childLimit(o->resource), shell;
+        getrlimit(o->resource, &shell);
+        rlim_t value;
+        char *end;
+        if (strcmp(argv[i], "unlimited") == 0)
+            value = RLIM_INFINITY;
+        else if (strcmp(argv[i], "hard") == 0)
+            value = now.rlim_max;
+        else if (strcmp(argv[i], "soft") == 0)
+            value = now.rlim_cur;
+        else
+        {
+            errno = 0;
+            unsigned long long number = strtoull(argv[i], &end, 10);
+            if (errno || end == argv[i] || *end || argv[i][0] == '-')
+            {
+                fprintf(stderr, "-%s: ulimit: %s: invalid number\n", sysname, argv[i]);
+                return 1;
+            }
+            value = number > RLIM_INFINITY / o->scale ? RLIM_INFINITY : number * o->scale;
+        }
+        struct rlimit limit = {soft ? value : now.rlim_cur, hard ? value : now.rlim_max};
+        int error = limit.rlim_max != RLIM_INFINITY && limit.rlim_cur > limit.rlim_max ? EINVAL
+                  : limit.rlim_max > shell.rlim_max && geteuid() != 0             ? EPERM
+                                                                                    : 0;
+        if (error == 0 && limit.rlim_max > shell.rlim_max) // root: the kernel may still say no, try it
+        {
+            if (setrlimit(o->resource, &limit) == -1)
+                error = errno;
+            else
+                setrlimit(o->resource, &shell);
+        }
+        if (error)
+        {
+            fprintf(stderr, "-%s: ulimit: %s: cannot modify limit: %s\n", sysname, o->description, strerror(error));
+            return 1;
+        }
+        childLimits[o->resource].limit = limit;
+        childLimits[o->resource].soft |= soft;
+        childLimits[o->resource].hard |= hard;
+    }
+    return 0;
+}
+
+/**
+ * Accounting: what every command the shell waited for used, from wait4. The
+ * last LEDGER_SIZE are kept, for jobs --stats and jobs --csv.
+ */
+struct usageRecord
+{
+    long id;
+    pid_t pid;
+    char *command;
+    int status;         // exit status as in $?
+    time_t started;     // wall clock
+    double seconds;     // elapsed
+    struct rusage usage; // of the command and the children it waited for
+};
+
+#define LEDGER_SIZE 1024
+
+struct
+{
+    struct usageRecord records[LEDGER_SIZE];
+    long count; // ever recorded; record n is at n % LEDGER_SIZE
+} ledger;
+
+void recordUsage(pid_t pid, const char *command, int wstatus, const struct rusage *usage,
+                 const struct timespec *started)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    struct usageRecord *r = &ledger.records[ledger.count % LEDGER_SIZE];
+    free(r->command);
+    r->id = ++ledger.count;
+    r->pid = pid;
+    r->command = strdup(command);
+    r->status = exitStatus(wstatus);
+    r->seconds = (now.tv_sec - started->tv_sec) + (now.tv_nsec - started->tv_nsec) / 1e9;
+    r->started = time(NULL) - (time_t)r->seconds;
+    r->usage = *usage;
+}
+
+static double timevalSeconds(struct timeval t)
+{
+    return t.tv_sec + t.tv_usec / 1e6;
+}
+
+// jobs --stats [N]: the last N (all kept) commands and what they used
+static void printLedger(long last)
+{
+    long first = ledger.count - (ledger.count < LEDGER_SIZE ? ledger.count : LEDGER_SIZE);
+    if (last > 0 && ledger.count - last > first)
+        first = ledger.count - last;
+    printf("%6s %8s %6s %9s %9s %9s %10s %8s %8s %8s %8s  %s\n", "ID", "PID", "STATUS", "REAL", "USER", "SYS",
+           "MAXRSS", "INBLK", "OUTBLK", "VCSW", "IVCSW", "COMMAND");
+    for (long n = first; n < ledger.count; n++)
+    {
+        struct usageRecord *r = &ledger.records[n % LEDGER_SIZE];
+        printf("%6ld %8d %6d %9.3f %9.3f %9.3f %8ldkB %8ld %8ld %8ld %8ld  %s\n", r->id, r->pid, r->status,
+               r->seconds, timevalSeconds(r->usage.ru_utime), timevalSeconds(r->usage.ru_stime), r->usage.ru_maxrss,
+               r->usage.ru_inblock, r->usage.ru_oublock, r->usage.ru_nvcsw, r->usage.ru_nivcsw, r->command);
+    }
+}
+
+// jobs --csv [FILE]: the ledger as CSV, for a spreadsheet
+static int exportLedger(const char *fileName)
+{
+    FILE *out = fileName && strcmp(fileName, "-") != 0 ? fopen(fileName, "w") : stdout;
+    if (out == NULL)
+    {
+        fprintf(stderr, "-%s: jobs: %s: %s\n", sysname, fileName, strerror(errno));
+        return 1;
+    }
+    fprintf(out, "id,pid,started,status,real_s,user_s,sys_s,maxrss_kb,inblock,oublock,nvcsw,nivcsw,command\n");
+    long first = ledger.count - (ledger.count < LEDGER_SIZE ? ledger.count : LEDGER_SIZE);
+    for (long n = first; n < ledger.count; n++)
+    {
+        struct usageRecord *r = &ledger.records[n % LEDGER_SIZE];
+        char started[32];
+        strftime(started, sizeof(started), "%Y-%m-%dT%H:%M:%S", localtime(&r->started));
+        fprintf(out, "%ld,%d,%s,%d,%.6f,%.6f,%.6f,%ld,%ld,%ld,%ld,%ld,\"", r->id, r->pid, started, r->status,
+                r->seconds, timevalSeconds(r->usage.ru_utime), timevalSeconds(r->usage.ru_stime), r->usage.ru_maxrss,
+                r->usage.ru_inblock, r->usage.ru_oublock, r->usage.ru_nvcsw, r->usage.ru_nivcsw);
+        for (const char *p = r->command; *p; p++)
+        {
+            if (*p == '"') // quotes in a quoted field are doubled
+                putc('"', out);
+            putc(*p, out);
+        }
+        fprintf(out, "\"\n");
+    }
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
+
+// a background command, %id
+struct shellJob
+{
+    int id;
+    int slot; // in the supervisor
+    pid_t pid;
+    char *command;
+};
+
+struct shellJob *shellJobs;
+int shellJobCount, shellJobCapacity;
+
+/**
+ * Add a background child to the job table
+ * @return its job number
+ */
+int addJob(pid_t pid, const char *command)
+{
+    int slot = superviseChild(pid);
+    if (slot == -1)
+        return -1;
+    int id = shellJobCount > 0 ? shellJobs[shellJobCount - 1].id + 1 : 1;
+    if (shellJobCount == shellJobCapacity)
+        shellJobs = realloc(shellJobs, sizeof(struct shellJob) * (shellJobCapacity = shellJobCapacity * 2 + 16));
+    shellJobs[shellJobCount++] = (struct shellJob){id, slot, pid, strdup(command)};
+    if (interactive)
+        fprintf(stderr, "[%d] %d\n", id, pid);
+    return id;
+}
+
+static void removeJob(int index)
+{
+    struct supervisedChild *c = &supervisor.children[shellJobs[index].slot];
+    recordUsage(c->pid, shellJobs[index].command, c->status, &c->usage, &c->started);
+    releaseChild(shellJobs[index].slot);
+    free(shellJobs[index].command);
+    memmove(&shellJobs[index], &shellJobs[index + 1], sizeof(struct shellJob) * (shellJobCount - index - 1));
+    shellJobCount--;
+}
+
+// in a forked child: the jobs are the parent's
+void forgetJobs()
+{
+    for (int i = 0; i < shellJobCount; i++)
+        free(shellJobs[i].command);
+    shellJobCount = 0;
+}
+
+// the command line of a background command, for the job table
+char *describeCommand(struct command_t *command)
+{
+    size_t length = 1;
+    for (struct command_t *c = command; c; c = c->next)
+    {
+        length += strlen(c->name) + 3;
+        for (int i = 0; i < c->arg_count; i++)
+            length += strlen(c->args[i]) + 1;
+    }
+    char *text = malloc(length), *p = text;
+    for (struct command_t *c = command; c; c = c->next)
+    {
+        p += sprintf(p, "%s%s", c == command ? "" : " | ", c->name);
+        for (int i = 0; i < c->arg_count; i++)
+            p += sprintf(p, " %s", c->args[i]);
+    }
+    *p = 0;
+    return text;
+}
+
+static void printJob(struct shellJob *job, bool withPid)
+{
+    struct supervisedChild *c = &supervisor.children[job->slot];
+    char state[32];
+    if (!c->exited)
+        strcpy(state, "Running");
+    else if (WIFEXITED(c->status) && WEXITSTATUS(c->status) == 0)
+        strcpy(state, "Done");
+    else if (WIFEXITED(c->status))
+        snprintf(state, sizeof(state), "Exit %d", WEXITSTATUS(c->status));
+    else
+        snprintf(state, sizeof(state), "%s", strsignal(WTERMSIG(c->status)));
+    if (withPid)
+        printf("[%d]  %d %-22s %s\n", job->id, job->pid, state, job->command);
+    else
+        printf("[%d]  %-22s %s\n", job->id, state, job->command);
+}
+
+// before a prompt: tell which background jobs ended, and forget them
+void reportJobs()
+{
+    if (shellJobCount == 0)
+        return;
+    supervisorWait(0, NULL, 0);
+    for (int i = 0; i < shellJobCount;)
+    {
+        if (supervisor.children[shellJobs[i].slot].exited)
+        {
+            printJob(&shellJobs[i], false);
+            removeJob(i);
+        }
+        else
+            i++;
+    }
+}
+
+// %N, %% / %+ (the last one), or a pid; -1 if there is no such job
+static int findJob(const char *spec)
+{
+    if (strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0 || strcmp(spec, "%") == 0)
+        return shellJobCount - 1;
+    int number = atoi(spec + (spec[0] == '%'));
+    for (int i = 0; i < shellJobCount; i++)
+        if (spec[0] == '%' ? shellJobs[i].id == number : shellJobs[i].pid == number)
+            return i;
+    return -1;
+}
+
+// wait for the job at index, take it out of the table, return its exit status
+static int collectJob(int index)
+{
+    int slot = shellJobs[index].slot;
+    if (superviseUntilExit(slot) == -1)
+        return 127;
+    int status = exitStatus(supervisor.children[slot].status);
+    removeJob(index);
+    return status;
+}
+
+/**
+ * wait: for all background jobs; wait -n: for the next one to end;
+ * wait %N or PID: for that one. Returns the exit status of the (last) job
+ * waited for by name, 0 for all of them.
+ */
+static int builtinWait(int argc, char **argv)
+{
+    outFlush();
+    if (argc > 1 && strcmp(argv[1], "-n") == 0)
+    {
+        if (shellJobCount == 0)
+            return 127;
+        while (1)
+        {
+            int first = -1; // the earliest to end, of those that did
+            for (int i = 0; i < shellJobCount; i++)
+            {
+                struct supervisedChild *c = &supervisor.children[shellJobs[i].slot];
+                if (c->exited && (first == -1 || c->order < supervisor.children[shellJobs[first].slot].order))
+                    first = i;
+            }
+            if (first != -1)
+                return collectJob(first);
+            if (supervisorWait(-1, NULL, 0) == -1)
+                return 127;
+        }
+    }
+    if (argc == 1) // newest first, so no job is moved down the table
+    {
+        while (shellJobCount > 0)
+            collectJob(shellJobCount - 1);
+        return 0;
+    }
+    int status = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        int index = findJob(argv[i]);
+        if (index == -1)
+        {
+            fprintf(stderr, "-%s: wait: %s: no such job\n", sysname, argv[i]);
+            status = 127;
+            continue;
+        }
+        status = collectJob(index);
+    }
+    return status;
+}
+
+/**
+ * jobs [-l]: the background jobs and their state
+ * jobs [-l] --stats [N]: what the last N commands used; jobs --csv [FILE]: all of it as CSV
+ */
+static int builtinJobs(int argc, char **argv)
+{
+    bool withPid = false;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-l") == 0)
+            withPid = true;
+        else if (strcmp(argv[i], "--stats") == 0)
+        {
+            printLedger(i + 1 < argc ? atol(argv[i + 1]) : 0);
+            return 0;
+        }
+        else if (strcmp(argv[i], "--csv") == 0)
+            return exportLedger(i + 1 < argc ? argv[i + 1] : NULL);
+        else
+        {
+            fprintf(stderr, "usage: jobs [-l] [--stats [N] | --csv [FILE]]\n");
+            return 2;
+        }
+    }
+    supervisorWait(0, NULL, 0);
+    for (int i = 0; i < shellJobCount;)
+    {
+        printJob(&shellJobs[i], withPid);
+        if (supervisor.children[shellJobs[i].slot].exited) // reported now, like at the prompt
+            removeJob(i);
+        else
+            i++;
+    }
+    return 0;
+}
+
+// the words of a command, back in one line
+static char *joinArguments(int argc, char **argv)
+{
+    size_t length = 1;
+    for (int i = 0; i < argc; i++)
+        length += strlen(argv[i]) + 1;
+    char *text = malloc(length), *p = text;
+    *p = 0;
+    for (int i = 0; i < argc; i++)
+        p += sprintf(p, "%s%s", i ? " " : "", argv[i]);
+    return text;
+}
+
+// 1.5, 10s, 200ms, 2m, 1h, 1d to milliseconds; -1 if it is not a duration
+long parseDuration(const char *text)
+{
+    char *end;
+    double value = strtod(text, &end);
+    if (end == text || value < 0)
+        return -1;
+    double scale = strcmp(end, "") == 0 || strcmp(end, "s") == 0 ? 1000
+                 : strcmp(end, "ms") == 0                        ? 1
+                 : strcmp(end, "m") == 0                         ? 60000
+                 : strcmp(end, "h") == 0                         ? 3600000
+                 : strcmp(end, "d") == 0                         ? 86400000
+                                                                 : -1;
+    return scale < 0 ? -1 : (long)(value * scale + 0.5);
+}
+
+static int parseSignal(const char *text)
+{
+    if (text[0] >= '0' && text[0] <= '9')
+        return atoi(text);
+    if (strncmp(text, "SIG", 3) == 0)
+        text += 3;
+    static const struct
+    {
+        const char *name;
+        int number;
+    } signals[] = {{"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"KILL", SIGKILL}, {"USR1", SIGUSR1},
+                   {"USR2", SIGUSR2}, {"ALRM", SIGALRM}, {"TERM", SIGTERM}, {"CONT", SIGCONT}, {"STOP", SIGSTOP}};
+    for (size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); i++)
+        if (strcmp(text, signals[i].name) == 0)
+            return signals[i].number;
+    return -1;
+}
+
+/**
+ * timeout [-s SIGNAL] [-k GRACE] DURATION command [args]
+ * Runs the command in its own process group. At the deadline the group gets
+ * SIGNAL (TERM), and KILL GRACE later (2s, -k 0: never). Returns 124 if the
+ * deadline passed, 137 if it had to be killed, else the command's status.
+ */
+static int builtinTimeout(int argc, char **argv)
+{
+    int signal = SIGTERM, i = 1;
+    long graceMs = 2000;
+    for (; i < argc - 1 && argv[i][0] == '-'; i += 2)
+    {
+        if (strcmp(argv[i], "-s") == 0 && (signal = parseSignal(argv[i + 1])) > 0)
+            continue;
+        if (strcmp(argv[i], "-k") == 0 && (graceMs = parseDuration(argv[i + 1])) >= 0)
+            continue;
+        fprintf(stderr, "-%s: timeout: invalid option or value: %s %s\n", sysname, argv[i], argv[i + 1]);
+        return 125;
+    }
+    if (i + 1 >= argc)
+    {
+        fprintf(stderr, "usage: timeout [-s SIGNAL] [-k GRACE] DURATION command [args]\n");
+        return 125;
+    }
+    long ms = parseDuration(argv[i]);
+    if (ms < 0)
+    {
+        fprintf(stderr, "-%s: timeout: invalid duration: %s\n", sysname, argv[i]);
+        return 125;
+    }
+
+    outFlush();
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        setpgid(0, 0); // so the whole pipeline or script it starts gets the signal
+        struct command_t *command = calloc(1, sizeof(struct command_t));
+        command->name = strdup(argv[i + 1]);
+        command->arg_count = argc - i - 2;
+        command->args = malloc(sizeof(char *) * (command->arg_count + 1));
+        for (int k = 0; k < command->arg_count; k++)
+            command->args[k] = strdup(argv[i + 2 + k]);
+        runCommand(command);
+        exit(127);
+    }
+    if (pid == -1)
+    {
+        fprintf(stderr, "-%s: timeout: %s\n", sysname, strerror(errno));
+        return 125;
+    }
+    setpgid(pid, pid);
+    int slot = superviseChild(pid);
+    if (slot == -1 || superviseDeadline(slot, ms, signal, graceMs) == -1)
+    {
+        fprintf(stderr, "-%s: timeout: %s\n", sysname, strerror(errno));
+        if (slot != -1)
+            releaseChild(slot);
+        return 125;
+    }
+    superviseUntilExit(slot);
+    struct supervisedChild *c = &supervisor.children[slot];
+    char *text = joinArguments(argc - i - 1, argv + i + 1);
+    recordUsage(pid, text, c->status, &c->usage, &c->started);
+    free(text);
+    bool killed = c->killed || (c->timedOut && signal == SIGKILL);
+    int status = killed ? 128 + SIGKILL : c->timedOut ? 124 : exitStatus(c->status);
+    releaseChild(slot);
+    return status;
+}
+
+/**
+ * Placement of the commands the shell starts: which CPUs, nice value and
+ * scheduling policy. Like the ulimit limits it is set in the child, before
+ * exec, in every stage of a pipeline. With spread, the stages of a pipeline
+ * go to different L2 cache domains, so they don't evict each other's data.
+ */
+struct placement
+{
+    bool hasCpus, hasNice, hasPolicy, spread;
+    cpu_set_t cpus;
+    int nice;   // absolute, so applying it twice changes nothing
+    int policy; // SCHED_OTHER, SCHED_BATCH or SCHED_IDLE
+};
+
+struct placement placement; // set by pin without a command
+cpu_set_t placementGroups[64]; // for spread, see preparePlacement
+int placementGroupCount;
+
+// "0-3,8,10-11" or "all"; -1 if it is not a CPU list
+static int parseCpuList(const char *text, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    if (strcmp(text, "all") == 0)
+    {
+        for (long i = 0, n = sysconf(_SC_NPROCESSORS_CONF); i < n && i < CPU_SETSIZE; i++)
+            CPU_SET(i, set);
+        return 0;
+    }
+    const char *p = text;
+    while (*p)
+    {
+        char *end;
+        long first = strtol(p, &end, 10), last = first;
+        if (end == p || first < 0)
+            return -1;
+        if (*end == '-')
+        {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first)
+                return -1;
+        }
+        if (*end != ',' && *end != 0)
+            return -1;
+        for (long i = first; i <= last && i < CPU_SETSIZE; i++)
+            CPU_SET(i, set);
+        p = *end ? end + 1 : end;
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+static void printCpuList(const cpu_set_t *set)
+{
+    bool first = true;
+    for (int i = 0; i < CPU_SETSIZE; i++)
+    {
+        if (!CPU_ISSET(i, set))
+            continue;
+        int last = i;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set))
+            last++;
+        printf(last > i ? "%s%d-%d" : "%s%d", first ? "" : ",", i, last);
+        first = false;
+        i = last;
+    }
+}
+
+/**
+ * The CPUs of set grouped by the L2 cache they share, from sysfs. Without
+ * sysfs, or when they all share one L2, every CPU is a group of its own.
+ * @return number of groups
+ */
+static int l2Groups(const cpu_set_t *set, cpu_set_t *groups, int max)
+{
+    int count = 0;
+    cpu_set_t seen;
+    CPU_ZERO(&seen);
+    for (int cpu = 0; cpu < CPU_SETSIZE && count < max; cpu++)
+    {
+        if (!CPU_ISSET(cpu, set) || CPU_ISSET(cpu, &seen))
+            continue;
+        cpu_set_t shared;
+        CPU_ZERO(&shared);
+        CPU_SET(cpu, &shared);
+        for (int index = 0; index < 8; index++)
+        {
+            char path[128], text[256];
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, index);
+            FILE *f = fopen(path, "r");
+            if (f == NULL)
+                break;
+            int level = 0;
+            if (fscanf(f, "%d", &level) != 1)
+                level = 0;
+            fclose(f);
+            if (level != 2)
+                continue;
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", cpu, index);
+            f = fopen(path, "r");
+            if (f && fgets(text, sizeof(text), f))
+            {
+                text[strcspn(text, "\n")] = 0;
+                if (parseCpuList(text, &shared) == 0)
+                    CPU_SET(cpu, &shared);
+            }
+            if (f)
+                fclose(f);
+            break;
+        }
+        CPU_AND(&groups[count], &shared, set);
+        CPU_OR(&seen, &seen, &groups[count]);
+        count++;
+    }
+    if (count == 1 && CPU_COUNT(set) > 1) // one L2 for all: spread over the CPUs
+    {
+        count = 0;
+        for (int cpu = 0; cpu < CPU_SETSIZE && count < max; cpu++)
+        {
+            if (!CPU_ISSET(cpu, set))
+                continue;
+            CPU_ZERO(&groups[count]);
+            CPU_SET(cpu, &groups[count++]);
+        }
+    }
+    return count;
+}
+
+// before forking the stages of a pipeline: find the L2 groups once for all of them
+void preparePlacement()
+{
+    if (!placement.spread || placementGroupCount > 0)
+        return;
+    cpu_set_t cpus;
+    if (placement.hasCpus)
+        cpus = placement.cpus;
+    else
+        sched_getaffinity(0, sizeof(cpus), &cpus);
+    placementGroupCount = l2Groups(&cpus, placementGroups, 64);
+}
+
+// in the child, before exec: go where placement (or pin) says
+void applyPlacement()
+{
+    const struct placement *p = &placement;
+    if (p->hasCpus || (p->spread && pipelineStages > 1))
+    {
+        cpu_set_t cpus;
+        if (p->hasCpus)
+            cpus = p->cpus;
+        else
+            sched_getaffinity(0, sizeof(cpus), &cpus);
+        if (p->spread && pipelineStages > 1)
+        {
+            preparePlacement();
+            if (placementGroupCount > 0)
+                cpus = placementGroups[pipelineStage % placementGroupCount];
+        }
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) == -1)
+            fprintf(stderr, "-%s: pin: %s\n", sysname, strerror(errno));
+    }
+    if (p->hasPolicy)
+    {
+        struct sched_param parameter = {0};
+        if (sched_setscheduler(0, p->policy, &parameter) == -1)
+            fprintf(stderr, "-%s: pin: %s\n", sysname, strerror(errno));
+    }
+    if (p->hasNice && setpriority(PRIO_PROCESS, 0, p->nice) == -1)
+        fprintf(stderr, "-%s: pin: nice: %s\n", sysname, strerror(errno));
+}
+
+static void printPlacement()
+{
+    const struct placement *p = &placement;
+    if (!p->hasCpus && !p->hasNice && !p->hasPolicy && !p->spread)
+    {
+        printf("pin: off\n");
+        return;
+    }
+    printf("pin:");
+    if (p->hasCpus)
+    {
+        printf(" cpus ");
+        printCpuList(&p->cpus);
+    }
+    if (p->hasNice)
+        printf(" nice %d", p->nice);
+    if (p->hasPolicy)
+        printf(" policy %s", p->policy == SCHED_BATCH ? "batch" : p->policy == SCHED_IDLE ? "idle" : "other");
+    if (p->spread)
+        printf(" spread");
+    printf("\n");
+}
+
+/**
+ * pin [-n NICE] [-p batch|idle|other] [--spread] [CPUS] [command [args]]
+ * With a command: run it with that placement, e.g. as one pipeline stage,
+ *   zcat log.gz | pin 2-3 -p batch parse | sort
+ * Without: every stage of the commands after it gets it; pin off undoes it,
+ * pin alone shows it. NICE is relative to the shell's, like nice(1).
+ */
+static int builtinPin(int argc, char **argv)
+{
+    if (argc == 1)
+    {
+        printPlacement();
+        return 0;
+    }
+    if (argc == 2 && strcmp(argv[1], "off") == 0)
+    {
+        memset(&placement, 0, sizeof(placement));
+        placementGroupCount = 0;
+        return 0;
+    }
+    struct placement p;
+    memset(&p, 0, sizeof(p));
+    int i = 1;
+    for (; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--spread") == 0)
+            p.spread = true;
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+        {
+            p.nice = getpriority(PRIO_PROCESS, 0) + atoi(argv[++i]);
+            p.nice = p.nice < -20 ? -20 : p.nice > 19 ? 19 : p.nice;
+            p.hasNice = true;
+        }
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+        {
+            i++;
+            p.hasPolicy = true;
+            if (strcmp(argv[i], "batch") == 0)
+                p.policy = SCHED_BATCH;
+            else if (strcmp(argv[i], "idle") == 0)
+                p.policy = SCHED_IDLE;
+            else if (strcmp(argv[i], "other") == 0)
+                p.policy = SCHED_OTHER;
+            else
+            {
+                fprintf(stderr, "-%s: pin: %s: not a policy (batch, idle or other)\n", sysname, argv[i]);
+                return 2;
+            }
+        }
+        else if (!p.hasCpus && parseCpuList(argv[i], &p.cpus) == 0)
+            p.hasCpus = true;
+        else if (argv[i][0] == '-')
+        {
+            fprintf(stderr, "usage: pin [-n NICE] [-p batch|idle|other] [--spread] [CPUS] [command [args]]\n");
+            return 2;
+        }
+        else
+            break;
+    }
+    if (p.hasCpus)
+    {
+        cpu_set_t online; // CPUs this shell can't use would fail in every child
+        sched_getaffinity(0, sizeof(online), &online);
+        CPU_AND(&online, &online, &p.cpus);
+        if (CPU_COUNT(&online) == 0)
+        {
+            fprintf(stderr, "-%s: pin: none of those CPUs is available\n", sysname);
+            return 1;
+        }
+    }
+    if (i == argc)
+    {
+        placement = p;
+        placementGroupCount = 0;
+        return 0;
+    }
+
+    outFlush();
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        if (p.hasCpus) // runCommand applies it, on top of what pin without a command set
+            placement.hasCpus = true, placement.cpus = p.cpus;
+        if (p.hasNice)
+            placement.hasNice = true, placement.nice = p.nice;
+        if (p.hasPolicy)
+            placement.hasPolicy = true, placement.policy = p.policy;
+        pipelineStages = 1;
+        struct command_t *command = calloc(1, sizeof(struct command_t));
+        command->name = strdup(argv[i]);
+        command->arg_count = argc - i - 1;
+        command->args = malloc(sizeof(char *) * (command->arg_count + 1));
+        for (int k = 0; k < command->arg_count; k++)
+            command->args[k] = strdup(argv[i + 1 + k]);
+        runCommand(command);
+        exit(127);
+    }
+    if (pid == -1)
+    {
+        fprintf(stderr, "-%s: pin: %s\n", sysname, strerror(errno));
+        return 1;
+    }
+    int slot = superviseChild(pid);
+    if (slot == -1)
+        return 1;
+    superviseUntilExit(slot);
+    struct supervisedChild *c = &supervisor.children[slot];
+    char *text = joinArguments(argc - i, argv + i);
+    recordUsage(pid, text, c->status, &c->usage, &c->started);
+    free(text);
+    int status = exitStatus(c->status);
+    releaseChild(slot);
+    return status;
+}
+
+// ---- highlighting the line being typed ----
+
+/**
+ * Names of the commands in PATH, so the highlighter can tell whether a
+ * command exists without looking at the disk while a key is handled. Made
+ * on first use, and again after PATH or one of its directories changed:
+ * that is checked once per prompt, not per key.
+ */
+struct pathIndex
+{
+    char *path;               // the PATH it was made from, NULL if not made yet
+    char **names;             // open addressing
+    size_t capacity, count;
+    char **dirs;
+    struct timespec *modified; // of each directory when it was read
+    int dirCount;
+} pathIndex;
+
+static inline uint64_t hashName(const char *name, size_t length)
+{
+    uint64_t h = 1469598103934665603ULL; // FNV-1a
+    for (size_t i = 0; i < length; i++)
+        h = (h ^ (unsigned char)name[i]) * 1099511628211ULL;
+    return h;
+}
+
+static void pathIndexAdd(const char *name)
+{
+    if ((pathIndex.count + 1) * 2 > pathIndex.capacity)
+    {
+        size_t oldCapacity = pathIndex.capacity;
+        char **old = pathIndex.names;
+        pathIndex.capacity = oldCapacity ? oldCapacity * 2 : 4096;
+        pathIndex.names = calloc(pathIndex.capacity, sizeof(char *));
+        pathIndex.count = 0;
+        for (size_t i = 0; i < oldCapacity; i++)
+        {
+            if (old[i] == NULL)
+                continue;
+            size_t slot = hashName(old[i], strlen(old[i])) & (pathIndex.capacity - 1);
+            while (pathIndex.names[slot])
+                slot = (slot + 1) & (pathIndex.capacity - 1);
+            pathIndex.names[slot] = old[i];
+            pathIndex.count++;
+        }
+        free(old);
+    }
+    size_t slot = hashName(name, strlen(name)) & (pathIndex.capacity - 1);
+    for (; pathIndex.names[slot]; slot = (slot + 1) & (pathIndex.capacity - 1))
+        if (strcmp(pathIndex.names[slot], name) == 0)
+            return;
+    pathIndex.names[slot] = strdup(name);
+    pathIndex.count++;
+}
+
+static void pathIndexFree()
+{
+    for (size_t i = 0; i < pathIndex.capacity; i++)
+        free(pathIndex.names[i]);
+    for (int i = 0; i < pathIndex.dirCount; i++)
+        free(pathIndex.dirs[i]);
+    free(pathIndex.names);
+    free(pathIndex.dirs);
+    free(pathIndex.modified);
+    free(pathIndex.path);
+    memset(&pathIndex, 0, sizeof(pathIndex));
+}
+
+static void pathIndexBuild()
+{
+    pathIndexFree();
+    const char *path = getenv("PATH");
+    pathIndex.path = strdup(path ? path : "");
+    char *copy = strdup(pathIndex.path), *save = NULL;
+    for (char *dir = strtok_r(copy, ":", &save); dir; dir = strtok_r(NULL, ":", &save))
+    {
+        struct stat st;
+        DIR *d = opendir(dir);
+        if (d == NULL || fstat(dirfd(d), &st) == -1)
+        {
+            if (d)
+                closedir(d);
+            continue;
+        }
+        pathIndex.dirs = realloc(pathIndex.dirs, sizeof(char *) * (pathIndex.dirCount + 1));
+        pathIndex.modified = realloc(pathIndex.modified, sizeof(struct timespec) * (pathIndex.dirCount + 1));
+        pathIndex.dirs[pathIndex.dirCount] = strdup(dir);
+        pathIndex.modified[pathIndex.dirCount++] = st.st_mtim;
+        struct dirent *entry;
+        while ((entry = readdir(d)) != NULL)
+            if (entry->d_name[0] != '.' && entry->d_type != DT_DIR)
+                pathIndexAdd(entry->d_name);
+        closedir(d);
+    }
+    free(copy);
+    if (pathIndex.capacity == 0)
+        pathIndexAdd(""); // so that it counts as made
+}
+
+// once per prompt, not per key: if PATH or what is in its directories changed, make it again
+static void pathIndexCheck()
+{
+    const char *path = getenv("PATH");
+    if (pathIndex.path == NULL)
+    {
+        pathIndexBuild();
+        return;
+    }
+    bool stale = strcmp(pathIndex.path, path ? path : "") != 0;
+    for (int i = 0; i < pathIndex.dirCount && !stale; i++)
+    {
+        struct stat st;
+        stale = stat(pathIndex.dirs[i], &st) == -1 || st.st_mtim.tv_sec != pathIndex.modified[i].tv_sec ||
+                st.st_mtim.tv_nsec != pathIndex.modified[i].tv_nsec;
+    }
+    if (stale)
+        pathIndexBuild();
+}
+
+static bool pathIndexFind(const char *name, size_t length)
+{
+    if (pathIndex.path == NULL)
+        pathIndexBuild();
+    size_t slot = hashName(name, length) & (pathIndex.capacity - 1);
+    for (; pathIndex.names[slot]; slot = (slot + 1) & (pathIndex.capacity - 1))
+        if (strncmp(pathIndex.names[slot], name, length) == 0 && pathIndex.names[slot][length] == 0)
+            return true;
+    return false;
+}
+
+enum highlightClass
+{
+    HIGHLIGHT_PLAIN,
+    HIGHLIGHT_BUILTIN, // builtins, functions, aliases and keywords
+    HIGHLIGHT_COMMAND, // found in PATH
+    HIGHLIGHT_MISSING, // no such command (yet)
+    HIGHLIGHT_STRING,
+    HIGHLIGHT_OPERATOR, // | ; & ( ) and redirections
+    HIGHLIGHT_VARIABLE,
+    HIGHLIGHT_COMMENT,
+    HIGHLIGHT_WORD, // part of a command name, its class depends on the whole name
+};
+
+static const char *highlightColors[] = {"\033[0m", "\033[1;36m", "\033[32m", "\033[31m", "\033[33m",
+                                        "\033[35m", "\033[34m", "\033[90m"};
+
+#define HIGHLIGHT_MAX 4096
+
+// the tokenizer between two characters of the line
+struct lexState
+{
+    char quote; // ', " or ` that is open
+    bool escaped, comment, variable;
+    bool inWord, commandWord; // in a word, and it names a command
+    bool commandNext;         // a word starting here names a command
+    bool redirectNext;        // a word starting here is a file to redirect to
+    int wordStart;
+};
+
+struct
+{
+    bool off;                             // highlight off
+    bool active;                          // for the line being typed
+    struct lexState states[HIGHLIGHT_MAX + 1]; // states[i]: before character i
+    unsigned char classes[HIGHLIGHT_MAX]; // as drawn
+    unsigned char drawn;                  // color the terminal is in
+    long budgetNs;                        // a key taking longer turns highlighting off for the line
+    bool measureOnly;                     // highlight --bench: count the keys over budget, don't turn off
+    // instrumentation: time spent per key
+    long keys, overBudget, totalNs, maxNs;
+    long histogram[6]; // < 10us, < 50us, < 100us, < 500us, < 1ms, more
+} highlight = {.budgetNs = 1000000};
+
+static const char *shellKeywords[] = {"if", "then", "else", "elif", "fi", "while", "until", "do", "done",
+                                      "for", "in", "case", "esac", "{", "}", "!", NULL};
+static const char *shellCommands[] = {"cd", "exit", "word", "guessGame", "chatroom", "wiseman", "parallel", NULL};
+
+static bool inList(const char **list, const char *word, size_t length)
+{
+    for (int i = 0; list[i]; i++)
+        if (strncmp(list[i], word, length) == 0 && list[i][length] == 0)
+            return true;
+    return false;
+}
+
+// what a command name is: builtin, function, alias, in PATH, or nothing
+static unsigned char classifyCommand(const char *word, size_t length)
+{
+    char name[256];
+    if (length == 0 || length >= sizeof(name))
+        return HIGHLIGHT_MISSING;
+    memcpy(name, word, length);
+    name[length] = 0;
+    if (inList(shellKeywords, name, length) || inList(shellCommands, name, length) || findShellBuiltin(name) ||
+        findFunction(name) || findAlias(name))
+        return HIGHLIGHT_BUILTIN;
+    struct command_t probe;
+    memset(&probe, 0, sizeof(probe));
+    probe.name = name;
+    if (findTextBuiltin(&probe))
+        return HIGHLIGHT_BUILTIN;
+    if (strchr(name, '/'))
+        return access(name, X_OK) == 0 ? HIGHLIGHT_COMMAND : HIGHLIGHT_MISSING;
+    return pathIndexFind(name, length) ? HIGHLIGHT_COMMAND : HIGHLIGHT_MISSING;
+}
+
+static bool isAssignmentWord(const char *word, size_t length)
+{
+    if (length == 0 || !(isalpha((unsigned char)word[0]) || word[0] == '_'))
+        return false;
+    for (size_t i = 1; i < length; i++)
+    {
+        if (word[i] == '=')
+            return true;
+        if (!(isalnum((unsigned char)word[i]) || word[i] == '_'))
+            return false;
+    }
+    return false;
+}
+
+// a word ends: does the next one name a command?
+static void lexEndWord(struct lexState *st, const char *line, int end)
+{
+    if (!st->inWord)
+        return;
+    st->inWord = false;
+    if (st->redirectNext && !st->commandWord)
+        st->redirectNext = false;
+    else if (st->commandWord)
+    {
+        const char *word = line + st->wordStart;
+        size_t length = end - st->wordStart;
+        bool keyword = inList(shellKeywords, word, length);
+        bool names = keyword && (strncmp(word, "for", length) == 0 || strncmp(word, "case", length) == 0 ||
+                                 strncmp(word, "in", length) == 0);
+        st->commandNext = (keyword && !names) || isAssignmentWord(word, length);
+    }
+}
+
+static void lexStartWord(struct lexState *st, int i)
+{
+    if (st->inWord)
+        return;
+    st->inWord = true;
+    st->wordStart = i;
+    st->commandWord = st->commandNext && !st->redirectNext;
+}
+
+/**
+ * Move the tokenizer over character i of line
+ * @return the class of that character
+ */
+static unsigned char lexStep(struct lexState *st, const char *line, int i)
+{
+    char c = line[i];
+    if (st->comment)
+        return HIGHLIGHT_COMMENT;
+    if (st->escaped)
+    {
+        st->escaped = false;
+        return st->quote ? HIGHLIGHT_STRING : st->commandWord ? HIGHLIGHT_WORD : HIGHLIGHT_PLAIN;
+    }
+    if (st->quote)
+    {
+        if (st->variable && (isalnum((unsigned char)c) || c == '_' || c == '{' || c == '}'))
+            return HIGHLIGHT_VARIABLE;
+        st->variable = false;
+        if (c == st->quote)
+            st->quote = 0;
+        else if (c == '\\' && st->quote != '\'')
+            st->escaped = true;
+        else if (c == '$' && st->quote == '"')
+            return st->variable = true, HIGHLIGHT_VARIABLE;
+        return HIGHLIGHT_STRING;
+    }
+    if (st->variable && (isalnum((unsigned char)c) || c == '_' || c == '{' || c == '}' || c == '?' || c == '#'))
+        return HIGHLIGHT_VARIABLE;
+    st->variable = false;
+    switch (c)
+    {
+    case ' ':
+    case '\t':
+        lexEndWord(st, line, i);
+        return HIGHLIGHT_PLAIN;
+    case '#':
+        if (st->inWord)
+            break;
+        st->comment = true;
+        return HIGHLIGHT_COMMENT;
+    case '|':
+    case '&':
+    case ';':
+    case '(':
+    case ')':
+        lexEndWord(st, line, i);
+        st->commandNext = c != ')';
+        st->redirectNext = false;
+        return HIGHLIGHT_OPERATOR;
+    case '<':
+    case '>':
+        lexEndWord(st, line, i);
+        st->redirectNext = true;
+        return HIGHLIGHT_OPERATOR;
+    case '\'':
+    case '"':
+    case '`':
+        lexStartWord(st, i);
+        st->quote = c;
+        return HIGHLIGHT_STRING;
+    case '$':
+        lexStartWord(st, i);
+        st->variable = true;
+        return HIGHLIGHT_VARIABLE;
+    case '\\':
+        lexStartWord(st, i);
+        st->escaped = true;
+        break;
+    default:
+        lexStartWord(st, i);
+    }
+    return st->commandWord ? HIGHLIGHT_WORD : HIGHLIGHT_PLAIN;
+}
+
+static void highlightColor(unsigned char class)
+{
+    if (highlight.drawn != class)
+        outString(highlightColors[class]);
+    highlight.drawn = class;
+}
+
+// draw characters from..length-1 of line, the cursor being at from
+static void highlightDraw(const char *line, int from, int length)
+{
+    for (int i = from; i < length; i++)
+    {
+        highlightColor(highlight.classes[i]);
+        outChar(line[i]);
+    }
+}
+
+/**
+ * Give the chars of the command name being typed (ending at end) the class
+ * of the whole name so far
+ * @return where the first char that changed class is, or end if none did
+ */
+static int highlightCommandWord(const char *line, int end)
+{
+    const struct lexState *st = &highlight.states[end];
+    if (!st->inWord || !st->commandWord)
+        return end;
+    unsigned char class = HIGHLIGHT_PLAIN;
+    bool plainName = true; // no quotes or $ in it
+    for (int i = st->wordStart; i < end && plainName; i++)
+        plainName = strchr("'\"`$\\", line[i]) == NULL;
+    if (plainName)
+        class = isAssignmentWord(line + st->wordStart, end - st->wordStart)
+                    ? HIGHLIGHT_PLAIN
+                    : classifyCommand(line + st->wordStart, end - st->wordStart);
+    int changed = end;
+    for (int i = end - 1; i >= st->wordStart; i--)
+    {
+        if (highlight.classes[i] == HIGHLIGHT_STRING || highlight.classes[i] == HIGHLIGHT_VARIABLE)
+            continue;
+        if (highlight.classes[i] != class)
+            changed = i;
+        highlight.classes[i] = class;
+    }
+    return changed;
+}
+
+static void highlightStartTimer(struct timespec *start)
+{
+    clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+// account for the time the key took; over the budget, the rest of the line is plain
+static void highlightStopTimer(const struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long ns = (end.tv_sec - start->tv_sec) * 1000000000L + (end.tv_nsec - start->tv_nsec);
+    static const long limits[] = {10000, 50000, 100000, 500000, 1000000};
+    int bucket = 0;
+    while (bucket < 5 && ns >= limits[bucket])
+        bucket++;
+    highlight.histogram[bucket]++;
+    highlight.keys++;
+    highlight.totalNs += ns;
+    if (ns > highlight.maxNs)
+        highlight.maxNs = ns;
+    if (ns > highlight.budgetNs)
+    {
+        highlight.overBudget++;
+        if (highlight.measureOnly)
+            return;
+        highlight.active = false;
+        highlightColor(HIGHLIGHT_PLAIN);
+    }
+}
+
+// a new line is typed: highlight it if it goes to a terminal
+void highlightStart()
+{
+    highlight.active = !highlight.off && isatty(STDIN_FILENO) && isatty(STDOUT_FILENO);
+    if (!highlight.active)
+        return;
+    const char *term = getenv("TERM");
+    if (term && strcmp(term, "dumb") == 0)
+    {
+        highlight.active = false;
+        return;
+    }
+    memset(&highlight.states[0], 0, sizeof(struct lexState));
+    highlight.states[0].commandNext = true;
+    highlight.drawn = HIGHLIGHT_PLAIN;
+    pathIndexCheck();
+}
+
+/**
+ * Character length-1 was typed at the end of line: tokenize it, starting
+ * from the state before it, and draw it. Only when the class of the command
+ * name being typed changes is that name drawn again.
+ * @return false if the line is not highlighted (the caller echoes the key)
+ */
+bool highlightInsert(const char *line, int length)
+{
+    if (!highlight.active || length > HIGHLIGHT_MAX)
+        return false;
+    struct timespec start;
+    highlightStartTimer(&start);
+    int i = length - 1;
+    highlight.states[length] = highlight.states[i];
+    highlight.classes[i] = lexStep(&highlight.states[length], line, i);
+    int from = i;
+    if (highlight.classes[i] == HIGHLIGHT_WORD)
+        from = highlightCommandWord(line, length);
+    if (from > i)
+        from = i;
+    if (from < i) // back to where it changed
+        outPrintf("\033[%dD", i - from);
+    highlightDraw(line, from, length);
+    highlightStopTimer(&start);
+    return true;
+}
+
+// the last character was erased, line has length left
+bool highlightErase(const char *line, int length)
+{
+    if (!highlight.active)
+        return false;
+    struct timespec start;
+    highlightStartTimer(&start);
+    outWrite("\b \b", 3);
+    int from = highlightCommandWord(line, length);
+    if (from < length)
+    {
+        outPrintf("\033[%dD", length - from);
+        highlightDraw(line, from, length);
+    }
+    highlightStopTimer(&start);
+    return true;
+}
+
+// the whole line was replaced (up arrow): tokenize and draw all of it
+bool highlightLine(const char *line, int length)
+{
+    if (!highlight.active || length > HIGHLIGHT_MAX)
+        return false;
+    struct timespec start;
+    highlightStartTimer(&start);
+    for (int i = 0; i < length; i++)
+    {
+        highlight.states[i + 1] = highlight.states[i];
+        highlight.classes[i] = lexStep(&highlight.states[i + 1], line, i);
+        if (highlight.classes[i] == HIGHLIGHT_WORD)
+            highlightCommandWord(line, i + 1);
+    }
+    highlightDraw(line, 0, length);
+    highlightStopTimer(&start);
+    return true;
+}
+
+// the line is done: back to the terminal's colors
+void highlightEnd()
+{
+    if (highlight.drawn != HIGHLIGHT_PLAIN)
+        highlightColor(HIGHLIGHT_PLAIN);
+}
+
+static void printHighlightStats()
+{
+    printf("keys %ld, mean %.2f us, max %.2f us, budget %.0f us, over budget %ld\n", highlight.keys,
+           highlight.keys ? highlight.totalNs / 1e3 / highlight.keys : 0.0, highlight.maxNs / 1e3,
+           highlight.budgetNs / 1e3, highlight.overBudget);
+    static const char *labels[] = {"<10us", "<50us", "<100us", "<500us", "<1ms", ">=1ms"};
+    for (int i = 0; i < 6; i++)
+        printf("  %-7s %ld\n", labels[i], highlight.histogram[i]);
+}
+
+/**
+ * highlight --bench [LENGTH]: type a line of LENGTH chars (4000) key by key
+ * through the highlighter, with a backspace every 10 keys, and time it
+ */
+static int benchHighlight(int length)
+{
+    if (length < 1 || length > HIGHLIGHT_MAX)
+        length = HIGHLIGHT_MAX - 96;
+    static const char *pieces[] = {"ls -la ", "| grep \"x $HOME\" ", "; echo 'a b' ", "> /tmp/out ",
+                                   "&& nosuchcommand ", "$PATH ", "cat "};
+    char *line = malloc(length + 1);
+    int n = 0;
+    for (int k = 0; n < length; k++)
+        for (const char *p = pieces[k % 7]; *p && n < length; p++)
+            line[n++] = *p;
+    line[n] = 0;
+
+    bool wasOff = highlight.off;
+    long saved[4] = {highlight.keys, highlight.overBudget, highlight.totalNs, highlight.maxNs};
+    long savedHistogram[6];
+    memcpy(savedHistogram, highlight.histogram, sizeof(savedHistogram));
+    memset(highlight.histogram, 0, sizeof(highlight.histogram));
+    highlight.keys = highlight.overBudget = highlight.totalNs = highlight.maxNs = 0;
+    memset(&highlight.states[0], 0, sizeof(struct lexState));
+    highlight.states[0].commandNext = true;
+    highlight.active = true;
+    highlight.measureOnly = true;
+    size_t outputBefore = output.length;
+    for (int i = 1; i <= n; i++)
+    {
+        highlightInsert(line, i);
+        if (i % 10 == 0)
+        {
+            highlightErase(line, i - 1);
+            highlightInsert(line, i);
+        }
+        output.length = outputBefore; // the drawing is not shown
+    }
+    highlight.measureOnly = false;
+    highlight.active = false;
+    highlight.drawn = HIGHLIGHT_PLAIN;
+    printf("line of %d chars:\n", n);
+    printHighlightStats();
+    highlight.off = wasOff;
+    highlight.keys = saved[0], highlight.overBudget = saved[1], highlight.totalNs = saved[2], highlight.maxNs = saved[3];
+    memcpy(highlight.histogram, savedHistogram, sizeof(savedHistogram));
+    free(line);
+    return 0;
+}
+
+/**
+ * highlight [on | off]: highlighting as you type
+ * highlight --stats: time taken per key; highlight --budget US: the most a key may take
+ * highlight --bench [LENGTH]
+ */
+static int builtinHighlight(int argc, char **argv)
+{
+    if (argc == 1)
+        printf("highlight %s\n", highlight.off ? "off" : "on");
+    else if (strcmp(argv[1], "on") == 0 || strcmp(argv[1], "off") == 0)
+        highlight.off = argv[1][1] == 'f';
+    else if (strcmp(argv[1], "--stats") == 0)
+        printHighlightStats();
+    else if (strcmp(argv[1], "--budget") == 0 && argc > 2 && atol(argv[2]) > 0)
+        highlight.budgetNs = atol(argv[2]) * 1000;
+    else if (strcmp(argv[1], "--bench") == 0)
+        return benchHighlight(argc > 2 ? atoi(argv[2]) : 0);
+    else
+    {
+        fprintf(stderr, "usage: highlight [on | off | --stats | --budget US | --bench [LENGTH]]\n");
+        return 2;
+    }
+    return 0;
+}
+
+/**
+ * watch and onchange: run a command again when files change (inotify) or
+ * every few seconds (timerfd), instead of a loop of sleep children. Between
+ * runs the shell sleeps in epoll_wait, with no timeout.
+ */
+struct watchSet
+{
+    int fd;       // inotify
+    char **paths; // by watch descriptor
+    int capacity;
+    bool lost;    // a watched file went away (replaced by an editor, say)
+    char **roots; // as given, to watch again when lost
+    int rootCount;
+};
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | \
+                      IN_DELETE_SELF | IN_MOVE_SELF)
+
+// watch path, and the directories under it
+static int watchAdd(struct watchSet *set, const char *path)
+{
+    int wd = inotify_add_watch(set->fd, path, WATCH_EVENTS);
+    if (wd == -1)
+        return -1;
+    if (wd >= set->capacity)
+    {
+        int old = set->capacity;
+        set->capacity = wd * 2 + 16;
+        set->paths = realloc(set->paths, sizeof(char *) * set->capacity);
+        memset(set->paths + old, 0, sizeof(char *) * (set->capacity - old));
+    }
+    free(set->paths[wd]);
+    set->paths[wd] = strdup(path);
+    DIR *d = opendir(path);
+    if (d == NULL)
+        return 0; // a file
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL)
+    {
+        if (entry->d_type != DT_DIR || strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        char *child = malloc(strlen(path) + strlen(entry->d_name) + 2);
+        sprintf(child, "%s/%s", path, entry->d_name);
+        watchAdd(set, child);
+        free(child);
+    }
+    closedir(d);
+    return 0;
+}
+
+/**
+ * Read the events that are there; new directories are watched too
+ * @return whether any of them is a change
+ */
+static bool watchRead(struct watchSet *set, char *changed, size_t size)
+{
+    char buffer[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool any = false;
+    ssize_t length;
+    while ((length = read(set->fd, buffer, sizeof(buffer))) > 0)
+    {
+        for (char *p = buffer; p < buffer + length; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len)
+        {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            const char *dir = event->wd >= 0 && event->wd < set->capacity ? set->paths[event->wd] : NULL;
+            if (event->mask & IN_IGNORED)
+            {
+                if (dir)
+                    free(set->paths[event->wd]), set->paths[event->wd] = NULL;
+                set->lost = true;
+                continue;
+            }
+            if (dir == NULL || (event->mask & IN_Q_OVERFLOW))
+            {
+                any = true;
+                continue;
+            }
+            if (event->len)
+                snprintf(changed, size, "%s/%s", dir, event->name);
+            else
+                snprintf(changed, size, "%s", dir);
+            if ((event->mask & (IN_CREATE | IN_MOVED_TO)) && (event->mask & IN_ISDIR))
+                watchAdd(set, changed);
+            any = true;
+        }
+    }
+    return any;
+}
+
+static void watchFree(struct watchSet *set)
+{
+    for (int i = 0; i < set->capacity; i++)
+        free(set->paths[i]);
+    free(set->paths);
+    if (set->fd != -1)
+        close(set->fd);
+}
+
+// one run of the command, the shell waiting for it like for any foreground command
+static int watchRun(struct command_t *command, const char *text, const char *changed, const sigset_t *mask)
+{
+    outFlush(); // or the child would print what the shell has buffered too
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        sigprocmask(SIG_UNBLOCK, mask, NULL);
+        if (changed[0])
+            setenv("WATCH_PATH", changed, 1);
+        runCommand(command);
+        exit(127);
+    }
+    if (pid == -1)
+    {
+        fprintf(stderr, "-%s: watch: %s\n", sysname, strerror(errno));
+        return 1;
+    }
+    int slot = superviseChild(pid);
+    if (slot == -1)
+        return 1;
+    superviseUntilExit(slot);
+    struct supervisedChild *c = &supervisor.children[slot];
+    recordUsage(pid, text, c->status, &c->usage, &c->started);
+    int status = exitStatus(c->status);
+    releaseChild(slot);
+    return status;
+}
+
+/**
+ * watch [-n SECONDS] [-d DEBOUNCE] [-c COUNT] [-e PATH... --] command [args]
+ * onchange PATH... -- command [args]
+ * -e: run the command when something in the PATHs changes; directories are
+ *   watched with everything under them. Changes closer together than
+ *   DEBOUNCE (100ms) make one run, after the last of them. $WATCH_PATH is
+ *   the file that changed last.
+ * -n: run it now and then every SECONDS, and after changes if -e is given.
+ * -c: stop after COUNT runs. Ctrl+C stops it too. Returns the status of the
+ * last run.
+ */
+static int builtinWatch(int argc, char **argv)
+{
+    long intervalMs = 0, debounceMs = 100, count = -1;
+    struct watchSet set = {.fd = -1};
+    int i = 1, status = 0;
+    bool bad = false;
+    while (i < argc && (argv[i][0] == '-' || strcmp(argv[0], "onchange") == 0))
+    {
+        if (strcmp(argv[i], "--") == 0)
+        {
+            i++;
+            break;
+        }
+        if (strcmp(argv[i], "-e") == 0 || strcmp(argv[0], "onchange") == 0) // the paths, up to --
+        {
+            i += strcmp(argv[0], "onchange") != 0;
+            set.roots = argv + i;
+            while (i < argc && strcmp(argv[i], "--") != 0)
+                i++, set.rootCount++;
+            bad = i == argc || set.rootCount == 0;
+            i++;
+            break;
+        }
+        long *value = strcmp(argv[i], "-n") == 0   ? &intervalMs
+                      : strcmp(argv[i], "-d") == 0 ? &debounceMs
+                      : strcmp(argv[i], "-c") == 0 ? &count
+                                                   : NULL;
+        if (value == NULL || i + 1 >= argc)
+        {
+            bad = true;
+            break;
+        }
+        *value = value == &count ? atol(argv[i + 1]) : parseDuration(argv[i + 1]);
+        if (*value <= 0 && !(value == &debounceMs && *value == 0))
+            bad = true;
+        i += 2;
+    }
+    if (bad || i >= argc || (set.roots == NULL && intervalMs == 0))
+    {
+        fprintf(stderr, "usage: watch [-n SECONDS] [-d DEBOUNCE] [-c COUNT] [-e PATH... --] command [args]\n"
+                        "       onchange PATH... -- command [args]\n");
+        return 2;
+    }
+
+    if (set.roots)
+    {
+        set.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        for (int k = 0; set.fd != -1 && k < set.rootCount; k++)
+            if (watchAdd(&set, set.roots[k]) == -1)
+            {
+                fprintf(stderr, "-%s: watch: %s: %s\n", sysname, set.roots[k], strerror(errno));
+                watchFree(&set);
+                return 1;
+            }
+        if (set.fd == -1)
+        {
+            fprintf(stderr, "-%s: watch: %s\n", sysname, strerror(errno));
+            return 1;
+        }
+    }
+    // the command, made once for all the runs
+    struct command_t *command = calloc(1, sizeof(struct command_t));
+    command->name = strdup(argv[i]);
+    command->arg_count = argc - i - 1;
+    command->args = malloc(sizeof(char *) * (command->arg_count + 1));
+    for (int k = 0; k < command->arg_count; k++)
+        command->args[k] = strdup(argv[i + 1 + k]);
+    command->args[command->arg_count] = NULL;
+    char *text = joinArguments(argc - i, argv + i);
+
+    sigset_t mask, oldMask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigprocmask(SIG_BLOCK, &mask, &oldMask);
+    int signals = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    int epoll = epoll_create1(EPOLL_CLOEXEC);
+    int debounce = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    int interval = intervalMs ? timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK) : -1;
+    int fds[4] = {signals, set.fd, debounce, interval};
+    for (int k = 0; k < 4; k++)
+    {
+        struct epoll_event event = {EPOLLIN, {.u32 = k}};
+        if (fds[k] != -1)
+            epoll_ctl(epoll, EPOLL_CTL_ADD, fds[k], &event);
+    }
+    if (interval != -1)
+    {
+        struct itimerspec every = {{intervalMs / 1000, intervalMs % 1000 * 1000000},
+                                   {intervalMs / 1000, intervalMs % 1000 * 1000000}};
+        timerfd_settime(interval, 0, &every, NULL);
+    }
+
+    char changed[PATH_MAX] = "";
+    bool run = interval != -1; // -n runs it at once, -e at the first change
+    while (count != 0)
+    {
+        if (run)
+        {
+            status = watchRun(command, text, changed, &mask);
+            changed[0] = 0;
+            run = false;
+            if (count > 0)
+                count--;
+            if (set.lost) // watch again what was replaced while we were away
+            {
+                set.lost = false;
+                for (int k = 0; k < set.rootCount; k++)
+                    watchAdd(&set, set.roots[k]);
+            }
+            continue;
+        }
+        outFlush();
+        struct epoll_event events[4];
+        int n = epoll_wait(epoll, events, 4, -1);
+        if (n == -1 && errno != EINTR)
+            break;
+        bool stop = false;
+        for (int k = 0; k < n; k++)
+        {
+            uint64_t expirations;
+            switch (events[k].data.u32)
+            {
+            case 0: // Ctrl+C
+                stop = true;
+                status = 128 + SIGINT;
+                break;
+            case 1:
+                if (watchRead(&set, changed, sizeof(changed)))
+                {
+                    struct itimerspec once = {{0, 0}, {debounceMs / 1000, debounceMs % 1000 * 1000000 + 1}};
+                    timerfd_settime(debounce, 0, &once, NULL); // again at each event: after the last of a burst
+                }
+                break;
+            case 2:
+            case 3:
+                if (read(fds[events[k].data.u32], &expirations, sizeof(expirations)) > 0)
+                    run = true;
+                break;
+            }
+        }
+        if (stop)
+            break;
+    }
+
+    struct signalfd_siginfo pending; // a Ctrl+C the loop did not see is not for the shell
+    while (signals != -1 && read(signals, &pending, sizeof(pending)) > 0)
+        ;
+    for (int k = 0; k < 4; k++)
+        if (fds[k] != -1 && k != 1)
+            close(fds[k]);
+    close(epoll);
+    sigprocmask(SIG_SETMASK, &oldMask, NULL);
+    watchFree(&set);
+    free(text);
+    free_command(command);
+    return status;
+}
+
+/**
+ * z: jump to a directory by fragments of its name, ranked by frecency. Every
+ * directory cd goes to is counted in ~/.shellax_z (or $SHELLAX_Z), a file
+ * mapped by all the shells of the user. The entries are dense, in the order
+ * they came (the last one fills the place of a deleted one), with a separate
+ * array of masks of the characters of each path and of its last part, which
+ * is all a query reads of most entries. A fixed table of Z_CAPACITY slots
+ * finds the entry of a path (linear probing, deleting by shifting back, so
+ * there are no tombstones), and the paths are in a heap after it. No command
+ * pays for a whole pass over it: aging multiplies by Z_AGING in O(1) by
+ * counting generations, which each entry catches up with when it is visited,
+ * and every cd sweeps Z_SWEEP entries (dropping what aged below 1) and moves
+ * Z_COMPACT paths down the heap when half of it is garbage.
+ */
+#define Z_MAGIC "shellaxz"
+#define Z_VERSION 1
+#define Z_CAPACITY (1 << 16)
+#define Z_MAX_COUNT (Z_CAPACITY / 4 * 3)
+#define Z_HEAP_SIZE (1 << 18) // to start with; it doubles when full
+#define Z_MAX_TOTAL 100000.0  // sum of the ranks before they age
+#define Z_AGING 0.9
+#define Z_SWEEP 256
+#define Z_COMPACT 64
+
+struct zHeader
+{
+    char magic[8];
+    uint32_t version, capacity;
+    uint32_t count, generation; // aging so far
+    uint32_t sweep;             // next entry to sweep
+    uint32_t compacting;        // paths are being moved down the heap
+    double total;               // of the ranks, as of their last visit
+    uint64_t fileSize;
+    uint64_t heapUsed, heapLive;        // bytes, in the heap
+    uint64_t compactRead, compactWrite; // where compaction is
+};
+
+struct zEntry
+{
+    uint32_t hash;
+    uint32_t generation; // rank is as of this aging
+    float rank;
+    uint32_t last;   // time of the last visit
+    uint32_t slot;   // in the table
+    uint32_t offset; // of its path in the heap
+};
+
+// which characters a path has, see zMask
+struct zMasks
+{
+    uint64_t path, last; // last: of its last part
+};
+
+// a path in the heap: its length bytes and a 0 follow, then the same in lower case, padded to 8
+struct zHeapPath
+{
+    uint32_t entry; // UINT32_MAX: deleted
+    uint32_t length;
+};
+
+struct zDatabase
+{
+    int fd; // -1: not open, -2: can't be
+    char *map;
+    size_t size;
+    struct zHeader *header;
+    struct zMasks *masks; // of the entries: count of both
+    struct zEntry *entries;
+    uint32_t *table;      // slots: entry + 1, 0 if empty
+    char *heap;
+};
+
+struct zDatabase zDb = {.fd = -1};
+
+#define Z_HEAP_START \
+    (sizeof(struct zHeader) + Z_CAPACITY * (sizeof(struct zMasks) + sizeof(struct zEntry) + sizeof(uint32_t)))
+
+static inline uint32_t zHash(const char *path, size_t length)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ (unsigned char)path[i]) * 16777619u;
+    return hash;
+}
+
+// the characters of text (case folded) as bits: a-z, 0-9, then - _ . and the rest
+static inline uint64_t zMask(const char *text, size_t length)
+{
+    uint64_t mask = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        unsigned char c = tolower((unsigned char)text[i]);
+        if (c >= 'a' && c <= 'z')
+            mask |= 1ull << (c - 'a');
+        else if (c >= '0' && c <= '9')
+            mask |= 1ull << (26 + c - '0');
+        else if (c == '-' || c == '_' || c == '.')
+            mask |= 1ull << (36 + (c == '_') + 2 * (c == '.'));
+        else if (c != '/')
+            mask |= 1ull << 39;
+    }
+    return mask;
+}
+
+static inline struct zHeapPath *zRecordAt(struct zDatabase *db, uint64_t offset)
+{
+    return (struct zHeapPath *)(db->heap + offset);
+}
+
+static inline uint64_t zRecordSize(uint32_t length)
+{
+    return (sizeof(struct zHeapPath) + 2 * (length + 1) + 7) & ~(uint64_t)7;
+}
+
+static void zMap(struct zDatabase *db, size_t size)
+{
+    if (db->map)
+        munmap(db->map, db->size);
+    db->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, db->fd, 0);
+    if (db->map == MAP_FAILED)
+    {
+        db->map = NULL;
+        close(db->fd);
+        db->fd = -2;
+        return;
+    }
+    db->size = size;
+    db->header = (struct zHeader *)db->map;
+    db->masks = (struct zMasks *)(db->map + sizeof(struct zHeader));
+    db->entries = (struct zEntry *)(db->masks + Z_CAPACITY);
+    db->table = (uint32_t *)(db->entries + Z_CAPACITY);
+    db->heap = db->map + Z_HEAP_START;
+}
+
+// open the database at path, making it if create is set (a missing one is no error otherwise)
+static int zOpen(struct zDatabase *db, const char *path, bool create)
+{
+    db->fd = open(path, O_RDWR | (create ? O_CREAT : 0) | O_CLOEXEC, 0600);
+    if (db->fd == -1)
+    {
+        if (create || errno != ENOENT)
+            fprintf(stderr, "-%s: z: %s: %s\n", sysname, path, strerror(errno));
+        db->fd = -2;
+        return -1;
+    }
+    flock(db->fd, LOCK_EX);
+    struct stat st;
+    fstat(db->fd, &st);
+    if (st.st_size == 0)
+    {
+        struct zHeader header = {.magic = Z_MAGIC, .version = Z_VERSION, .capacity = Z_CAPACITY};
+        header.fileSize = Z_HEAP_START + Z_HEAP_SIZE;
+        if (ftruncate(db->fd, header.fileSize) == -1 || pwrite(db->fd, &header, sizeof(header), 0) == -1)
+            st.st_size = -1;
+        else
+            st.st_size = header.fileSize;
+    }
+    if ((size_t)st.st_size >= Z_HEAP_START)
+        zMap(db, st.st_size);
+    if (db->map == NULL || memcmp(db->header->magic, Z_MAGIC, 8) != 0 || db->header->version != Z_VERSION ||
+        db->header->capacity != Z_CAPACITY || db->header->fileSize > (uint64_t)st.st_size)
+    {
+        fprintf(stderr, "-%s: z: %s: not a database of this shell\n", sysname, path);
+        if (db->map)
+            munmap(db->map, db->size);
+        db->map = NULL;
+        flock(db->fd, LOCK_UN);
+        close(db->fd);
+        db->fd = -2;
+        return -1;
+    }
+    flock(db->fd, LOCK_UN);
+    return 0;
+}
+
+// lock the database, seeing what other shells did to its size
+static bool zLock(struct zDatabase *db, int operation)
+{
+    if (db == &zDb && db->fd == -1)
+    {
+        char path[PATH_MAX];
+        const char *file = getenv("SHELLAX_Z"), *home = getenv("HOME");
+        if (file == NULL && home)
+            snprintf(path, sizeof(path), "%s/.shellax_z", home), file = path;
+        // a script that cds counts into the database, only an interactive shell makes one
+        if (file == NULL || zOpen(db, file, interactive) == -1)
+            db->fd = -2;
+    }
+    if (db->fd < 0)
+        return false;
+    flock(db->fd, operation);
+    if (db->header->fileSize != db->size)
+        zMap(db, db->header->fileSize);
+    return db->map != NULL;
+}
+
+static void zUnlock(struct zDatabase *db)
+{
+    flock(db->fd, LOCK_UN);
+}
+
+static const char *zPath(struct zDatabase *db, uint32_t entry, uint32_t *length)
+{
+    struct zHeapPath *record = zRecordAt(db, db->entries[entry].offset);
+    *length = record->length;
+    return (const char *)(record + 1);
+}
+
+// the rank of entry now, aged to the current generation
+static float zRank(struct zDatabase *db, uint32_t entry)
+{
+    struct zEntry *e = &db->entries[entry];
+    static float aging[256];
+    if (aging[0] == 0)
+        for (int i = 0; i < 256; i++)
+            aging[i] = pow(Z_AGING, i);
+    uint32_t behind = db->header->generation - e->generation;
+    return behind < 256 ? e->rank * aging[behind] : 0; // 0.9^256 of any rank is below 1
+}
+
+static double zFrecency(struct zDatabase *db, uint32_t entry, time_t now)
+{
+    long age = now - (long)db->entries[entry].last;
+    double recent = age < 3600 ? 4 : age < 86400 ? 2 : age < 7 * 86400 ? 0.5 : 0.25;
+    return zRank(db, entry) * recent;
+}
+
+// delete entry: the last one takes its place, the slots after its own shift back so lookups still find them
+static void zDelete(struct zDatabase *db, uint32_t entry)
+{
+    struct zHeader *h = db->header;
+    struct zHeapPath *record = zRecordAt(db, db->entries[entry].offset);
+    h->heapLive -= zRecordSize(record->length);
+    record->entry = UINT32_MAX; // garbage for compaction
+    h->total -= zRank(db, entry);
+    if (h->total < 0)
+        h->total = 0;
+    uint32_t hole = db->entries[entry].slot, mask = Z_CAPACITY - 1, last = --h->count;
+    if (entry != last)
+    {
+        db->masks[entry] = db->masks[last];
+        db->entries[entry] = db->entries[last];
+        db->table[db->entries[entry].slot] = entry + 1;
+        zRecordAt(db, db->entries[entry].offset)->entry = entry;
+    }
+    for (uint32_t next = (hole + 1) & mask; db->table[next]; next = (next + 1) & mask)
+    {
+        struct zEntry *e = &db->entries[db->table[next] - 1];
+        uint32_t home = e->hash & mask;
+        bool stays = hole <= next ? (hole < home && home <= next) : (hole < home || home <= next);
+        if (stays)
+            continue;
+        db->table[hole] = db->table[next];
+        e->slot = hole;
+        hole = next;
+    }
+    db->table[hole] = 0;
+}
+
+// find path: the slot of its entry, or the empty slot where it would go
+static uint32_t zFind(struct zDatabase *db, const char *path, size_t length, uint32_t hash, bool *found)
+{
+    uint32_t mask = Z_CAPACITY - 1, slot = hash & mask;
+    for (; db->table[slot]; slot = (slot + 1) & mask)
+    {
+        uint32_t entry = db->table[slot] - 1, n;
+        if (db->entries[entry].hash != hash)
+            continue;
+        const char *p = zPath(db, entry, &n);
+        if (n == length && memcmp(p, path, length) == 0)
+        {
+            *found = true;
+            return slot;
+        }
+    }
+    *found = false;
+    return slot;
+}
+
+static uint32_t zAppend(struct zDatabase *db, uint32_t entry, const char *path, uint32_t length)
+{
+    struct zHeader *h = db->header;
+    uint64_t size = zRecordSize(length), heapSize = h->fileSize - Z_HEAP_START;
+    if (h->heapUsed + size > heapSize) // grow the file; the other shells map it again when they see fileSize
+    {
+        while (h->heapUsed + size > heapSize)
+            heapSize *= 2;
+        if (heapSize > UINT32_MAX || ftruncate(db->fd, Z_HEAP_START + heapSize) == -1)
+            return UINT32_MAX;
+        h->fileSize = Z_HEAP_START + heapSize;
+        zMap(db, h->fileSize);
+        if (db->map == NULL)
+            return UINT32_MAX;
+        h = db->header;
+    }
+    uint64_t offset = h->heapUsed;
+    struct zHeapPath *record = zRecordAt(db, offset);
+    record->entry = entry;
+    record->length = length;
+    char *text = (char *)(record + 1);
+    memcpy(text, path, length);
+    text[length] = 0;
+    for (uint32_t i = 0; i <= length; i++)
+        text[length + 1 + i] = tolower((unsigned char)text[i]);
+    h->heapUsed += size;
+    h->heapLive += size;
+    return offset;
+}
+
+// a bit of the upkeep: age the next entries, drop the weak ones, compact some of the heap
+static void zUpkeep(struct zDatabase *db)
+{
+    struct zHeader *h = db->header;
+    for (int k = 0; k < Z_SWEEP && h->count > 0; k++)
+    {
+        if (h->sweep >= h->count)
+            h->sweep = 0;
+        struct zEntry *e = &db->entries[h->sweep];
+        e->rank = zRank(db, h->sweep);
+        e->generation = h->generation;
+        if (e->rank < 1) // like z: what aged below 1 goes, and the last entry takes its place
+            zDelete(db, h->sweep);
+        else
+            h->sweep++;
+    }
+
+    if (!h->compacting && h->heapUsed > Z_HEAP_SIZE / 2 && h->heapLive < h->heapUsed / 2)
+    {
+        h->compacting = 1;
+        h->compactRead = h->compactWrite = 0;
+    }
+    for (int k = 0; h->compacting && k < Z_COMPACT; k++)
+    {
+        if (h->compactRead >= h->heapUsed) // done: what is after compactWrite is free again
+        {
+            h->heapUsed = h->compactWrite;
+            h->compacting = 0;
+            break;
+        }
+        struct zHeapPath *record = zRecordAt(db, h->compactRead);
+        uint64_t size = zRecordSize(record->length);
+        if (record->entry != UINT32_MAX)
+        {
+            if (h->compactWrite != h->compactRead)
+                memmove(db->heap + h->compactWrite, record, size);
+            db->entries[zRecordAt(db, h->compactWrite)->entry].offset = h->compactWrite;
+            h->compactWrite += size;
+        }
+        h->compactRead += size;
+    }
+}
+
+// count a visit to dir (an absolute path) in db
+static void zAdd(struct zDatabase *db, const char *dir, time_t now)
+{
+    size_t length = strlen(dir);
+    if (length == 0 || length > PATH_MAX || !zLock(db, LOCK_EX))
+        return;
+    struct zHeader *h = db->header;
+    uint32_t hash = zHash(dir, length);
+    bool found;
+    uint32_t slot = zFind(db, dir, length, hash, &found);
+    if (found)
+    {
+        uint32_t entry = db->table[slot] - 1;
+        struct zEntry *e = &db->entries[entry];
+        e->rank = zRank(db, entry) + 1;
+        e->generation = h->generation;
+        e->last = now;
+        h->total += 1;
+    }
+    else if (h->count < Z_MAX_COUNT)
+    {
+        uint32_t entry = h->count, offset = zAppend(db, entry, dir, length);
+        if (offset == UINT32_MAX)
+        {
+            if (db->map)
+                zUnlock(db);
+            return;
+        }
+        h = db->header;
+        const char *lastPart = strrchr(dir, '/') + 1;
+        db->masks[entry] = (struct zMasks){zMask(dir, length), zMask(lastPart, dir + length - lastPart)};
+        db->entries[entry] = (struct zEntry){hash, h->generation, 1, (uint32_t)now, slot, offset};
+        db->table[slot] = entry + 1;
+        h->count++;
+        h->total += 1;
+    }
+    if (h->total > Z_MAX_TOTAL || h->count >= Z_MAX_COUNT) // everyone ages, as they are visited
+    {
+        h->generation++;
+        h->total *= Z_AGING;
+    }
+    zUpkeep(db);
+    zUnlock(db);
+}
+
+// cd went to the current directory: count it
+void zRecord()
+{
+    char dir[PATH_MAX];
+    if (getcwd(dir, sizeof(dir)))
+        zAdd(&zDb, dir, time(NULL));
+}
+
+struct zMatch
+{
+    uint32_t entry, hash; // the hash tells if entry is still that path, see zCopyPath
+    double score;
+};
+
+static int compareMatches(const void *a, const void *b)
+{
+    double x = ((const struct zMatch *)a)->score, y = ((const struct zMatch *)b)->score;
+    return x > y ? -1 : x < y;
+}
+
+// do the fragments (in lower case) occur in path (too) in order, the last one in its last part?
+static bool zMatches(const char *path, uint32_t length, char **fragments, int count)
+{
+    const char *at = path, *lastPart = memrchr(path, '/', length);
+    for (int i = 0; i < count; i++)
+    {
+        if (i == count - 1 && lastPart && !strchr(fragments[i], '/') && at <= lastPart)
+            at = lastPart + 1;
+        const char *found = strstr(at, fragments[i]);
+        if (found == NULL)
+            return false;
+        at = found + strlen(fragments[i]);
+    }
+    return true;
+}
+
+/**
+ * The directories matching fragments, best first if sorted
+ * @return how many, in *matches (to free)
+ */
+static int zQuery(struct zDatabase *db, char **fragments, int count, bool sorted, struct zMatch **matches)
+{
+    *matches = NULL;
+    if (!zLock(db, LOCK_SH))
+        return 0;
+    char *lowered[64];
+    struct zMasks want = {0, 0};
+    if (count > 64)
+        count = 64;
+    for (int i = 0; i < count; i++)
+    {
+        lowered[i] = strdup(fragments[i]);
+        for (char *p = lowered[i]; *p; p++)
+            *p = tolower((unsigned char)*p);
+        want.path |= zMask(lowered[i], strlen(lowered[i]));
+    }
+    if (count > 0 && !strchr(lowered[count - 1], '/'))
+        want.last = zMask(lowered[count - 1], strlen(lowered[count - 1]));
+    time_t now = time(NULL);
+    int found = 0, capacity = 0;
+    for (uint32_t i = 0; i < db->header->count; i++)
+    {
+        struct zMasks m = db->masks[i];
+        if ((m.path & want.path) != want.path || (m.last & want.last) != want.last) // a character is missing
+            continue;
+        uint32_t length;
+        const char *path = zPath(db, i, &length);
+        if (count > 0 && !zMatches(path + length + 1, length, lowered, count))
+            continue;
+        if (found == capacity)
+            *matches = realloc(*matches, sizeof(struct zMatch) * (capacity = capacity ? capacity * 2 : 64));
+        (*matches)[found++] = (struct zMatch){i, db->entries[i].hash, zFrecency(db, i, now)};
+    }
+    zUnlock(db);
+    for (int i = 0; i < count; i++)
+        free(lowered[i]);
+    if (sorted)
+        qsort(*matches, found, sizeof(struct zMatch), compareMatches);
+    return found;
+}
+
+// copy the path of a match to out, under the lock: since the query, another shell may have moved it
+static bool zCopyPath(struct zDatabase *db, const struct zMatch *match, char *out, size_t size)
+{
+    if (!zLock(db, LOCK_SH))
+        return false;
+    uint32_t length = 0;
+    bool ok = match->entry < db->header->count && db->entries[match->entry].hash == match->hash;
+    if (ok)
+    {
+        const char *path = zPath(db, match->entry, &length);
+        ok = length < size;
+        if (ok)
+            memcpy(out, path, length), out[length] = 0;
+    }
+    zUnlock(db);
+    return ok;
+}
+
+static void zForget(struct zDatabase *db, const char *dir)
+{
+    if (!zLock(db, LOCK_EX))
+        return;
+    bool found;
+    size_t length = strlen(dir);
+    uint32_t slot = zFind(db, dir, length, zHash(dir, length), &found);
+    if (found)
+        zDelete(db, db->table[slot] - 1);
+    zUnlock(db);
+}
+
+/**
+ * Tab on "z fragments": the line becomes "z " and the best directory; Tab
+ * again, the next one
+ * @return whether line was changed
+ */
+bool zComplete(char *line, size_t size)
+{
+    static char fragments[4096], last[4096];
+    static int next;
+    if (strncmp(line, "z ", 2) != 0)
+        return false;
+    if (strcmp(line, last) == 0)
+        next++;
+    else
+    {
+        snprintf(fragments, sizeof(fragments), "%s", line + 2);
+        next = 0;
+    }
+    char copy[4096], *words[64], *save = NULL;
+    int count = 0;
+    snprintf(copy, sizeof(copy), "%s", fragments);
+    for (char *w = strtok_r(copy, " \t", &save); w && count < 64; w = strtok_r(NULL, " \t", &save))
+        words[count++] = w;
+    if (count == 0)
+        return false;
+    struct zMatch *matches;
+    int found = zQuery(&zDb, words, count, true, &matches);
+    char path[PATH_MAX];
+    bool changed = found > 0 && zCopyPath(&zDb, &matches[next % found], path, sizeof(path));
+    free(matches);
+    if (!changed || strlen(path) + 3 > size)
+        return false;
+    snprintf(line, size, "z %s", path);
+    snprintf(last, sizeof(last), "%s", line);
+    return true;
+}
+
+static void printZStats(struct zDatabase *db)
+{
+    if (!zLock(db, LOCK_SH))
+    {
+        fprintf(stderr, "-%s: z: no database (set HOME or SHELLAX_Z)\n", sysname);
+        return;
+    }
+    struct zHeader *h = db->header;
+    printf("%u directories of %u, generation %u, total rank %.1f\n", h->count, Z_MAX_COUNT, h->generation, h->total);
+    printf("heap %llu bytes used, %llu live, file %llu bytes%s\n", (unsigned long long)h->heapUsed,
+           (unsigned long long)h->heapLive, (unsigned long long)h->fileSize, h->compacting ? ", compacting" : "");
+    zUnlock(db);
+}
+
+/**
+ * z --bench [N]: fill a database in a temporary file with N directories
+ * (20000) and time visits and queries
+ */
+static int benchZ(int count)
+{
+    if (count < 1 || count > Z_MAX_COUNT)
+        count = 20000;
+    char path[] = "/tmp/shellax_z_bench_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1)
+    {
+        fprintf(stderr, "-%s: z: %s\n", sysname, strerror(errno));
+        return 1;
+    }
+    close(fd);
+    unlink(path);
+    struct zDatabase db = {.fd = -1};
+    if (zOpen(&db, path, true) == -1)
+        return 1;
+    unlink(path);
+    static const char *parts[] = {"srv", "deploy", "releases", "api", "web", "worker", "config", "logs",
+                                  "current", "shared", "src", "build", "cache", "prod", "staging", "eu-west"};
+    char dir[256];
+    unsigned seed = 42;
+    struct timespec start, end;
+    time_t now = time(NULL);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < count * 3; i++) // every directory visited, some of them more
+    {
+        int n = i < count ? i : rand_r(&seed) % count;
+        snprintf(dir, sizeof(dir), "/%s/%s/%s-%d/%s/%d", parts[n % 16], parts[n / 16 % 16], parts[n / 256 % 16],
+                 n / 4096, parts[n / 7 % 16], n);
+        zAdd(&db, dir, now - rand_r(&seed) % (30 * 86400));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double addUs = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / 1e3 / (count * 3);
+
+    static const char *queries[][2] = {{"api", "12"}, {"prod", "worker"}, {"eu", "cache"}, {"deploy", "77"},
+                                       {"xyz", NULL}, {"srv", "3"}, {"logs", NULL}, {"shared", "9"}};
+    int rounds = 200;
+    double worst = 0, total = 0;
+    long matched = 0;
+    for (int r = 0; r < rounds; r++)
+    {
+        const char **q = queries[r % 8];
+        char *words[2] = {(char *)q[0], (char *)q[1]};
+        struct zMatch *matches;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        matched += zQuery(&db, words, q[1] ? 2 : 1, false, &matches);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        free(matches);
+        double us = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / 1e3;
+        total += us;
+        worst = us > worst ? us : worst;
+    }
+    printZStats(&db);
+    printf("visit: mean %.2f us\n", addUs);
+    printf("query: mean %.1f us, max %.1f us, %.1f matches on average\n", total / rounds, worst,
+           (double)matched / rounds);
+    munmap(db.map, db.size);
+    close(db.fd);
+    return 0;
+}
+
+/**
+ * z [fragments...]: cd to the best ranked directory whose path has the
+ * fragments in this order, the last one in its last part. A directory as
+ * argument is just cd'ed to. z alone goes home.
+ * z -l [fragments...]: the matches, best first, with their score
+ * z -x [dir]: forget dir (the current one); z --stats, z --bench [N]
+ */
+static int builtinZ(int argc, char **argv)
+{
+    if (argc > 1 && strcmp(argv[1], "--stats") == 0)
+    {
+        printZStats(&zDb);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0)
+        return benchZ(argc > 2 ? atoi(argv[2]) : 0);
+    if (argc > 1 && strcmp(argv[1], "-x") == 0)
+    {
+        char dir[PATH_MAX];
+        if (argc == 2 && getcwd(dir, sizeof(dir)) == NULL)
+        {
+            fprintf(stderr, "-%s: z: %s\n", sysname, strerror(errno));
+            return 1;
+        }
+        if (argc > 2 && realpath(argv[2], dir) == NULL) // gone already: forget it as given
+            snprintf(dir, sizeof(dir), "%s", argv[2]);
+        zForget(&zDb, dir);
+        return 0;
+    }
+    bool list = argc > 1 && strcmp(argv[1], "-l") == 0;
+    char **fragments = argv + 1 + list;
+    int count = argc - 1 - list;
+    struct stat st;
+    if (!list && count <= 1 && (count == 0 || (stat(fragments[0], &st) == 0 && S_ISDIR(st.st_mode))))
+    {
+        const char *dir = count ? fragments[0] : getenv("HOME");
+        if (dir == NULL || chdir(dir) == -1)
+        {
+            fprintf(stderr, "-%s: z: %s: %s\n", sysname, dir ? dir : "HOME", strerror(dir ? errno : ENOENT));
+            return 1;
+        }
+        zRecord();
+        return 0;
+    }
+
+    struct zMatch *matches;
+    int found = zQuery(&zDb, fragments, count, list, &matches);
+    char cwd[PATH_MAX], path[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+        cwd[0] = 0;
+    int status = 1;
+    for (int i = 0; i < found; i++)
+    {
+        if (!list) // to jump, the best is usually all that is needed: no sorting
+        {
+            int best = i;
+            for (int k = i + 1; k < found; k++)
+                if (matches[k].score > matches[best].score)
+                    best = k;
+            struct zMatch swap = matches[i];
+            matches[i] = matches[best];
+            matches[best] = swap;
+        }
+        if (!zCopyPath(&zDb, &matches[i], path, sizeof(path)))
+            continue;
+        if (list)
+        {
+            printf("%10.1f %s\n", matches[i].score, path);
+            status = 0;
+            continue;
+        }
+        if (strcmp(path, cwd) == 0) // already there: the next best
+            continue;
+        if (chdir(path) == 0)
+        {
+            zRecord();
+            status = 0;
+            break;
+        }
+        if (errno == ENOENT) // gone: forget it
+            zForget(&zDb, path);
+    }
+    free(matches);
+    if (status && !list)
+        fprintf(stderr, "-%s: z: no match\n", sysname);
+    return status;
+}
+
+/**
+ * History shared by all the sessions of the user. The lines typed go to
+ * ~/.shellax_history ($SHELLAX_HISTORY), a log every session appends to with
+ * O_APPEND, one write per record, so records never interleave. Each record
+ * has a checksum: a torn one (a crash, a full disk) is skipped. The index,
+ * ~/.shellax_history.index, is mapped by all of them: a session takes the
+ * next place in it with an atomic add on count and stores the offset of its
+ * record there, so the others see the line at once, with no lock and no
+ * reading of the log. When HISTORY_COMPACT places are taken, a thread seals
+ * the index (a bit in count: appends after it go to the new files), writes
+ * the last HISTORY_KEEP lines to a new log and index and renames them in
+ * place. Only compaction locks (flock on the index); a session that finds the
+ * index sealed by a compaction that died, or the index lost, does it again.
+ */
+#define HISTORY_MAGIC "shellaxh"
+#define HISTORY_VERSION 1
+#define HISTORY_CAPACITY (1 << 16)
+#define HISTORY_COMPACT (HISTORY_CAPACITY / 2)
+#define HISTORY_KEEP 10000
+#define HISTORY_SEALED (1ull << 63)
+#define HISTORY_RECORD 0x48535852u // "RXSH"
+#define HISTORY_MAX_LINE 65536
+
+// the start of the log
+struct historyLogHeader
+{
+    char magic[8];
+    uint64_t generation; // compactions so far
+};
+
+struct historyRecord
+{
+    uint32_t magic;
+    uint32_t length; // of the line after it
+    uint32_t time;
+    uint32_t checksum; // CRC-32 of length, time and the line
+};
+
+struct historyIndex
+{
+    char magic[8];
+    uint32_t version, capacity;
+    uint64_t generation;                        // of the log it indexes
+    _Atomic uint64_t count;                     // places taken, and HISTORY_SEALED
+    _Atomic uint64_t offsets[HISTORY_CAPACITY]; // of the records, plus 1; 0 while it is being written
+};
+
+struct historyFiles
+{
+    char path[PATH_MAX]; // of the log; the index is path.index
+    int log, index;
+    struct historyIndex *map;
+    bool failed;         // no history for this session
+    uint64_t generation; // for the compaction thread: the one to compact
+};
+
+struct historyFiles history = {.log = -1, .index = -1};
+
+static uint32_t historyChecksum(uint32_t crc, const void *data, size_t length)
+{
+    static uint32_t table[256];
+    if (table[1] == 0)
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    const unsigned char *p = data;
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++)
+        crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static uint32_t recordChecksum(const struct historyRecord *record, const char *line)
+{
+    return historyChecksum(historyChecksum(0, &record->length, 8), line, record->length);
+}
+
+/**
+ * The line of the record at offset, from log mapped with its size
+ * @return NULL if there is no whole record there
+ */
+static const char *historyLine(const char *log, uint64_t size, uint64_t offset, uint32_t *length)
+{
+    if (offset < sizeof(struct historyLogHeader) || offset + sizeof(struct historyRecord) > size)
+        return NULL;
+    struct historyRecord record;
+    memcpy(&record, log + offset, sizeof(record));
+    const char *line = log + offset + sizeof(record);
+    if (record.magic != HISTORY_RECORD || record.length > HISTORY_MAX_LINE ||
+        offset + sizeof(record) + record.length > size || recordChecksum(&record, line) != record.checksum)
+        return NULL;
+    *length = record.length;
+    return line;
+}
+
+// the line of the record at offset, read from the log
+static bool historyRead(struct historyFiles *h, uint64_t offset, char *line, size_t size)
+{
+    struct historyRecord record;
+    if (pread(h->log, &record, sizeof(record), offset) != sizeof(record) || record.magic != HISTORY_RECORD ||
+        record.length >= size || pread(h->log, line, record.length, offset + sizeof(record)) != record.length ||
+        recordChecksum(&record, line) != record.checksum)
+        return false;
+    line[record.length] = 0;
+    return true;
+}
+
+static void historyClose(struct historyFiles *h)
+{
+    if (h->map)
+        munmap(h->map, sizeof(struct historyIndex));
+    if (h->log != -1)
+        close(h->log);
+    if (h->index != -1)
+        close(h->index);
+    h->map = NULL;
+    h->log = h->index = -1;
+}
+
+// are fd and the file at path the same?
+static bool sameFile(int fd, const char *path)
+{
+    struct stat a, b;
+    return fstat(fd, &a) == 0 && stat(path, &b) == 0 && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+}
+
+/**
+ * Write a new log and index with the last HISTORY_KEEP lines of h: those of
+ * its index, which gets sealed, or, when the index is lost, all the whole
+ * records found in the log. With the lock on h->index.
+ */
+static int historyCompact(struct historyFiles *h, bool fromIndex)
+{
+    struct historyLogHeader header;
+    if (pread(h->log, &header, sizeof(header), 0) != sizeof(header))
+        return -1;
+    uint64_t *offsets = NULL, count = 0;
+    if (fromIndex)
+    {
+        uint64_t n = atomic_fetch_or(&h->map->count, HISTORY_SEALED) & ~HISTORY_SEALED;
+        n = n < HISTORY_CAPACITY ? n : HISTORY_CAPACITY;
+        offsets = malloc(sizeof(uint64_t) * (n + 1));
+        struct timespec deadline, now;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += 100000000;
+        for (uint64_t i = 0; i < n; i++)
+        {
+            uint64_t offset;
+            // a place taken, but not filled yet: its record is written, the offset comes right after
+            while ((offset = atomic_load(&h->map->offsets[i])) == 0)
+            {
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                if (now.tv_sec * 1000000000L + now.tv_nsec > deadline.tv_sec * 1000000000L + deadline.tv_nsec)
+                    break; // the session died there
+                sched_yield();
+            }
+            if (offset)
+                offsets[count++] = offset - 1;
+        }
+    }
+    struct stat st;
+    if (fstat(h->log, &st) == -1)
+    {
+        free(offsets);
+        return -1;
+    }
+    char *log = st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, h->log, 0) : NULL;
+    if (log == MAP_FAILED)
+    {
+        free(offsets);
+        return -1;
+    }
+    uint32_t length;
+    if (!fromIndex) // every whole record, skipping what is torn
+    {
+        uint64_t capacity = 0;
+        for (uint64_t at = sizeof(header); at + sizeof(struct historyRecord) <= (uint64_t)st.st_size;)
+        {
+            if (historyLine(log, st.st_size, at, &length) == NULL)
+            {
+                at++;
+                continue;
+            }
+            if (count == capacity)
+                offsets = realloc(offsets, sizeof(uint64_t) * (capacity = capacity ? capacity * 2 : 1024));
+            offsets[count++] = at;
+            at += sizeof(struct historyRecord) + length;
+        }
+    }
+
+    // the last lines that are whole, in order
+    uint64_t first = count, kept = 0, size = sizeof(header);
+    while (first > 0 && kept < HISTORY_KEEP)
+    {
+        first--;
+        if (historyLine(log, st.st_size, offsets[first], &length))
+        {
+            kept++;
+            size += sizeof(struct historyRecord) + length;
+        }
+        else
+            offsets[first] = 0;
+    }
+    char *data = malloc(size), newLog[PATH_MAX + 16], newIndex[PATH_MAX + 16], indexPath[PATH_MAX + 16];
+    struct historyLogHeader newHeader = {HISTORY_MAGIC, header.generation + 1};
+    memcpy(data, &newHeader, sizeof(newHeader));
+    uint64_t *newOffsets = malloc(sizeof(uint64_t) * (kept + 1)), at = sizeof(newHeader);
+    kept = 0;
+    for (uint64_t i = first; i < count; i++)
+    {
+        if (offsets[i] == 0 || historyLine(log, st.st_size, offsets[i], &length) == NULL)
+            continue;
+        memcpy(data + at, log + offsets[i], sizeof(struct historyRecord) + length);
+        newOffsets[kept++] = at + 1;
+        at += sizeof(struct historyRecord) + length;
+    }
+    if (log)
+        munmap(log, st.st_size);
+    free(offsets);
+
+    snprintf(newLog, sizeof(newLog), "%s.new", h->path);
+    snprintf(newIndex, sizeof(newIndex), "%s.index.new", h->path);
+    snprintf(indexPath, sizeof(indexPath), "%s.index", h->path);
+    int status = -1, logFd = open(newLog, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600),
+        indexFd = open(newIndex, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    struct historyIndex *map = MAP_FAILED;
+    if (logFd != -1 && indexFd != -1 && ftruncate(indexFd, sizeof(struct historyIndex)) == 0)
+        map = mmap(NULL, sizeof(struct historyIndex), PROT_READ | PROT_WRITE, MAP_SHARED, indexFd, 0);
+    if (map != MAP_FAILED)
+    {
+        memcpy(map->magic, HISTORY_MAGIC, 8);
+        map->version = HISTORY_VERSION;
+        map->capacity = HISTORY_CAPACITY;
+        map->generation = newHeader.generation;
+        for (uint64_t i = 0; i < kept; i++)
+            map->offsets[i] = newOffsets[i];
+        map->count = kept;
+        munmap(map, sizeof(struct historyIndex));
+        // both are on disk before either has its name: a crash leaves the old pair or the new one
+        if (write(logFd, data, at) == (ssize_t)at && fdatasync(logFd) == 0 && fdatasync(indexFd) == 0 &&
+            rename(newLog, h->path) == 0 && rename(newIndex, indexPath) == 0)
+            status = 0;
+    }
+    if (logFd != -1)
+        close(logFd);
+    if (indexFd != -1)
+        close(indexFd);
+    if (status == -1)
+    {
+        unlink(newLog);
+        unlink(newIndex);
+    }
+    free(data);
+    free(newOffsets);
+    return status;
+}
+
+// what the files h has open are: 1 ready, 0 a new history, 2 to repair (index lost or sealed), -1 not a history
+static int historyState(struct historyFiles *h, bool *indexOk)
+{
+    struct historyLogHeader header;
+    struct stat st;
+    ssize_t n = pread(h->log, &header, sizeof(header), 0);
+    if (n == 0)
+        return 0;
+    if (n != sizeof(header) || memcmp(header.magic, HISTORY_MAGIC, 8) != 0)
+        return -1;
+    if (h->map == NULL && fstat(h->index, &st) == 0 && st.st_size >= (off_t)sizeof(struct historyIndex))
+    {
+        h->map = mmap(NULL, sizeof(struct historyIndex), PROT_READ | PROT_WRITE, MAP_SHARED, h->index, 0);
+        if (h->map == MAP_FAILED)
+            h->map = NULL;
+    }
+    *indexOk = h->map && memcmp(h->map->magic, HISTORY_MAGIC, 8) == 0 && h->map->version == HISTORY_VERSION &&
+               h->map->capacity == HISTORY_CAPACITY && h->map->generation == header.generation;
+    return *indexOk && !(atomic_load(&h->map->count) & HISTORY_SEALED) ? 1 : 2;
+}
+
+// start the history of h: the header of the log, an empty index. With the lock on h->index.
+static int historyCreate(struct historyFiles *h)
+{
+    struct historyLogHeader first = {HISTORY_MAGIC, 1};
+    struct historyIndex *map = MAP_FAILED;
+    if (write(h->log, &first, sizeof(first)) == sizeof(first) && ftruncate(h->index, 0) == 0 &&
+        ftruncate(h->index, sizeof(struct historyIndex)) == 0)
+        map = mmap(NULL, sizeof(struct historyIndex), PROT_READ | PROT_WRITE, MAP_SHARED, h->index, 0);
+    if (map == MAP_FAILED)
+        return -1;
+    memcpy(map->magic, HISTORY_MAGIC, 8);
+    map->version = HISTORY_VERSION;
+    map->capacity = HISTORY_CAPACITY;
+    map->generation = first.generation;
+    munmap(map, sizeof(struct historyIndex));
+    return 0;
+}
+
+/**
+ * Open the log and index at h->path, making them if there are none, and
+ * redoing the index if it is lost or sealed by a compaction that died
+ */
+static bool historyOpen(struct historyFiles *h)
+{
+    char indexPath[PATH_MAX + 16];
+    snprintf(indexPath, sizeof(indexPath), "%s.index", h->path);
+    for (int attempt = 0; attempt < 1000; attempt++)
+    {
+        historyClose(h);
+        h->log = open(h->path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+        h->index = open(indexPath, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (h->log == -1 || h->index == -1)
+            break;
+        bool indexOk = false;
+        int state = historyState(h, &indexOk);
+        if (state == 1)
+            return true;
+        if (state == -1)
+        {
+            fprintf(stderr, "-%s: history: %s: not a history of this shell\n", sysname, h->path);
+            break;
+        }
+        if (flock(h->index, LOCK_EX | LOCK_NB) == -1) // being compacted: the new files come soon
+        {
+            nanosleep(&(struct timespec){0, 1000000}, NULL);
+            continue;
+        }
+        // unless they were renamed meanwhile (then again, from the start), look again, now with the lock
+        if (sameFile(h->log, h->path) && sameFile(h->index, indexPath))
+        {
+            state = historyState(h, &indexOk);
+            if ((state == 0 && historyCreate(h) == -1) || (state == 2 && historyCompact(h, indexOk) == -1))
+                break;
+        }
+        flock(h->index, LOCK_UN);
+    }
+    historyClose(h);
+    return false;
+}
+
+// is the history of this session open, on the files in use now?
+static bool historyReady()
+{
+    struct historyFiles *h = &history;
+    if (h->failed)
+        return false;
+    if (h->map && !(atomic_load(&h->map->count) & HISTORY_SEALED))
+        return true;
+    if (h->path[0] == 0)
+    {
+        const char *file = getenv("SHELLAX_HISTORY"), *home = getenv("HOME");
+        if (file)
+            snprintf(h->path, sizeof(h->path), "%s", file);
+        else if (home)
+            snprintf(h->path, sizeof(h->path), "%s/.shellax_history", home);
+    }
+    h->failed = h->path[0] == 0 || !historyOpen(h);
+    return !h->failed;
+}
+
+static void *historyCompactThread(void *arg)
+{
+    struct historyFiles *h = arg;
+    char indexPath[PATH_MAX + 16];
+    snprintf(indexPath, sizeof(indexPath), "%s.index", h->path);
+    h->log = open(h->path, O_RDONLY | O_CLOEXEC);
+    h->index = open(indexPath, O_RDWR | O_CLOEXEC);
+    if (h->log != -1 && h->index != -1 && flock(h->index, LOCK_EX | LOCK_NB) == 0)
+    {
+        h->map = mmap(NULL, sizeof(struct historyIndex), PROT_READ | PROT_WRITE, MAP_SHARED, h->index, 0);
+        if (h->map == MAP_FAILED)
+            h->map = NULL;
+        // not compacted yet by someone else (who may already have made the files of the next generation)
+        if (h->map && sameFile(h->log, h->path) && sameFile(h->index, indexPath) &&
+            h->map->generation == h->generation && !(atomic_load(&h->map->count) & HISTORY_SEALED))
+            historyCompact(h, true);
+    }
+    historyClose(h);
+    free(h);
+    return NULL;
+}
+
+// append line to the history of files h; false if there is none
+static bool historyAppend(struct historyFiles *h, const char *line, time_t now)
+{
+    size_t length = strlen(line);
+    if (length > HISTORY_MAX_LINE)
+        return false;
+    char *data = malloc(sizeof(struct historyRecord) + length);
+    struct historyRecord record = {.magic = HISTORY_RECORD, .length = length, .time = (uint32_t)now};
+    record.checksum = recordChecksum(&record, line);
+    memcpy(data, &record, sizeof(record));
+    memcpy(data + sizeof(record), line, length);
+    size_t size = sizeof(record) + length;
+    bool added = false;
+    for (int attempt = 0; attempt < 100 && !added; attempt++) // each time, a compaction came between
+    {
+        if (write(h->log, data, size) != (ssize_t)size) // torn, if anything: the checksum tells
+            break;
+        off_t end = lseek(h->log, 0, SEEK_CUR); // O_APPEND: right after what this write added
+        uint64_t place = atomic_fetch_add(&h->map->count, 1);
+        if (!(place & HISTORY_SEALED) && place < HISTORY_CAPACITY)
+        {
+            atomic_store(&h->map->offsets[place], end - size + 1);
+            added = true;
+            if (place + 1 == HISTORY_COMPACT) // one session gets this place
+            {
+                struct historyFiles *copy = calloc(1, sizeof(struct historyFiles));
+                snprintf(copy->path, sizeof(copy->path), "%s", h->path);
+                copy->generation = h->map->generation;
+                pthread_t thread;
+                if (pthread_create(&thread, NULL, historyCompactThread, copy) == 0)
+                    pthread_detach(thread);
+                else
+                    free(copy);
+            }
+            break;
+        }
+        // the index is sealed (or full, so it is now): the record went to a log being replaced, again to the new one
+        atomic_fetch_or(&h->map->count, HISTORY_SEALED);
+        if (!historyOpen(h))
+            break;
+    }
+    free(data);
+    return added;
+}
+
+// a line was typed: add it to the shared history
+void historyAdd(const char *line)
+{
+    if (line[strspn(line, " \t")] != 0 && historyReady())
+        historyAppend(&history, line, time(NULL));
+}
+
+struct
+{
+    bool active;           // the arrows moved in this prompt
+    uint64_t generation;   // of the index position is in
+    long position, end;    // end: the line being typed
+    char typed[4096];
+} historyBrowse;
+
+void historyReset()
+{
+    historyBrowse.active = false;
+}
+
+/**
+ * Up (direction -1) or down (1) in the history: line becomes the line
+ * there, or the one being typed after the last
+ * @return 1 if line changed, 0 if not, -1 if there is no shared history
+ */
+int historyMove(int direction, char *line, size_t size)
+{
+    if (!historyReady())
+        return -1;
+    struct historyIndex *map = history.map;
+    uint64_t count = atomic_load(&map->count) & ~HISTORY_SEALED;
+    count = count < HISTORY_CAPACITY ? count : HISTORY_CAPACITY;
+    if (!historyBrowse.active || historyBrowse.generation != map->generation) // from the end, what is there now
+    {
+        if (!historyBrowse.active)
+            snprintf(historyBrowse.typed, sizeof(historyBrowse.typed), "%s", line);
+        historyBrowse.active = true;
+        historyBrowse.generation = map->generation;
+        historyBrowse.position = historyBrowse.end = count;
+    }
+    for (long at = historyBrowse.position + direction; at >= 0; at += direction)
+    {
+        if (at >= historyBrowse.end)
+        {
+            if (historyBrowse.position == historyBrowse.end)
+                return 0;
+            historyBrowse.position = historyBrowse.end;
+            snprintf(line, size, "%s", historyBrowse.typed);
+            return 1;
+        }
+        uint64_t offset = atomic_load(&map->offsets[at]);
+        if (offset && historyRead(&history, offset - 1, line, size))
+        {
+            historyBrowse.position = at;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * history --bench [LINES] [SESSIONS]: SESSIONS processes (4) append LINES
+ * lines (5000) each to a history in a temporary directory at the same
+ * time. Then it is checked that what is left of every session is its last
+ * lines, once each and in order: compaction only drops the oldest lines.
+ */
+static int benchHistory(int lines, int sessions)
+{
+    lines = lines > 0 ? lines : 5000;
+    sessions = sessions > 0 && sessions <= 64 ? sessions : 4;
+    char directory[] = "/tmp/shellax_history_XXXXXX";
+    if (mkdtemp(directory) == NULL)
+    {
+        fprintf(stderr, "-%s: history: %s\n", sysname, strerror(errno));
+        return 1;
+    }
+    struct historyFiles h = {.log = -1, .index = -1};
+    snprintf(h.path, sizeof(h.path), "%s/history", directory);
+    if (!historyOpen(&h)) // made once, so the sessions don't all race to make it
+        return 1;
+    historyClose(&h);
+
+    outFlush();
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pids[64];
+    for (int s = 0; s < sessions; s++)
+    {
+        pids[s] = fork();
+        if (pids[s] == 0)
+        {
+            if (!historyOpen(&h))
+                _exit(1);
+            char line[64];
+            int failed = 0;
+            for (int i = 0; i < lines; i++)
+            {
+                snprintf(line, sizeof(line), "echo session %d line %d", s, i);
+                failed += !historyAppend(&h, line, 0);
+            }
+            _exit(failed > 0);
+        }
+    }
+    int failed = 0;
+    for (int s = 0; s < sessions; s++)
+    {
+        int status;
+        if (pids[s] == -1 || waitpid(pids[s], &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status))
+            failed++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double appendUs = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / 1e3 / lines;
+
+    // a compaction may still be running in the session that started it, or have died with it
+    int *next = calloc(sessions, sizeof(int)), bad = 0; // next line expected of each session, 0: any
+    long total = 0;
+    char line[128];
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (historyOpen(&h))
+    {
+        uint64_t count = atomic_load(&h.map->count) & ~HISTORY_SEALED;
+        for (uint64_t i = 0; i < count; i++)
+        {
+            int s, k;
+            uint64_t offset = atomic_load(&h.map->offsets[i]);
+            if (offset == 0 || !historyRead(&h, offset - 1, line, sizeof(line)) ||
+                sscanf(line, "echo session %d line %d", &s, &k) != 2 || s < 0 || s >= sessions ||
+                (next[s] && k != next[s]))
+                bad++;
+            else
+                next[s] = k + 1, total++;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double readUs = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / 1e3 / (total ? total : 1);
+    int missing = 0, dropped = 0;
+    for (int s = 0; s < sessions; s++)
+        if (next[s] == 0)
+            dropped++;
+        else
+            missing += next[s] != lines;
+    struct stat st;
+    long logSize = h.log != -1 && fstat(h.log, &st) == 0 ? (long)st.st_size : 0;
+    printf("%d sessions x %d lines: %.2f us per line in each session, %s\n", sessions, lines, appendUs,
+           failed ? "some sessions failed" : "all appended");
+    printf("%ld lines kept (log %ld bytes, generation %llu), read at %.2f us each\n", total, logSize,
+           h.map ? (unsigned long long)h.map->generation : 0ull, readUs);
+    printf("%d lines missing, repeated, out of order or torn; %d sessions without their last line, %d compacted "
+           "away\n",
+           bad, missing, dropped);
+    historyClose(&h);
+    free(next);
+    char path[PATH_MAX + 32];
+    snprintf(path, sizeof(path), "%s/history", directory);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/history.index", directory);
+    unlink(path);
+    rmdir(directory);
+    return failed || bad || missing;
+}
+
+/**
+ * history [N]: the last N lines (all) of the shared history
+ * history --stats, history --bench [LINES] [SESSIONS]
+ */
+static int builtinHistory(int argc, char **argv)
+{
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0)
+        return benchHistory(argc > 2 ? atoi(argv[2]) : 0, argc > 3 ? atoi(argv[3]) : 0);
+    if (!historyReady())
+    {
+        if (history.path[0] == 0)
+            fprintf(stderr, "-%s: history: no shared history (set HOME or SHELLAX_HISTORY)\n", sysname);
+        return 1;
+    }
+    struct historyIndex *map = history.map;
+    uint64_t count = atomic_load(&map->count) & ~HISTORY_SEALED;
+    count = count < HISTORY_CAPACITY ? count : HISTORY_CAPACITY;
+    if (argc > 1 && strcmp(argv[1], "--stats") == 0)
+    {
+        struct stat st;
+        fstat(history.log, &st);
+        printf("%llu lines, generation %llu, log %lld bytes, compaction at %d lines\n", (unsigned long long)count,
+               (unsigned long long)map->generation, (long long)st.st_size, HISTORY_COMPACT);
+        return 0;
+    }
+    long last = argc > 1 ? atol(argv[1]) : 0;
+    char line[HISTORY_MAX_LINE + 1];
+    for (uint64_t i = last > 0 && (uint64_t)last < count ? count - last : 0; i < count; i++)
+    {
+        uint64_t offset = atomic_load(&map->offsets[i]);
+        if (offset && historyRead(&history, offset - 1, line, sizeof(line)))
+            printf("%6llu  %s\n", (unsigned long long)i + 1, line);
+    }
+    return 0;
+}
+
+const struct shellBuiltin shellBuiltins[] = {
+    {"echo", builtinEcho, false},
+    {"true", builtinTrue, true},
+    {"false", builtinFalse, true},
+    {":", builtinTrue, true},
+    {"test", builtinTest, true},
+    {"[", builtinTest, true},
+    {"break", builtinLoopControl, true},
+    {"continue", builtinLoopControl, true},
+    {"return", builtinReturn, true},
+    {"exit", builtinExit, false},
+    {"cd", builtinCd, false},
+    {"export", builtinExport, true},
+    {"unset", builtinUnset, true},
+    {"shift", builtinShift, true},
+    {"local", builtinLocal, true},
+    {"read", builtinRead, false},
+    {"eval", builtinEval, true},
+    {"source", builtinSource, false},
+    {".", builtinSource, false},
+    {"alias", builtinAlias, true},
+    {"unalias", builtinUnalias, true},
+    {"wait", builtinWait, false},
+    {"jobs", builtinJobs, false},
+    {"timeout", builtinTimeout, false},
+    {"ulimit", builtinUlimit, false},
+    {"pin", builtinPin, false},
+    {"highlight", builtinHighlight, false},
+    {"watch", builtinWatch, false},
+    {"onchange", builtinWatch, false},
+    {"z", builtinZ, false},
+    {"history", builtinHistory, false},
+    {NULL, NULL, false},
+};
+
+const struct shellBuiltin *findShellBuiltin(const char *name)
+{
+    for (int i = 0; shellBuiltins[i].name; i++)
+        if (strcmp(name, shellBuiltins[i].name) == 0)
+            return &shellBuiltins[i];
+    return NULL;
+}
+
+// ---- running compiled scripts ----
+
+/**
+ * Point stdin/stdout (or the fds the redirects name) at the redirects for
+ * something that runs in the shell itself; saved gets copies of the old fds
+ * for restoreFds
+ * @return 0, or -1 if a file could not be opened
+ */
+int redirectInShell(struct scriptRedirect *redirects, int count, int saved[REDIRECT_FDS])
+{
+    for (int i = 0; i < REDIRECT_FDS; i++)
+        saved[i] = -1;
+    if (count == 0)
+        return 0;
+    rcImpure();
+    outFlush();
+    for (int i = 0; i < count; i++)
+    {
+        struct scriptRedirect *r = &redirects[i];
+        int target = r->fd;
+        char *text = r->target.dynamic ? expandString(r->target.text, EXPAND_STRING) : strdup(r->target.text);
+        if (expansionFailed) // said why already
+        {
+            free(text);
+            restoreFds(saved);
+            return -1;
+        }
+        int fd;
+        if (r->kind == REDIRECT_STRING || r->kind == REDIRECT_HEREDOC)
+        {
+            fd = makeTempFd("heredoc");
+            size_t length = strlen(text);
+            if (r->kind == REDIRECT_STRING)
+                text[length++] = '\n'; // over the terminating 0, written by length
+            if (fd != -1 && (writeAll(fd, text, length) == -1 || lseek(fd, 0, SEEK_SET) == -1))
+            {
+                close(fd);
+                fd = -1;
+            }
+        }
+        else if (r->kind == REDIRECT_DUP)
+            fd = redirectSource(text);
+        else
+            fd = open(text, r->kind == REDIRECT_IN ? O_RDONLY : O_WRONLY | O_CREAT | (r->kind == REDIRECT_OUT ? O_TRUNC : O_APPEND), 0666);
+        if (fd == -1)
+        {
+            fprintf(stderr, "-%s: %s: %s\n", sysname, r->kind == REDIRECT_STRING || r->kind == REDIRECT_HEREDOC ? "here-document" : text, strerror(errno));
+            free(text);
+            restoreFds(saved);
+            return -1;
+        }
+        free(text);
+        if (saved[target] == -1) // -2: it was not open, restoreFds closes it
+            saved[target] = fcntl(target, F_GETFD) == -1 ? -2 : fcntl(target, F_DUPFD_CLOEXEC, REDIRECT_FDS);
+        if (fd != target)
+        {
+            dup2(fd, target);
+            if (r->kind != REDIRECT_DUP)
+                close(fd);
+        }
+    }
+    return 0;
+}
+
+void restoreFds(int saved[REDIRECT_FDS])
+{
+    outFlush();
+    for (int i = 0; i < REDIRECT_FDS; i++)
+    {
+        if (saved[i] == -2)
+            close(i);
+        else if (saved[i] != -1)
+        {
+            dup2(saved[i], i);
+            close(saved[i]);
+        }
+        saved[i] = -1;
+    }
+}
+
+/**
+ * Build the command_t chain of a pipeline of simple commands, expanding its
+ * dynamic words
+ */
+struct command_t *buildCommand(struct scriptNode *node)
+{
+    struct command_t *head = NULL, **link = &head;
+    for (int s = 0; s < node->stageCount; s++)
+    {
+        struct scriptStage *stage = &node->stages[s];
+        struct command_t *command = calloc(1, sizeof(struct command_t));
+        struct fieldList fields = {NULL, 0, 0};
+        expandWords(stage->words, stage->wordCount, &fields);
+        command->name = fields.count > 0 ? fields.items[0] : strdup("");
+        command->arg_count = fields.count > 0 ? fields.count - 1 : 0;
+        command->args = malloc(sizeof(char *) * (command->arg_count + 1));
+        for (int i = 0; i < command->arg_count; i++)
+            command->args[i] = fields.items[i + 1];
+        free(fields.items);
+
+        for (int i = 0; i < stage->redirectCount; i++)
+        {
+            struct scriptRedirect *r = &stage->redirects[i];
+            char *text = r->target.dynamic ? expandString(r->target.text, EXPAND_STRING) : strdup(r->target.text);
+            if (r->kind == REDIRECT_STRING || r->kind == REDIRECT_HEREDOC)
+            {
+                size_t length = strlen(text);
+                if (r->kind == REDIRECT_STRING)
+                    text[length++] = '\n';
+                stageHereText(command, text, length);
+                free(text);
+                if (command->fdRedirectCount == 0)
+                    continue;
+                text = command->redirects[0]; // after a 2>&1 it has to come in order too
+                command->redirects[0] = NULL;
+            }
+            // once a redirect names a fd, the ones after it go in order after redirects[]: 2>&1 >file
+            if (r->fd != (r->kind == REDIRECT_OUT || r->kind == REDIRECT_APPEND) || r->kind == REDIRECT_DUP ||
+                command->fdRedirectCount > 0)
+            {
+                const int flags[] = {O_RDONLY, O_WRONLY | O_CREAT | O_TRUNC, O_WRONLY | O_CREAT | O_APPEND,
+                                     O_RDONLY, O_RDONLY, -1};
+                command->fdRedirects = realloc(command->fdRedirects,
+                                               sizeof(struct fdRedirect) * (command->fdRedirectCount + 1));
+                command->fdRedirects[command->fdRedirectCount++] = (struct fdRedirect){r->fd, flags[r->kind], text};
+                continue;
+            }
+            int index = r->kind == REDIRECT_IN ? 0 : r->kind == REDIRECT_OUT ? 1 : 2;
+            free(command->redirects[index]);
+            command->redirects[index] = text;
+            if (index > 0) // the last output redirect wins
+            {
+                free(command->redirects[3 - index]);
+                command->redirects[3 - index] = NULL;
+            }
+        }
+        *link = command;
+        link = &command->next;
+    }
+    head->background = node->background;
+    return head;
+}
+
+static bool isStaticCommand(struct scriptNode *node)
+{
+    for (int s = 0; s < node->stageCount; s++)
+    {
+        struct scriptStage *stage = &node->stages[s];
+        if (stage->assignmentCount > 0)
+            return false;
+        for (int i = 0; i < stage->wordCount; i++)
+            if (stage->words[i].dynamic)
+                return false;
+        for (int i = 0; i < stage->redirectCount; i++)
+            if (stage->redirects[i].target.dynamic)
+                return false;
+    }
+    return true;
+}
+
+// NAME=value words of a stage, set in the shell or only in the environment
+static void applyAssignments(struct scriptStage *stage, bool environmentOnly, char ***saved)
+{
+    for (int i = 0; i < stage->assignmentCount; i++)
+    {
+        struct scriptWord *w = &stage->assignments[i];
+        char *eq = strchr(w->text, '=');
+        *eq = 0;
+        char *value = w->dynamic ? expandString(eq + 1, EXPAND_STRING) : strdup(eq + 1);
+        if (environmentOnly)
+        {
+            const char *old = getenv(w->text);
+            (*saved)[i] = old ? strdup(old) : NULL;
+            setenv(w->text, value, 1);
+        }
+        else
+            setVariable(w->text, value, false);
+        *eq = '=';
+        free(value);
+    }
+}
+
+static void restoreEnvironment(struct scriptStage *stage, char **saved)
+{
+    for (int i = 0; i < stage->assignmentCount; i++)
+    {
+        char *name = strndup(stage->assignments[i].text, strchr(stage->assignments[i].text, '=') - stage->assignments[i].text);
+        if (saved[i])
+            setenv(name, saved[i], 1);
+        else
+            unsetenv(name);
+        free(name);
+        free(saved[i]);
+    }
+}
+
+/**
+ * Call a shell function with arguments; local variables are put back after it
+ */
+int callFunction(struct shellFunction *function, int argc, char **argv)
+{
+    if (function->body == NULL) // from the rc snapshot, compile it now
+    {
+        struct scriptNode *program;
+        if (compileScript(function->definition, &program) != 0)
+            return 1;
+        executeNode(program); // defines it again, with the body
+        freeNode(program);
+        if (function->body == NULL)
+            return 1;
+    }
+
+    char **oldPositional = positional;
+    int oldCount = positionalCount, oldLocals = localCount;
+    positional = argv + 1;
+    positionalCount = argc - 1;
+    functionDepth++;
+    int savedLoopDepth = loopDepth;
+    loopDepth = 0;
+
+    struct scriptNode *body = function->body;
+    body->references++; // the function may be redefined while it runs
+    int status = executeNode(body);
+    freeNode(body);
+    if (returning)
+    {
+        returning = false;
+        status = lastStatus;
+    }
+
+    loopDepth = savedLoopDepth;
+    functionDepth--;
+    while (localCount > oldLocals)
+    {
+        struct savedVariable *local = &locals[--localCount];
+        if (local->value)
+            setVariable(local->name, local->value, false);
+        else
+            unsetVariable(local->name);
+        free(local->name);
+        free(local->value);
+    }
+    positional = oldPositional;
+    positionalCount = oldCount;
+    return status;
+}
+
+/**
+ * Run a pipeline of simple commands. A single builtin (shell or text) or a
+ * function runs in the shell itself, anything else goes to process_command.
+ */
+int executeCommand(struct scriptNode *node)
+{
+    struct scriptStage *stage = &node->stages[0];
+    expansionFailed = false;
+    if (node->stageCount == 1 && !node->background)
+    {
+        if (stage->wordCount == 0) // only assignments and redirects
+        {
+            lastStatus = 0; // or the status of a $(...) in them
+            applyAssignments(stage, false, NULL);
+            int saved[REDIRECT_FDS];
+            if (expansionFailed || redirectInShell(stage->redirects, stage->redirectCount, saved) == -1)
+                return 1;
+            restoreFds(saved);
+            return lastStatus;
+        }
+
+        struct fieldList fields = {NULL, 0, 0};
+        expandWords(stage->words, stage->wordCount, &fields);
+        if (expansionFailed)
+        {
+            freeFields(&fields);
+            finishProcessSubstitutions(false);
+            return 1;
+        }
+        if (fields.count == 0) // expanded to nothing
+            return 0;
+        addField(&fields, NULL); // argv ends with NULL
+        fields.count--;
+
+        const struct shellBuiltin *builtin = findShellBuiltin(fields.items[0]);
+        struct shellFunction *function = builtin ? NULL : findFunction(fields.items[0]);
+        struct command_t probe = {.name = fields.items[0]};
+        probe.args = fields.items + 1;
+        probe.arg_count = fields.count - 1;
+        const struct textBuiltin *text = builtin || function ? NULL : findTextBuiltin(&probe);
+        if (builtin || function || text)
+        {
+            if (!function && !(builtin && builtin->pure))
+                rcImpure();
+            int status, saved[REDIRECT_FDS];
+            applyAssignments(stage, false, NULL);
+            if (expansionFailed || redirectInShell(stage->redirects, stage->redirectCount, saved) == -1)
+                status = 1;
+            else
+            {
+                if (builtin)
+                    status = builtin->run(fields.count, fields.items);
+                else if (function)
+                    status = callFunction(function, fields.count, fields.items);
+                else
+                {
+                    outFlush();
+                    status = runTextBuiltin(text, &probe);
+                }
+                restoreFds(saved);
             }
+            freeFields(&fields);
+            finishProcessSubstitutions(false);
+            return status;
+        }
+        freeFields(&fields);
+    }
+
+    // external commands and pipelines: fork through process_command
+    rcImpure();
+    struct command_t *command = node->compiled;
+    if (command == NULL)
+    {
+        command = buildCommand(node);
+        if (isStaticCommand(node))
+            node->compiled = command; // nothing to expand, the same command_t every time
+    }
+    char **saved = calloc(stage->assignmentCount + 1, sizeof(char *));
+    applyAssignments(stage, true, &saved);
+    lastStatus = 0;
+    if (expansionFailed)
+        lastStatus = 1;
+    else
+        process_command(command);
+    restoreEnvironment(stage, saved);
+    free(saved);
+    finishProcessSubstitutions(node->background);
+    if (command != node->compiled)
+        free_command(command);
+    return lastStatus;
+}
+
+// run a node in a child process, with its stdin/stdout on the given fds
+static pid_t forkNode(struct scriptNode *node, int in, int out, int closeFd)
+{
+    rcImpure();
+    outFlush();
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        if (in != STDIN_FILENO)
+        {
+            dup2(in, STDIN_FILENO);
+            close(in);
+        }
+        if (out != STDOUT_FILENO)
+        {
+            dup2(out, STDOUT_FILENO);
+            close(out);
+        }
+        if (closeFd != -1)
+            close(closeFd);
+        node->background = false; // this is the background process
+        int status = executeNode(node);
+        outFlush();
+        exit(status);
+    }
+    return pid;
+}
+
+static int waitStatus(pid_t pid)
+{
+    int wstatus;
+    if (waitpid(pid, &wstatus, 0) == -1)
+        return 127;
+    return WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128 + WTERMSIG(wstatus);
+}
+
+// a pipeline with compound commands: every part runs in its own child
+int executePipeline(struct scriptNode *node)
+{
+    pid_t *pids = malloc(sizeof(pid_t) * node->childCount);
+    int input = STDIN_FILENO;
+    for (int i = 0; i < node->childCount; i++)
+    {
+        int p[2] = {-1, STDOUT_FILENO};
+        if (i + 1 < node->childCount && pipe(p) == -1)
+        {
+            fprintf(stderr, "-%s: pipe: %s\n", sysname, strerror(errno));
+            p[0] = -1, p[1] = STDOUT_FILENO;
+        }
+        pids[i] = forkNode(node->children[i], input, p[1], p[0]);
+        if (input != STDIN_FILENO)
+            close(input);
+        if (p[1] != STDOUT_FILENO)
+            close(p[1]);
+        input = p[0] == -1 ? STDIN_FILENO : p[0];
+    }
+    int status = 0;
+    for (int i = 0; i < node->childCount; i++)
+        status = waitStatus(pids[i]);
+    free(pids);
+    return status;
+}
+
+// after a loop body: should the loop stop?
+static bool loopShouldStop()
+{
+    if (breakLevels > 0)
+    {
+        breakLevels--;
+        return true;
+    }
+    if (continueLevels > 0)
+    {
+        if (--continueLevels > 0) // continue an outer loop
+            return true;
+    }
+    return returning || exiting;
+}
+
+static int executeLoop(struct scriptNode *node)
+{
+    int status = 0;
+    loopDepth++;
+    if (node->type == NODE_FOR)
+    {
+        struct fieldList fields = {NULL, 0, 0};
+        expansionFailed = false;
+        if (node->words)
+            expandWords(node->words, node->wordCount, &fields);
+        if (expansionFailed)
+        {
+            freeFields(&fields);
+            loopDepth--;
+            return 1;
+        }
+        else
+            for (int i = 0; i < positionalCount; i++)
+                addField(&fields, strdup(positional[i]));
+        for (int i = 0; i < fields.count; i++)
+        {
+            setVariable(node->name, fields.items[i], false);
+            status = executeNode(node->second);
+            if (loopShouldStop())
+                break;
         }
-        else // no < operation
+        freeFields(&fields);
+    }
+    else
+    {
+        while (1)
         {
-            if (command->redirects[1] != NULL) // operation: >
+            int condition = executeNode(node->first);
+            if (returning || exiting || breakLevels || continueLevels)
             {
-                close(connection[1]);                           // close the unused end of the pipe
-                read(connection[0], &message, sizeof(message)); // read the input from the pipe
-                FILE *ptr;
-                ptr = fopen(command->redirects[1], "w"); // open to file to write
-                printf("%s\n", command->redirects[1]);
-                fprintf(ptr, "%s", message);
-                fclose(ptr);
-                close(connection[1]);
+                if (loopShouldStop())
+                    break;
+                continue;
             }
-            if (command->redirects[2] != NULL) // operation: >>
+            if ((condition == 0) != (node->type == NODE_WHILE))
+                break;
+            status = executeNode(node->second);
+            if (loopShouldStop())
+                break;
+        }
+    }
+    loopDepth--;
+    return status;
+}
+
+static int executeCase(struct scriptNode *node)
+{
+    expansionFailed = false;
+    char *subject = node->words[0].dynamic ? expandString(node->words[0].text, EXPAND_STRING) : strdup(node->words[0].text);
+    if (expansionFailed)
+    {
+        free(subject);
+        return 1;
+    }
+    int status = 0;
+    for (int a = 0; a < node->armCount; a++)
+    {
+        struct caseArm *arm = &node->arms[a];
+        bool match = false;
+        for (int i = 0; i < arm->patternCount && !match; i++)
+        {
+            char *pattern = arm->patterns[i].dynamic ? expandString(arm->patterns[i].text, EXPAND_PATTERN) : strdup(arm->patterns[i].text);
+            match = fnmatch(pattern, subject, 0) == 0;
+            free(pattern);
+        }
+        if (match)
+        {
+            status = executeNode(arm->body);
+            break;
+        }
+    }
+    free(subject);
+    return status;
+}
+
+/**
+ * Run a compiled script node
+ * @return its exit status, also left in lastStatus
+ */
+int executeNode(struct scriptNode *node)
+{
+    int status = 0;
+    if (node->background && node->type != NODE_COMMAND) // compound command in the background
+    {
+        static const char *labels[] = {"", "pipeline", "list", "&&", "||", "!", "if", "while", "until",
+                                       "for", "case", "function", "{ ... }", "( ... )"};
+        lastBackground = forkNode(node, STDIN_FILENO, STDOUT_FILENO, -1);
+        addJob(lastBackground, labels[node->type]);
+        return lastStatus = 0;
+    }
+
+    int saved[REDIRECT_FDS];
+    if (node->redirectCount > 0 && redirectInShell(node->redirects, node->redirectCount, saved) == -1)
+        return lastStatus = 1;
+
+    switch (node->type)
+    {
+    case NODE_COMMAND:
+        status = executeCommand(node);
+        break;
+    case NODE_PIPELINE:
+        status = executePipeline(node);
+        break;
+    case NODE_LIST:
+        for (int i = 0; i < node->childCount; i++)
+        {
+            status = executeNode(node->children[i]);
+            if (returning || exiting || breakLevels || continueLevels)
+                break;
+        }
+        break;
+    case NODE_AND:
+    case NODE_OR:
+        status = executeNode(node->first);
+        if (!(returning || exiting || breakLevels || continueLevels) && (status == 0) == (node->type == NODE_AND))
+            status = executeNode(node->second);
+        break;
+    case NODE_NOT:
+        status = !executeNode(node->first);
+        break;
+    case NODE_IF:
+        status = executeNode(node->first);
+        if (returning || exiting || breakLevels || continueLevels)
+            break;
+        if (status == 0)
+            status = executeNode(node->second);
+        else
+            status = node->third ? executeNode(node->third) : 0;
+        break;
+    case NODE_WHILE:
+    case NODE_UNTIL:
+    case NODE_FOR:
+        status = executeLoop(node);
+        break;
+    case NODE_CASE:
+        status = executeCase(node);
+        break;
+    case NODE_FUNCTION:
+        defineFunction(node->name, node->first, node->definition);
+        status = 0;
+        break;
+    case NODE_GROUP:
+        status = executeNode(node->first);
+        break;
+    case NODE_SUBSHELL:
+    {
+        pid_t pid = forkNode(node->first, STDIN_FILENO, STDOUT_FILENO, -1);
+        status = waitStatus(pid);
+        break;
+    }
+    }
+    if (node->redirectCount > 0)
+        restoreFds(saved);
+    return lastStatus = status;
+}
+
+/**
+ * Compile and run a script
+ * @return exit status (2 on a syntax error)
+ */
+int runScript(const char *source)
+{
+    struct scriptParser ps = {.source = source};
+    int status = scriptLex(source, &ps.tokens, &ps.count);
+    if (status != 0)
+    {
+        if (status == 1)
+            fprintf(stderr, "-%s: syntax error: unexpected end of file\n", sysname);
+        return lastStatus = 2;
+    }
+    // a line at a time: an alias defined on one line is used on the next
+    status = 0;
+    while (!(returning || exiting || breakLevels || continueLevels))
+    {
+        skipNewlines(&ps);
+        if (peekToken(&ps)->type == TOKEN_END)
+            break;
+        struct scriptNode *line = parseLine(&ps);
+        if (ps.status != 0)
+        {
+            if (ps.status == 1)
+                fprintf(stderr, "-%s: syntax error: unexpected end of file\n", sysname);
+            freeNode(line);
+            status = lastStatus = 2;
+            break;
+        }
+        status = executeNode(line);
+        freeNode(line);
+    }
+    freeTokens(ps.tokens, ps.count);
+    return status;
+}
+
+// read a whole script file; NULL with errno set on failure
+char *readScriptFile(const char *fileName)
+{
+    int fd = open(fileName, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+    size_t length = 0, capacity = 4096;
+    char *source = malloc(capacity);
+    ssize_t n;
+    while ((n = read(fd, source + length, capacity - length - 1)) > 0)
+    {
+        length += n;
+        if (capacity - length < 2)
+            source = realloc(source, capacity *= 2);
+    }
+    close(fd);
+    source[length] = 0;
+    return source;
+}
+
+// a dependency of the rc file on the environment, or a change it made
+static void rcRecordRead(const char *name, const char *value)
+{
+    if (!rcRecording.active)
+        return;
+    for (int i = 0; i < rcRecording.readCount; i++)
+        if (strcmp(rcRecording.reads[i].name, name) == 0)
+            return; // the first read is the one that came from the environment
+    rcRecording.reads = realloc(rcRecording.reads, sizeof(struct savedVariable) * (rcRecording.readCount + 1));
+    rcRecording.reads[rcRecording.readCount].name = strdup(name);
+    rcRecording.reads[rcRecording.readCount++].value = value ? strdup(value) : NULL;
+}
+
+// getenv, noting the variable as something the rc snapshot depends on
+const char *rcGetenv(const char *name)
+{
+    const char *value = getenv(name);
+    rcRecordRead(name, value);
+    return value;
+}
+
+// the rc file did something its snapshot can't replay: ran a command, read a file...
+void rcImpure()
+{
+    if (rcRecording.active)
+        rcRecording.impure = true;
+}
+
+struct snapshotHeader
+{
+    char magic[8];
+    uint64_t device, inode, size, modifiedSeconds, modifiedNanoseconds;
+    uint32_t recordCount;
+};
+
+// record kinds of the snapshot
+#define SNAPSHOT_ENVIRONMENT 'E' // the rc read this from the environment: value, or none if unset
+#define SNAPSHOT_VARIABLE 'V'
+#define SNAPSHOT_EXPORTED 'X'
+#define SNAPSHOT_ALIAS 'A'
+#define SNAPSHOT_FUNCTION 'F' // the source of its definition
+
+static const char snapshotMagic[8] = {'S', 'H', 'X', 'S', 'N', 'A', 'P', '1'};
+
+struct snapshotBuffer
+{
+    char *data;
+    size_t length, capacity;
+    uint32_t records;
+};
+
+static void snapshotAdd(struct snapshotBuffer *b, char kind, const char *name, const char *value)
+{
+    uint32_t nameLength = strlen(name), valueLength = value ? strlen(value) : UINT32_MAX;
+    size_t need = 10 + nameLength + (value ? valueLength + 1 : 0);
+    if (b->length + need > b->capacity)
+        b->data = realloc(b->data, b->capacity = (b->length + need) * 2);
+    char *p = b->data + b->length;
+    *p++ = kind;
+    memcpy(p, &nameLength, 4);
+    memcpy(p + 4, &valueLength, 4);
+    memcpy(p + 8, name, nameLength + 1); // with the 0s, so they are used where they are mapped
+    if (value)
+        memcpy(p + 9 + nameLength, value, valueLength + 1);
+    b->length += need;
+    b->records++;
+}
+
+static void fillSnapshotHeader(struct snapshotHeader *header, const struct stat *rc)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, snapshotMagic, sizeof(snapshotMagic));
+    header->device = rc->st_dev;
+    header->inode = rc->st_ino;
+    header->size = rc->st_size;
+    header->modifiedSeconds = rc->st_mtim.tv_sec;
+    header->modifiedNanoseconds = rc->st_mtim.tv_nsec;
+}
+
+/**
+ * Save what running the rc file left behind: its variables, aliases and
+ * functions, plus the environment variables it read. Written to a temporary
+ * file and renamed, so a shell starting meanwhile sees the old snapshot or
+ * the new one.
+ */
+int writeRcSnapshot(const char *snapshotPath, const struct stat *rc)
+{
+    struct snapshotHeader header;
+    fillSnapshotHeader(&header, rc);
+    struct snapshotBuffer b = {NULL, 0, 0, 0};
+    for (int i = 0; i < rcRecording.readCount; i++)
+        snapshotAdd(&b, SNAPSHOT_ENVIRONMENT, rcRecording.reads[i].name, rcRecording.reads[i].value);
+    for (int i = 0; i < VARIABLE_BUCKETS; i++)
+        for (struct shellVariable *v = variables[i]; v; v = v->next)
+            snapshotAdd(&b, v->exported ? SNAPSHOT_EXPORTED : SNAPSHOT_VARIABLE, v->name, v->value);
+    for (int i = 0; i < ALIAS_BUCKETS; i++)
+        for (struct alias *a = aliases[i]; a; a = a->next)
+            snapshotAdd(&b, SNAPSHOT_ALIAS, a->name, a->value);
+    for (int i = 0; i < FUNCTION_BUCKETS; i++)
+    {
+        for (struct shellFunction *f = functions[i]; f; f = f->next)
+        {
+            if (f->definition == NULL) // made by an alias, no source to save
             {
-                close(connection[1]);                           // close the unused end of the pipe
-                read(connection[0], &message, sizeof(message)); // read the input from the pipe
-                FILE *ptr;
-                ptr = fopen(command->redirects[2], "a"); // option "a" appends to the end of the file
-                printf("%s\n", command->redirects[2]);
-                fputs(message, ptr);
-                fclose(ptr);
-                close(connection[1]);
+                free(b.data);
+                return -1;
             }
+            snapshotAdd(&b, SNAPSHOT_FUNCTION, f->name, f->definition);
         }
+    }
+    header.recordCount = b.records;
+
+    char temporary[PATH_MAX];
+    snprintf(temporary, sizeof(temporary), "%s.%d", snapshotPath, getpid());
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    int r = fd == -1 ? -1 : 0;
+    if (r == 0 && (writeAll(fd, (char *)&header, sizeof(header)) == -1 || writeAll(fd, b.data, b.length) == -1))
+        r = -1;
+    if (fd != -1)
+        close(fd);
+    if (r == 0 && rename(temporary, snapshotPath) == -1)
+        r = -1;
+    if (r == -1)
+        unlink(temporary);
+    free(b.data);
+    return r;
+}
 
-        return SUCCESS;
+// walk the records of a snapshot: 1 with the next one, 0 at the end, -1 if it is damaged
+static int snapshotNext(const char **p, const char *end, char *kind, const char **name, const char **value)
+{
+    if (*p == end)
+        return 0;
+    uint32_t nameLength, valueLength;
+    if (end - *p < 10)
+        return -1;
+    *kind = **p;
+    memcpy(&nameLength, *p + 1, 4);
+    memcpy(&valueLength, *p + 5, 4);
+    size_t length = 10 + (size_t)nameLength + (valueLength == UINT32_MAX ? 0 : (size_t)valueLength + 1);
+    if ((size_t)(end - *p) < length)
+        return -1;
+    *name = *p + 9;
+    *value = valueLength == UINT32_MAX ? NULL : *name + nameLength + 1;
+    if ((*name)[nameLength] != 0 || (*value && (*value)[valueLength] != 0))
+        return -1;
+    *p += length;
+    return 1;
+}
+
+bool inRcSnapshot(const void *p)
+{
+    const char *c = p;
+    return (c >= rcSnapshot.data && c < rcSnapshot.data + rcSnapshot.size) ||
+           (c >= rcSnapshot.entries && c < rcSnapshot.entries + rcSnapshot.entriesSize);
+}
+
+// free, unless it is part of the mapped rc snapshot
+void snapshotFree(void *p)
+{
+    if (!inRcSnapshot(p))
+        free(p);
+}
+
+/**
+ * Load the snapshot of the rc file, if it was made from this very file and
+ * the environment variables the rc file read still have the same values.
+ * The snapshot stays mapped: the variables, aliases and functions made from
+ * it use the names and values in it, and their structs come from one block,
+ * so a large rc file costs no allocation per entry.
+ * @return 0 if loaded, -1 if the rc file has to be run
+ */
+int loadRcSnapshot(const char *snapshotPath, const struct stat *rc)
+{
+    int fd = open(snapshotPath, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(struct snapshotHeader))
+    {
+        close(fd);
+        return -1;
+    }
+    char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return -1;
+    struct snapshotHeader expected, header;
+    fillSnapshotHeader(&expected, rc);
+    memcpy(&header, data, sizeof(header));
+    expected.recordCount = header.recordCount;
+    const char *begin = data + sizeof(header), *end = data + st.st_size, *p;
+    const char *name, *value;
+    char kind;
+    int r = memcmp(&header, &expected, sizeof(header)) == 0 ? 0 : -1;
+    size_t counts[3] = {0, 0, 0}; // variables, aliases, functions
+
+    // first pass: is it still valid?
+    for (p = begin; r == 0;)
+    {
+        int more = snapshotNext(&p, end, &kind, &name, &value);
+        if (more <= 0)
+        {
+            r = more;
+            break;
+        }
+        if (kind == SNAPSHOT_ENVIRONMENT)
+        {
+            const char *now = getenv(name);
+            if ((now == NULL) != (value == NULL) || (now && strcmp(now, value) != 0))
+                r = -1;
+        }
+        else if (value == NULL)
+            r = -1;
+        else
+            counts[kind == SNAPSHOT_ALIAS ? 1 : kind == SNAPSHOT_FUNCTION ? 2 : 0]++;
+    }
+    if (r == -1)
+    {
+        munmap(data, st.st_size);
+        return -1;
+    }
+
+    // second pass: link its entries into the tables
+    size_t entriesSize = counts[0] * sizeof(struct shellVariable) + counts[1] * sizeof(struct alias) +
+                         counts[2] * sizeof(struct shellFunction);
+    char *entries = calloc(1, entriesSize + 1);
+    struct shellVariable *v = (struct shellVariable *)entries;
+    struct alias *a = (struct alias *)(v + counts[0]);
+    struct shellFunction *f = (struct shellFunction *)(a + counts[1]);
+    for (p = begin; snapshotNext(&p, end, &kind, &name, &value) == 1;)
+    {
+        unsigned bucket;
+        switch (kind)
+        {
+        case SNAPSHOT_VARIABLE:
+        case SNAPSHOT_EXPORTED:
+            bucket = variableBucket(name, VARIABLE_BUCKETS);
+            *v = (struct shellVariable){(char *)name, (char *)value, kind == SNAPSHOT_EXPORTED, variables[bucket]};
+            variables[bucket] = v++;
+            if (kind == SNAPSHOT_EXPORTED)
+                setenv(name, value, 1);
+            break;
+        case SNAPSHOT_ALIAS:
+            bucket = variableBucket(name, ALIAS_BUCKETS);
+            *a = (struct alias){(char *)name, (char *)value, aliases[bucket]};
+            aliases[bucket] = a++;
+            break;
+        case SNAPSHOT_FUNCTION: // compiled when it is first called
+            bucket = variableBucket(name, FUNCTION_BUCKETS);
+            *f = (struct shellFunction){(char *)name, NULL, (char *)value, functions[bucket]};
+            functions[bucket] = f++;
+            break;
+        }
+    }
+    rcSnapshot.data = data;
+    rcSnapshot.size = st.st_size;
+    rcSnapshot.entries = entries;
+    rcSnapshot.entriesSize = entriesSize + 1;
+    return 0;
+}
+
+/**
+ * Run ~/.shellaxrc (or $SHELLAXRC). If it only sets variables, aliases and
+ * functions, what it leaves behind is saved as a snapshot next to it, and
+ * later shells load that instead of running it, until the file changes.
+ */
+void loadRcFile()
+{
+    char rcPath[PATH_MAX], snapshotPath[PATH_MAX];
+    const char *path = getenv("SHELLAXRC");
+    const char *home = getenv("HOME");
+    if (path == NULL && home == NULL)
+        return;
+    if (path == NULL)
+    {
+        snprintf(rcPath, sizeof(rcPath), "%s/.shellaxrc", home);
+        path = rcPath;
+    }
+    struct stat rc;
+    if (stat(path, &rc) == -1)
+        return;
+    if (snprintf(snapshotPath, sizeof(snapshotPath), "%s.snapshot", path) >= (int)sizeof(snapshotPath))
+        return;
+    bool useSnapshot = getenv("SHELLAX_NO_SNAPSHOT") == NULL;
+    if (useSnapshot && loadRcSnapshot(snapshotPath, &rc) == 0)
+        return;
+
+    char *source = readScriptFile(path);
+    if (source == NULL)
+    {
+        fprintf(stderr, "-%s: %s: %s\n", sysname, path, strerror(errno));
+        return;
+    }
+    rcRecording.active = true;
+    runScript(source);
+    rcRecording.active = false;
+    free(source);
+    returning = false;
+    breakLevels = continueLevels = 0;
+    if (useSnapshot && !rcRecording.impure && !exiting)
+        writeRcSnapshot(snapshotPath, &rc);
+    else if (useSnapshot)
+        unlink(snapshotPath); // stale, and this rc file can't have one
+    for (int i = 0; i < rcRecording.readCount; i++)
+    {
+        free(rcRecording.reads[i].name);
+        free(rcRecording.reads[i].value);
+    }
+    free(rcRecording.reads);
+    memset(&rcRecording, 0, sizeof(rcRecording));
+}
+
+static int compareTimes(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// start this shell count times up to its first prompt, return the times in ms
+static double *timeStartups(int count, bool snapshot)
+{
+    double *times = malloc(sizeof(double) * count);
+    for (int i = 0; i < count; i++)
+    {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            int null = open("/dev/null", O_WRONLY);
+            dup2(null, STDOUT_FILENO);
+            setenv("SHELLAX_STARTUP_EXIT", "1", 1);
+            if (!snapshot)
+                setenv("SHELLAX_NO_SNAPSHOT", "1", 1);
+            execl("/proc/self/exe", sysname, (char *)NULL);
+            _exit(127);
+        }
+        waitpid(pid, NULL, 0);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        times[i] = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    }
+    qsort(times, count, sizeof(double), compareTimes);
+    return times;
+}
+
+/**
+ * shellax --bench-startup N: time from exec to the first prompt, with the rc
+ * snapshot and with the rc file run every time
+ */
+int benchStartup(int count)
+{
+    if (count < 1)
+        count = 100;
+    free(timeStartups(1, true)); // makes the snapshot if there is none yet
+    for (int snapshot = 1; snapshot >= 0; snapshot--)
+    {
+        double *times = timeStartups(count, snapshot);
+        double total = 0;
+        for (int i = 0; i < count; i++)
+            total += times[i];
+        printf("%-14s %d runs: min %.3f ms, median %.3f ms, mean %.3f ms, p95 %.3f ms\n",
+               snapshot ? "rc snapshot" : "rc run", count, times[0], times[count / 2], total / count,
+               times[count * 95 / 100]);
+        free(times);
+    }
+    return 0;
+}
+
+/**
+ * shellax --server SOCKET: a shell that stays up and runs the scripts of
+ * shellax --client SOCKET -c, which asks for it by name. The rc file is
+ * run once, then every request is a fork of that shell in a session of its
+ * own: the client passes its stdin, stdout, stderr and cwd as fds
+ * (SCM_RIGHTS) with its environment, so the script writes straight to the
+ * client's output. The exit status goes back over the socket. A client
+ * that goes away takes its session with it.
+ */
+struct serverRequest
+{
+    uint32_t length; // of the strings that follow: script, $0 and arguments, environment
+    uint32_t argCount, envCount;
+    uint32_t umask;
+};
+
+#define SERVER_FDS 4 // stdin, stdout, stderr, cwd
+#define SERVER_MAX_REQUEST (64 << 20)
+
+static int serverConnect(const char *path)
+{
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd != -1 && connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// send the request for script and args (argv of -c after the script) on fd
+static int serverSend(int fd, const char *script, int argc, char **argv)
+{
+    extern char **environ;
+    int envCount = 0;
+    size_t length = strlen(script) + 1;
+    for (int i = 0; i < argc; i++)
+        length += strlen(argv[i]) + 1;
+    for (; environ[envCount]; envCount++)
+        length += strlen(environ[envCount]) + 1;
+    char *body = malloc(length), *p = body;
+    p = stpcpy(p, script) + 1;
+    for (int i = 0; i < argc; i++)
+        p = stpcpy(p, argv[i]) + 1;
+    for (int i = 0; i < envCount; i++)
+        p = stpcpy(p, environ[i]) + 1;
+
+    mode_t mask = umask(0);
+    umask(mask);
+    struct serverRequest request = {length, argc, envCount, mask};
+    int cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int fds[SERVER_FDS] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, cwd};
+    char control[CMSG_SPACE(sizeof(fds))] = {0};
+    struct iovec iov = {&request, sizeof(request)};
+    struct msghdr message = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control,
+                             .msg_controllen = sizeof(control)};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    int r = cwd == -1 || sendmsg(fd, &message, MSG_NOSIGNAL) != sizeof(request) || writeAll(fd, body, length) == -1
+                ? -1
+                : 0;
+    if (cwd != -1)
+        close(cwd);
+    free(body);
+    return r;
+}
+
+/**
+ * shellax --client SOCKET -c: have the server run it. Plain -c never asks a
+ * server: it is faster cold (no rc file) than a client exec plus a request
+ * @return its exit status, or -1 if there is no server to run it
+ */
+int runThroughServer(const char *path, int argc, char **argv)
+{
+    int fd = serverConnect(path);
+    if (fd == -1)
+        return -1;
+    outFlush(); // the script writes to our stdout from now on
+    if (serverSend(fd, argv[0], argc - 1, argv + 1) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    int32_t status;
+    ssize_t n;
+    while ((n = read(fd, &status, sizeof(status))) == -1 && errno == EINTR)
+        ;
+    close(fd);
+    if (n != sizeof(status))
+    {
+        fprintf(stderr, "-%s: %s: server closed the connection\n", sysname, path);
+        return 255;
+    }
+    return status;
+}
+
+static int readFull(int fd, void *data, size_t length)
+{
+    for (size_t done = 0; done < length;)
+    {
+        ssize_t n = read(fd, (char *)data + done, length - done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+// in the forked session: take the client's fds, cwd and environment, run the script
+static int serveRequest(int fd)
+{
+    struct serverRequest request;
+    int fds[SERVER_FDS];
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = {&request, sizeof(request)};
+    struct msghdr message = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control,
+                             .msg_controllen = sizeof(control)};
+    ssize_t n = recvmsg(fd, &message, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    if (n != sizeof(request) || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(fds)) || request.length > SERVER_MAX_REQUEST || request.length == 0)
+        return 2;
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    char *body = malloc(request.length + 1);
+    if (readFull(fd, body, request.length) == -1)
+        return 2;
+    body[request.length] = 0;
+
+    for (int i = 0; i < 3; i++)
+    {
+        dup2(fds[i], i);
+        close(fds[i]);
+    }
+    if (fchdir(fds[3]) == -1)
+        fprintf(stderr, "-%s: cd: %s\n", sysname, strerror(errno));
+    close(fds[3]);
+    umask(request.umask);
+
+    // the strings: script, $0 and the arguments, then the environment
+    char *p = body, *end = body + request.length;
+    char *script = p;
+    p += strlen(p) + 1;
+    char **args = malloc(sizeof(char *) * (request.argCount + 1));
+    for (uint32_t i = 0; i < request.argCount && p < end; i++, p += strlen(p) + 1)
+        args[i] = p;
+    clearenv();
+    for (uint32_t i = 0; i < request.envCount && p < end; i++, p += strlen(p) + 1)
+    {
+        putenv(p);
+        char *equals = strchr(p, '=');
+        if (equals == NULL)
+            continue;
+        *equals = 0; // a variable the rc file set is the client's now
+        if (findVariable(p))
+            setVariable(p, equals + 1, true);
+        *equals = '=';
     }
+    for (int b = 0; b < VARIABLE_BUCKETS; b++) // and what it exported is in the environment too
+        for (struct shellVariable *v = variables[b]; v; v = v->next)
+            if (v->exported && getenv(v->name) == NULL)
+                setenv(v->name, v->value, 1);
+
+    if (request.argCount > 0)
+        scriptName = args[0];
+    positional = args + (request.argCount > 0);
+    positionalCount = request.argCount > 1 ? request.argCount - 1 : 0;
+    int status = runScript(script);
+    outFlush();
+    return status;
+}
 
-    // TODO: your implementation here
-    printf("-%s: %s: command not found\n", sysname, command->name);
-    return UNKNOWN;
+struct serverSession
+{
+    int connection;
+    pid_t pid;
+};
+
+/**
+ * The server. One session is forked ahead of time and waits on channel for
+ * the connection it is to serve, so a request does not wait for a fork. The
+ * next one is forked after a session's status went out, not while a session
+ * runs: with few CPUs that fork would delay it.
+ */
+static struct
+{
+    int listener, epoll, signals;
+    sigset_t stop;
+    struct serverSession *sessions; // by supervisor slot
+    int capacity;
+    pid_t spare; // the next session, 0 if there is none
+    int spareSlot, spareChannel;
+} server;
+
+// in the spare session: wait for a connection from the server, serve it
+static void serverSpare(int channel)
+{
+    int connection = -1;
+    char byte;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {&byte, 1};
+    struct msghdr message = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control,
+                             .msg_controllen = sizeof(control)};
+    while (recvmsg(channel, &message, MSG_CMSG_CLOEXEC) == -1 && errno == EINTR)
+        ;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    if (cmsg && cmsg->cmsg_type == SCM_RIGHTS)
+        memcpy(&connection, CMSG_DATA(cmsg), sizeof(int));
+    close(channel);
+    if (connection == -1) // the server is going away
+        exit(0);
+    exit(serveRequest(connection));
 }
 
-int pipeCommand(struct command_t *command, int *p)
+static void serverForkSpare()
 {
-    char word[4096];
-    if (strcmp(command->name, "uniq") == 0) // call the corresponding uniq function if the command is "uniq"
+    int channel[2];
+    server.spare = 0;
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, channel) == -1)
+        return;
+    pid_t pid = fork();
+    if (pid == 0)
     {
-        close(p[1]);
-        read(p[0], &word, sizeof(word)); // get the input which "uniq" command will be applied to
-
-        if (command->arg_count > 0) // handles uniq -c
-        {
-            ourUniqWithCount(word);
-        }
-        else // handles uniq
-        {
-            ourUniq(word);
-        }
+        setsid();
+        sigprocmask(SIG_UNBLOCK, &server.stop, NULL);
+        signal(SIGPIPE, SIG_DFL);
+        close(server.listener);
+        close(server.epoll);
+        close(server.signals);
+        close(channel[0]);
+        for (int s = 0; s < server.capacity; s++)
+            if (server.sessions[s].pid)
+                close(server.sessions[s].connection);
+        serverSpare(channel[1]);
+    }
+    close(channel[1]);
+    int slot = pid == -1 ? -1 : superviseChild(pid);
+    if (slot == -1)
+    {
+        close(channel[0]);
+        return;
     }
+    server.spare = pid;
+    server.spareSlot = slot;
+    server.spareChannel = channel[0];
+}
 
-    if (command->next == NULL) // base case for piping
+// hand connection to the spare session; the next one is forked once a session ends
+static void serverHandOff(int connection)
+{
+    if (server.spare == 0)
+        serverForkSpare();
+    if (server.spare == 0)
     {
-        close(0);
-        dup(p[0]); // pass the output to the next command as an input
-        close(p[1]);
-        runCommand(command); // no more pipe, run the last commnand on the output of previous commands
+        close(connection);
+        return;
     }
-    else
+    char byte = 0;
+    char control[CMSG_SPACE(sizeof(int))] = {0};
+    struct iovec iov = {&byte, 1};
+    struct msghdr message = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control,
+                             .msg_controllen = sizeof(control)};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &connection, sizeof(int));
+    int sent = sendmsg(server.spareChannel, &message, MSG_NOSIGNAL);
+    close(server.spareChannel);
+    int slot = server.spareSlot;
+    server.spare = 0;
+    if (sent != 1)
     {
-        if (fork() == 0)
-        {
-            close(0);
-            dup(p[0]); // pass the output to the next command as an input
-            close(p[1]);
-            pipeCommand(command->next, p); // recursive call to handle the next pipe
-        }
-        else
-        {
-            close(1);
-            dup(p[1]); // write to pipe - passing the input
-            close(p[0]);
-            runCommand(command); // run command with the input
-        }
+        close(connection);
+        serverForkSpare();
+        return;
     }
-    return 0;
+    if (slot >= server.capacity)
+    {
+        int old = server.capacity;
+        server.capacity = slot * 2 + 16;
+        server.sessions = realloc(server.sessions, sizeof(struct serverSession) * server.capacity);
+        memset(server.sessions + old, 0, sizeof(struct serverSession) * (server.capacity - old));
+    }
+    server.sessions[slot] = (struct serverSession){connection, supervisor.children[slot].pid};
+    struct epoll_event hangup = {EPOLLRDHUP, {.u64 = 3 + (uint64_t)slot}};
+    epoll_ctl(server.epoll, EPOLL_CTL_ADD, connection, &hangup);
 }
 
-void runCommand(struct command_t *command)
+// sessions that ended: their exit status to their client
+static void serverReap()
 {
-    // increase args size by 2
-    command->args = (char **)realloc(
-        command->args, sizeof(char *) * (command->arg_count += 2));
-
-    // shift everything forward by 1
-    for (int i = command->arg_count - 2; i > 0; --i)
-        command->args[i] = command->args[i - 1];
-
-    command->args[0] = strdup(command->name);
-    command->args[command->arg_count - 1] = NULL;
-
-    char *path = getenv("PATH"); // get the path to search for commands
-
-    char pathOfCommand[50];
-    const char s[2] = ":";
-
-    char *token;
-
-    token = strtok(path, s); // divide into tokens to search into every directory
-
-    DIR *pDir;
-    struct dirent *entry;
-
-    while (token != NULL) // keep reading until there are no directories left
+    supervisorWait(0, NULL, 0);
+    for (int slot = 0; slot < server.capacity; slot++)
     {
-        pDir = opendir(token); // open the current directory
-
-        if (pDir == NULL)
-        {
-            // return 1;
-        }
-        else
-        {
-            while ((entry = readdir(pDir)) != NULL) // read the entries in the current directory
-            {
-                if (strcmp(entry->d_name, command->name) == 0) // the path of the command is found
-                {
-                    strcpy(pathOfCommand, "");
-                    strcpy(pathOfCommand, token);
-                    strcat(pathOfCommand, "/");
-                    strcat(pathOfCommand, command->name);
-                    execv(pathOfCommand, command->args); // call execv() wiht the path of the command and the arguments received from the user
-                    exit(0);
-                    break;
-                }
-            }
-        }
-
-        token = strtok(NULL, s); // read the next one
+        struct serverSession *s = &server.sessions[slot];
+        if (s->pid == 0 || !supervisor.children[slot].exited)
+            continue;
+        int32_t status = exitStatus(supervisor.children[slot].status);
+        send(s->connection, &status, sizeof(status), MSG_NOSIGNAL);
+        close(s->connection);
+        s->pid = 0;
+        releaseChild(slot);
+    }
+    if (server.spare && supervisor.children[server.spareSlot].exited) // should not happen, but then
+    {
+        close(server.spareChannel);
+        releaseChild(server.spareSlot);
+        server.spare = 0;
     }
+    if (server.spare == 0) // the next one, now that the client has its status
+        serverForkSpare();
 }
 
-void ourUniq(char *input)
+int runServer(const char *path)
 {
-    const char s[2] = "\n";
-    char *token;
-    token = strtok(input, s); // get each token separated by a newline
-
-    char visited[100][100]; // keep an array of strings to keep the words encountered for the first time
-    int i = 0;
-    strcpy(visited[i], token); // the first word read from the input should be added to the array
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "-%s: %s: %s\n", sysname, path, strerror(ENAMETOOLONG));
+        return 1;
+    }
+    strcpy(address.sun_path, path);
+    int other = serverConnect(path);
+    if (other != -1)
+    {
+        close(other);
+        fprintf(stderr, "-%s: %s: a server is already running there\n", sysname, path);
+        return 1;
+    }
+    unlink(path); // left by one that is gone
+    server.listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    mode_t mask = umask(0077); // only for this user
+    int r = server.listener == -1 ? -1 : bind(server.listener, (struct sockaddr *)&address, sizeof(address));
+    umask(mask);
+    if (r == -1 || listen(server.listener, 128) == -1)
+    {
+        fprintf(stderr, "-%s: %s: %s\n", sysname, path, strerror(errno));
+        return 1;
+    }
 
-    int exists = 0; // initially exists set to 0 meaning the word is not encountered yet
+    loadRcFile(); // once, for all the sessions
+    outFlush();
+    sigemptyset(&server.stop);
+    sigaddset(&server.stop, SIGINT);
+    sigaddset(&server.stop, SIGTERM);
+    sigprocmask(SIG_BLOCK, &server.stop, NULL);
+    server.signals = signalfd(-1, &server.stop, SFD_CLOEXEC);
+    signal(SIGPIPE, SIG_IGN);
+    supervisorStart();
+    server.epoll = epoll_create1(EPOLL_CLOEXEC);
+    int fds[3] = {server.listener, server.signals, supervisor.epoll};
+    for (int k = 0; k < 3; k++)
+    {
+        struct epoll_event event = {EPOLLIN, {.u64 = k}};
+        epoll_ctl(server.epoll, EPOLL_CTL_ADD, fds[k], &event);
+    }
+    fprintf(stderr, "-%s: serving on %s\n", sysname, path);
+    serverForkSpare();
 
-    while (token != NULL) // keep reading the input
+    bool running = true;
+    while (running)
     {
-        for (int k = 0; k < i; k++)
+        struct epoll_event events[64];
+        int n = epoll_wait(server.epoll, events, 64, -1);
+        for (int k = 0; k < n; k++)
         {
-            if (strcmp(visited[k], token) == 0) // current token is a duplicate, so we will not add it to the visited array
+            uint64_t what = events[k].data.u64;
+            if (what == 0)
+            {
+                int connection;
+                while ((connection = accept4(server.listener, NULL, NULL, SOCK_CLOEXEC)) != -1)
+                {
+                    struct ucred peer;
+                    socklen_t size = sizeof(peer);
+                    if (getsockopt(connection, SOL_SOCKET, SO_PEERCRED, &peer, &size) == -1 ||
+                        peer.uid != geteuid())
+                        close(connection);
+                    else
+                        serverHandOff(connection);
+                }
+            }
+            else if (what == 1)
+                running = false;
+            else if (what == 2)
+                serverReap();
+            else // a client went away before its script ended
             {
-                exists = 1; // this word is previously encountered
+                struct serverSession *s = &server.sessions[what - 3];
+                if (s->pid)
+                {
+                    kill(-s->pid, SIGHUP);
+                    epoll_ctl(server.epoll, EPOLL_CTL_DEL, s->connection, NULL);
+                }
             }
         }
-        if (exists == 0) // first encounter of this word, so will be add to the array
-        {
-            strcpy(visited[i], token);
-            i++;
-        }
-        token = strtok(NULL, s); // read the next one
-        exists = 0;              // reset the exists variable
-    }
-
-    for (int m = 0; m < i; m++) // print the elements from the array with no duplicates
-    {
-        printf("%s\n", visited[m]);
     }
+    unlink(path);
+    if (server.spare)
+        close(server.spareChannel); // it exits
+    for (int s = 0; s < server.capacity; s++)
+        if (server.sessions[s].pid)
+            kill(-server.sessions[s].pid, SIGHUP);
+    free(server.sessions);
+    return 0;
 }
 
-void ourUniqWithCount(char *input)
+// time count requests through the server, either execing a client (with exec) or sending them from here
+static double *timeRequests(const char *path, int count, bool exec)
 {
-    const char s[2] = "\n";
-    char *token;
-    token = strtok(input, s); // get each token separated by a newline
-
-    char visited[100][100]; // keep an array of strings to keep the words encountered for the first time
-    int visitedCount[100];  // will keep the count in an array
-    int i = 0;
-    strcpy(visited[i], token); // the first word read from the input should be added to the array
-
-    int exists = 0; // initially exists set to 0 meaning the word is not encountered yet
-
-    while (token != NULL) // keep reading the input
+    double *times = malloc(sizeof(double) * count);
+    char *argv[] = {"true", (char *)sysname};
+    for (int i = 0; i < count; i++)
     {
-        for (int k = 0; k < i; k++)
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (exec)
         {
-            if (strcmp(visited[k], token) == 0) // current token is a duplicate, so we will not add it to the visited array
+            pid_t pid = fork();
+            if (pid == 0)
             {
-                exists = 1;        // this word is previously encountered
-                visitedCount[k]++; // increment the corresponding index in the visitedCount array
+                if (path)
+                    execl("/proc/self/exe", sysname, "--client", path, "-c", "true", (char *)NULL);
+                else
+                    execl("/proc/self/exe", sysname, "-c", "true", (char *)NULL);
+                _exit(127);
             }
+            waitpid(pid, NULL, 0);
         }
-        if (exists == 0) // first encounter of this word, so will be add to the array
+        else if (runThroughServer(path, 2, argv) == -1)
         {
-            strcpy(visited[i], token);
-            visitedCount[i] = 1; // count is 1
-            i++;
+            fprintf(stderr, "-%s: %s: %s\n", sysname, path, strerror(errno));
+            free(times);
+            return NULL;
         }
-        token = strtok(NULL, s); // read the next one
-        exists = 0;              // reset the exists variable
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        times[i] = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
     }
+    qsort(times, count, sizeof(double), compareTimes);
+    return times;
+}
 
-    for (int m = 0; m < i; m++) // print the elements from the array with no duplicates and the corresponding counts
+/**
+ * shellax --bench-server SOCKET [N]: time shellax -c true started cold, the
+ * same with --client through the server, and a request alone (no client exec)
+ */
+int benchServer(const char *path, int count)
+{
+    if (count < 1)
+        count = 100;
+    const char *labels[] = {"cold start", "via server", "request only"};
+    for (int kind = 0; kind < 3; kind++)
     {
-        printf("%d %s\n", visitedCount[m], visited[m]);
+        double *times = timeRequests(kind == 0 ? NULL : path, count, kind < 2);
+        if (times == NULL)
+            return 1;
+        double total = 0;
+        for (int i = 0; i < count; i++)
+            total += times[i];
+        printf("%-14s %d runs: min %.3f ms, median %.3f ms, mean %.3f ms, p95 %.3f ms\n", labels[kind], count,
+               times[0], times[count / 2], total / count, times[count * 95 / 100]);
+        free(times);
     }
+    return 0;
 }
 
 int wiseman(struct command_t *command, char *minutes)
 {
+    (void)command;
     // str will appends the input "minutes" to the cronjob to be scheduled
     char str[150];
     strcpy(str, "echo '*/");
@@ -806,6 +11541,7 @@ int wiseman(struct command_t *command, char *minutes)
     strcat(str, " * * * * /tmp/com.sh' | crontab -");
     // system("echo 'echo | fortune | cowsay >>/tmp/wisecow.txt' >/tmp/com.sh"); //does not work for some reason
     //  instead it writes "Wiseman is working" to /tmp/wisecow.txt periodically
+    outFlush(); // system forks
     system("echo 'echo 'Wiseman is working' >>/tmp/wisecow.txt' >/tmp/com.sh");
     system("chmod a+x /tmp/com.sh"); // make the com.sh executable
     system(str);                     // schedule the cron job
@@ -826,7 +11562,6 @@ void chatroom(struct command_t *command)
 
     int numberOfUser = 0; // keeping the number of users in a chatroom
 
-    DIR *chatroomPtr;
     DIR *userPtr;
     DIR *userPtr2;
     DIR *userPtr3;
@@ -840,26 +11575,16 @@ void chatroom(struct command_t *command)
     strcat(userName, "/");
     strcat(userName, command->args[1]); // append the name of the user
 
-    chatroomPtr = opendir("/tmp");
+    // create the directory with the given name and handle the permissions; if it is there the chatroom is
+    if (mkdir(chatroomName, 0777) == -1 && errno == EEXIST)
+        chatroomExist = 1;
 
-    if (chatroomPtr == NULL)
-    {
-    }
-    else
-    {
-        while ((entry = readdir(chatroomPtr)) != NULL) // check inside the /tmp
-        {
-            if (strcmp(entry->d_name, command->args[0]) == 0) // chatroom is found, no need to create again
-            {
-                chatroomExist = 1;
-            }
-        }
-    }
-    if (chatroomExist == 0) // chatroom is not created before
-    {
-        mkdir(chatroomName, 0777); // create the directory with the given name and handle the permissions
-    }
-    else
+    // users joining later are told by inotify, instead of looking through the chatroom again
+    int joins = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (joins != -1)
+        inotify_add_watch(joins, chatroomName, IN_CREATE);
+
+    if (chatroomExist == 1)
     {
         userPtr = opendir(chatroomName);
 
@@ -894,17 +11619,24 @@ void chatroom(struct command_t *command)
     {
         strcpy(users[numberOfUser], userName); // add the new user's info to the users array
         numberOfUser++;
-        if (mkfifo(userName, 0777) == -1) // create a named pipe with the given user name and handle the permissions
+        if (mkfifo(userName, 0777) == -1 && errno != EEXIST) // create a named pipe with the given user name and handle the permissions
         {
             printf("Failed to pipe\n");
         }
     }
+    if (joins != -1) // our own pipe is already in users
+    {
+        char events[4096];
+        while (read(joins, events, sizeof(events)) > 0)
+            ;
+    }
 
     // pid_t pids[numberOfUser];
     char messageSent[450];
     char messageReceived[450];
     strcpy(messageSent, "");
 
+    outFlush();
     for (int i = 0; i < numberOfUser; i++)
     {
         pid_t pid = fork();
@@ -939,6 +11671,7 @@ void chatroom(struct command_t *command)
         char messageReceived[450];
         strcpy(messageSent, "");
 
+        outFlush(); // opening the pipe waits for a writer
         int fd1 = open(userName, O_RDONLY);
         read(fd1, &messageReceived, sizeof(messageReceived));
         close(fd1);
@@ -948,8 +11681,29 @@ void chatroom(struct command_t *command)
 
         // get the message from the user:
         char messageToSent[450];
+        outFlush();
         fgets(messageToSent, 450, stdin);
 
+        // whoever joined meanwhile gets it too
+        char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t length;
+        while (joins != -1 && (length = read(joins, events, sizeof(events))) > 0)
+        {
+            for (char *p = events; p < events + length; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len)
+            {
+                const struct inotify_event *event = (const struct inotify_event *)p;
+                char username[50];
+                if (event->len == 0 || numberOfUser == 50 ||
+                    snprintf(username, sizeof(username), "%s/%s", chatroomName, event->name) >= (int)sizeof(username))
+                    continue; // users[] takes names of 50 bytes
+                bool known = false;
+                for (int i = 0; i < numberOfUser && !known; i++)
+                    known = strcmp(users[i], username) == 0;
+                if (!known)
+                    strcpy(users[numberOfUser++], username);
+            }
+        }
+
         for (int i = 0; i < numberOfUser; i++)
         {
             pid_t pid2 = fork();
@@ -997,6 +11751,7 @@ void guessGame(int guess, int goal, int lower, int higher, int *shot)
         int newguess;
         printf("Too low please make a guess between %d-%d : ", guess, higher);
         (*shot)++;
+        outFlush();
         scanf("%d", &newguess);
         guessGame(newguess, goal, guess, higher, shot);
     }
@@ -1005,6 +11760,7 @@ void guessGame(int guess, int goal, int lower, int higher, int *shot)
         int newguess2;
         printf("Too high please make a guess between %d-%d : ", lower, guess);
         (*shot)++;
+        outFlush();
         scanf("%d", &newguess2);
         guessGame(newguess2, goal, lower, guess, shot);
     }
@@ -1013,74 +11769,463 @@ void guessGame(int guess, int goal, int lower, int higher, int *shot)
 // Custom Command - Yesim
 void wordGame(char word[], int *chance) // takes the word to be guessed in the game,  and the number of chances the user have
 {
-    // will count the number of letters that are in the right location
-    // correctness == 5 means the word is guessed correctly
-    int correctness = 0;
-
-    char guess[7];
+    unsigned char answer[WORD_LENGTH], letters[WORD_LENGTH];
+    unsigned char marks[WORD_LENGTH];
+    char guess[WORD_LENGTH + 2];
 
-    // Get the guess from the user
-    printf("Enter a guess: ");
-    fgets(guess, 7, stdin);
+    encodeWord(word, answer);
 
-    // Compare each char of the guess string and the wordle string
-    for (int i = 0; i < 5; i++)
+    while ((*chance) > 0) // one iteration per guess
     {
-        if (guess[i] == word[i]) // the letter user guessed is in the right location.
+        // Get the guess from the user
+        outString("Enter a guess: ");
+        outFlush();
+        if (fgets(guess, sizeof(guess), stdin) == NULL)
+            return;
+        encodeWord(guess, letters);
+
+        // marks[i] is 2 for right place, 1 for wrong place, 0 for not in the word
+        int pattern = scoreGuess(letters, answer);
+        int correctness = 0; // number of letters that are in the right location
+        for (int i = 0; i < WORD_LENGTH; i++)
         {
-            correctness++; // Increment each time a letter is right
-            green();       // Print this letter green
-            printf("%c", guess[i]);
+            marks[i] = pattern % 3;
+            pattern /= 3;
+        }
+
+        for (int i = 0; i < WORD_LENGTH; i++)
+        {
+            if (marks[i] == 2) // the letter user guessed is in the right location.
+            {
+                correctness++;
+                green();
+            }
+            else if (marks[i] == 0) // the letter is not in the word (or all its copies are already used)
+                red();
+            else // Letters that are in the word, but guessed in the wrong location will be colored yellow.
+                yellow();
+            outChar(guess[i]);
             reset();
         }
-        // Check if the current letter is same as any of the letters in the word. If not, it should be printed in red
-        else if (guess[i] != word[0] && guess[i] != word[1] &&
-                 guess[i] != word[2] && guess[i] != word[3] &&
-                 guess[i] != word[4])
+        printf("\n"); // After printing and coloring the guess string
+        (*chance)--;  // User lost 1 chance, decrement the chance
+
+        if (correctness == WORD_LENGTH) // all the letters are guessed correctly
         {
-            red();
-            printf("%c", guess[i]);
+            blue();
+            printf("Correct!\n");
             reset();
+            return;
         }
-        else // Letters that are in the word, but guessed in the wrong location will be colored yellow.
+        blue();
+        if ((*chance) == 0) // no chances left, print out the actual word
         {
-            yellow();
-            printf("%c", guess[i]);
+            printf("Sorry:(( The word you were looking for : ");
             reset();
+            cyan();
+            printf("%s", word);
         }
+        else if (correctness > 2) // more than 2 letters are guessed correctly in the right location
+            printf("%d chances left. Almost there, try again.\n", *chance);
+        else
+            printf("%d chances left. Try again.\n", *chance);
+        reset();
     }
-    printf("\n"); // After printing and coloring the guess string
-    (*chance)--;  // User lost 1 chance, decrement the chance
+}
 
-    if (correctness == 5 && (*chance) >= 0) // all the letters are guessed correctly. Do not call the function recursively.
+/**
+ * Convert the letters of a word to 0-25, anything else becomes 26
+ * @param word    text of the word, at least WORD_LENGTH chars or NUL terminated
+ * @param letters output, WORD_LENGTH bytes
+ * @return        26-bit mask of the letters used in the word
+ */
+uint32_t encodeWord(const char *word, unsigned char *letters)
+{
+    uint32_t mask = 0;
+    int ended = 0;
+    for (int i = 0; i < WORD_LENGTH; i++)
     {
-        blue();
-        printf("Correct!\n");
-        reset();
+        if (word[i] == 0)
+            ended = 1;
+        if (!ended && word[i] >= 'a' && word[i] <= 'z')
+        {
+            letters[i] = word[i] - 'a';
+            mask |= 1u << letters[i];
+        }
+        else
+            letters[i] = 26;
     }
-    else if (correctness > 2 && (*chance) > 0) // more than 2 letters are guessed correctly in the right location and the user still has chances
+    return mask;
+}
+
+/**
+ * Wordle feedback for a guess, repeated letters are only marked as many
+ * times as they appear in the answer (greens first, then yellows left to right)
+ * @return pattern in base 3, digit i is 2 (green), 1 (yellow) or 0 (grey)
+ */
+int scoreGuess(const unsigned char *guess, const unsigned char *answer)
+{
+    unsigned char counts[27] = {0};
+    unsigned char marks[WORD_LENGTH];
+    for (int i = 0; i < WORD_LENGTH; i++)
     {
-        blue();
-        printf("%d chances left. Almost there, try again.\n", *chance);
-        reset();
-        wordGame(word, chance);
+        if (guess[i] == answer[i] && guess[i] != 26)
+            marks[i] = 2;
+        else
+        {
+            marks[i] = 0;
+            counts[answer[i]]++;
+        }
     }
-    else if ((*chance) > 0) // user still has chances, so call the function recursively, and print out the chances left.
+    int pattern = 0;
+    for (int i = WORD_LENGTH - 1; i >= 0; i--)
+        pattern = pattern * 3 + marks[i];
+    for (int i = 0; i < WORD_LENGTH; i++) // yellows, consuming the unmatched letters of the answer
     {
-        blue();
-        printf("%d chances left. Try again.\n", *chance);
-        reset();
-        wordGame(word, chance);
+        if (marks[i] == 0 && guess[i] != 26 && counts[guess[i]] > 0)
+        {
+            counts[guess[i]]--;
+            pattern += pow3[i];
+        }
+    }
+    return pattern;
+}
+
+/**
+ * Read a word list (one word per line) and encode it
+ * @return 0 on success, -1 if the file could not be read
+ */
+int loadWordList(const char *fileName, struct wordList *list)
+{
+    FILE *textfile = fopen(fileName, "r");
+    if (textfile == NULL)
+        return -1;
+
+    int capacity = 256;
+    char line[64];
+    memset(list, 0, sizeof(*list));
+    list->masks = malloc(sizeof(uint32_t) * capacity);
+    list->texts = malloc(sizeof(*list->texts) * capacity);
+    for (int p = 0; p < WORD_LENGTH; p++)
+        list->letters[p] = malloc(capacity);
+
+    while (fgets(line, sizeof(line), textfile) != NULL)
+    {
+        int len = strcspn(line, "\r\n");
+        if (len != WORD_LENGTH) // skip blank lines and words of the wrong size
+            continue;
+        if (list->count == capacity)
+        {
+            capacity *= 2;
+            list->masks = realloc(list->masks, sizeof(uint32_t) * capacity);
+            list->texts = realloc(list->texts, sizeof(*list->texts) * capacity);
+            for (int p = 0; p < WORD_LENGTH; p++)
+                list->letters[p] = realloc(list->letters[p], capacity);
+        }
+        unsigned char letters[WORD_LENGTH];
+        list->masks[list->count] = encodeWord(line, letters);
+        for (int p = 0; p < WORD_LENGTH; p++)
+            list->letters[p][list->count] = letters[p];
+        memcpy(list->texts[list->count], line, WORD_LENGTH);
+        list->texts[list->count][WORD_LENGTH] = 0;
+        list->count++;
+    }
+    fclose(textfile);
+    return list->count > 0 ? 0 : -1;
+}
+
+void freeWordList(struct wordList *list)
+{
+    free(list->masks);
+    free(list->texts);
+    for (int p = 0; p < WORD_LENGTH; p++)
+        free(list->letters[p]);
+}
+
+// letters of word i of the list, gathered from the per-position columns
+static inline void wordLetters(const struct wordList *list, int i, unsigned char *letters)
+{
+    for (int p = 0; p < WORD_LENGTH; p++)
+        letters[p] = list->letters[p][i];
+}
+
+/**
+ * Keep only the candidates that would have produced the given feedback.
+ * Greens and letter masks are checked column by column over the whole candidate
+ * set first (plain loops the compiler vectorizes), the exact score is only
+ * computed for the survivors.
+ * @param cand  indexes into the list, filtered in place
+ * @return      new number of candidates
+ */
+int filterCandidates(const struct wordList *list, int *cand, int n,
+                     const unsigned char *guess, int pattern)
+{
+    uint32_t present = 0, absent = 0;
+    unsigned char marks[WORD_LENGTH];
+    for (int i = 0, p = pattern; i < WORD_LENGTH; i++, p /= 3)
+    {
+        marks[i] = p % 3;
+        if (marks[i] != 0 && guess[i] != 26)
+            present |= 1u << guess[i];
     }
-    else if ((*chance) == 0) // no chances left, print out the actual word
+    for (int i = 0; i < WORD_LENGTH; i++) // grey letters are absent only if not marked elsewhere
+        if (marks[i] == 0 && guess[i] != 26 && !(present & (1u << guess[i])))
+            absent |= 1u << guess[i];
+
+    unsigned char *keep = malloc(n > 0 ? n : 1);
+    for (int k = 0; k < n; k++)
     {
-        blue();
-        printf("Sorry:(( The word you were looking for : ");
-        reset();
-        cyan();
-        printf("%s", word);
-        reset();
+        uint32_t m = list->masks[cand[k]];
+        keep[k] = ((m & present) == present) & ((m & absent) == 0);
+    }
+    for (int i = 0; i < WORD_LENGTH; i++)
+    {
+        if (guess[i] == 26)
+            continue;
+        const unsigned char *column = list->letters[i];
+        unsigned char g = guess[i];
+        if (marks[i] == 2)
+            for (int k = 0; k < n; k++)
+                keep[k] &= column[cand[k]] == g;
+        else
+            for (int k = 0; k < n; k++)
+                keep[k] &= column[cand[k]] != g;
+    }
+
+    int kept = 0;
+    unsigned char letters[WORD_LENGTH];
+    for (int k = 0; k < n; k++)
+    {
+        if (!keep[k])
+            continue;
+        wordLetters(list, cand[k], letters);
+        if (scoreGuess(guess, letters) == pattern)
+            cand[kept++] = cand[k];
+    }
+    free(keep);
+    return kept;
+}
+
+/**
+ * Pick the guess with the highest expected information gain over the candidates.
+ * Every word of the list is a possible guess, ties prefer a remaining candidate.
+ * @return index of the guess in the list
+ */
+int bestGuess(const struct wordList *list, const int *cand, int n)
+{
+    if (n <= 2) // no guess can do better than trying a candidate
+        return cand[0];
+
+    int histogram[WORD_PATTERNS];
+    unsigned char guess[WORD_LENGTH], answer[WORD_LENGTH];
+    char *isCandidate = calloc(list->count, 1);
+    for (int k = 0; k < n; k++)
+        isCandidate[cand[k]] = 1;
+
+    int best = cand[0];
+    double bestScore = -1;
+    for (int g = 0; g < list->count; g++)
+    {
+        memset(histogram, 0, sizeof(histogram));
+        wordLetters(list, g, guess);
+        uint32_t gm = list->masks[g];
+        for (int k = 0; k < n; k++)
+        {
+            if ((list->masks[cand[k]] & gm) == 0) // no common letters, all grey
+            {
+                histogram[0]++;
+                continue;
+            }
+            wordLetters(list, cand[k], answer);
+            histogram[scoreGuess(guess, answer)]++;
+        }
+        // expected information = log2(n) - sum(c * log2(c)) / n
+        double sum = 0;
+        for (int p = 0; p < WORD_PATTERNS; p++)
+            if (histogram[p] > 1)
+                sum += histogram[p] * log2(histogram[p]);
+        double score = log2(n) - sum / n + (isCandidate[g] ? 1e-6 : 0);
+        if (score > bestScore)
+        {
+            bestScore = score;
+            best = g;
+        }
+    }
+    free(isCandidate);
+    return best;
+}
+
+/**
+ * Let the solver play against one answer
+ * @param firstGuess precomputed opening guess (same for every game), -1 to compute
+ * @param trace      print every guess with its colors
+ * @return           number of guesses used
+ */
+int solveWord(const struct wordList *list, int answerIndex, int firstGuess, int trace)
+{
+    int *cand = malloc(sizeof(int) * list->count);
+    int n = list->count;
+    for (int k = 0; k < n; k++)
+        cand[k] = k;
+
+    unsigned char guess[WORD_LENGTH], answer[WORD_LENGTH];
+    wordLetters(list, answerIndex, answer);
+    int guesses = 0;
+    while (n > 0 && guesses < WORD_MAX_SOLVER_GUESSES)
+    {
+        int g = (guesses == 0 && firstGuess >= 0) ? firstGuess : bestGuess(list, cand, n);
+        wordLetters(list, g, guess);
+        int pattern = scoreGuess(guess, answer);
+        guesses++;
+        if (trace)
+        {
+            printf("%d. ", guesses);
+            for (int i = 0, p = pattern; i < WORD_LENGTH; i++, p /= 3)
+            {
+                if (p % 3 == 2)
+                    green();
+                else if (p % 3 == 1)
+                    yellow();
+                else
+                    red();
+                printf("%c", list->texts[g][i]);
+                reset();
+            }
+            printf("  (%d candidates left)\n", n);
+        }
+        if (pattern == WORD_PATTERNS - 1) // all green
+            break;
+        n = filterCandidates(list, cand, n, guess, pattern);
+    }
+    free(cand);
+    return guesses;
+}
+
+// word --solve [answer] [wordlist]: the solver plays a game and shows its guesses
+void wordSolve(struct command_t *command)
+{
+    struct wordList list;
+    const char *fileName = command->arg_count > 2 ? command->args[2] : "words.txt";
+    if (loadWordList(fileName, &list) == -1)
+    {
+        printf("Sorry, could not read %s.\n", fileName);
+        return;
+    }
+
+    int answerIndex = -1;
+    if (command->arg_count > 1)
+    {
+        for (int i = 0; i < list.count; i++)
+            if (strcmp(list.texts[i], command->args[1]) == 0)
+                answerIndex = i;
+        if (answerIndex == -1)
+        {
+            printf("%s is not in the word list\n", command->args[1]);
+            freeWordList(&list);
+            return;
+        }
+    }
+    else
+    {
+        srand(time(NULL));
+        answerIndex = rand() % list.count;
+    }
+
+    int guesses = solveWord(&list, answerIndex, -1, 1);
+    blue();
+    printf("Solved %s in %d guesses\n", list.texts[answerIndex], guesses);
+    reset();
+    freeWordList(&list);
+}
+
+struct wordBenchJob
+{
+    const struct wordList *list;
+    int firstGuess;
+    int start, step; // answers start, start + step, ...
+    long totalGuesses;
+    int maxGuesses, failures;
+};
+
+void *wordBenchWorker(void *arg)
+{
+    struct wordBenchJob *job = arg;
+    for (int i = job->start; i < job->list->count; i += job->step)
+    {
+        int guesses = solveWord(job->list, i, job->firstGuess, 0);
+        job->totalGuesses += guesses;
+        if (guesses > job->maxGuesses)
+            job->maxGuesses = guesses;
+        if (guesses > 6) // would have lost the real game
+            job->failures++;
+    }
+    return NULL;
+}
+
+// word --bench [wordlist]: play every word of the list and report the solver's average
+void wordBench(struct command_t *command)
+{
+    struct wordList list;
+    const char *fileName = command->arg_count > 1 ? command->args[1] : "words.txt";
+    if (loadWordList(fileName, &list) == -1)
+    {
+        printf("Sorry, could not read %s.\n", fileName);
+        return;
+    }
+
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    int *all = malloc(sizeof(int) * list.count);
+    for (int k = 0; k < list.count; k++)
+        all[k] = k;
+    int firstGuess = bestGuess(&list, all, list.count); // the opening is the same for every game
+    free(all);
+
+    int threads = 1;
+    if (list.count >= WORD_PARALLEL_THRESHOLD)
+    {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (threads < 1)
+            threads = 1;
+    }
+    struct wordBenchJob *jobs = calloc(threads, sizeof(struct wordBenchJob));
+    pthread_t *tids = malloc(sizeof(pthread_t) * threads);
+    for (int t = 0; t < threads; t++)
+    {
+        jobs[t].list = &list;
+        jobs[t].firstGuess = firstGuess;
+        jobs[t].start = t;
+        jobs[t].step = threads;
+        if (threads > 1)
+            pthread_create(&tids[t], NULL, wordBenchWorker, &jobs[t]);
+        else
+            wordBenchWorker(&jobs[t]);
+    }
+
+    long totalGuesses = 0;
+    int maxGuesses = 0, failures = 0;
+    for (int t = 0; t < threads; t++)
+    {
+        if (threads > 1)
+            pthread_join(tids[t], NULL);
+        totalGuesses += jobs[t].totalGuesses;
+        if (jobs[t].maxGuesses > maxGuesses)
+            maxGuesses = jobs[t].maxGuesses;
+        failures += jobs[t].failures;
     }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+
+    printf("Words played: %d (%d thread%s)\n", list.count, threads, threads > 1 ? "s" : "");
+    printf("Opening guess: %s\n", list.texts[firstGuess]);
+    printf("Average guesses: %.3f, worst: %d, over 6: %d\n",
+           (double)totalGuesses / list.count, maxGuesses, failures);
+    printf("Time: %.3f s, %.1f words/second\n", seconds, list.count / seconds);
+
+    free(jobs);
+    free(tids);
+    freeWordList(&list);
 }
 
 // helper function for the wordGame
@@ -1111,35 +12256,35 @@ void printGameInfo()
 // functions below this line are used to color the texts in the wordGame:
 void red()
 {
-    printf("\033[1;31m");
+    outString("\033[1;31m");
 }
 
 void purple()
 {
-    printf("\033[1;35m");
+    outString("\033[1;35m");
 }
 
 void green()
 {
-    printf("\033[1;32m");
+    outString("\033[1;32m");
 }
 
 void reset()
 {
-    printf("\033[0m");
+    outString("\033[0m");
 }
 
 void blue()
 {
-    printf("\33[0;34m");
+    outString("\33[0;34m");
 }
 
 void yellow()
 {
-    printf("\033[1;33m");
+    outString("\033[1;33m");
 }
 
 void cyan()
 {
-    printf("\033[1;36m");
+    outString("\033[1;36m");
 }
@@ -0,0 +1,27 @@
+#!/bin/sh
+# $((...)): C precedence, short-circuit, LONG_MIN / -1, errors that stop the command
+# usage: sh tests/arithmetic.sh path/to/shellax
+shellax=$(realpath "${1:-./shellax}")
+
+status=0
+check() # expected script
+{
+    got=$("$shellax" -c "$2" 2>&1)
+    if [ "$got" != "$1" ]; then
+        echo "$2: got '$got', expected '$1'"
+        status=1
+    fi
+}
+check "1 1 13 0" 'echo $((1 | 2 & 0)) $((1 || 0 && 0)) $((6 ^ 3 | 8)) $((5 & 3 ^ 1))'
+check "0 x=1 1 x=1 9 x=1" 'x=1; echo $((0 && (x=5))) x=$x $((1 || (x=6))) x=$x $((0 ? (x=8) : 9)) x=$x'
+check "0 1" 'echo $((0 && 1/0)) $((1 || 1%0))'
+check "-9223372036854775808 0 -7" 'echo $(( (-9223372036854775807-1) / -1 )) $(( (-9223372036854775807-1) % -1 )) $((7 / -1))'
+check "-shellax: arithmetic syntax error: 1+
+rc=1" 'echo $((1+)); echo rc=$?'
+check "-shellax: division by 0: 1/0
+rc=1" 'echo $((1/0)); echo rc=$?'
+check "-shellax: division by 0: 2/0
+rc=1" 'for i in $((2/0)); do echo in; done; echo rc=$?'
+check "-shellax: division by 0: 2/0
+rc=1" 'ls $((2/0)) | cat; echo rc=$?'
+exit $status
@@ -0,0 +1,40 @@
+#!/bin/sh
+# grep -F with matches past the first 1 MiB read, with every scan kernel
+# usage: sh tests/grep-fixed.sh path/to/shellax
+shellax=$(realpath "${1:-./shellax}")
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+
+# 2 MiB of 16-byte lines, needl on the first line of the second chunk and on the last line
+awk 'BEGIN { for (i = 1; i <= 131072; i++) print (i == 65537 || i == 131072) ? "xxxxxneedlxxxxx" : "abcdefghijklmno" }' > g.txt
+status=0
+check() # kernel expected script
+{
+    got=$(SHELLAX_SCAN=$1 "$shellax" -c "$3" 2>&1)
+    if [ "$got" != "$2" ]; then
+        echo "$1: $3: got '$got', expected '$2'"
+        status=1
+    fi
+}
+for kernel in scalar sse2 avx2; do
+    check $kernel 2 'grep -F -c needl g.txt'
+    check $kernel 2 'cat g.txt | grep -F -c needl'
+    check $kernel 65537 'grep -F -n needl g.txt | head -n 1 | cut -d: -f1'
+    # more patterns than the SIMD prefilter takes: the scalar search does them all
+    check $kernel 2 'grep -F -c -e q1 -e q2 -e q3 -e q4 -e q5 -e q6 -e q7 -e q8 -e needl g.txt'
+    check $kernel 131070 'grep -F -v -c needl g.txt'
+done
+# -v selects lines, so it succeeds; what the builtin doesn't do goes to the real grep
+printf 'a\nb\nA\n' > ab.txt
+check scalar "b
+A
+rc=0" 'grep -F -v a ab.txt; echo rc=$?'
+check scalar "rc=1" 'grep -F -v -e a -e b -e A ab.txt; echo rc=$?'
+check scalar "a
+A" 'grep -iF a ab.txt'
+check scalar "a" 'grep -Fx a ab.txt'
+check scalar "q" 'grep -Fq a ab.txt && echo q'
+check scalar "ab.txt:A
+g.txt:xxxxxneedlxxxxx" 'grep -F -e needl -e A ab.txt g.txt | head -n 2'
+exit $status
@@ -0,0 +1,22 @@
+#!/bin/sh
+# parallel: -k order, failure count, jobs that cannot start
+# usage: sh tests/parallel.sh path/to/shellax
+shellax=$(realpath "${1:-./shellax}")
+
+status=0
+check() # expected script [nofile limit]
+{
+    got=$( (ulimit -n "${3:-1024}"; exec timeout 10 "$shellax" -c "$2") 2>/dev/null)
+    if [ "$got" != "$1" ]; then
+        echo "$2: got '$got', expected '$1'"
+        status=1
+    fi
+}
+check "$(seq 20)" 'seq 20 | parallel -j 4 -k echo'
+check "$(seq 20 | sort)" 'seq 20 | parallel -j 4 echo | sort'
+check "2" 'seq 20 | parallel -j 3 test {} -ne 7 -a {} -ne 14; echo $?'
+# out of fds: the jobs that get no output file fail, -k still prints the others and ends
+check "a
+b
+rc=4" 'parallel -j 4 -k echo ::: a b c d e f; echo rc=$?' 10
+exit $status
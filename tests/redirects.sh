@@ -0,0 +1,35 @@
+#!/bin/sh
+# redirects naming a fd: N>, N>>, N<, N>&M, >&M, for commands, builtins and groups
+# usage: sh tests/redirects.sh path/to/shellax
+shellax=$(realpath "${1:-./shellax}")
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+
+status=0
+check() # expected script
+{
+    got=$("$shellax" -c "$2" 2>&1)
+    if [ "$got" != "$1" ]; then
+        echo "$2: got '$got', expected '$1'"
+        status=1
+    fi
+}
+check "rc=2" 'ls /nonexistent 2>/dev/null; echo rc=$?'
+check "1" 'ls /nonexistent 2>err; wc -l < err'
+check "2" 'ls /nonexistent 2>err; ls /nonexistent 2>>err; wc -l < err'
+check "hello" 'echo hello > in; cat 3<in <&3'
+check "hello" 'echo hello > in; read line 3<in <&3; echo "$line"'
+check "1" 'ls /nonexistent 2>&1 | wc -l'
+check "1" 'ls /nonexistent 2>&1 >/dev/null | wc -l'
+check "0" 'ls /nonexistent >/dev/null 2>&1 | wc -l'
+check "err" 'echo err >&2 | tr a-z A-Z; echo err 2>/dev/null >&2 | tr a-z A-Z'
+check "out
+err" '{ echo out; echo err >&2; } >both 2>&1; cat both'
+check "after" 'f() { echo fn >&2; }; f 2>/dev/null; echo after'
+check "x2" 'echo x2>file; cat file'
+check "-shellax: 9: Bad file descriptor
+rc=1" 'echo bad >&9; echo rc=$?'
+# cat and wc run in the shell: the 2> stays with cat
+check "1" 'echo hello > in; cat /nonexistent in 2>/dev/null | wc -l'
+exit $status
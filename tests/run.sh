@@ -0,0 +1,17 @@
+#!/bin/sh
+# Build shellax and run every test in this directory: sh tests/run.sh
+cd "$(dirname "$0")/.." || exit 1
+shellax=${TMPDIR:-/tmp}/shellax-test.$$
+gcc -O2 -o "$shellax" shellax-skeleton.c -lm -pthread || exit 1
+failed=0
+for test in tests/*.sh; do
+    [ "$test" = tests/run.sh ] && continue
+    if sh "$test" "$shellax"; then
+        echo "ok   $test"
+    else
+        echo "FAIL $test"
+        failed=1
+    fi
+done
+rm -f "$shellax"
+exit $failed
@@ -0,0 +1,26 @@
+#!/bin/sh
+# tee: files get every byte, stdout keeps every byte when a file fails
+# usage: sh tests/tee.sh path/to/shellax
+shellax=$(realpath "${1:-./shellax}")
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+
+status=0
+check() # expected script
+{
+    got=$("$shellax" -c "$2" 2>/dev/null)
+    if [ "$got" != "$1" ]; then
+        echo "$2: got '$got', expected '$1'"
+        status=1
+    fi
+}
+expected=$(seq 100000 | cksum)
+check "$expected" 'seq 100000 | tee a b | cksum'
+check "$expected" 'cksum < a'
+check "$expected" 'cksum < b'
+# /dev/full takes no splice and no write: stdout still gets everything
+check "$expected" 'seq 100000 | tee /dev/full | cksum'
+check "0" 'true | tee empty; wc -c < empty'
+check "$(seq 3)" 'seq 2 | tee c > /dev/null; seq 3 3 | tee -a c > /dev/null; cat c'
+exit $status